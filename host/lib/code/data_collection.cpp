@@ -16,20 +16,45 @@ http://www.cisst.org/cisst/license.txt.
 */
 
 #include <iostream>
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <chrono>
 #include <fstream>
 #include <string>
+#include <sstream>
 #include <pthread.h>
 #include <iomanip>
+#include <math.h>
+#include <algorithm>
 
 #include "udp_tx.h"
 #include "data_collection.h"
 #include "data_collection_shared.h"
+#include "sample_compression.h"
 
 using namespace std;
 
+// Retransmit mode: a missing data packet is requested after NACK_DELAY_S (it may only be
+// late, or rebuilt by FEC), then again every NACK_RETRY_S until MAX_NACKS requests; the
+// missing packets are checked every NACK_CHECK_S
+const double NACK_DELAY_S = 0.002;
+const double NACK_RETRY_S = 0.02;
+const int MAX_NACKS = 5;
+const double NACK_CHECK_S = 0.001;
+
+// a marked event is sent again every EVENT_RESEND_S until the Zynq sends it back, and the
+// capture stops once they are all back, or after EVENT_STOP_WAIT_S
+const float EVENT_RESEND_S = 0.1;
+const float EVENT_STOP_WAIT_S = 0.5;
+
+// packet ring (see set_packet_ring): 8 MB, in blocks of 128 KB. A block that is not full
+// is passed on after 1 ms, so the ring holds at least 64 ms of data; a larger one would
+// hold seconds of data the host is behind on, when it cannot keep up
+const uint32_t PACKET_RING_BLOCK_SIZE = 128 * 1024;
+const uint32_t PACKET_RING_BLOCKS = 64;
+
 // Byteswap (bswap_32)
 #ifdef _MSC_VER
 #include <stdlib.h>   // for byteswap functions
@@ -79,46 +104,1004 @@ static void hwVersToString(uint32_t val, char *str)
 // PROTECTED METHODS //
 ///////////////////////
 
-void DataCollection:: process_sample(uint32_t *data_packet, int start_idx)
+bool DataCollection::load_meta_data(void)
+{
+    if (dc_meta.num_boards == 0 || dc_meta.num_boards > MAX_NUM_BOARDS) {
+        return false;
+    }
+
+    uint32_t num_encoders = 0;
+    uint32_t num_motors = 0;
+    for (uint32_t b = 0; b < dc_meta.num_boards; b++) {
+        const BoardSection &board = dc_meta.boards[b];
+        if (board.hwvers != dRA1_String && board.hwvers != QLA1_String && board.hwvers != DQLA_String) {
+            return false;
+        }
+        num_encoders += board.num_encoders;
+        num_motors += board.num_motors;
+    }
+
+    char hw_vers[5];
+    hwVersToString(dc_meta.hwvers, hw_vers);
+
+    cout << "---- DATA COLLECTION METADATA ---" << endl;
+    if (dc_meta.num_boards == 1) {
+        cout << "Hardware Version: " << hw_vers << endl;
+    } else {
+        cout << "Boards: " << dc_meta.num_boards << endl;
+        for (uint32_t b = 0; b < dc_meta.num_boards; b++) {
+            const BoardSection &board = dc_meta.boards[b];
+            hwVersToString(board.hwvers, hw_vers);
+            cout << "  Board " << board.board_id << ": " << hw_vers << ", " << board.num_encoders
+                 << " encoders, " << board.num_motors << " motors" << endl;
+        }
+    }
+    cout << "Num of Encoders:  " <<  +dc_meta.num_encoders << endl;
+    cout << "Num of Motors: " << +dc_meta.num_motors << endl;
+    cout << "Packet Size (in bytes): " << dc_meta.data_packet_size << " (max " << dc_meta.payload_size << ")" << endl;
+    if (dc_meta.samples_per_packet == 0) {
+        cout << "Samples per Packet: variable (compressed)" << endl;
+    } else {
+        cout << "Samples per Packet: " << dc_meta.samples_per_packet << endl;
+    }
+    cout << "Sizoef Samples (in quadlets): " << dc_meta.size_of_sample << endl;
+    cout << "Session ID: 0x" << hex << dc_meta.session_id << dec << endl;
+    cout << "----------------------------------" << endl << endl;
+
+    // The Zynq reports the flags it actually uses, which may differ from the
+    // requested ones (PS IO is forced on in sample rate mode) or be unknown
+    // to the host (when resuming a session)
+    options_mask = static_cast<uint8_t>(dc_meta.options_mask);
+    use_ps_io = (options_mask & ENABLE_PSIO_MSK) != 0;
+    use_pot = (options_mask & ENABLE_POT_MSK) != 0;
+    use_sample_rate = (options_mask & ENABLE_SAMPLE_RATE_MSK) != 0;
+    use_compression = (options_mask & ENABLE_COMPRESSION_MSK) != 0;
+    sample_rate = static_cast<uint16_t>(dc_meta.sample_rate);
+
+    sample_format.num_boards = dc_meta.num_boards;
+    sample_format.num_encoders = dc_meta.num_encoders;
+    sample_format.num_motors = dc_meta.num_motors;
+    sample_format.ps_io = use_ps_io;
+    sample_format.pot = use_pot;
+    sample_format.channels = dc_meta.channel_mask;
+    sample_format.min_max = (options_mask & ENABLE_OVERSAMPLING_MSK) && dc_meta.oversampling.min_max;
+    sample_format.timestamp_ticks_per_s = (options_mask & ENABLE_FPGA_TIMESTAMP_MSK) ? dc_meta.timestamp_ticks_per_s : 0;
+
+    if (sample_format.num_encoders > MAX_NUM_ENCODERS || sample_format.num_motors > MAX_NUM_MOTORS ||
+        num_encoders != dc_meta.num_encoders || num_motors != dc_meta.num_motors ||
+        sample_format.quadlets() != dc_meta.size_of_sample ||
+        ((options_mask & ENABLE_FPGA_TIMESTAMP_MSK) && dc_meta.timestamp_ticks_per_s == 0) ||
+        dc_meta.fec_group_size > MAX_FEC_GROUP_SIZE || dc_meta.retransmit_history > MAX_RETRANSMIT_HISTORY) {
+        cout << "[ERROR] Sample layout in metadata is inconsistent" << endl;
+        return false;
+    }
+
+    // in FEC mode, the parity packets take the header on top of the largest data packet,
+    // which ends with its sequence number in retransmit mode
+    const uint32_t max_data_bytes = dc_meta.payload_size - ((dc_meta.fec_group_size > 0) ? sizeof(FecParityHeader) : 0) -
+                                    data_trailer_size();
+    if (dc_meta.size_of_sample * 4 > max_data_bytes) {
+        cout << "[ERROR] Samples of " << dc_meta.size_of_sample * 4 << " bytes do not fit in data packets of "
+             << max_data_bytes << " bytes; select fewer channels or turn off min/max" << endl;
+        return false;
+    }
+
+    use_burst = (options_mask & ENABLE_BURST_MSK) != 0;
+    if (use_burst) {
+        static const char *trigger_names[] = {"host", "digital I/O", "motor current"};
+        const BurstConfig &config = dc_meta.burst;
+        cout << "Burst: " << config.pre_trigger << " samples before and " << config.post_trigger
+             << " from the trigger (" << ((config.trigger <= BURST_TRIGGER_MOTOR_CURRENT) ? trigger_names[config.trigger] : "unknown");
+        if (config.trigger == BURST_TRIGGER_DIGITAL_IO) {
+            cout << ", board " << config.channel + 1 << " mask 0x" << hex << config.mask << dec;
+        } else if (config.trigger == BURST_TRIGGER_MOTOR_CURRENT) {
+            cout << ", axis " << config.channel + 1 << " threshold " << config.threshold;
+        }
+        cout << ")" << endl << endl;
+    }
+
+    if (sample_format.timestamp_ticks_per_s != 0) {
+        cout << "Timestamps: FPGA clock, " << sample_format.timestamp_ticks_per_s << " ticks/s" << endl << endl;
+    }
+
+    if (dc_meta.telemetry_interval_ms > 0) {
+        cout << "Telemetry: every " << dc_meta.telemetry_interval_ms << " ms" << endl << endl;
+    }
+
+    // the data packets of two groups (the parity packet of the first one may be lost),
+    // and the one rebuilt from a parity packet
+    if (dc_meta.fec_group_size > 0) {
+        cout << "FEC: parity packet every " << dc_meta.fec_group_size << " data packets" << endl << endl;
+        fec_buffer.assign((2 * dc_meta.fec_group_size + 1) * UDP_MAX_PAYLOAD_QUADLETS, 0);
+    } else {
+        fec_buffer.clear();
+    }
+    fec_lengths.clear();
+
+    // the packets that may still be requested from the history of the Zynq
+    if (dc_meta.retransmit_history > 0) {
+        cout << "Retransmit: last " << dc_meta.retransmit_history << " data packets kept on the Zynq" << endl << endl;
+        reorder_buffer.assign((size_t) dc_meta.retransmit_history * UDP_MAX_PAYLOAD_QUADLETS, 0);
+    } else {
+        reorder_buffer.clear();
+    }
+    reorder_slots.assign(dc_meta.retransmit_history, ReorderSlot());
+
+    if (options_mask & ENABLE_OVERSAMPLING_MSK) {
+        cout << "Oversampling: mean of " << dc_meta.oversampling.reads_per_sample << " reads per sample"
+             << (sample_format.min_max ? ", with min/max" : "") << endl << endl;
+    }
+
+    if (!sample_format.all_channels()) {
+        cout << "Channels: position 0x" << hex << sample_format.channels.encoder_position
+             << ", velocity 0x" << sample_format.channels.encoder_velocity
+             << ", motor 0x" << sample_format.channels.motor
+             << ", pot 0x" << sample_format.channels.pot << dec << endl << endl;
+    }
+
+    return compile_schema();
+}
+
+bool DataCollection::handshake(int start_state)
+{
+    const bool resuming = (start_state == SM_SEND_RESUME_SESSION_TO_PS);
+    // a running Zynq answers a resume request immediately
+    const float RESUME_TIMEOUT_S = 1.0;
+    // wait for each payload probe packet, and number of probes before falling back to UDP_REAL_MTU
+    const float PROBE_TIMEOUT_S = 0.1;
+    const int MAX_PROBE_ATTEMPTS = 3;
+    int probe_attempts = 0;
+    // wait for the metadata or the ready message of the Zynq before the handshake is
+    // started again (a datagram was lost, or the Zynq gave up the handshake on a datagram
+    // duplicated or reordered on the way), and number of handshakes sent
+    const float HANDSHAKE_RETRY_S = 0.5;
+    const int MAX_HANDSHAKE_ATTEMPTS = 20;
+    handshake_attempts = 0;
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> handshake_start = std::chrono::high_resolution_clock::now();
+    std::chrono::time_point<std::chrono::high_resolution_clock> attempt_start = handshake_start;
+
+    sm_state = start_state;
+    int ret_code = 0;
+
+    char recvBuffer[100] = {0};
+
+    // Handshaking PS
+    while(1) {
+        if ((sm_state == SM_WAIT_FOR_PS_HANDSHAKE || (sm_state == SM_RECV_DATA_COLLECTION_META_DATA && !resuming)) &&
+            convert_chrono_duration_to_float(attempt_start, std::chrono::high_resolution_clock::now()) > HANDSHAKE_RETRY_S) {
+            if (handshake_attempts < MAX_HANDSHAKE_ATTEMPTS) {
+                cout << "[WARNING] No reply from Zynq, starting the handshake again" << endl;
+                sm_state = start_state;
+            } else {
+                cout << "[ERROR] Host data collection is out of sync with Zynq State Machine (no handshake after "
+                     << handshake_attempts << " attempts). Restart Zynq and Host Program" << endl;
+                sm_state = SM_CLOSE_SOCKET;
+            }
+        }
+
+        switch(sm_state) {
+            case SM_SEND_READY_STATE_TO_PS:
+                {
+                    handshake_attempts++;
+                    attempt_start = std::chrono::high_resolution_clock::now();
+
+                    udp_transmit(sock_id, (char *)HOST_READY_CMD, sizeof(HOST_READY_CMD));
+                    udp_transmit(sock_id, (char *)HOST_FLAG_CMD, sizeof(HOST_FLAG_CMD));
+                    udp_transmit(sock_id, (void *)&options_mask, sizeof(options_mask));
+
+                    if (use_sample_rate){
+                        // as the int the Zynq reads
+                        int rate = sample_rate;
+                        udp_transmit(sock_id, (char *)HOST_SAMPLE_RATE_CMD, sizeof(HOST_SAMPLE_RATE_CMD));
+                        udp_transmit(sock_id, &rate, sizeof(rate));
+                    }
+
+                    if (options_mask & ENABLE_CHANNEL_MASK_MSK) {
+                        udp_transmit(sock_id, (char *)HOST_CHANNEL_MASK_CMD, sizeof(HOST_CHANNEL_MASK_CMD));
+                        udp_transmit(sock_id, &channel_mask, sizeof(channel_mask));
+                    }
+
+                    if (options_mask & ENABLE_OVERSAMPLING_MSK) {
+                        udp_transmit(sock_id, (char *)HOST_OVERSAMPLING_CMD, sizeof(HOST_OVERSAMPLING_CMD));
+                        udp_transmit(sock_id, &oversampling, sizeof(oversampling));
+                    }
+
+                    if (options_mask & ENABLE_BURST_MSK) {
+                        udp_transmit(sock_id, (char *)HOST_BURST_CMD, sizeof(HOST_BURST_CMD));
+                        udp_transmit(sock_id, &burst, sizeof(burst));
+                    }
+
+                    // no room left in the flag byte, so always sent
+                    udp_transmit(sock_id, (char *)HOST_FEC_CMD, sizeof(HOST_FEC_CMD));
+                    udp_transmit(sock_id, &fec_group_size, sizeof(fec_group_size));
+
+                    udp_transmit(sock_id, (char *)HOST_RETRANSMIT_CMD, sizeof(HOST_RETRANSMIT_CMD));
+                    udp_transmit(sock_id, &retransmit_history, sizeof(retransmit_history));
+
+                    udp_transmit(sock_id, (char *)HOST_PAYLOAD_SIZE_CMD, sizeof(HOST_PAYLOAD_SIZE_CMD));
+                    udp_transmit(sock_id, &payload_size, sizeof(payload_size));
+                }
+                sm_state = SM_RECV_DATA_COLLECTION_META_DATA;
+                break;
+
+            case SM_SEND_RESUME_SESSION_TO_PS:
+                handshake_attempts++;
+                handshake_start = std::chrono::high_resolution_clock::now();
+                attempt_start = handshake_start;
+                udp_transmit(sock_id, (char *)HOST_RESUME_SESSION_CMD, sizeof(HOST_RESUME_SESSION_CMD));
+                sm_state = SM_RECV_DATA_COLLECTION_META_DATA;
+                break;
+
+            case SM_RECV_DATA_COLLECTION_META_DATA:
+                // receive into data_packet since data packets of an ongoing capture may arrive first
+                ret_code = udp_nonblocking_receive(sock_id, data_packet, sizeof(data_packet));
+                if (ret_code == sizeof(dc_meta)) {
+                    memcpy(&dc_meta, data_packet, sizeof(dc_meta));
+                }
+
+                if (ret_code == sizeof(dc_meta) && load_meta_data()) {
+                    cout << "Received Message from Zynq: RECEIVED METADATA" << endl << endl;
+
+                    if (resuming && dc_meta.session_state == SESSION_NONE) {
+                        cout << "No session to resume on Zynq" << endl;
+                        sm_state = SM_CLOSE_SOCKET;
+                    } else if (resuming && dc_meta.session_state == SESSION_CAPTURING) {
+                        cout << "Resumed session with capture in progress" << endl;
+                        return true;
+                    } else if (dc_meta.payload_size > UDP_REAL_MTU) {
+                        // make sure large frames actually get through before using them
+                        sm_state = SM_SEND_PAYLOAD_PROBE;
+                    } else {
+                        sm_state = SM_SEND_METADATA_RECV;
+                    }
+                } else if (ret_code == (int) sizeof(dc_meta) && !resuming) {
+                    // metadata rejected (see load_meta_data)
+                    sm_state = SM_CLOSE_SOCKET;
+                } else if (ret_code > 0) {
+                    // data packet of the ongoing capture, or late copy of a reply to an
+                    // earlier handshake; ignore it
+                    sm_state = SM_RECV_DATA_COLLECTION_META_DATA;
+                } else if (ret_code == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || ret_code == UDP_NON_UDP_DATA_IS_AVAILABLE){
+                    sm_state = SM_RECV_DATA_COLLECTION_META_DATA;
+                } else {
+                    cout << "[ERROR] - UDP fail, Check connection if zynq program failed" << endl;
+                    sm_state = SM_CLOSE_SOCKET;
+                }
+
+                if (resuming && sm_state == SM_RECV_DATA_COLLECTION_META_DATA &&
+                    convert_chrono_duration_to_float(handshake_start, std::chrono::high_resolution_clock::now()) > RESUME_TIMEOUT_S) {
+                    cout << "[ERROR] No response from Zynq to resume request" << endl;
+                    sm_state = SM_CLOSE_SOCKET;
+                }
+                break;
+
+            case SM_SEND_PAYLOAD_PROBE:
+                udp_transmit(sock_id, (char *) HOST_PROBE_PAYLOAD_CMD, sizeof(HOST_PROBE_PAYLOAD_CMD));
+                handshake_start = std::chrono::high_resolution_clock::now();
+                probe_attempts++;
+                sm_state = SM_WAIT_FOR_PAYLOAD_PROBE;
+                break;
+
+            case SM_WAIT_FOR_PAYLOAD_PROBE:
+                ret_code = udp_nonblocking_receive(sock_id, data_packet, sizeof(data_packet));
+
+                if (ret_code == (int) dc_meta.payload_size && strcmp((char *) data_packet, ZYNQ_PROBE_PAYLOAD) == 0) {
+                    cout << "Payload size of " << dc_meta.payload_size << " bytes confirmed" << endl;
+                    sm_state = SM_SEND_METADATA_RECV;
+                } else if (ret_code < 0 && ret_code != UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT && ret_code != UDP_NON_UDP_DATA_IS_AVAILABLE) {
+                    cout << "[ERROR] - UDP fail, Check connection if zynq program failed" << endl;
+                    sm_state = SM_CLOSE_SOCKET;
+                } else if (convert_chrono_duration_to_float(handshake_start, std::chrono::high_resolution_clock::now()) > PROBE_TIMEOUT_S) {
+                    if (probe_attempts < MAX_PROBE_ATTEMPTS) {
+                        sm_state = SM_SEND_PAYLOAD_PROBE;
+                    } else {
+                        // large frames are dropped on the way; renegotiate the default size
+                        cout << "[WARNING] " << dc_meta.payload_size << " byte packets are dropped, using "
+                             << UDP_REAL_MTU << " bytes" << endl;
+                        payload_size = UDP_REAL_MTU;
+                        udp_transmit(sock_id, (char *)HOST_PAYLOAD_SIZE_CMD, sizeof(HOST_PAYLOAD_SIZE_CMD));
+                        udp_transmit(sock_id, &payload_size, sizeof(payload_size));
+                        attempt_start = std::chrono::high_resolution_clock::now();
+                        sm_state = SM_RECV_DATA_COLLECTION_META_DATA;
+                    }
+                }
+                break;
+
+            case SM_SEND_METADATA_RECV:
+                udp_transmit(sock_id, (char *) HOST_RECVD_METADATA , sizeof(HOST_RECVD_METADATA ));
+                attempt_start = std::chrono::high_resolution_clock::now();
+                sm_state = SM_WAIT_FOR_PS_HANDSHAKE;
+                break;
+
+            case SM_WAIT_FOR_PS_HANDSHAKE:
+                ret_code = udp_nonblocking_receive(sock_id, recvBuffer, sizeof(recvBuffer));
+                
+                if (ret_code > 0) {
+                    if (strcmp(recvBuffer, "ZYNQ: READY FOR DATA COLLECTION") == 0) {
+                        cout << "Received Message " << ZYNQ_READY_CMD << endl;
+                        sm_state = SM_SEND_START_DATA_COLLECTIION_CMD_TO_PS;
+                        return true; 
+                    } else {
+                        // late copy of the metadata or of a probe packet
+                        sm_state = SM_WAIT_FOR_PS_HANDSHAKE;
+                    }
+                } else if (ret_code == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || ret_code == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+                    sm_state = SM_WAIT_FOR_PS_HANDSHAKE;
+                } else {
+                    cout << "[ERROR] - UDP fail, Check connection if zynq program failed" << endl;
+                    sm_state = SM_CLOSE_SOCKET;
+                }
+                break;
+
+            case SM_CLOSE_SOCKET:
+                close(sock_id);
+                return false;
+        }
+    }
+}
+
+// compiles the schema of the samples (metadata) into one op per column and the names of
+// the columns, so that each sample is decoded with a flat loop over the columns
+bool DataCollection::compile_schema(void)
+{
+    const SampleSchema &schema = dc_meta.schema;
+
+    columns.clear();
+    column_names.clear();
+    tick_period = (dc_meta.timestamp_ticks_per_s != 0) ? 1.0 / dc_meta.timestamp_ticks_per_s : 0.0;
+
+    if (schema.version != SAMPLE_SCHEMA_VERSION) {
+        cout << "[ERROR] Sample schema version " << schema.version << " is not supported (expected "
+             << SAMPLE_SCHEMA_VERSION << "); update the host program" << endl;
+        return false;
+    }
+    if (schema.num_fields == 0 || schema.num_fields > MAX_SCHEMA_FIELDS ||
+        schema.quadlets != dc_meta.size_of_sample || schema.quadlets > MAX_QUADLETS_PER_SAMPLE) {
+        cout << "[ERROR] Sample schema is inconsistent with the metadata" << endl;
+        return false;
+    }
+
+    for (uint32_t f = 0; f < schema.num_fields; f++) {
+        const SchemaField &field = schema.fields[f];
+        const string name(field.name, strnlen(field.name, sizeof(field.name)));
+        const string suffix(field.suffix, strnlen(field.suffix, sizeof(field.suffix)));
+
+        ColumnOp op;
+        op.shift = 0;
+        if (field.type == SCHEMA_FLOAT && field.width == 8) {
+            op.kind = COLUMN_DOUBLE;
+        } else if (field.type == SCHEMA_TICKS && field.width == 8 && tick_period > 0.0) {
+            op.kind = COLUMN_TICKS;
+        } else if (field.type == SCHEMA_INT && field.width == 4) {
+            op.kind = COLUMN_INT32;
+        } else if (field.type == SCHEMA_UINT && field.width == 4) {
+            op.kind = COLUMN_UINT32;
+        } else if (field.type == SCHEMA_FLOAT && field.width == 4) {
+            op.kind = COLUMN_FLOAT;
+        } else if (field.type == SCHEMA_UINT && field.width == 2 && field.shift <= 16) {
+            op.kind = COLUMN_UINT16;
+            op.shift = field.shift;
+        } else {
+            cout << "[ERROR] Unsupported type of sample field " << name << suffix << "; update the host program" << endl;
+            return false;
+        }
+
+        // the first column is the timestamp, used for the sample timing statistics
+        const bool is_timestamp = (op.kind == COLUMN_DOUBLE || op.kind == COLUMN_TICKS) && field.count == 1;
+        const unsigned int value_quadlets = (field.width == 8) ? 2 : 1;
+        if ((f == 0 && !is_timestamp) || field.count == 0 || field.stride == 0 ||
+            field.offset + (field.count - 1u) * field.stride + value_quadlets > schema.quadlets) {
+            cout << "[ERROR] Invalid sample field " << name << suffix << endl;
+            return false;
+        }
+
+        uint32_t axes = field.axes;
+        for (unsigned int i = 0; i < field.count; i++) {
+            op.quadlet = (uint16_t) (field.offset + i * field.stride);
+            columns.push_back(op);
+
+            ostringstream column;
+            if (field.index == SCHEMA_INDEX_ENCODER || field.index == SCHEMA_INDEX_MOTOR) {
+                if (axes == 0) {
+                    cout << "[ERROR] Sample field " << name << suffix << " has more values than axes" << endl;
+                    return false;
+                }
+                int axis = 0;
+                while (!(axes & (1u << axis))) {
+                    axis++;
+                }
+                axes &= axes - 1;
+                column << axis_column(name.c_str(), axis, field.index == SCHEMA_INDEX_MOTOR) << suffix;
+            } else if (field.index == SCHEMA_INDEX_BOARD && dc_meta.num_boards > 1 && i < dc_meta.num_boards) {
+                column << "BOARD" << dc_meta.boards[i].board_id << "_" << name << suffix;
+            } else {
+                column << name << suffix;
+            }
+
+            column_names.push_back(column.str());
+        }
+    }
+
+    return true;
+}
+
+// timestamp of a sample in seconds (first column)
+double DataCollection::sample_timestamp(const uint32_t *sample) const
 {
-    if (start_idx + dc_meta.size_of_sample > UDP_MAX_QUADLET_PER_PACKET) {
+    const uint64_t bits = sample_timestamp_bits(&sample[columns[0].quadlet]);
+    if (columns[0].kind == COLUMN_TICKS) {
+        return bits * tick_period;
+    }
+    double seconds;
+    memcpy(&seconds, &bits, sizeof(seconds));
+    return seconds;
+}
+
+// data packets have a fixed size, except compressed ones which are tagged and the
+// last packets of a burst, which may hold fewer samples
+bool DataCollection::is_data_packet(const uint32_t *packet, int length) const
+{
+    if (use_burst && is_burst_status(packet, length)) {
+        return true;
+    }
+    if (use_compression) {
+        return is_compressed_packet(packet, length);
+    }
+    if (use_burst) {
+        const int samples_length = length - (int) data_trailer_size();
+        return samples_length > 0 && length <= (int) dc_meta.data_packet_size && samples_length % (dc_meta.size_of_sample * 4) == 0;
+    }
+    return length == (int) dc_meta.data_packet_size;
+}
+
+bool DataCollection::is_burst_status(const uint32_t *packet, int length) const
+{
+    return length == (int) sizeof(BurstStatus) && packet[0] == BURST_STATUS_TAG;
+}
+
+bool DataCollection::is_telemetry_packet(const uint32_t *packet, int length) const
+{
+    return length == (int) sizeof(TelemetryPacket) && packet[0] == TELEMETRY_TAG;
+}
+
+// writes a telemetry packet to the telemetry file, with the packets and samples
+// received so far
+void DataCollection::handle_telemetry(const uint32_t *packet)
+{
+    TelemetryPacket telemetry;
+    memcpy(&telemetry, packet, sizeof(telemetry));
+
+    telemetryFile << setprecision(12) << telemetry.timestamp << "," << telemetry.sequence << "," << telemetry.final
+                  << "," << telemetry.samples_taken << "," << telemetry.packets_sent << "," << telemetry.samples_sent
+                  << "," << telemetry.emio_errors << "," << telemetry.producer_stalls << "," << telemetry.transmit_errors
+                  << "," << telemetry.dropped_packets << "," << setprecision(4) << telemetry.cpu_load
+                  << "," << setprecision(12) << telemetry.sample_rate << "," << udp_data_packets_recvd_count
+                  << "," << samples_recvd_count << endl;
+
+    if (telemetry.final) {
+        // packets lost at the end of the capture
+        if (dc_meta.retransmit_history > 0 && !reorder_resync) {
+            mark_missing_packets((uint32_t) telemetry.numbered_packets);
+        }
+        final_telemetry = telemetry;
+        final_telemetry_received = true;
+    }
+}
+
+// data packets of the capture lost on the network and not recovered, from the final
+// telemetry (which must have been received)
+long long DataCollection::lost_packets(void) const
+{
+    // in retransmit mode, the packets the Zynq failed to send may be recovered too
+    const uint64_t expected_packets = (dc_meta.retransmit_history > 0) ? final_telemetry.numbered_packets : final_telemetry.packets_sent;
+    return (long long) expected_packets - (udp_data_packets_recvd_count - duplicate_packets) - fec_recovered_packets -
+           retransmit_recovered;
+}
+
+// samples of the lost data packets (see lost_packets)
+long long DataCollection::lost_samples(void) const
+{
+    const uint64_t expected_samples = (dc_meta.retransmit_history > 0) ? final_telemetry.numbered_samples : final_telemetry.samples_sent;
+    return (long long) expected_samples - samples_recvd_count;
+}
+
+// compares the final telemetry of the capture with what was received, to tell losses
+// on the network from samples the Zynq did not send
+void DataCollection::print_telemetry_summary(void)
+{
+    UdpFaultInjector::Stats faults;
+    if (udp_fault_injection_stats(faults)) {
+        cout << "Fault injection: " << faults.Received - fault_stats_start.Received << " datagrams received, "
+             << faults.Dropped - fault_stats_start.Dropped << " dropped, "
+             << faults.Duplicated - fault_stats_start.Duplicated << " duplicated, "
+             << faults.Reordered - fault_stats_start.Reordered << " reordered, "
+             << faults.Delayed - fault_stats_start.Delayed << " delayed, "
+             << faults.Truncated - fault_stats_start.Truncated << " truncated" << endl;
+    }
+
+    if (packet_ring_used) {
+        PacketRing::Stats ring = packet_ring.GetStats();
+        cout << "Packet ring: " << ring.Packets << " datagrams in " << ring.Blocks << " blocks, " << ring.Drops
+             << " dropped by the kernel (ring full " << ring.Freezes << " times)" << endl;
+    }
+    cout << "Receive: " << ((udp_data_packets_recvd_count > 0) ? receive_time * 1e6 / udp_data_packets_recvd_count : 0.0)
+         << " us per data packet to receive (" << (packet_ring_used ? "packet ring" : "UDP socket") << "), "
+         << ((curr_time.elapsed > 0.0) ? 100.0 * receive_time / curr_time.elapsed : 0.0) << "% of the capture" << endl;
+    if (pipeline_used && pipeline.GetDroppedSamples() > 0) {
+        // received, but not in the output of some sinks (the files of the capture have them all)
+        cout << "[WARNING] Dropped by the pipeline: " << pipeline.GetDroppedSamples() << " samples (sinks behind, see below)" << endl;
+    }
+
+    if (!final_telemetry_received) {
+        cout << "No final telemetry from the Zynq (lost or not sent)" << endl;
         return;
     }
 
-    int idx = start_idx;
+    const TelemetryPacket &telemetry = final_telemetry;
+
+    cout << "Zynq: " << telemetry.samples_taken << " samples taken, " << telemetry.samples_sent << " sent in "
+         << telemetry.packets_sent << " packets (CPU load " << telemetry.cpu_load << ")" << endl;
+    cout << "Lost on the network: " << lost_packets() << " packets (" << lost_samples() << " samples)" << endl;
+    if (dc_meta.fec_group_size > 0) {
+        cout << "Recovered by FEC: " << fec_recovered_packets << " packets (" << fec_recovered_samples << " samples), "
+             << fec_unrecoverable_groups << " groups with more than one packet lost; " << telemetry.fec_parity_packets
+             << " parity packets, " << telemetry.fec_encode_ns << " ns per data packet to encode on the Zynq" << endl;
+    }
+    if (dc_meta.retransmit_history > 0) {
+        cout << "Retransmitted: " << retransmit_recovered << " of " << retransmit_requested << " packets requested in "
+             << nack_count << " NACKs; Zynq resent " << telemetry.retransmitted_packets << " during the capture ("
+             << ((telemetry.packets_sent > 0) ? 100.0 * telemetry.retransmitted_packets / telemetry.packets_sent : 0.0)
+             << "% of the packets sent), " << telemetry.retransmit_misses << " no longer in its history" << endl;
+        cout << "Recovery latency: mean " << ((retransmit_recovered > 0) ? recovery_latency_sum / retransmit_recovered : 0.0) * 1e3
+             << " ms, max " << recovery_latency_max * 1e3 << " ms; unrecoverable: " << retransmit_lost << " packets in "
+             << retransmit_gaps << " gaps" << endl;
+    }
+    if (duplicate_packets > 0 || malformed_packets > 0) {
+        cout << "Discarded: " << duplicate_packets << " duplicate data packets, " << malformed_packets
+             << " datagrams of an unexpected size" << endl;
+    }
+    if (telemetry.dropped_packets > 0 || telemetry.transmit_errors > 0) {
+        cout << "Not sent by the Zynq: " << telemetry.dropped_packets << " packets (" << telemetry.transmit_errors
+             << " transmit errors)" << endl;
+    }
+    if (telemetry.emio_errors > 0 || telemetry.producer_stalls > 0) {
+        cout << "Board read errors: " << telemetry.emio_errors << ", producer stalls: " << telemetry.producer_stalls << endl;
+    }
+}
+
+// writes the figures of print_telemetry_summary to <base>_summary.csv, a header and one
+// row, for the programs that run captures (e.g. replay/replay_sweep.py). The loss and the
+// figures of the Zynq are empty without the final telemetry; times are in seconds.
+void DataCollection::write_capture_summary(void)
+{
+    const std::string summary_filename = filename.substr(0, filename.size() - 4) + "_summary.csv";
+    std::ofstream summaryFile(summary_filename);
+
+    UdpFaultInjector::Stats faults;
+    const bool fault_injection = udp_fault_injection_stats(faults);
+    const TelemetryPacket &telemetry = final_telemetry;
+
+    summaryFile << "ELAPSED,HANDSHAKE_ATTEMPTS,PACKET_RING,PACKETS_RECEIVED,SAMPLES_RECEIVED,DUPLICATE_PACKETS,"
+                << "MALFORMED_PACKETS,FEC_RECOVERED,RETRANSMIT_REQUESTED,RETRANSMIT_RECOVERED,RETRANSMIT_LOST,"
+                << "RECOVERY_LATENCY_MEAN,RECOVERY_LATENCY_MAX,RECEIVE_TIME,SINK_DROPPED_SAMPLES,FAULTS_RECEIVED,FAULTS_IMPAIRED,"
+                << "FINAL_TELEMETRY,SAMPLES_TAKEN,SAMPLES_SENT,PACKETS_SENT,LOST_PACKETS,LOST_SAMPLES,"
+                << "ZYNQ_FAULTS_RECEIVED,ZYNQ_FAULTS_IMPAIRED" << endl;
+
+    summaryFile << setprecision(12) << curr_time.elapsed << "," << handshake_attempts << "," << (packet_ring_used ? 1 : 0)
+                << "," << udp_data_packets_recvd_count << "," << samples_recvd_count << "," << duplicate_packets
+                << "," << malformed_packets << "," << fec_recovered_packets << "," << retransmit_requested
+                << "," << retransmit_recovered << "," << retransmit_lost
+                << "," << ((retransmit_recovered > 0) ? recovery_latency_sum / retransmit_recovered : 0.0)
+                << "," << recovery_latency_max
+                << "," << ((udp_data_packets_recvd_count > 0) ? receive_time / udp_data_packets_recvd_count : 0.0)
+                << "," << (pipeline_used ? pipeline.GetDroppedSamples() : 0);
+    if (fault_injection) {
+        summaryFile << "," << faults.Received - fault_stats_start.Received << ","
+                    << (faults.Dropped + faults.Duplicated + faults.Reordered + faults.Delayed + faults.Truncated) -
+                       (fault_stats_start.Dropped + fault_stats_start.Duplicated + fault_stats_start.Reordered +
+                        fault_stats_start.Delayed + fault_stats_start.Truncated);
+    } else {
+        summaryFile << ",0,0";
+    }
+    if (final_telemetry_received) {
+        summaryFile << ",1," << telemetry.samples_taken << "," << telemetry.samples_sent << "," << telemetry.packets_sent
+                    << "," << lost_packets() << "," << lost_samples()
+                    << "," << telemetry.faults_received << "," << telemetry.faults_impaired << endl;
+    } else {
+        summaryFile << ",0,,,,,,," << endl;
+    }
+
+    cout << "Summary stored to " << summary_filename << "." << endl;
+}
+
+bool DataCollection::is_event_packet(const uint32_t *packet, int length) const
+{
+    return length == (int) sizeof(EventPacket) && packet[0] == EVENT_TAG;
+}
+
+void DataCollection::handle_event(const uint32_t *packet)
+{
+    EventPacket event;
+    memcpy(&event, packet, sizeof(event));
+
+    {
+        // an event already received (the Zynq sends it again when its command is resent)
+        std::lock_guard<std::mutex> lock(capture_cmd_mutex);
+        size_t i = 0;
+        while (i < pending_events.size() && pending_events[i].command.sequence != event.sequence) {
+            i++;
+        }
+        if (i == pending_events.size()) {
+            return;
+        }
+        pending_events.erase(pending_events.begin() + i);
+        pending_event_count = (int) pending_events.size();
+    }
+
+    if (!eventsFile.is_open() && write_files) {
+        events_filename = filename.substr(0, filename.size() - 4) + "_events.csv";
+        eventsFile.open(events_filename);
+        eventsFile << "TIMESTAMP,EVENT,SAMPLE" << endl;
+    }
+    eventsFile << setprecision(12) << event.timestamp << "," << event.event_id << "," << event.sample_index << endl;
+    cout << "Event " << event.event_id << " marked at " << event.timestamp << "s (sample " << event.sample_index << ")" << endl;
+}
+
+// sends again the marked events that the Zynq has not sent back (the command or the event
+// packet was lost)
+void DataCollection::check_pending_events(void)
+{
+    std::lock_guard<std::mutex> lock(capture_cmd_mutex);
+    const std::chrono::time_point<std::chrono::high_resolution_clock> now = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < pending_events.size(); i++) {
+        if (convert_chrono_duration_to_float(pending_events[i].sent, now) > EVENT_RESEND_S) {
+            udp_transmit(sock_id, &pending_events[i].command, sizeof(pending_events[i].command));
+            pending_events[i].sent = now;
+        }
+    }
+}
+
+void DataCollection::handle_burst_status(const uint32_t *packet)
+{
+    BurstStatus status;
+    memcpy(&status, packet, sizeof(status));
+
+    streamsize precision = cout.precision();
+    cout << "BURST: received " << samples_recvd_count << " of " << status.num_samples << " samples, trigger at sample "
+         << status.trigger_index << " (timestamp " << setprecision(12) << status.trigger_timestamp << "s), "
+         << fixed << setprecision(1) << status.sample_rate << " Hz" << defaultfloat << setprecision(precision) << endl;
+    if (reorder_missing > 0) {
+        cout << "BURST: " << reorder_missing << " packets requested again" << endl;
+    }
+    burst_done = true;
+}
+
+uint32_t *DataCollection::fec_slot(size_t index)
+{
+    return &fec_buffer[index * UDP_MAX_PAYLOAD_QUADLETS];
+}
+
+// keeps the data packet just received until the parity packet of its group
+void DataCollection::buffer_fec_packet(const uint32_t *packet, int length)
+{
+    // parity packets lost: write the packets rather than overwrite the last slot
+    if (fec_lengths.size() + 2 > fec_buffer.size() / UDP_MAX_PAYLOAD_QUADLETS) {
+        flush_fec_packets(fec_lengths.size());
+    }
+
+    memcpy(fec_slot(fec_lengths.size()), packet, length);
+    fec_lengths.push_back(length);
+}
+
+// writes the first count packets of the FEC buffer and removes them from it
+void DataCollection::flush_fec_packets(size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        deliver_data_packet(fec_slot(i), fec_lengths[i]);
+        fec_next_key = max(fec_next_key, fec_packet_key(fec_slot(i), use_compression) + 1);
+    }
+
+    const size_t remaining = fec_lengths.size() - count;
+    if (count > 0 && remaining > 0) {
+        memmove(fec_slot(0), fec_slot(count), remaining * UDP_MAX_PAYLOAD_QUADLETS * sizeof(uint32_t));
+    }
+    fec_lengths.erase(fec_lengths.begin(), fec_lengths.begin() + count);
+}
+
+bool DataCollection::is_fec_parity(const uint32_t *packet, int length) const
+{
+    if (dc_meta.fec_group_size == 0 || length < (int) sizeof(FecParityHeader) || packet[0] != FEC_PARITY_TAG) {
+        return false;
+    }
+
+    FecParityHeader header;
+    memcpy(&header, packet, sizeof(header));
+    return length == (int) (sizeof(header) + header.length);
+}
+
+// writes the buffered data packets of the group of the parity packet just received,
+// with the one that was lost rebuilt from the others and the parity, if only one was
+void DataCollection::handle_fec_parity(const uint32_t *packet)
+{
+    FecParityHeader header;
+    memcpy(&header, packet, sizeof(header));
+
+    // packets of the group already written (the buffer was full)
+    if (header.first_key < fec_next_key) {
+        return;
+    }
+
+    // packets of the previous groups, whose parity packets were lost
+    size_t first = 0;
+    while (first < fec_lengths.size() && fec_packet_key(fec_slot(first), use_compression) < header.first_key) {
+        first++;
+    }
+    flush_fec_packets(first);
+
+    size_t members = 0;
+    while (members < fec_lengths.size() && fec_packet_key(fec_slot(members), use_compression) <= header.last_key) {
+        members++;
+    }
+
+    if (members + 1 == header.num_packets) {
+        uint32_t *rebuilt = fec_slot(fec_buffer.size() / UDP_MAX_PAYLOAD_QUADLETS - 1);
+        uint32_t packet_length = header.length_xor;
+
+        memcpy(rebuilt, &packet[sizeof(header) / 4], header.length);
+        for (size_t i = 0; i < members; i++) {
+            fec_xor(rebuilt, fec_slot(i), fec_lengths[i]);
+            packet_length ^= fec_lengths[i];
+        }
+
+        const uint64_t key = fec_packet_key(rebuilt, use_compression);
+        const uint32_t samples_length = packet_length - data_trailer_size();
+        bool valid = packet_length >= dc_meta.size_of_sample * 4 + data_trailer_size() && packet_length <= header.length &&
+                     key >= header.first_key && key <= header.last_key &&
+                     (use_compression ? is_compressed_packet(rebuilt, samples_length)
+                                      : samples_length % (dc_meta.size_of_sample * 4) == 0);
+
+        if (valid) {
+            // in its place among the packets of the group
+            size_t before = 0;
+            while (before < members && fec_packet_key(fec_slot(before), use_compression) < key) {
+                before++;
+            }
+            flush_fec_packets(before);
+            members -= before;
+
+            fec_recovered_packets++;
+            fec_recovered_samples += packet_samples(rebuilt, samples_length);
+            deliver_data_packet(rebuilt, packet_length);
+        } else {
+            fec_unrecoverable_groups++;
+        }
+    } else if (members < header.num_packets) {
+        fec_unrecoverable_groups++;
+    }
+
+    flush_fec_packets(members);
+    fec_next_key = max(fec_next_key, header.last_key + 1);
+}
+
+// bytes after the samples of a data packet: its sequence number in retransmit mode
+uint32_t DataCollection::data_trailer_size(void) const
+{
+    return (dc_meta.retransmit_history > 0) ? sizeof(uint32_t) : 0;
+}
+
+// samples of a data packet of length bytes (without the sequence number)
+int DataCollection::packet_samples(const uint32_t *packet, int length) const
+{
+    if (use_compression) {
+        return is_compressed_packet(packet, length) ? (int) (packet[0] & 0x0000FFFF) : 0;
+    }
+    return length / (int) (dc_meta.size_of_sample * 4);
+}
+
+// time since the start of the current capture, in seconds
+double DataCollection::capture_time(void) const
+{
+    std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - curr_time.start;
+    return duration.count();
+}
+
+// writes a data packet (received or rebuilt by FEC), in sequence number order in
+// retransmit mode
+void DataCollection::deliver_data_packet(const uint32_t *packet, int length)
+{
+    if (dc_meta.retransmit_history == 0) {
+        process_and_write_data(packet, length);
+        return;
+    }
+
+    uint32_t sequence;
+    memcpy(&sequence, reinterpret_cast<const uint8_t *>(packet) + length - sizeof(sequence), sizeof(sequence));
+    reorder_packet(packet, length - sizeof(sequence), sequence);
+}
+
+// data packets resent by the Zynq are not part of the FEC groups
+bool DataCollection::is_retransmitted_packet(const uint32_t *packet, int length) const
+{
+    if (dc_meta.retransmit_history == 0 || length < (int) sizeof(uint32_t)) {
+        return false;
+    }
+
+    uint32_t sequence;
+    memcpy(&sequence, reinterpret_cast<const uint8_t *>(packet) + length - sizeof(sequence), sizeof(sequence));
+    return (sequence & RETRANSMITTED_PACKET_FLAG) != 0;
+}
+
+uint32_t *DataCollection::reorder_slot(uint32_t sequence)
+{
+    return &reorder_buffer[(size_t) (sequence % reorder_slots.size()) * UDP_MAX_PAYLOAD_QUADLETS];
+}
+
+// keeps the data packet until the ones before it have been written or given up
+void DataCollection::reorder_packet(const uint32_t *packet, int length, uint32_t sequence)
+{
+    const bool retransmitted = (sequence & RETRANSMITTED_PACKET_FLAG) != 0;
+    sequence &= ~RETRANSMITTED_PACKET_FLAG;
+
+    if (reorder_resync) {
+        reorder_next = reorder_end = sequence;
+        reorder_resync = false;
+    }
+
+    // already written or given up (the original packets were counted as received)
+    if (sequence < reorder_next) {
+        duplicate_packets += retransmitted ? 0 : 1;
+        return;
+    }
+    if (sequence >= reorder_end) {
+        mark_missing_packets(sequence + 1);
+    }
+
+    ReorderSlot &slot = reorder_slots[sequence % reorder_slots.size()];
+    if (slot.length != 0) {
+        duplicate_packets += retransmitted ? 0 : 1;
+        return;
+    }
+
+    reorder_missing--;
+    if (retransmitted) {
+        const double latency = capture_time() - slot.missing_since;
+        retransmit_recovered++;
+        recovery_latency_sum += latency;
+        recovery_latency_max = max(recovery_latency_max, latency);
+    }
+
+    memcpy(reorder_slot(sequence), packet, length);
+    slot.length = length;
+    write_reordered_packets();
+}
+
+// extends the window up to the sequence number end (excluded), the new packets being
+// missing until they arrive
+void DataCollection::mark_missing_packets(uint32_t end)
+{
+    const uint32_t window = (uint32_t) reorder_slots.size();
+    const double now = capture_time();
+
+    // the packets more than a window back are no longer in the history of the Zynq
+    while (end - reorder_next > window && end > reorder_next) {
+        if (reorder_next == reorder_end) {
+            retransmit_lost += end - window - reorder_next;
+            retransmit_gaps += last_written_lost ? 0 : 1;
+            last_written_lost = true;
+            reorder_next = reorder_end = end - window;
+            break;
+        }
+        ReorderSlot &slot = reorder_slots[reorder_next % window];
+        if (slot.length == 0) {
+            give_up_packet(slot);
+        }
+        write_reordered_packets();
+    }
+
+    for (; reorder_end < end; reorder_end++) {
+        ReorderSlot &slot = reorder_slots[reorder_end % window];
+        slot.length = 0;
+        slot.nacks = 0;
+        slot.missing_since = now;
+        slot.last_nack = now;
+        reorder_missing++;
+    }
+}
+
+void DataCollection::give_up_packet(ReorderSlot &slot)
+{
+    slot.length = -1;
+    reorder_missing--;
+    retransmit_lost++;
+}
+
+// writes the packets at the head of the window, up to the first missing one
+void DataCollection::write_reordered_packets(void)
+{
+    while (reorder_next != reorder_end) {
+        ReorderSlot &slot = reorder_slots[reorder_next % reorder_slots.size()];
+        if (slot.length == 0) {
+            break;
+        }
 
+        if (slot.length > 0) {
+            process_and_write_data(reorder_slot(reorder_next), slot.length);
+            last_written_lost = false;
+        } else {
+            retransmit_gaps += last_written_lost ? 0 : 1;
+            last_written_lost = true;
+        }
+        slot.length = 0;
+        slot.nacks = 0;
+        reorder_next++;
+    }
+}
 
-    uint64_t timestamp_high = data_packet[idx++];
-    uint32_t timestamp_low = data_packet[idx++];
+// requests the missing packets that are due, in ranges of consecutive packets, and
+// gives up on the ones requested MAX_NACKS times
+void DataCollection::check_retransmits(double now)
+{
+    NackRequest request;
+    memset(&request, 0, sizeof(request));
+    request.tag = NACK_TAG;
 
-    uint64_t raw_64bit_timestamp = (timestamp_high << 32) | (timestamp_low);
+    last_retransmit_check = now;
 
-    proc_sample.timestamp = *reinterpret_cast<double *>(&raw_64bit_timestamp);
+    for (uint32_t sequence = reorder_next; sequence != reorder_end; sequence++) {
+        ReorderSlot &slot = reorder_slots[sequence % reorder_slots.size()];
+        if (slot.length != 0 || now - slot.last_nack < ((slot.nacks == 0) ? NACK_DELAY_S : NACK_RETRY_S)) {
+            continue;
+        }
+        if (slot.nacks == MAX_NACKS) {
+            give_up_packet(slot);
+            continue;
+        }
 
-    for (int i = 0; i < dc_meta.num_encoders; i++) {
-        proc_sample.encoder_position[i] = *reinterpret_cast<int32_t *> (&data_packet[idx++]);
-    }
+        retransmit_requested += (slot.nacks == 0) ? 1 : 0;
+        slot.nacks++;
+        slot.last_nack = now;
 
-    for (int i = 0; i < dc_meta.num_encoders; i++) {
-        proc_sample.encoder_velocity[i] = *reinterpret_cast<float *> (&data_packet[idx++]);
+        if (request.num_ranges > 0) {
+            NackRange &range = request.ranges[request.num_ranges - 1];
+            if (range.first + range.count == sequence) {
+                range.count++;
+                continue;
+            }
+        }
+        if (request.num_ranges == MAX_NACK_RANGES) {
+            send_nack(request);
+        }
+        request.ranges[request.num_ranges].first = sequence;
+        request.ranges[request.num_ranges].count = 1;
+        request.num_ranges++;
     }
 
-    for (int i = 0; i < dc_meta.num_motors; i++) {
-        proc_sample.motor_status[i] = static_cast<uint16_t> ((0xFFFF0000 & data_packet[idx]) >> 16);
-        proc_sample.motor_current[i] = (uint16_t) (0x0000FFFF & data_packet[idx]);
-        idx++;
+    if (request.num_ranges > 0) {
+        send_nack(request);
     }
+    write_reordered_packets();
+}
 
-    if (use_ps_io){
-        proc_sample.digital_io = data_packet[idx++];
-        proc_sample.mio_pins = data_packet[idx++];
-    }
+// sends the request (a single datagram, as the commands of the main thread, see
+// send_capture_cmd) and empties it
+void DataCollection::send_nack(NackRequest &request)
+{
+    udp_transmit(sock_id, &request, sizeof(request));
+    nack_count++;
+    request.num_ranges = 0;
+}
 
-    if (use_pot){
-        for (int i = 0; i < dc_meta.num_encoders; i++){
-            proc_sample.pot_values[i] = data_packet[idx++];
-        }  
+// writes the packets left when the capture stops, giving up on the missing ones
+void DataCollection::flush_reordered_packets(void)
+{
+    for (uint32_t sequence = reorder_next; sequence != reorder_end; sequence++) {
+        ReorderSlot &slot = reorder_slots[sequence % reorder_slots.size()];
+        if (slot.length == 0) {
+            give_up_packet(slot);
+        }
     }
+    write_reordered_packets();
 }
 
 int DataCollection::collect_data() {
@@ -129,14 +1112,30 @@ int DataCollection::collect_data() {
 
     cout << "CAPTURE [" << data_capture_count << "] in Progress ... !" << endl;
 
+    {
+        std::lock_guard<std::mutex> lock(capture_cmd_mutex);
+        capture_cmd_sequence = 0;
+        pending_events.clear();
+        pending_event_count = 0;
+    }
     isDataCollectionRunning = true;
     stop_data_collection_flag = false;
-    sm_state = SM_SEND_START_DATA_COLLECTIION_CMD_TO_PS;
+
+    // when attaching, the Zynq is already streaming data
+    sm_state = attach_to_capture ? SM_START_DATA_COLLECTION : SM_SEND_START_DATA_COLLECTIION_CMD_TO_PS;
+    start_pending = false;
+    attach_to_capture = false;
+
+    // before the start command, so that all the data packets go to the ring
+    packet_ring_used = use_packet_ring && open_packet_ring();
 
     while (sm_state != SM_EXIT) {
         switch (sm_state) {
             case SM_SEND_START_DATA_COLLECTIION_CMD_TO_PS:
                 udp_transmit(sock_id, (char *)HOST_START_DATA_COLLECTION, sizeof(HOST_START_DATA_COLLECTION));
+                start_pending = true;
+                start_sent = std::chrono::high_resolution_clock::now();
+                start_sends = 1;
                 sm_state = SM_START_DATA_COLLECTION;
                 break;
 
@@ -157,26 +1156,118 @@ int DataCollection::collect_data() {
         }
     }
 
+    packet_ring.Close();
     return true;
 }
 
+// falls back to the UDP socket, for the next captures too, if the ring cannot be used
+bool DataCollection::open_packet_ring(void)
+{
+    UdpFaultInjector::Stats faults;
+    if (udp_fault_injection_stats(faults)) {
+        cout << "[WARNING] Fault injection only applies to the UDP socket, packet ring not used" << endl;
+    } else if (packet_ring.Open(sock_id, PACKET_RING_BLOCK_SIZE, PACKET_RING_BLOCKS)) {
+        return true;
+    } else if (errno == EPERM || errno == EACCES) {
+        cout << "[WARNING] The packet ring needs CAP_NET_RAW (e.g., sudo setcap cap_net_raw+ep <program>), "
+             << "receiving from the UDP socket" << endl;
+    } else {
+        cout << "[WARNING] Could not open the packet ring (" << strerror(errno) << "), receiving from the UDP socket" << endl;
+    }
+    use_packet_ring = false;
+    return false;
+}
+
 void DataCollection::handle_data_collection() {
     curr_time.start = std::chrono::high_resolution_clock::now();
+    last_packet_time = curr_time.start;
     udp_data_packets_recvd_count = 0;
     packet_misses_counter = 0;
+    data_bytes_recvd_count = 0;
+    samples_recvd_count = 0;
+    interval_sum = 0.0;
+    interval_sum_sq = 0.0;
+    fec_lengths.clear();
+    fec_next_key = 0;
+    fec_recovered_packets = 0;
+    fec_recovered_samples = 0;
+    fec_unrecoverable_groups = 0;
+    reorder_next = 0;
+    reorder_end = 0;
+    reorder_missing = 0;
+    last_written_lost = false;
+    last_retransmit_check = 0.0;
+    retransmit_requested = 0;
+    retransmit_recovered = 0;
+    retransmit_lost = 0;
+    retransmit_gaps = 0;
+    nack_count = 0;
+    recovery_latency_sum = 0.0;
+    recovery_latency_max = 0.0;
+    duplicate_packets = 0;
+    malformed_packets = 0;
+    udp_fault_injection_stats(fault_stats_start);
+    receive_time = 0.0;
 
     filename = return_filename();
-    myFile.open(filename);
-
-    write_csv_headers();
+    events_filename.clear();
+    telemetry_filename = filename.substr(0, filename.size() - 4) + "_telemetry.csv";
+
+    SamplePipeline::Context context;
+    context.columns = batch_columns();
+    context.basename = filename.substr(0, filename.size() - 4);
+    context.write_files = write_files;
+    pipeline.Begin(context);
+    pipeline_used = pipeline.IsRunning();
+
+    if (write_files) {
+        telemetryFile.open(telemetry_filename);
+        telemetryFile << "TIMESTAMP,SEQUENCE,FINAL,SAMPLES_TAKEN,PACKETS_SENT,SAMPLES_SENT,EMIO_ERRORS,PRODUCER_STALLS,"
+                      << "TRANSMIT_ERRORS,DROPPED_PACKETS,CPU_LOAD,SAMPLE_RATE,PACKETS_RECEIVED,SAMPLES_RECEIVED" << endl;
+    }
 
     while (!stop_data_collection_flag) {
-        int ret_code = udp_nonblocking_receive(sock_id, data_packet, dc_meta.data_packet_size);
-
+        // whole buffer, so that packets other than data packets are not truncated; the
+        // packet ring points to the datagram in the ring instead
+        const uint32_t *packet = data_packet;
+        const std::chrono::time_point<std::chrono::high_resolution_clock> receive_start = std::chrono::high_resolution_clock::now();
+        int ret_code = packet_ring_used ? packet_ring.Receive(packet)
+                                        : udp_nonblocking_receive(sock_id, data_packet, sizeof(data_packet));
         if (ret_code > 0) {
+            receive_time += convert_chrono_duration_to_float(receive_start, std::chrono::high_resolution_clock::now());
+            last_packet_time = receive_start;
+            start_pending = false;
+        }
+
+        if (ret_code > 0 && is_telemetry_packet(packet, ret_code)) {
+            packet_misses_counter = 0;
+            handle_telemetry(packet);
+        } else if (ret_code > 0 && is_event_packet(packet, ret_code)) {
+            packet_misses_counter = 0;
+            handle_event(packet);
+        } else if (ret_code > 0 && is_fec_parity(packet, ret_code)) {
+            packet_misses_counter = 0;
+            handle_fec_parity(packet);
+        } else if (ret_code > 0 && use_burst && is_burst_status(packet, ret_code)) {
+            packet_misses_counter = 0;
+            flush_fec_packets(fec_lengths.size());
+            handle_burst_status(packet);
+        } else if (ret_code > 0 && !is_data_packet(packet, ret_code)) {
+            packet_misses_counter = 0;
+            malformed_packets++;
+        } else if (ret_code > 0 && is_retransmitted_packet(packet, ret_code)) {
+            packet_misses_counter = 0;
+            data_bytes_recvd_count += ret_code;
+            deliver_data_packet(packet, ret_code);
+        } else if (ret_code > 0) {
             udp_data_packets_recvd_count++;
             packet_misses_counter = 0;
-            process_and_write_data();
+            data_bytes_recvd_count += ret_code;
+            if (dc_meta.fec_group_size > 0) {
+                buffer_fec_packet(packet, ret_code);
+            } else {
+                deliver_data_packet(packet, ret_code);
+            }
         } else if (ret_code == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT) {
             handle_packet_timeout();
             if (stop_data_collection_flag) {
@@ -187,84 +1278,166 @@ void DataCollection::handle_data_collection() {
             stop_data_collection_flag = true;
             break;
         }
-    }
 
-    myFile.close();
-}
+        if (reorder_missing > 0) {
+            double now = capture_time();
+            if (now - last_retransmit_check >= NACK_CHECK_S) {
+                check_retransmits(now);
+            }
+        }
+        if (pending_event_count > 0) {
+            check_pending_events();
+        }
+    }
 
-void DataCollection::write_csv_headers() {
-    myFile << "TIMESTAMP,";
+    // packets of the last group, if its parity packet was lost
+    flush_fec_packets(fec_lengths.size());
+    flush_reordered_packets();
 
-    for (int i = 1; i <= dc_meta.num_encoders; i++) {
-        myFile << "ENCODER_POS_" << i << ",";
-    }
-    for (int i = 1; i <= dc_meta.num_encoders; i++) {
-        myFile << "ENCODER_VEL_" << i << ",";
-    }
-    for (int i = 1; i <= dc_meta.num_motors; i++) {
-        myFile << "MOTOR_CURRENT_" << i << ",";
-    }
-    for (int i = 1; i <= dc_meta.num_motors; i++) {
-        myFile << "MOTOR_STATUS_" << i;
-        if (i < dc_meta.num_motors) myFile << ",";
-    }
-    if (use_ps_io) {
-        myFile << ",DIGITAL_IO,MIO_PINS";
+    if (batch_samples > 0) {
+        sample_batches.Finish();
     }
+    // the sinks write what is left in their queues
+    pipeline.End();
+
+    telemetryFile.close();
+    eventsFile.close();
+}
+
+// column of an axis (0-based, over all boards): <name>_<axis> with a single board,
+// BOARD<id>_<name>_<axis on the board> otherwise (axes are 1-based in column names)
+string DataCollection::axis_column(const char *name, int axis, bool motor) const
+{
+    ostringstream column;
 
-    if (use_pot){
-        for (int i = 1; i <= dc_meta.num_encoders; i++){
-            myFile << ",POT_" << i;
+    if (dc_meta.num_boards > 1) {
+        uint32_t b = 0;
+        for (; b + 1 < dc_meta.num_boards; b++) {
+            int board_axes = (int) (motor ? dc_meta.boards[b].num_motors : dc_meta.boards[b].num_encoders);
+            if (axis < board_axes) {
+                break;
+            }
+            axis -= board_axes;
         }
+        column << "BOARD" << dc_meta.boards[b].board_id << "_";
     }
 
-    myFile << std::endl;
+    column << name << "_" << axis + 1;
+    return column.str();
 }
 
-void DataCollection::process_and_write_data() {
-    for (int i = 0; i < dc_meta.data_packet_size / 4; i += dc_meta.size_of_sample) {
-        process_sample(data_packet, i);
-
-        myFile << setprecision(12) << proc_sample.timestamp << ",";
+void DataCollection::process_and_write_data(const uint32_t *packet, int length) {
+    if (use_compression) {
+        SampleDecoder decoder(sample_format);
+        uint32_t sample[MAX_QUADLETS_PER_SAMPLE];
 
-        for (int j = 0; j < dc_meta.num_encoders; j++) {
-            myFile << proc_sample.encoder_position[j] << ",";
+        if (!decoder.Begin(packet, length)) {
+            cerr << "[ERROR] Received data packet that is not compressed" << endl;
+            return;
         }
-        for (int j = 0; j < dc_meta.num_encoders; j++) {
-            myFile << proc_sample.encoder_velocity[j] << ",";
+        while (decoder.Next(sample)) {
+            write_sample(sample);
         }
-        for (int j = 0; j < dc_meta.num_motors; j++) {
-            myFile << proc_sample.motor_current[j] << ",";
+    } else {
+        // the last packets of a burst may hold fewer samples
+        const int quadlets = use_burst ? length / 4 : (int) ((dc_meta.data_packet_size - data_trailer_size()) / 4);
+        for (int i = 0; i + (int) dc_meta.size_of_sample <= quadlets; i += dc_meta.size_of_sample) {
+            write_sample(&packet[i]);
         }
+    }
+
+    // a batch per data packet at most, so that the stages see the samples as they arrive
+    if (pipeline_used) {
+        pipeline.Flush();
+    }
+}
 
-        for (int j = 0; j < dc_meta.num_motors; j++) {
-            myFile << static_cast<uint16_t>(proc_sample.motor_status[j]);
-            if (j < dc_meta.num_motors - 1) myFile << ",";
+void DataCollection::write_sample(const uint32_t *sample) {
+    const double timestamp = sample_timestamp(sample);
+
+    if (samples_recvd_count > 0) {
+        double interval = timestamp - last_sample_timestamp;
+        interval_sum += interval;
+        interval_sum_sq += interval * interval;
+        if (samples_recvd_count == 1 || interval < interval_min) {
+            interval_min = interval;
+        }
+        if (samples_recvd_count == 1 || interval > interval_max) {
+            interval_max = interval;
         }
+    }
+    last_sample_timestamp = timestamp;
+    samples_recvd_count++;
+
+    if (batch_samples > 0) {
+        decode_sample(sample, sample_batches);
+    }
+    if (pipeline_used) {
+        decode_sample(sample, pipeline);
+    }
+}
 
-        if (use_ps_io) {
-            myFile << "," << proc_sample.digital_io << "," << proc_sample.mio_pins;
+// adds the sample to the queue (SampleBatchQueue or SamplePipeline), in the type of each
+// column (see batch_columns)
+template <class Queue>
+void DataCollection::decode_sample(const uint32_t *sample, Queue &queue)
+{
+    for (size_t c = 0; c < columns.size(); c++) {
+        uint8_t *slot = queue.ValueSlot((uint32_t) c);
+        if (slot == nullptr) {
+            // the program is behind: the sample is dropped
+            break;
         }
 
-        if (use_pot) {
-            myFile << ",";
-            for (int j = 0; j < dc_meta.num_encoders; j++) {
-                myFile << proc_sample.pot_values[j];
-                if (j < dc_meta.num_encoders - 1) myFile << ",";
+        const ColumnOp &op = columns[c];
+        switch (op.kind) {
+            case COLUMN_DOUBLE: {
+                uint64_t bits = sample_timestamp_bits(&sample[op.quadlet]);
+                memcpy(slot, &bits, sizeof(bits));
+                break;
+            }
+            case COLUMN_TICKS: {
+                double seconds = sample_timestamp_bits(&sample[op.quadlet]) * tick_period;
+                memcpy(slot, &seconds, sizeof(seconds));
+                break;
+            }
+            case COLUMN_UINT16: {
+                uint16_t value = (uint16_t) (sample[op.quadlet] >> op.shift);
+                memcpy(slot, &value, sizeof(value));
+                break;
             }
+            default:
+                // int32, uint32 and float: the quadlet as is
+                memcpy(slot, &sample[op.quadlet], sizeof(uint32_t));
+                break;
         }
-
-        myFile << std::endl;
-        memset(&proc_sample, 0, sizeof(proc_sample));
     }
+
+    queue.CommitSample();
 }
 
 void DataCollection::handle_packet_timeout() {
+    // start command lost on the way: sent again while nothing comes from the Zynq (which
+    // ignores it once the capture runs, e.g. a burst that sends nothing until its trigger)
+    const float START_RESEND_S = 0.2;
+    const int MAX_START_SENDS = 10;
+    // time without a packet (data, telemetry, etc.) before the capture is given up
+    const float CAPTURE_TIMEOUT_S = 2.0;
+
     packet_misses_counter++;
 
-    if (packet_misses_counter >= 100000 && udp_data_packets_recvd_count != 0) {
-        std::cerr << "[ERROR] Capture timeout. 100,000 data packet misses" << std::endl;
-        std::cerr << "Restart Zynq and Host programs" << std::endl;
+    if (start_pending && convert_chrono_duration_to_float(start_sent, std::chrono::high_resolution_clock::now()) > START_RESEND_S) {
+        udp_transmit(sock_id, (char *)HOST_START_DATA_COLLECTION, sizeof(HOST_START_DATA_COLLECTION));
+        start_sent = std::chrono::high_resolution_clock::now();
+        start_pending = (++start_sends < MAX_START_SENDS);
+    }
+
+    // nothing follows a complete burst until the capture is stopped; at low sample rates,
+    // the misses between two packets are many more than 100,000
+    if (packet_misses_counter >= 100000 && udp_data_packets_recvd_count != 0 && !burst_done &&
+        convert_chrono_duration_to_float(last_packet_time, std::chrono::high_resolution_clock::now()) > CAPTURE_TIMEOUT_S) {
+        std::cerr << "[ERROR] Capture timeout. No packet from the Zynq for " << CAPTURE_TIMEOUT_S << "s" << std::endl;
+        std::cerr << "Restart Host program with -r to resume the Zynq session" << std::endl;
         sm_state = SM_CLOSE_SOCKET;
         stop_data_collection_flag = true;
     }
@@ -301,137 +1474,236 @@ DataCollection::DataCollection()
     cout << "New Data Collection Object !" << endl << endl;
     isDataCollectionRunning = false;
     stop_data_collection_flag = false;
+
+    // the CSV file of each capture
+    std::string error;
+    pipeline.Configure("csv", error);
 }
 
 // TODO: need to add useful return statements -> all the close socket cases are just returns
 // make sure logic checks out 
+void DataCollection :: set_zynq_address(const std::string &address)
+{
+    zynq_address = address;
+}
+
+void DataCollection :: set_channel_mask(const SampleChannelMask &mask)
+{
+    channel_mask = mask;
+}
+
+void DataCollection :: set_oversampling(uint32_t reads_per_sample, bool min_max)
+{
+    oversampling.reads_per_sample = reads_per_sample;
+    oversampling.min_max = min_max ? 1 : 0;
+}
+
+void DataCollection :: set_burst(const BurstConfig &config)
+{
+    burst = config;
+}
+
+void DataCollection :: set_fec(uint32_t group_size)
+{
+    fec_group_size = group_size;
+}
+
+void DataCollection :: set_retransmit(uint32_t history)
+{
+    retransmit_history = history;
+}
+
+void DataCollection :: set_fault_injection(const UdpFaultConfig &config)
+{
+    udp_set_fault_injection(config);
+}
+
+void DataCollection :: set_packet_ring(bool enable)
+{
+    use_packet_ring = enable;
+}
+
+void DataCollection :: set_batch_output(uint32_t samples_per_batch, uint32_t num_batches)
+{
+    batch_samples = samples_per_batch;
+    this->num_batches = num_batches;
+}
+
+void DataCollection :: set_file_output(bool enable)
+{
+    write_files = enable;
+}
+
+bool DataCollection :: set_pipeline(const std::string &stages, std::string &error)
+{
+    return pipeline.Configure(stages, error);
+}
+
+std::vector<SampleBatchQueue::Column> DataCollection :: batch_columns() const
+{
+    // NumPy type strings in the byte order of the host
+    const uint16_t one = 1;
+    const char order = (*reinterpret_cast<const uint8_t *>(&one) == 1) ? '<' : '>';
+
+    std::vector<SampleBatchQueue::Column> batch_columns;
+    for (size_t c = 0; c < columns.size(); c++) {
+        SampleBatchQueue::Column column;
+        column.name = column_names[c];
+        switch (columns[c].kind) {
+            case COLUMN_DOUBLE:
+            case COLUMN_TICKS:
+                column.typestr = "f8";
+                break;
+            case COLUMN_INT32:
+                column.typestr = "i4";
+                break;
+            case COLUMN_UINT32:
+                column.typestr = "u4";
+                break;
+            case COLUMN_FLOAT:
+                column.typestr = "f4";
+                break;
+            default:
+                column.typestr = "u2";
+                break;
+        }
+        column.itemsize = (uint32_t) (column.typestr[1] - '0');
+        column.typestr.insert(column.typestr.begin(), order);
+        batch_columns.push_back(column);
+    }
+    return batch_columns;
+}
+
 bool DataCollection :: init(uint8_t boardID, uint8_t optionsMask, int sample_rate)
 {
-    if(!udp_init(&sock_id, boardID)) {
+    if(!udp_init(&sock_id, boardID, zynq_address.empty() ? nullptr : zynq_address.c_str())) {
         return false;
     }
 
-    const uint8_t supported_mask = ENABLE_PSIO_MSK | ENABLE_POT_MSK | ENABLE_SAMPLE_RATE_MSK;
+    const uint8_t supported_mask = ENABLE_PSIO_MSK | ENABLE_POT_MSK | ENABLE_SAMPLE_RATE_MSK | ENABLE_COMPRESSION_MSK |
+                                   ENABLE_CHANNEL_MASK_MSK | ENABLE_OVERSAMPLING_MSK | ENABLE_BURST_MSK |
+                                   ENABLE_FPGA_TIMESTAMP_MSK;
     options_mask = optionsMask & supported_mask;
 
     use_ps_io = (options_mask & ENABLE_PSIO_MSK) != 0;
     use_pot = (options_mask & ENABLE_POT_MSK) != 0;
     use_sample_rate = (options_mask & ENABLE_SAMPLE_RATE_MSK) != 0;
+    use_compression = (options_mask & ENABLE_COMPRESSION_MSK) != 0;
 
     if (use_sample_rate) {
         this->sample_rate = static_cast<uint16_t>(sample_rate);
     }
 
+    payload_size = udp_max_payload(sock_id);
 
-    sm_state = SM_SEND_READY_STATE_TO_PS;
-    int ret_code = 0;
-
-    char recvBuffer[100] = {0};
+    return handshake(SM_SEND_READY_STATE_TO_PS);
+}
 
-    bool error_flag = false;
+bool DataCollection :: resume(uint8_t boardID, bool &capture_in_progress)
+{
+    capture_in_progress = false;
 
-    // Handshaking PS
-    while(1) {
-        switch(sm_state) {
-            case SM_SEND_READY_STATE_TO_PS:
-                {
-                    udp_transmit(sock_id, (char *)HOST_READY_CMD, sizeof(HOST_READY_CMD));
-                    udp_transmit(sock_id, (char *)HOST_FLAG_CMD, sizeof(HOST_FLAG_CMD));
-                    udp_transmit(sock_id, (void *)&options_mask, sizeof(options_mask));
+    if(!udp_init(&sock_id, boardID, zynq_address.empty() ? nullptr : zynq_address.c_str())) {
+        return false;
+    }
 
-                    if (use_sample_rate){
-                        udp_transmit(sock_id, (char *)HOST_SAMPLE_RATE_CMD, sizeof(HOST_SAMPLE_RATE_CMD));
-                        udp_transmit(sock_id, (int *) &sample_rate, sizeof(sample_rate));
-                    }
-                }
-                sm_state = SM_RECV_DATA_COLLECTION_META_DATA;
-                break;
+    if (!handshake(SM_SEND_RESUME_SESSION_TO_PS)) {
+        return false;
+    }
 
-            case SM_RECV_DATA_COLLECTION_META_DATA:
-                ret_code = udp_nonblocking_receive(sock_id, &dc_meta, sizeof(dc_meta));
-                if (ret_code > 0) {
-                    if (dc_meta.hwvers == dRA1_String || dc_meta.hwvers == QLA1_String || dc_meta.hwvers == DQLA_String) {
-                        cout << "Received Message from Zynq: RECEIVED METADATA" << endl << endl;
+    capture_in_progress = (dc_meta.session_state == SESSION_CAPTURING);
+    return true;
+}
 
-                        char hw_vers[5];
-                        hwVersToString(dc_meta.hwvers, hw_vers);
+bool DataCollection :: start()
+{
+    burst_done = false;
+    reorder_resync = false;
+    if (batch_samples > 0) {
+        sample_batches.Configure(batch_columns(), batch_samples, num_batches);
+    }
+    final_telemetry_received = false;
 
-                        cout << "---- DATA COLLECTION METADATA ---" << endl;
-                        cout << "Hardware Version: " << hw_vers << endl;
-                        cout << "Num of Encoders:  " <<  +dc_meta.num_encoders << endl;
-                        cout << "Num of Motors: " << +dc_meta.num_motors << endl;
-                        cout << "Packet Size (in bytes): " << dc_meta.data_packet_size << endl;
-                        cout << "Samples per Packet: " << dc_meta.samples_per_packet << endl;
-                        cout << "Sizoef Samples (in quadlets): " << dc_meta.size_of_sample << endl;
-                        cout << "----------------------------------" << endl << endl;
+    if (pthread_create(&collect_data_t, nullptr, DataCollection::collect_data_thread, this) != 0) {
+        std::cerr << "Error collect data thread" << std::endl;
+        // no thread to join: the capture did not start
+        return false;
+    }
 
-                        sm_state = SM_SEND_METADATA_RECV;
-                    } else {
-                        cout << "[ERROR] Host data collection is out of sync with Zynq State Machine. Restart Zynq and Host Program";
-                        sm_state = SM_CLOSE_SOCKET;
-                    }
-                } else if (ret_code == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || ret_code == UDP_NON_UDP_DATA_IS_AVAILABLE){
-                    sm_state = SM_RECV_DATA_COLLECTION_META_DATA;
-                } else {
-                    cout << "[ERROR] - UDP fail, Check connection if zynq program failed" << endl;
-                    sm_state = SM_CLOSE_SOCKET;
-                }
-                break;
+    // clearing udp buffer of remaining packets not captured during data collection
+    while (udp_nonblocking_receive(sock_id, data_packet, dc_meta.data_packet_size) > 0) {}
 
-            case SM_SEND_METADATA_RECV:
-                udp_transmit(sock_id, (char *) HOST_RECVD_METADATA , sizeof(HOST_RECVD_METADATA ));
-                sm_state = SM_WAIT_FOR_PS_HANDSHAKE;
-                break;
+    return true;
+}
 
-            case SM_WAIT_FOR_PS_HANDSHAKE:
-                ret_code = udp_nonblocking_receive(sock_id, recvBuffer, sizeof(recvBuffer));
-                
-                if (ret_code > 0) {
-                    if (strcmp(recvBuffer, "ZYNQ: READY FOR DATA COLLECTION") == 0) {
-                        cout << "Received Message " << ZYNQ_READY_CMD << endl;
-                        sm_state = SM_SEND_START_DATA_COLLECTIION_CMD_TO_PS;
-                        return true; 
-                    } else {
-                        cout << "[ERROR] Host data collection is out of sync with Processor State Machine. Restart Server";
-                        sm_state = SM_CLOSE_SOCKET;
-                    }
-                } else if (ret_code == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || ret_code == UDP_NON_UDP_DATA_IS_AVAILABLE) {
-                    sm_state = SM_WAIT_FOR_PS_HANDSHAKE;
-                } else {
-                    cout << "[ERROR] - UDP fail, Check connection if zynq program failed" << endl;
-                    sm_state = SM_CLOSE_SOCKET;
-                }
-                break;
+bool DataCollection :: attach()
+{
+    if (batch_samples > 0) {
+        sample_batches.Configure(batch_columns(), batch_samples, num_batches);
+    }
+    attach_to_capture = true;
+    // the sequence numbers of the capture did not start with this host
+    reorder_resync = true;
+    burst_done = false;
+    final_telemetry_received = false;
 
-            case SM_CLOSE_SOCKET:
-                close(sock_id);
-                return false;
-        }
+    if (pthread_create(&collect_data_t, nullptr, DataCollection::collect_data_thread, this) != 0) {
+        std::cerr << "Error collect data thread" << std::endl;
+        attach_to_capture = false;
+        return false;
     }
-}
 
+    return true;
+}
 
-bool DataCollection :: start()
+bool DataCollection :: abort_capture()
 {
-    if (pthread_create(&collect_data_t, nullptr, DataCollection::collect_data_thread, this) != 0) {
-        std::cerr << "Error collect data thread" << std::endl;
-        return 1;
+    if (!udp_transmit(sock_id,(char *) HOST_STOP_DATA_COLLECTION, sizeof(HOST_STOP_DATA_COLLECTION)) ) {
+        cout << "[ERROR]: UDP error. Check connection if zynq program failed!" << endl;
+        return false;
     }
 
-    // clearing udp buffer of remaining packets not captured during data collection
-    while (udp_nonblocking_receive(sock_id, data_packet, dc_meta.data_packet_size) > 0) {}
+    usleep(1000);
+
+    // discard packets sent before the Zynq stopped
+    while (udp_nonblocking_receive(sock_id, data_packet, sizeof(data_packet)) > 0) {}
 
+    cout << "Stopped capture in progress on Zynq" << endl << endl;
     return true;
 }
 
 bool DataCollection :: stop()
 {
+    // wait for the final telemetry packet, which follows the last data packets, and
+    // the packets requested again in retransmit mode
+    const float FINAL_TELEMETRY_TIMEOUT_S = 0.5;
+    // the stop command (or the final telemetry) lost on the way: the command is sent again,
+    // and a stopped Zynq sends the final telemetry again
+    const float STOP_RESEND_S = 0.1;
+
+    // the events marked last are received back (and resent if lost) before the capture stops
+    std::chrono::time_point<std::chrono::high_resolution_clock> events_wait = std::chrono::high_resolution_clock::now();
+    while (pending_event_count > 0 && !stop_data_collection_flag &&
+           convert_chrono_duration_to_float(events_wait, std::chrono::high_resolution_clock::now()) < EVENT_STOP_WAIT_S) {
+        usleep(1000);
+    }
+
     // send end data collection cmd
     if (!udp_transmit(sock_id,(char *) HOST_STOP_DATA_COLLECTION, sizeof(HOST_STOP_DATA_COLLECTION)) ) {
         cout << "[ERROR]: UDP error. Check connection if zynq program failed!" << endl; // more descriptive eror message
     }
 
-    usleep(1000);
+    std::chrono::time_point<std::chrono::high_resolution_clock> stop_start = std::chrono::high_resolution_clock::now();
+    std::chrono::time_point<std::chrono::high_resolution_clock> stop_sent = stop_start;
+    do {
+        usleep(1000);
+        if (!final_telemetry_received &&
+            convert_chrono_duration_to_float(stop_sent, std::chrono::high_resolution_clock::now()) > STOP_RESEND_S) {
+            udp_transmit(sock_id, (char *) HOST_STOP_DATA_COLLECTION, sizeof(HOST_STOP_DATA_COLLECTION));
+            stop_sent = std::chrono::high_resolution_clock::now();
+        }
+    } while ((!final_telemetry_received || reorder_missing > 0) && !stop_data_collection_flag &&
+             convert_chrono_duration_to_float(stop_start, std::chrono::high_resolution_clock::now()) < FINAL_TELEMETRY_TIMEOUT_S);
 
     isDataCollectionRunning = false;
 
@@ -439,15 +1711,44 @@ bool DataCollection :: stop()
 
     pthread_join(collect_data_t, nullptr);
 
-    myFile.close();
-
     curr_time.end = std::chrono::high_resolution_clock::now();
     curr_time.elapsed = convert_chrono_duration_to_float(curr_time.start, curr_time.end);
 
 
     cout << "---------------------------------------------------------" << endl;
     cout << "STOPPED CAPTURE [" << data_capture_count++ << "] ! Time Elapsed: " << curr_time.elapsed << "s" << endl;
-    cout << "Data stored to " << filename << "." << endl;
+    if (write_files && pipeline_used && pipeline.HasStage("csv")) {
+        cout << "Data stored to " << filename << " (telemetry in " << telemetry_filename << ")." << endl;
+    } else if (write_files) {
+        cout << "Telemetry stored to " << telemetry_filename << "." << endl;
+    }
+    if (!events_filename.empty()) {
+        cout << "Events stored to " << events_filename << "." << endl;
+    }
+    if (pending_event_count > 0) {
+        cout << "[WARNING] " << pending_event_count << " marked events not received back from the Zynq (lost)" << endl;
+    }
+    print_telemetry_summary();
+    if (write_files) {
+        write_capture_summary();
+    }
+    if (pipeline_used) {
+        pipeline.PrintSummary();
+    }
+    if (use_compression && data_bytes_recvd_count > 0) {
+        long long sample_bytes = samples_recvd_count * dc_meta.size_of_sample * 4;
+        cout << "Compression ratio: " << (float) sample_bytes / data_bytes_recvd_count << " (" << samples_recvd_count
+             << " samples in " << data_bytes_recvd_count << " bytes)" << endl;
+    }
+    if (samples_recvd_count > 1) {
+        double intervals = (double) (samples_recvd_count - 1);
+        double mean = interval_sum / intervals;
+        double variance = interval_sum_sq / intervals - mean * mean;
+        streamsize precision = cout.precision();
+        cout << fixed << setprecision(2) << "Sample interval: mean " << mean * 1e6 << "us, std dev "
+             << ((variance > 0.0) ? sqrt(variance) : 0.0) * 1e6 << "us, min " << interval_min * 1e6
+             << "us, max " << interval_max * 1e6 << "us" << defaultfloat << setprecision(precision) << endl;
+    }
     cout << "---------------------------------------------------------" << endl << endl;
 
     collect_data_ret = true;
@@ -457,23 +1758,96 @@ bool DataCollection :: stop()
     return true;
 }
 
+bool DataCollection :: trigger_burst()
+{
+    if (!udp_transmit(sock_id, (char *) HOST_BURST_TRIGGER_CMD, sizeof(HOST_BURST_TRIGGER_CMD))) {
+        cout << "[ERROR]: UDP error. Check connection if zynq program failed!" << endl;
+        return false;
+    }
+    return true;
+}
+
+// sends a command of the current capture with its value (a single datagram, see
+// CaptureCommand)
+bool DataCollection :: send_capture_cmd(const char *cmd, uint32_t value)
+{
+    if (!isDataCollectionRunning) {
+        return false;
+    }
+    CaptureCommand command;
+    memset(&command, 0, sizeof(command));
+    strncpy(command.cmd, cmd, sizeof(command.cmd) - 1);
+    command.value = value;
+
+    std::lock_guard<std::mutex> lock(capture_cmd_mutex);
+    command.sequence = ++capture_cmd_sequence;
+    if (strcmp(cmd, HOST_MARK_EVENT_CMD) == 0) {
+        // before it is sent, so that it is pending when the event comes back
+        PendingEvent pending;
+        pending.command = command;
+        pending.sent = std::chrono::high_resolution_clock::now();
+        pending_events.push_back(pending);
+        pending_event_count = (int) pending_events.size();
+    }
+    if (!udp_transmit(sock_id, &command, sizeof(command))) {
+        cout << "[ERROR]: UDP error. Check connection if zynq program failed!" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool DataCollection :: set_sample_rate(uint32_t sample_rate)
+{
+    if (!use_sample_rate || sample_rate == 0) {
+        return false;
+    }
+    return send_capture_cmd(HOST_SET_SAMPLE_RATE_CMD, sample_rate);
+}
+
+bool DataCollection :: mark_event(uint32_t event_id)
+{
+    return send_capture_cmd(HOST_MARK_EVENT_CMD, event_id);
+}
 
 bool DataCollection :: terminate()
 {
+    // the command (or the reply) lost on the way: the command is sent again, up to
+    // MAX_TERMINATE_SENDS times
+    const float TERMINATE_RESEND_S = 0.2;
+    const int MAX_TERMINATE_SENDS = 5;
+
     char terminateClientAndServerCmd[] = "CLIENT: Terminate Server";
     char recvBuffer[100] = {0};
 
     if (!udp_transmit(sock_id, (char *) HOST_TERMINATE_SERVER, sizeof(HOST_TERMINATE_SERVER))) {
         cout << "[ERROR]: UDP error. check connection with host!" << endl;
     }
+    std::chrono::time_point<std::chrono::high_resolution_clock> terminate_sent = std::chrono::high_resolution_clock::now();
+    int terminate_sends = 1;
 
     while (1) {
-        int ret = udp_nonblocking_receive(sock_id, recvBuffer, 31);
+        if (convert_chrono_duration_to_float(terminate_sent, std::chrono::high_resolution_clock::now()) > TERMINATE_RESEND_S) {
+            if (terminate_sends == MAX_TERMINATE_SENDS) {
+                cout << "[ERROR] No reply from Zynq to the terminate command" << endl;
+                return false;
+            }
+            udp_transmit(sock_id, (char *) HOST_TERMINATE_SERVER, sizeof(HOST_TERMINATE_SERVER));
+            terminate_sent = std::chrono::high_resolution_clock::now();
+            terminate_sends++;
+        }
+
+        int ret = udp_nonblocking_receive(sock_id, data_packet, sizeof(data_packet));
 
         if (ret > 0) {
+            memcpy(recvBuffer, data_packet, sizeof(recvBuffer) - 1);
+
             if (strcmp(recvBuffer,  ZYNQ_TERMINATATION_SUCCESSFUL) == 0) {
                 cout << "Received Message:  " << ZYNQ_TERMINATATION_SUCCESSFUL << endl;
                 break;
+            } else if (is_data_packet(data_packet, ret) || is_telemetry_packet(data_packet, ret) || is_event_packet(data_packet, ret) ||
+                       is_fec_parity(data_packet, ret)) {
+                // data packet sent before the last capture stopped
+                continue;
             } else {
                 cout << "[ERROR] Zynq and Host out of sync" << endl;
                 return false;
@@ -0,0 +1,187 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <fstream>
+#include <new>
+#include <vector>
+
+#include "data_collection.h"
+#include "data_collection_c.h"
+
+static_assert(DVRK_DC_ENABLE_PSIO == ENABLE_PSIO_MSK && DVRK_DC_ENABLE_POT == ENABLE_POT_MSK &&
+              DVRK_DC_ENABLE_SAMPLE_RATE == ENABLE_SAMPLE_RATE_MSK && DVRK_DC_ENABLE_COMPRESSION == ENABLE_COMPRESSION_MSK &&
+              DVRK_DC_ENABLE_CHANNEL_MASK == ENABLE_CHANNEL_MASK_MSK && DVRK_DC_ENABLE_OVERSAMPLING == ENABLE_OVERSAMPLING_MSK &&
+              DVRK_DC_ENABLE_FPGA_TIMESTAMP == ENABLE_FPGA_TIMESTAMP_MSK, "DVRK_DC_ENABLE_* must match the flag masks");
+
+struct dvrk_dc {
+    DataCollection collection;
+    // columns of the session, from the metadata
+    std::vector<SampleBatchQueue::Column> columns;
+    bool capture_running = false;
+};
+
+uint32_t dvrk_dc_api_version(void)
+{
+    return DVRK_DC_API_VERSION;
+}
+
+dvrk_dc *dvrk_dc_create(void)
+{
+    dvrk_dc *dc = new (std::nothrow) dvrk_dc;
+    if (dc != nullptr) {
+        dc->collection.set_batch_output(DVRK_DC_DEFAULT_BATCH_SAMPLES, DVRK_DC_DEFAULT_NUM_BATCHES);
+    }
+    return dc;
+}
+
+void dvrk_dc_destroy(dvrk_dc *dc)
+{
+    if (dc != nullptr && dc->capture_running) {
+        dc->collection.stop();
+    }
+    delete dc;
+}
+
+void dvrk_dc_set_zynq_address(dvrk_dc *dc, const char *address)
+{
+    dc->collection.set_zynq_address((address != nullptr) ? address : "");
+}
+
+void dvrk_dc_set_channel_mask(dvrk_dc *dc, uint32_t encoder_position, uint32_t encoder_velocity, uint32_t motor, uint32_t pot)
+{
+    SampleChannelMask mask = {encoder_position, encoder_velocity, motor, pot};
+    dc->collection.set_channel_mask(mask);
+}
+
+void dvrk_dc_set_oversampling(dvrk_dc *dc, uint32_t reads_per_sample, int min_max)
+{
+    dc->collection.set_oversampling(reads_per_sample, min_max != 0);
+}
+
+void dvrk_dc_set_fec(dvrk_dc *dc, uint32_t group_size)
+{
+    dc->collection.set_fec(group_size);
+}
+
+void dvrk_dc_set_retransmit(dvrk_dc *dc, uint32_t history)
+{
+    dc->collection.set_retransmit(history);
+}
+
+void dvrk_dc_set_batches(dvrk_dc *dc, uint32_t samples_per_batch, uint32_t num_batches)
+{
+    // batches are always on, the program reads the samples from them
+    dc->collection.set_batch_output((samples_per_batch > 0) ? samples_per_batch : DVRK_DC_DEFAULT_BATCH_SAMPLES,
+                                    (num_batches > 0) ? num_batches : DVRK_DC_DEFAULT_NUM_BATCHES);
+}
+
+void dvrk_dc_set_file_output(dvrk_dc *dc, int enable)
+{
+    dc->collection.set_file_output(enable != 0);
+}
+
+int dvrk_dc_init(dvrk_dc *dc, uint8_t board_id, uint8_t options_mask, int sample_rate)
+{
+    // burst mode ends captures by itself, which this interface does not report
+    if (!dc->collection.init(board_id, options_mask & ~ENABLE_BURST_MSK, sample_rate)) {
+        dc->columns.clear();
+        return 0;
+    }
+    dc->columns = dc->collection.batch_columns();
+    return 1;
+}
+
+uint32_t dvrk_dc_num_columns(dvrk_dc *dc)
+{
+    return (uint32_t) dc->columns.size();
+}
+
+int dvrk_dc_get_column(dvrk_dc *dc, uint32_t index, dvrk_dc_column *column)
+{
+    if (index >= dc->columns.size()) {
+        return 0;
+    }
+    column->name = dc->columns[index].name.c_str();
+    column->typestr = dc->columns[index].typestr.c_str();
+    column->itemsize = dc->columns[index].itemsize;
+    return 1;
+}
+
+int dvrk_dc_start(dvrk_dc *dc)
+{
+    if (dc->columns.empty() || dc->capture_running) {
+        return 0;
+    }
+    dc->capture_running = dc->collection.start();
+    return dc->capture_running ? 1 : 0;
+}
+
+int dvrk_dc_pull_batch(dvrk_dc *dc, dvrk_dc_batch *batch, int timeout_ms)
+{
+    SampleBatchQueue *batches = dc->collection.batches();
+    SampleBatchQueue::Batch next;
+
+    if (batches == nullptr || !batches->IsConfigured()) {
+        return -1;
+    }
+
+    int ret = batches->Pull(next, timeout_ms);
+    if (ret == 1) {
+        batch->sequence = next.sequence;
+        batch->first_sample = next.first_sample;
+        batch->dropped_samples = next.dropped_samples;
+        batch->num_samples = next.num_samples;
+        batch->num_columns = (uint32_t) dc->columns.size();
+        batch->data = next.data;
+    }
+    return ret;
+}
+
+void dvrk_dc_release_batch(dvrk_dc *dc)
+{
+    SampleBatchQueue *batches = dc->collection.batches();
+    if (batches != nullptr) {
+        batches->Release();
+    }
+}
+
+int dvrk_dc_set_sample_rate(dvrk_dc *dc, uint32_t sample_rate)
+{
+    return dc->collection.set_sample_rate(sample_rate) ? 1 : 0;
+}
+
+int dvrk_dc_mark_event(dvrk_dc *dc, uint32_t event_id)
+{
+    return dc->collection.mark_event(event_id) ? 1 : 0;
+}
+
+int dvrk_dc_stop(dvrk_dc *dc)
+{
+    if (!dc->capture_running) {
+        return 0;
+    }
+    dc->capture_running = false;
+    return dc->collection.stop() ? 1 : 0;
+}
+
+int dvrk_dc_terminate(dvrk_dc *dc)
+{
+    if (dc->capture_running) {
+        dvrk_dc_stop(dc);
+    }
+    return dc->collection.terminate() ? 1 : 0;
+}
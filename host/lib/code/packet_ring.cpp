@@ -0,0 +1,313 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "packet_ring.h"
+#include "udp_tx.h"
+
+#ifdef __linux__
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#endif
+
+PacketRing::PacketRing()
+    : Socket(-1), UdpSocket(-1), Ring(nullptr), RingSize(0), BlockSize(0), NumBlocks(0), PeerAddress(0), PeerPort(0),
+      LocalPort(0), Block(0), Current(nullptr), Frame(nullptr), Remaining(0)
+{
+}
+
+PacketRing::~PacketRing()
+{
+    Close();
+}
+
+#ifdef __linux__
+
+bool PacketRing::Open(int udp_socket, uint32_t block_size, uint32_t num_blocks)
+{
+    Close();
+    Counts = Stats();
+
+    sockaddr_in peer, local;
+    socklen_t length = sizeof(peer);
+    if (getpeername(udp_socket, (sockaddr *) &peer, &length) != 0) {
+        return false;
+    }
+    length = sizeof(local);
+    if (getsockname(udp_socket, (sockaddr *) &local, &length) != 0) {
+        return false;
+    }
+    PeerAddress = peer.sin_addr.s_addr;
+    PeerPort = peer.sin_port;
+    LocalPort = local.sin_port;
+
+    // the interface of the local address of the socket, all of them if not found
+    int ifindex = 0;
+    ifaddrs *interfaces;
+    if (getifaddrs(&interfaces) == 0) {
+        for (ifaddrs *i = interfaces; i != nullptr; i = i->ifa_next) {
+            if (i->ifa_addr != nullptr && i->ifa_addr->sa_family == AF_INET &&
+                ((sockaddr_in *) i->ifa_addr)->sin_addr.s_addr == local.sin_addr.s_addr) {
+                ifindex = (int) if_nametoindex(i->ifa_name);
+                break;
+            }
+        }
+        freeifaddrs(interfaces);
+    }
+
+    // no protocol until bound, so that nothing is received before the filter is attached
+    Socket = socket(AF_PACKET, SOCK_DGRAM, 0);
+    if (Socket < 0) {
+        return false;
+    }
+
+    int version = TPACKET_V3;
+    tpacket_req3 request;
+    memset(&request, 0, sizeof(request));
+    request.tp_block_size = block_size;
+    request.tp_block_nr = num_blocks;
+    request.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    request.tp_frame_nr = (uint32_t) (((uint64_t) block_size * num_blocks) / request.tp_frame_size);
+    // a block that is not full is passed to the program after 1 ms
+    request.tp_retire_blk_tov = 1;
+
+    sockaddr_ll address;
+    memset(&address, 0, sizeof(address));
+    address.sll_family = AF_PACKET;
+    address.sll_protocol = htons(ETH_P_IP);
+    address.sll_ifindex = ifindex;
+
+    RingSize = (size_t) block_size * num_blocks;
+    if (!AttachFilter() ||
+        setsockopt(Socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0 ||
+        setsockopt(Socket, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) != 0) {
+        Close();
+        return false;
+    }
+    void *ring = mmap(nullptr, RingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Socket, 0);
+    if (ring == MAP_FAILED) {
+        Close();
+        return false;
+    }
+    Ring = (uint8_t *) ring;
+    BlockSize = block_size;
+    NumBlocks = num_blocks;
+
+    if (bind(Socket, (sockaddr *) &address, sizeof(address)) != 0) {
+        Close();
+        return false;
+    }
+
+    // the UDP socket drops the datagrams from now on (they are in the ring), and those
+    // received before
+    sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+    sock_fprog program = {1, &drop};
+    if (setsockopt(udp_socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != 0) {
+        Close();
+        return false;
+    }
+    UdpSocket = udp_socket;
+    uint8_t discard;
+    while (recv(udp_socket, &discard, sizeof(discard), MSG_DONTWAIT) >= 0) {}
+
+    return true;
+}
+
+// IPv4 datagrams of the host, unfragmented, of UDP from the peer to the local port (the
+// packet socket starts the filter at the IP header)
+bool PacketRing::AttachFilter(void)
+{
+    sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) (SKF_AD_OFF + SKF_AD_PKTTYPE)),
+        // not the copies of the datagrams sent on the loopback interface
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_HOST, 0, 12),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 10),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(PeerAddress), 0, 8),
+        // fragment offset and more fragments flag
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3FFF, 6, 0),
+        // X: length of the IP header
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(PeerPort), 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(LocalPort), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    sock_fprog program = {(unsigned short) (sizeof(filter) / sizeof(filter[0])), filter};
+
+    return setsockopt(Socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == 0;
+}
+
+void PacketRing::Close(void)
+{
+    if (UdpSocket >= 0) {
+        int unused = 0;
+        setsockopt(UdpSocket, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused));
+        UdpSocket = -1;
+    }
+    if (Socket >= 0) {
+        ReadKernelStats();
+    }
+    if (Ring != nullptr) {
+        munmap(Ring, RingSize);
+        Ring = nullptr;
+    }
+    if (Socket >= 0) {
+        close(Socket);
+        Socket = -1;
+    }
+    Block = 0;
+    Current = nullptr;
+    Frame = nullptr;
+    Remaining = 0;
+}
+
+int PacketRing::Receive(const uint32_t *&payload)
+{
+    while (true) {
+        if (Remaining == 0) {
+            // all the datagrams of the block were read: back to the kernel
+            if (Current != nullptr) {
+                tpacket_block_desc *done = (tpacket_block_desc *) Current;
+                __atomic_store_n(&done->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+                Current = nullptr;
+                Block = (Block + 1) % NumBlocks;
+            }
+
+            tpacket_block_desc *block = (tpacket_block_desc *) (Ring + (size_t) Block * BlockSize);
+            if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+                // a poll per call, as the select of udp_nonblocking_receive, which also
+                // reports socket errors
+                pollfd fd = {Socket, POLLIN, 0};
+                if (poll(&fd, 1, 0) < 0) {
+                    return UDP_SELECT_ERROR;
+                }
+                if ((fd.revents & (POLLERR | POLLNVAL)) != 0) {
+                    return UDP_SOCKET_ERROR;
+                }
+                if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+                    return UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT;
+                }
+            }
+
+            Current = (uint8_t *) block;
+            Frame = Current + block->hdr.bh1.offset_to_first_pkt;
+            Remaining = block->hdr.bh1.num_pkts;
+            Counts.Blocks++;
+            continue;
+        }
+
+        const uint8_t *frame = Frame;
+        Frame += ((const tpacket3_hdr *) frame)->tp_next_offset;
+        Remaining--;
+
+        int length = Parse(frame, payload);
+        if (length > 0) {
+            return length;
+        }
+    }
+}
+
+// payload of a datagram of the ring, or 0 if it is not one of the peer (past the filter
+// when the ring was opened) or was truncated
+int PacketRing::Parse(const uint8_t *frame, const uint32_t *&payload) const
+{
+    const tpacket3_hdr *header = (const tpacket3_hdr *) frame;
+    // SOCK_DGRAM: the IP header is at tp_net (tp_mac), aligned to TPACKET_ALIGNMENT
+    const uint8_t *ip = frame + header->tp_net;
+    const uint32_t captured = header->tp_snaplen;
+
+    if (captured < 20 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP) {
+        return 0;
+    }
+    const uint32_t ip_header = (ip[0] & 0x0F) * 4;
+    const uint32_t total = ((uint32_t) ip[2] << 8) | ip[3];
+    if (ip_header < 20 || total > captured || total < ip_header + 8) {
+        return 0;
+    }
+
+    const uint8_t *udp = ip + ip_header;
+    const uint32_t udp_length = ((uint32_t) udp[4] << 8) | udp[5];
+    uint32_t source;
+    memcpy(&source, ip + 12, sizeof(source));
+    if (udp_length < 8 || ip_header + udp_length > total || source != PeerAddress ||
+        memcmp(udp, &PeerPort, 2) != 0 || memcmp(udp + 2, &LocalPort, 2) != 0) {
+        return 0;
+    }
+
+    // IP headers are a multiple of 4 bytes long, so the payload is aligned for quadlets
+    payload = (const uint32_t *) (udp + 8);
+    return (int) (udp_length - 8);
+}
+
+void PacketRing::ReadKernelStats(void)
+{
+    // the kernel counts since the last read
+    tpacket_stats_v3 stats;
+    socklen_t length = sizeof(stats);
+    if (getsockopt(Socket, SOL_PACKET, PACKET_STATISTICS, &stats, &length) == 0) {
+        Counts.Packets += stats.tp_packets;
+        Counts.Drops += stats.tp_drops;
+        Counts.Freezes += stats.tp_freeze_q_cnt;
+    }
+}
+
+#else
+
+bool PacketRing::Open(int, uint32_t, uint32_t)
+{
+    Counts = Stats();
+    errno = ENOTSUP;
+    return false;
+}
+
+void PacketRing::Close(void)
+{
+}
+
+int PacketRing::Receive(const uint32_t *&)
+{
+    return UDP_SOCKET_ERROR;
+}
+
+void PacketRing::ReadKernelStats(void)
+{
+}
+
+#endif
+
+PacketRing::Stats PacketRing::GetStats(void)
+{
+    if (Socket >= 0) {
+        ReadKernelStats();
+    }
+    return Counts;
+}
@@ -0,0 +1,153 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <chrono>
+
+#include "sample_batch_queue.h"
+
+SampleBatchQueue::SampleBatchQueue() : BatchSamples(1), Current(nullptr), Count(0), SampleNumber(0), DroppedSamples(0),
+                                       Head(0), Pulled(0), Tail(0), Finished(false)
+{
+}
+
+void SampleBatchQueue::Configure(const std::vector<Column> &columns, uint32_t batch_samples, uint32_t num_batches)
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+
+    Columns = columns;
+    BatchSamples = (batch_samples > 0) ? batch_samples : 1;
+    Slots.resize((num_batches > 0) ? num_batches : 1);
+
+    for (size_t s = 0; s < Slots.size(); s++) {
+        Slot &slot = Slots[s];
+        std::vector<size_t> offsets;
+        size_t words = 0;
+        for (size_t c = 0; c < Columns.size(); c++) {
+            offsets.push_back(words);
+            words += ((size_t) BatchSamples * Columns[c].itemsize + 7) / 8;
+        }
+
+        // writes every page, so that the receive thread does not page fault
+        slot.Storage.assign(words, 0);
+        slot.Columns.resize(Columns.size());
+        slot.Data.resize(Columns.size());
+        for (size_t c = 0; c < Columns.size(); c++) {
+            slot.Columns[c] = reinterpret_cast<uint8_t *>(&slot.Storage[offsets[c]]);
+            slot.Data[c] = slot.Columns[c];
+        }
+    }
+
+    Head = 0;
+    Pulled = 0;
+    Tail = 0;
+    Finished = false;
+    SampleNumber = 0;
+    DroppedSamples = 0;
+    StartBatch();
+}
+
+// fills the next batch if the reader released it, otherwise drops the samples until it does
+void SampleBatchQueue::StartBatch(void)
+{
+    const uint64_t head = Head.load(std::memory_order_relaxed);
+
+    if (head - Tail.load(std::memory_order_acquire) < Slots.size()) {
+        Current = &Slots[head % Slots.size()];
+        Current->FirstSample = SampleNumber;
+    } else {
+        Current = nullptr;
+    }
+    Count = 0;
+}
+
+void SampleBatchQueue::Publish(void)
+{
+    Current->Sequence = Head.load(std::memory_order_relaxed);
+    Current->NumSamples = Count;
+    Current->DroppedSamples = DroppedSamples;
+    Current = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Head.fetch_add(1, std::memory_order_release);
+    }
+    Published.notify_one();
+}
+
+void SampleBatchQueue::CommitSample(void)
+{
+    SampleNumber++;
+
+    if (Current == nullptr) {
+        DroppedSamples++;
+        StartBatch();
+        return;
+    }
+
+    if (++Count == BatchSamples) {
+        Publish();
+        StartBatch();
+    }
+}
+
+void SampleBatchQueue::Finish(void)
+{
+    if (Current != nullptr && Count > 0) {
+        Publish();
+    }
+    Current = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Finished = true;
+    }
+    Published.notify_all();
+}
+
+int SampleBatchQueue::Pull(Batch &batch, int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(Mutex);
+    auto ready = [this] { return Pulled != Head.load(std::memory_order_acquire) || Finished; };
+
+    if (timeout_ms < 0) {
+        Published.wait(lock, ready);
+    } else if (!Published.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready)) {
+        return 0;
+    }
+
+    // capture ended, all batches pulled
+    if (Pulled == Head.load(std::memory_order_acquire)) {
+        return -1;
+    }
+
+    const Slot &slot = Slots[Pulled % Slots.size()];
+    Pulled++;
+
+    batch.sequence = slot.Sequence;
+    batch.first_sample = slot.FirstSample;
+    batch.dropped_samples = slot.DroppedSamples;
+    batch.num_samples = slot.NumSamples;
+    batch.data = slot.Data.data();
+    return 1;
+}
+
+void SampleBatchQueue::Release(void)
+{
+    if (Tail.load(std::memory_order_relaxed) != Pulled) {
+        Tail.fetch_add(1, std::memory_order_release);
+    }
+}
@@ -0,0 +1,1006 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "sample_pipeline.h"
+
+using namespace std;
+
+namespace {
+
+// types of the columns (see DataCollection::batch_columns)
+enum ValueType {
+    VALUE_F8,
+    VALUE_F4,
+    VALUE_I4,
+    VALUE_U4,
+    VALUE_U2
+};
+
+ValueType value_type(const SamplePipeline::Column &column)
+{
+    const string type = column.typestr.substr(1);
+    if (type == "f8") {
+        return VALUE_F8;
+    } else if (type == "f4") {
+        return VALUE_F4;
+    } else if (type == "i4") {
+        return VALUE_I4;
+    } else if (type == "u4") {
+        return VALUE_U4;
+    }
+    return VALUE_U2;
+}
+
+inline double read_value(const uint8_t *column, ValueType type, uint32_t i)
+{
+    switch (type) {
+        case VALUE_F8:
+            return ((const double *) column)[i];
+        case VALUE_F4:
+            return ((const float *) column)[i];
+        case VALUE_I4:
+            return ((const int32_t *) column)[i];
+        case VALUE_U4:
+            return ((const uint32_t *) column)[i];
+        default:
+            return ((const uint16_t *) column)[i];
+    }
+}
+
+// keeps the samples of the batch for which keep is set, in order
+void keep_samples(SamplePipeline::Batch &batch, const vector<SamplePipeline::Column> &columns,
+                  const vector<uint8_t> &keep)
+{
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < batch.num_samples; i++) {
+        if (!keep[i]) {
+            continue;
+        }
+        if (kept != i) {
+            for (size_t c = 0; c < columns.size(); c++) {
+                const uint32_t size = columns[c].itemsize;
+                memcpy(batch.columns[c] + kept * size, batch.columns[c] + i * size, size);
+            }
+        }
+        kept++;
+    }
+    batch.num_samples = kept;
+}
+
+// csv: the samples in the CSV file of the capture, one row per sample
+class CsvWriter : public SamplePipeline::Stage {
+public:
+    bool Begin(const SamplePipeline::Context &context, string &error)
+    {
+        Rows = 0;
+        if (!context.write_files) {
+            return false;
+        }
+        Filename = context.basename + ".csv";
+        File.open(Filename);
+        if (!File.is_open()) {
+            error = "cannot open " + Filename;
+            return false;
+        }
+
+        Types.clear();
+        for (size_t c = 0; c < context.columns.size(); c++) {
+            File << (c == 0 ? "" : ",") << context.columns[c].name;
+            Types.push_back(value_type(context.columns[c]));
+        }
+        File << "\n" << setprecision(12);
+        return true;
+    }
+
+    void Process(SamplePipeline::Batch &batch)
+    {
+        for (uint32_t i = 0; i < batch.num_samples; i++) {
+            for (size_t c = 0; c < Types.size(); c++) {
+                if (c > 0) {
+                    File << ",";
+                }
+                const uint8_t *column = batch.columns[c];
+                switch (Types[c]) {
+                    case VALUE_F8:
+                        File << ((const double *) column)[i];
+                        break;
+                    case VALUE_F4:
+                        File << ((const float *) column)[i];
+                        break;
+                    case VALUE_I4:
+                        File << ((const int32_t *) column)[i];
+                        break;
+                    case VALUE_U4:
+                        File << ((const uint32_t *) column)[i];
+                        break;
+                    case VALUE_U2:
+                        File << (uint32_t) ((const uint16_t *) column)[i];
+                        break;
+                }
+            }
+            File << "\n";
+        }
+        Rows += batch.num_samples;
+        // the rows of a batch at once, so that the file can be read during the capture
+        File.flush();
+    }
+
+    void End(void)
+    {
+        File.close();
+    }
+
+    string Summary(void) const
+    {
+        ostringstream summary;
+        summary << Rows << " rows stored to " << Filename;
+        return summary.str();
+    }
+
+    bool IsSink(void) const { return true; }
+    bool IsLossless(void) const { return true; }
+
+protected:
+    ofstream File;
+    string Filename;
+    vector<ValueType> Types;
+    uint64_t Rows = 0;
+};
+
+// npy: the samples in a NumPy file of the capture (<base>.npy), a 1-D array of one record
+// per sample with a field per column (numpy.load(file)['ENCODER_POS_1']). The number of
+// samples in the header is written once the capture is over.
+class NpyWriter : public SamplePipeline::Stage {
+public:
+    bool Begin(const SamplePipeline::Context &context, string &error)
+    {
+        Samples = 0;
+        if (!context.write_files) {
+            return false;
+        }
+
+        Columns = context.columns;
+        RowSize = 0;
+        for (size_t c = 0; c < Columns.size(); c++) {
+            RowSize += Columns[c].itemsize;
+        }
+        // room for any number of samples in the header
+        const size_t length = Header(0).size() + 20 + 1;
+        HeaderLength = (PREAMBLE + length + 63) / 64 * 64 - PREAMBLE;
+        if (HeaderLength > 0xFFFF) {
+            error = "too many columns for a NumPy 1.0 header";
+            return false;
+        }
+
+        Filename = context.basename + ".npy";
+        File.open(Filename, ios::binary);
+        if (!File.is_open()) {
+            error = "cannot open " + Filename;
+            return false;
+        }
+        WriteHeader();
+        return true;
+    }
+
+    void Process(SamplePipeline::Batch &batch)
+    {
+        const size_t size = (size_t) batch.num_samples * RowSize;
+        if (Rows.size() < size) {
+            Rows.resize(size);
+        }
+
+        uint8_t *row = Rows.data();
+        for (uint32_t i = 0; i < batch.num_samples; i++) {
+            for (size_t c = 0; c < Columns.size(); c++) {
+                const uint32_t itemsize = Columns[c].itemsize;
+                memcpy(row, batch.columns[c] + i * itemsize, itemsize);
+                row += itemsize;
+            }
+        }
+        File.write((const char *) Rows.data(), size);
+        Samples += batch.num_samples;
+    }
+
+    void End(void)
+    {
+        File.seekp(0);
+        WriteHeader();
+        File.close();
+    }
+
+    string Summary(void) const
+    {
+        ostringstream summary;
+        summary << Samples << " samples stored to " << Filename;
+        return summary.str();
+    }
+
+    bool IsSink(void) const { return true; }
+    bool IsLossless(void) const { return true; }
+
+protected:
+    // magic, version and header length
+    static const size_t PREAMBLE = 10;
+
+    vector<SamplePipeline::Column> Columns;
+    uint32_t RowSize = 0;
+    size_t HeaderLength = 0;
+    ofstream File;
+    string Filename;
+    vector<uint8_t> Rows;
+    uint64_t Samples = 0;
+
+    string Header(uint64_t samples) const
+    {
+        ostringstream header;
+        header << "{'descr': [";
+        for (size_t c = 0; c < Columns.size(); c++) {
+            header << (c == 0 ? "" : ", ") << "('" << Columns[c].name << "', '" << Columns[c].typestr << "')";
+        }
+        header << "], 'fortran_order': False, 'shape': (" << samples << ",), }";
+        return header.str();
+    }
+
+    // padded with spaces to HeaderLength, so that the data starts at the same offset
+    // whatever the number of samples
+    void WriteHeader(void)
+    {
+        string header = Header(Samples);
+        header.resize(HeaderLength - 1, ' ');
+        header += '\n';
+
+        const uint8_t preamble[PREAMBLE] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, (uint8_t) (HeaderLength & 0xFF),
+                                            (uint8_t) (HeaderLength >> 8)};
+        File.write((const char *) preamble, sizeof(preamble));
+        File.write(header.data(), header.size());
+    }
+};
+
+// stats: count, mean, standard deviation, minimum and maximum of each column, written to
+// <base>_stats.csv at the end of the capture
+class ColumnStatistics : public SamplePipeline::Stage {
+public:
+    bool Begin(const SamplePipeline::Context &context, string &error)
+    {
+        Count = 0;
+        if (!context.write_files) {
+            return false;
+        }
+        Filename = context.basename + "_stats.csv";
+        Columns = context.columns;
+        Types.clear();
+        Figures.assign(Columns.size(), Figure());
+        for (size_t c = 0; c < Columns.size(); c++) {
+            Types.push_back(value_type(Columns[c]));
+        }
+        // opened now, so that an error shows before the capture
+        File.open(Filename);
+        if (!File.is_open()) {
+            error = "cannot open " + Filename;
+            return false;
+        }
+        return true;
+    }
+
+    void Process(SamplePipeline::Batch &batch)
+    {
+        for (size_t c = 0; c < Columns.size(); c++) {
+            Figure &figure = Figures[c];
+            uint64_t count = Count;
+            for (uint32_t i = 0; i < batch.num_samples; i++) {
+                // Welford's update, exact enough for timestamps
+                const double value = read_value(batch.columns[c], Types[c], i);
+                const double delta = value - figure.Mean;
+                figure.Mean += delta / (double) ++count;
+                figure.M2 += delta * (value - figure.Mean);
+                if (count == 1 || value < figure.Min) {
+                    figure.Min = value;
+                }
+                if (count == 1 || value > figure.Max) {
+                    figure.Max = value;
+                }
+            }
+        }
+        Count += batch.num_samples;
+    }
+
+    void End(void)
+    {
+        File << "COLUMN,COUNT,MEAN,STD,MIN,MAX" << "\n" << setprecision(12);
+        for (size_t c = 0; c < Columns.size(); c++) {
+            const Figure &figure = Figures[c];
+            File << Columns[c].name << "," << Count;
+            if (Count > 0) {
+                File << "," << figure.Mean << "," << sqrt(figure.M2 / (double) Count) << "," << figure.Min << ","
+                     << figure.Max;
+            } else {
+                File << ",,,,";
+            }
+            File << "\n";
+        }
+        File.close();
+    }
+
+    string Summary(void) const
+    {
+        ostringstream summary;
+        summary << "statistics of " << Count << " samples stored to " << Filename;
+        return summary.str();
+    }
+
+    bool IsSink(void) const { return true; }
+
+protected:
+    struct Figure {
+        double Mean = 0.0;
+        double M2 = 0.0;
+        double Min = 0.0;
+        double Max = 0.0;
+    };
+
+    vector<SamplePipeline::Column> Columns;
+    vector<ValueType> Types;
+    vector<Figure> Figures;
+    uint64_t Count = 0;
+    ofstream File;
+    string Filename;
+};
+
+// publish=<address>:<port>: the samples in UDP datagrams, as float64 values (see
+// SamplePipeline::PublishHeader), for a live display; nothing waits for a reader
+class SamplePublisher : public SamplePipeline::Stage {
+public:
+    SamplePublisher(const sockaddr_in &address, const string &name) : Address(address), Name(name) {}
+
+    ~SamplePublisher()
+    {
+        End();
+    }
+
+    bool Begin(const SamplePipeline::Context &context, string &error)
+    {
+        Datagrams = 0;
+        Samples = 0;
+        Failed = 0;
+        NumColumns = (uint32_t) context.columns.size();
+        Types.clear();
+        Names.clear();
+        for (size_t c = 0; c < context.columns.size(); c++) {
+            Names += (c == 0 ? "" : ",") + context.columns[c].name;
+            Types.push_back(value_type(context.columns[c]));
+        }
+        SamplesPerDatagram = (uint32_t) ((MAX_DATAGRAM - sizeof(SamplePipeline::PublishHeader)) / (8 * NumColumns));
+        if (NumColumns > 0xFFFF || SamplesPerDatagram == 0 ||
+            sizeof(SamplePipeline::PublishHeader) + Names.size() > MAX_DATAGRAM) {
+            error = "too many columns to publish";
+            return false;
+        }
+        Datagram.assign(MAX_DATAGRAM / 8, 0);
+
+        Socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (Socket < 0 || connect(Socket, (const sockaddr *) &Address, sizeof(Address)) != 0) {
+            error = string("cannot send to ") + Name + ": " + strerror(errno);
+            End();
+            return false;
+        }
+        SendColumns();
+        return true;
+    }
+
+    void Process(SamplePipeline::Batch &batch)
+    {
+        // the names again every second, for a reader started during the capture
+        if (chrono::steady_clock::now() - LastColumns >= chrono::seconds(1)) {
+            SendColumns();
+        }
+
+        for (uint32_t first = 0; first < batch.num_samples; first += SamplesPerDatagram) {
+            const uint32_t count = min(SamplesPerDatagram, batch.num_samples - first);
+            SamplePipeline::PublishHeader *header = Header(SamplePipeline::PUBLISH_SAMPLES, count);
+            double *values = (double *) (header + 1);
+            for (uint32_t c = 0; c < NumColumns; c++) {
+                for (uint32_t i = 0; i < count; i++) {
+                    values[i * NumColumns + c] = read_value(batch.columns[c], Types[c], first + i);
+                }
+            }
+            Send(sizeof(*header) + (size_t) count * NumColumns * 8);
+            Samples += count;
+        }
+    }
+
+    void End(void)
+    {
+        if (Socket >= 0) {
+            close(Socket);
+            Socket = -1;
+        }
+    }
+
+    string Summary(void) const
+    {
+        ostringstream summary;
+        summary << Samples << " samples published to " << Name << " in " << Datagrams << " datagrams";
+        if (Failed > 0) {
+            summary << " (" << Failed << " not sent)";
+        }
+        return summary.str();
+    }
+
+    bool IsSink(void) const { return true; }
+
+protected:
+    // an Ethernet jumbo frame, fragmented on other networks
+    static const size_t MAX_DATAGRAM = 8192;
+
+    sockaddr_in Address;
+    string Name;
+    int Socket = -1;
+    uint32_t NumColumns = 0;
+    uint32_t SamplesPerDatagram = 0;
+    vector<ValueType> Types;
+    string Names;
+    vector<uint64_t> Datagram;      // 8-byte aligned values
+    chrono::steady_clock::time_point LastColumns;
+    uint32_t Datagrams = 0;
+    uint64_t Samples = 0;
+    uint64_t Failed = 0;
+
+    SamplePipeline::PublishHeader *Header(uint16_t kind, uint32_t samples)
+    {
+        SamplePipeline::PublishHeader *header = (SamplePipeline::PublishHeader *) Datagram.data();
+        header->magic = SamplePipeline::PUBLISH_MAGIC;
+        header->kind = kind;
+        header->num_columns = (uint16_t) NumColumns;
+        header->sequence = Datagrams;
+        header->num_samples = samples;
+        header->first_sample = Samples;
+        return header;
+    }
+
+    void SendColumns(void)
+    {
+        SamplePipeline::PublishHeader *header = Header(SamplePipeline::PUBLISH_COLUMNS, 0);
+        memcpy(header + 1, Names.data(), Names.size());
+        Send(sizeof(*header) + Names.size());
+        LastColumns = chrono::steady_clock::now();
+    }
+
+    void Send(size_t length)
+    {
+        // e.g. ECONNREFUSED while no reader listens on the port
+        if (send(Socket, Datagram.data(), length, MSG_DONTWAIT) != (ssize_t) length) {
+            Failed++;
+        }
+        Datagrams++;
+    }
+};
+
+// decimate=<n>: keeps the first sample of every n
+class Decimator : public SamplePipeline::Stage {
+public:
+    explicit Decimator(uint32_t factor) : Factor(factor) {}
+
+    bool Begin(const SamplePipeline::Context &context, string &)
+    {
+        Columns = context.columns;
+        Phase = 0;
+        In = 0;
+        Out = 0;
+        return true;
+    }
+
+    void Process(SamplePipeline::Batch &batch)
+    {
+        Keep.assign(batch.num_samples, 0);
+        for (uint32_t i = 0; i < batch.num_samples; i++) {
+            Keep[i] = (Phase == 0);
+            Phase = (Phase + 1 == Factor) ? 0 : Phase + 1;
+        }
+        In += batch.num_samples;
+        keep_samples(batch, Columns, Keep);
+        Out += batch.num_samples;
+    }
+
+    string Summary(void) const
+    {
+        ostringstream summary;
+        summary << Out << " of " << In << " samples kept";
+        return summary.str();
+    }
+
+    bool IsSink(void) const { return false; }
+
+protected:
+    uint32_t Factor;
+    vector<SamplePipeline::Column> Columns;
+    vector<uint8_t> Keep;
+    uint32_t Phase = 0;
+    uint64_t In = 0;
+    uint64_t Out = 0;
+};
+
+// trigger=<column><op><value>[:<n>]: keeps the samples from each time the condition
+// (column op value) becomes true, for n samples (all of them from the first time if n is
+// 0). The condition being true at the start of the capture is not a crossing.
+class Trigger : public SamplePipeline::Stage {
+public:
+    Trigger(const string &column, char op, double threshold, uint64_t length)
+        : ColumnName(column), Op(op), Threshold(threshold), Length(length) {}
+
+    bool Begin(const SamplePipeline::Context &context, string &error)
+    {
+        Columns = context.columns;
+        Column = Columns.size();
+        for (size_t c = 0; c < Columns.size(); c++) {
+            if (Columns[c].name == ColumnName) {
+                Column = c;
+            }
+        }
+        if (Column == Columns.size()) {
+            error = "no column " + ColumnName + " in the samples";
+            return false;
+        }
+        Type = value_type(Columns[Column]);
+        Started = false;
+        Previous = false;
+        Open = false;
+        Remaining = 0;
+        Crossings = 0;
+        In = 0;
+        Out = 0;
+        return true;
+    }
+
+    void Process(SamplePipeline::Batch &batch)
+    {
+        Keep.assign(batch.num_samples, 0);
+        for (uint32_t i = 0; i < batch.num_samples; i++) {
+            const double value = read_value(batch.columns[Column], Type, i);
+            const bool condition = (Op == '>') ? (value > Threshold) : (value < Threshold);
+            if (condition && Started && !Previous) {
+                Crossings++;
+                Open = true;
+                Remaining = Length;
+            }
+            Started = true;
+            Previous = condition;
+
+            if (Open) {
+                Keep[i] = 1;
+                if (Length > 0 && --Remaining == 0) {
+                    Open = false;
+                }
+            }
+        }
+        In += batch.num_samples;
+        keep_samples(batch, Columns, Keep);
+        Out += batch.num_samples;
+    }
+
+    string Summary(void) const
+    {
+        ostringstream summary;
+        summary << Crossings << " crossings, " << Out << " of " << In << " samples kept";
+        return summary.str();
+    }
+
+    bool IsSink(void) const { return false; }
+
+protected:
+    string ColumnName;
+    char Op;
+    double Threshold;
+    uint64_t Length;
+    vector<SamplePipeline::Column> Columns;
+    size_t Column = 0;
+    ValueType Type = VALUE_F8;
+    vector<uint8_t> Keep;
+    bool Started = false;
+    bool Previous = false;
+    bool Open = false;
+    uint64_t Remaining = 0;
+    uint64_t Crossings = 0;
+    uint64_t In = 0;
+    uint64_t Out = 0;
+};
+
+// stage of <name>[=<argument>], nullptr (with error set) if it cannot be parsed
+SamplePipeline::Stage *create_stage(const string &name, const string &argument, bool has_argument, string &error)
+{
+    char *end;
+    if (name == "csv" && !has_argument) {
+        return new CsvWriter();
+    } else if (name == "npy" && !has_argument) {
+        return new NpyWriter();
+    } else if (name == "stats" && !has_argument) {
+        return new ColumnStatistics();
+    } else if (name == "decimate" && has_argument) {
+        unsigned long factor = strtoul(argument.c_str(), &end, 10);
+        if (*end == '\0' && factor > 0 && factor <= 0xFFFFFFFF) {
+            return new Decimator((uint32_t) factor);
+        }
+        error = "decimate=<n> needs a factor of at least 1";
+    } else if (name == "trigger" && has_argument) {
+        const size_t op = argument.find_first_of("<>");
+        if (op != string::npos && op > 0) {
+            double threshold = strtod(argument.c_str() + op + 1, &end);
+            unsigned long long length = 0;
+            bool valid = end != argument.c_str() + op + 1;
+            if (valid && *end == ':') {
+                const char *number = end + 1;
+                length = strtoull(number, &end, 10);
+                valid = end != number;
+            }
+            if (valid && *end == '\0') {
+                return new Trigger(argument.substr(0, op), argument[op], threshold, length);
+            }
+        }
+        error = "trigger=<column><op><value>[:<n>] with op > or <, e.g. trigger=ENCODER_POS_1>1000:500";
+    } else if (name == "publish" && has_argument) {
+        const size_t colon = argument.rfind(':');
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        if (colon != string::npos && inet_pton(AF_INET, argument.substr(0, colon).c_str(), &address.sin_addr) == 1) {
+            unsigned long port = strtoul(argument.c_str() + colon + 1, &end, 10);
+            if (*end == '\0' && port > 0 && port <= 0xFFFF && end != argument.c_str() + colon + 1) {
+                address.sin_port = htons((uint16_t) port);
+                return new SamplePublisher(address, argument);
+            }
+        }
+        error = "publish=<address>:<port> with an IPv4 address, e.g. publish=127.0.0.1:6000";
+    } else {
+        error = "unknown stage " + name + (has_argument ? "=" + argument : string()) +
+                " (csv, npy, stats, publish=<address>:<port>, decimate=<n>, trigger=<column><op><value>[:<n>])";
+    }
+    return nullptr;
+}
+
+}
+
+void SamplePipeline::Batch::Allocate(const vector<Column> &columns, uint32_t capacity)
+{
+    vector<size_t> offsets;
+    size_t words = 0;
+    for (size_t c = 0; c < columns.size(); c++) {
+        offsets.push_back(words);
+        words += ((size_t) capacity * columns[c].itemsize + 7) / 8;
+    }
+
+    // writes every page, so that the threads do not page fault during the capture
+    storage.assign(words, 0);
+    this->columns.resize(columns.size());
+    for (size_t c = 0; c < columns.size(); c++) {
+        this->columns[c] = reinterpret_cast<uint8_t *>(&storage[offsets[c]]);
+    }
+    first_sample = 0;
+    num_samples = 0;
+}
+
+void SamplePipeline::Batch::CopyFrom(const Batch &batch, const vector<Column> &columns)
+{
+    first_sample = batch.first_sample;
+    num_samples = batch.num_samples;
+    for (size_t c = 0; c < columns.size(); c++) {
+        memcpy(this->columns[c], batch.columns[c], (size_t) num_samples * columns[c].itemsize);
+    }
+}
+
+SamplePipeline::SamplePipeline() : BatchSamples(1), Running(false), SampleNumber(0)
+{
+}
+
+SamplePipeline::~SamplePipeline()
+{
+    End();
+    Clear();
+}
+
+void SamplePipeline::Clear(void)
+{
+    for (size_t s = 0; s < Stages.size(); s++) {
+        delete Stages[s].Instance;
+    }
+    Stages.clear();
+}
+
+bool SamplePipeline::Configure(const string &spec, string &error)
+{
+    vector<StageSlot> stages;
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t end = spec.find(',', start);
+        if (end == string::npos) {
+            end = spec.size();
+        }
+        const string item = spec.substr(start, end - start);
+        const size_t equal = item.find('=');
+
+        StageSlot slot = StageSlot();
+        slot.Name = item;
+        slot.Instance = item.empty() ? nullptr
+                                     : create_stage(item.substr(0, equal),
+                                                    (equal == string::npos) ? string() : item.substr(equal + 1),
+                                                    equal != string::npos, error);
+        if (slot.Instance == nullptr) {
+            if (item.empty()) {
+                error = "empty stage in " + spec;
+            }
+            for (size_t s = 0; s < stages.size(); s++) {
+                delete stages[s].Instance;
+            }
+            return false;
+        }
+        stages.push_back(slot);
+        start = end + 1;
+    }
+
+    End();
+    Clear();
+    Stages = stages;
+    Spec = spec;
+    return true;
+}
+
+bool SamplePipeline::HasStage(const string &name) const
+{
+    for (size_t s = 0; s < Stages.size(); s++) {
+        if (Stages[s].Name == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SamplePipeline::Begin(const Context &context, uint32_t batch_samples, size_t queue_bytes)
+{
+    End();
+
+    Columns = context.columns;
+    BatchSamples = (batch_samples > 0) ? batch_samples : 1;
+    SampleNumber = 0;
+    Current.Allocate(Columns, BatchSamples);
+
+    size_t batch_bytes = 0;
+    for (size_t c = 0; c < Columns.size(); c++) {
+        batch_bytes += (size_t) BatchSamples * Columns[c].itemsize;
+    }
+    const size_t queue_size = min(max(queue_bytes / max(batch_bytes, (size_t) 1), (size_t) 4), (size_t) 4096);
+
+    bool has_sink = false;
+    for (size_t s = 0; s < Stages.size(); s++) {
+        StageSlot &slot = Stages[s];
+        string error;
+        slot.Bypassed = !slot.Instance->Begin(context, error);
+        slot.Batches = 0;
+        slot.Samples = 0;
+        slot.DroppedBatches = 0;
+        slot.DroppedSamples = 0;
+        slot.Waits = 0;
+        slot.QueueSize = 0;
+        slot.DepthSum = 0;
+        slot.MaxDepth = 0;
+        if (slot.Bypassed) {
+            if (!error.empty()) {
+                cerr << "[ERROR] Pipeline: " << slot.Name << ": " << error << "; the stage is bypassed" << endl;
+            }
+            continue;
+        }
+        if (!slot.Instance->IsSink()) {
+            continue;
+        }
+
+        has_sink = true;
+        slot.Queue = new SinkQueue();
+        slot.Queue->Slots.resize(queue_size);
+        for (size_t b = 0; b < queue_size; b++) {
+            slot.Queue->Slots[b].Allocate(Columns, BatchSamples);
+        }
+        slot.QueueSize = (uint32_t) queue_size;
+        slot.Queue->Thread = thread(&SamplePipeline::RunSink, this, &slot);
+    }
+
+    Running = true;
+    if (!has_sink) {
+        // filters alone lead nowhere
+        End();
+    }
+}
+
+void SamplePipeline::Flush(void)
+{
+    if (!Running || Current.num_samples == 0) {
+        return;
+    }
+
+    Current.first_sample = SampleNumber;
+    SampleNumber += Current.num_samples;
+    for (size_t s = 0; s < Stages.size() && Current.num_samples > 0; s++) {
+        StageSlot &slot = Stages[s];
+        if (slot.Bypassed) {
+            continue;
+        }
+        slot.Samples += Current.num_samples;
+        if (slot.Queue != nullptr) {
+            Enqueue(slot, Current);
+        } else {
+            slot.Instance->Process(Current);
+            slot.Batches++;
+        }
+    }
+    Current.num_samples = 0;
+}
+
+// copies the batch to the queue of the sink; if the queue is full, waits for the sink
+// (lossless sinks) or drops the batch
+void SamplePipeline::Enqueue(StageSlot &slot, const Batch &batch)
+{
+    SinkQueue &queue = *slot.Queue;
+    const uint64_t head = queue.Head.load(std::memory_order_relaxed);
+    const uint64_t depth = head - queue.Tail.load(std::memory_order_acquire);
+
+    slot.DepthSum += depth;
+    if (depth > slot.MaxDepth) {
+        slot.MaxDepth = (uint32_t) depth;
+    }
+    if (depth >= queue.Slots.size() && slot.Instance->IsLossless()) {
+        slot.Waits++;
+        unique_lock<mutex> lock(queue.Mutex);
+        queue.Dequeued.wait(lock, [&] { return head - queue.Tail.load(std::memory_order_acquire) < queue.Slots.size(); });
+    } else if (depth >= queue.Slots.size()) {
+        slot.DroppedBatches++;
+        slot.DroppedSamples += batch.num_samples;
+        return;
+    }
+
+    queue.Slots[head % queue.Slots.size()].CopyFrom(batch, Columns);
+    slot.Batches++;
+    {
+        lock_guard<mutex> lock(queue.Mutex);
+        queue.Head.store(head + 1, std::memory_order_release);
+    }
+    queue.Queued.notify_one();
+}
+
+// thread of a sink: processes the batches of its queue until End
+void SamplePipeline::RunSink(StageSlot *slot)
+{
+    SinkQueue &queue = *slot->Queue;
+    while (true) {
+        const uint64_t tail = queue.Tail.load(std::memory_order_relaxed);
+        {
+            unique_lock<mutex> lock(queue.Mutex);
+            queue.Queued.wait(lock, [&] { return queue.Head.load(std::memory_order_acquire) != tail || queue.Finished; });
+            if (queue.Head.load(std::memory_order_acquire) == tail) {
+                break;
+            }
+        }
+        slot->Instance->Process(queue.Slots[tail % queue.Slots.size()]);
+        {
+            lock_guard<mutex> lock(queue.Mutex);
+            queue.Tail.store(tail + 1, std::memory_order_release);
+        }
+        queue.Dequeued.notify_one();
+    }
+}
+
+void SamplePipeline::End(void)
+{
+    if (!Running) {
+        return;
+    }
+    Flush();
+    Running = false;
+
+    for (size_t s = 0; s < Stages.size(); s++) {
+        StageSlot &slot = Stages[s];
+        if (slot.Queue != nullptr) {
+            {
+                lock_guard<mutex> lock(slot.Queue->Mutex);
+                slot.Queue->Finished = true;
+            }
+            slot.Queue->Queued.notify_one();
+            slot.Queue->Thread.join();
+            delete slot.Queue;
+            slot.Queue = nullptr;
+        }
+        if (!slot.Bypassed) {
+            slot.Instance->End();
+        }
+    }
+}
+
+vector<SamplePipeline::StageStats> SamplePipeline::GetStats(void) const
+{
+    vector<StageStats> stats;
+    for (size_t s = 0; s < Stages.size(); s++) {
+        const StageSlot &slot = Stages[s];
+        StageStats stage;
+        stage.name = slot.Name;
+        stage.sink = slot.Instance->IsSink();
+        stage.bypassed = slot.Bypassed;
+        stage.batches = slot.Batches;
+        stage.samples = slot.Samples;
+        stage.dropped_batches = slot.DroppedBatches;
+        stage.dropped_samples = slot.DroppedSamples;
+        stage.waits = slot.Waits;
+        stage.queue_size = slot.QueueSize;
+        stage.max_depth = slot.MaxDepth;
+        const uint64_t queued = slot.Batches + slot.DroppedBatches;
+        stage.mean_depth = (queued > 0) ? (double) slot.DepthSum / queued : 0.0;
+        stats.push_back(stage);
+    }
+    return stats;
+}
+
+uint64_t SamplePipeline::GetDroppedSamples(void) const
+{
+    uint64_t dropped = 0;
+    for (size_t s = 0; s < Stages.size(); s++) {
+        dropped += Stages[s].DroppedSamples;
+    }
+    return dropped;
+}
+
+void SamplePipeline::PrintSummary(void) const
+{
+    const vector<StageStats> stats = GetStats();
+    const streamsize precision = cout.precision();
+
+    cout << "Pipeline: " << Spec << endl;
+    for (size_t s = 0; s < stats.size(); s++) {
+        const StageStats &stage = stats[s];
+        const string summary = Stages[s].Instance->Summary();
+        cout << "  " << stage.name << ": ";
+        if (stage.bypassed) {
+            cout << "bypassed" << endl;
+            continue;
+        }
+        if (!summary.empty()) {
+            cout << summary << "; ";
+        }
+        if (!stage.sink) {
+            cout << stage.batches << " batches on the receive thread" << endl;
+            continue;
+        }
+        cout << stage.batches << " batches, queue depth mean " << fixed << setprecision(2) << stage.mean_depth
+             << defaultfloat << setprecision(precision) << ", max " << stage.max_depth << " of " << stage.queue_size;
+        if (stage.waits > 0) {
+            cout << ", the receive thread waited " << stage.waits << " times for the stage";
+        }
+        if (stage.dropped_batches > 0) {
+            cout << ", [WARNING] " << stage.dropped_batches << " batches (" << stage.dropped_samples
+                 << " samples) dropped, the stage being behind";
+        }
+        cout << endl;
+    }
+}
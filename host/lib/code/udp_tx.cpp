@@ -27,17 +27,24 @@ http://www.cisst.org/cisst/license.txt.
 #include "udp_tx.h"
 #include "data_collection_shared.h"
 
-bool udp_init(int *client_socket, uint8_t boardId)
+// impairments of the received datagrams, when enabled
+static UdpFaultInjector udp_faults;
+
+bool udp_init(int *client_socket, uint8_t boardId, const char *address)
 {
     int ret;
-    char ipAddress[14] = "169.254.10.";
+    char ipAddress[INET_ADDRSTRLEN] = "169.254.10.";
 
     if (boardId > 15) {
         std::cout << "[ERROR] invalid BoardID! Range [0,15]" << std::endl;
         return false; 
     }
 
-    snprintf(ipAddress + strlen(ipAddress), sizeof(ipAddress) - strlen(ipAddress), "%d", boardId);
+    if (address != nullptr) {
+        snprintf(ipAddress, sizeof(ipAddress), "%s", address);
+    } else {
+        snprintf(ipAddress + strlen(ipAddress), sizeof(ipAddress) - strlen(ipAddress), "%d", boardId);
+    }
 
     *client_socket = socket(AF_INET, SOCK_DGRAM, 0);
 
@@ -49,7 +56,11 @@ bool udp_init(int *client_socket, uint8_t boardId)
     memset(&server_address, 0, sizeof(server_address));
     server_address.sin_family = AF_INET;
     server_address.sin_port = htons(12345);
-    inet_pton(AF_INET, ipAddress, &server_address.sin_addr);
+    if (inet_pton(AF_INET, ipAddress, &server_address.sin_addr) != 1) {
+        std::cout << "[ERROR] invalid address [" << ipAddress << "]" << std::endl;
+        close(*client_socket);
+        return false;
+    }
 
     ret = connect(*client_socket, (struct sockaddr*)&server_address, sizeof(server_address));
 
@@ -62,6 +73,19 @@ bool udp_init(int *client_socket, uint8_t boardId)
     return true;
 }
 
+unsigned int udp_max_payload(int client_socket)
+{
+    int mtu = MTU_DEFAULT;
+    socklen_t len = sizeof(mtu);
+
+    if (getsockopt(client_socket, IPPROTO_IP, IP_MTU, &mtu, &len) != 0) {
+        mtu = MTU_DEFAULT;
+    }
+
+    unsigned int payload = mtu - IP_UDP_HEADER;
+    return (payload < UDP_MAX_PAYLOAD) ? payload : UDP_MAX_PAYLOAD;
+}
+
 bool udp_transmit(int client_socket, void *data, int size)
 {
     if (size > UDP_REAL_MTU) {
@@ -73,9 +97,17 @@ bool udp_transmit(int client_socket, void *data, int size)
 
 bool udp_receive(int client_socket, void *data, int len)
 {
-    uint16_t received_bytes = recv(client_socket, data, len, 0);
+    if (udp_faults.IsEnabled() && udp_faults.Release(data, len) > 0) {
+        return true;
+    }
+
+    while (true) {
+        uint16_t received_bytes = recv(client_socket, data, len, 0);
 
-    return (received_bytes > 0);
+        if (!udp_faults.IsEnabled() || (int16_t) received_bytes <= 0 || udp_faults.Receive(data, received_bytes) > 0) {
+            return (received_bytes > 0);
+        }
+    }
 }
 
 int udp_nonblocking_receive(int client_socket, void *data, int len)
@@ -86,6 +118,13 @@ int udp_nonblocking_receive(int client_socket, void *data, int len)
 
     int ret_code;
 
+    if (udp_faults.IsEnabled()) {
+        ret_code = udp_faults.Release(data, len);
+        if (ret_code > 0) {
+            return ret_code;
+        }
+    }
+
     struct timeval timeout;
 
     // Timeout values
@@ -107,6 +146,8 @@ int udp_nonblocking_receive(int client_socket, void *data, int len)
                 return UDP_CONNECTION_CLOSED_ERROR;
             } else if (ret_code < 0) {
                 return UDP_SOCKET_ERROR;
+            } else if (udp_faults.IsEnabled() && (ret_code = udp_faults.Receive(data, ret_code)) == 0) {
+                return UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT;
             } else {
                 return ret_code; // Return the number of bytes received
             }
@@ -117,6 +158,20 @@ int udp_nonblocking_receive(int client_socket, void *data, int len)
     }
 }
 
+void udp_set_fault_injection(const UdpFaultConfig &config)
+{
+    udp_faults.Configure(config);
+}
+
+bool udp_fault_injection_stats(UdpFaultInjector::Stats &stats)
+{
+    if (!udp_faults.IsEnabled()) {
+        return false;
+    }
+    stats = udp_faults.GetStats();
+    return true;
+}
+
 bool udp_close(int *client_socket)
 {
     close(*client_socket);
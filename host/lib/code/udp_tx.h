@@ -20,6 +20,8 @@ http://www.cisst.org/cisst/license.txt.
 
 #include <stdint.h>
 
+#include "udp_fault_injection.h"
+
 enum UDP_RETURN_CODES {
     UDP_DATA_IS_AVAILABLE = 0,
     UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT = -1,
@@ -30,8 +32,12 @@ enum UDP_RETURN_CODES {
 };
 
 
-// upd init function
-bool udp_init(int * client_socket, uint8_t encoder_number);
+// upd init function. Connects to 169.254.10.<boardId>, or to address if given
+bool udp_init(int * client_socket, uint8_t encoder_number, const char *address = nullptr);
+
+// largest UDP payload that can be sent on the route of the (connected) socket without
+// fragmentation, based on the interface MTU
+unsigned int udp_max_payload(int client_socket);
 
 // udp close function
 bool udp_close(int * client_socket);
@@ -44,6 +50,12 @@ bool udp_receive(int client_socket, void *data, int len);
 // this is what ya gotta do fr make a nonblocking receive function
 int udp_nonblocking_receive(int client_socket, void *data, int len);
 
+// impairs the datagrams received by the functions above (see udp_fault_injection.h);
+// off by default
+void udp_set_fault_injection(const UdpFaultConfig &config);
+// datagrams impaired so far, false if fault injection is off
+bool udp_fault_injection_stats(UdpFaultInjector::Stats &stats);
+
 // check fd to check if data is available for udp port (and also console input)
 int isDataAvailable(fd_set *readfds, int client_socket);
 
@@ -18,11 +18,18 @@ http://www.cisst.org/cisst/license.txt.
 #ifndef __DATACOLLECTION_H__
 #define __DATACOLLECTION_H__
 
+#include <atomic>
 #include <chrono>
+#include <mutex>
 #include <string>
+#include <vector>
 #include <stdint.h>
 
 #include "data_collection_shared.h"
+#include "packet_ring.h"
+#include "sample_batch_queue.h"
+#include "sample_pipeline.h"
+#include "udp_fault_injection.h"
 
 class DataCollection {
     private:
@@ -39,28 +46,35 @@ class DataCollection {
         enum DataCollectionStateMachine {
             SM_READY = 0,
             SM_SEND_READY_STATE_TO_PS,
+            SM_SEND_RESUME_SESSION_TO_PS,
             SM_WAIT_FOR_PS_HANDSHAKE,
             SM_SEND_START_DATA_COLLECTIION_CMD_TO_PS,
             SM_START_DATA_COLLECTION,
             SM_RECV_DATA_COLLECTION_META_DATA,
             SM_SEND_METADATA_RECV,
+            SM_SEND_PAYLOAD_PROBE,
+            SM_WAIT_FOR_PAYLOAD_PROBE,
             SM_CLOSE_SOCKET,
             SM_EXIT_DATA_COLLECTION,
             SM_FORCE_TERMINATE,
             SM_EXIT
         };
 
-        struct ProcessedSample {
-            double timestamp;
-            int32_t encoder_position[MAX_NUM_ENCODERS];
-            float encoder_velocity[MAX_NUM_ENCODERS];
-            uint16_t motor_current[MAX_NUM_MOTORS];
-            uint16_t motor_status[MAX_NUM_MOTORS];
-            float force_torque[FORCE_SAMPLE_NUM_DEGREES];
-            uint32_t digital_io;
-            uint32_t mio_pins;
-            uint16_t pot_values[MAX_NUM_POTS];
-        } proc_sample;
+        // how a CSV column is read from a sample (see compile_schema)
+        enum ColumnKind {
+            COLUMN_DOUBLE,          // two quadlets, high first
+            COLUMN_TICKS,           // uint64_t FPGA clock ticks, written in seconds
+            COLUMN_INT32,
+            COLUMN_UINT32,
+            COLUMN_FLOAT,
+            COLUMN_UINT16           // at shift
+        };
+
+        struct ColumnOp {
+            uint16_t quadlet;
+            uint8_t kind;           // ColumnKind
+            uint8_t shift;
+        };
 
         struct DC_Time {
             std::chrono::time_point<std::chrono::high_resolution_clock> start;
@@ -84,36 +98,229 @@ class DataCollection {
 
         bool use_sample_rate = false;
 
+        // data packets are delta compressed (see sample_compression.h)
+        bool use_compression = false;
+
+        // channels requested with ENABLE_CHANNEL_MASK_MSK (see set_channel_mask)
+        SampleChannelMask channel_mask;
+
+        // oversampling mode requested with ENABLE_OVERSAMPLING_MSK (see set_oversampling)
+        OversamplingConfig oversampling = {1, 0};
+
+        // burst mode requested with ENABLE_BURST_MSK (see set_burst)
+        BurstConfig burst = {0, 1, BURST_TRIGGER_HOST, 0, 0, 0, BURST_EDGE_RISING};
+        bool use_burst = false;
+        // set when the BurstStatus packet of the current capture is received
+        bool burst_done = false;
+
+        // FEC group size requested (see set_fec); the one in use is dc_meta.fec_group_size
+        uint32_t fec_group_size = 0;
+        // FEC mode: data packets received since the last parity packet, in slots of
+        // UDP_MAX_PAYLOAD_QUADLETS, written once the parity packet of their group has been
+        // handled (see handle_fec_parity)
+        std::vector<uint32_t> fec_buffer;
+        std::vector<int> fec_lengths;
+        // fec_packet_key of the next packet to write (packets before it were written)
+        uint64_t fec_next_key = 0;
+        // data packets rebuilt from the parity packets, and groups with too many packets
+        // lost to do so, in the current capture
+        int fec_recovered_packets = 0;
+        long long fec_recovered_samples = 0;
+        int fec_unrecoverable_groups = 0;
+
+        // history size requested for retransmit mode (see set_retransmit); the one in use
+        // is dc_meta.retransmit_history
+        uint32_t retransmit_history = 0;
+        // Retransmit mode: data packets by sequence number, in slots of UDP_MAX_PAYLOAD_QUADLETS,
+        // from the oldest one not written yet (reorder_next) to the newest one received.
+        // Missing packets are requested from the Zynq (see check_retransmits) until they
+        // arrive or are given up; the packets are written in order.
+        struct ReorderSlot {
+            int length;                 // bytes, without the sequence number; 0: missing, -1: given up
+            int nacks;                  // requests sent for the missing packet
+            double missing_since;       // capture time (s) when found missing
+            double last_nack;
+        };
+        std::vector<uint32_t> reorder_buffer;
+        std::vector<ReorderSlot> reorder_slots;
+        uint32_t reorder_next = 0;
+        uint32_t reorder_end = 0;       // one past the newest sequence number
+        // missing packets not given up yet; also polled by stop() on the main thread
+        std::atomic<int> reorder_missing{0};
+        // the first packet received sets reorder_next (attach to a running capture)
+        bool reorder_resync = false;
+        bool last_written_lost = false;
+        double last_retransmit_check = 0.0;
+        // in the current capture: packets requested at least once, recovered by a
+        // retransmission and given up (in runs of consecutive packets), NACKs sent
+        int retransmit_requested = 0;
+        int retransmit_recovered = 0;
+        int retransmit_lost = 0;
+        int retransmit_gaps = 0;
+        int nack_count = 0;
+        double recovery_latency_sum = 0.0;
+        double recovery_latency_max = 0.0;
+        // in the current capture: data packets received but not written (duplicates, and
+        // packets that arrived after being recovered or given up), in retransmit mode, and
+        // datagrams of none of the expected sizes (e.g., truncated)
+        int duplicate_packets = 0;
+        int malformed_packets = 0;
+
+        // datagrams impaired by the fault injection (see set_fault_injection) when the
+        // current capture started
+        UdpFaultInjector::Stats fault_stats_start;
+
+        // receive the datagrams of the captures from a packet ring (see set_packet_ring),
+        // and whether the current capture does
+        bool use_packet_ring = false;
+        bool packet_ring_used = false;
+        PacketRing packet_ring;
+        // time spent receiving the datagrams of the current capture (s), without the misses
+        double receive_time = 0.0;
+
+        // telemetry packets of the current capture (see TelemetryPacket), written to
+        // telemetry_filename; the final one accounts for the samples not received
+        std::ofstream telemetryFile;
+        std::string telemetry_filename;
+        TelemetryPacket final_telemetry;
+        // set by the receive thread once final_telemetry is written; polled by stop()
+        std::atomic<bool> final_telemetry_received{false};
+
+        // events marked during the current capture (see mark_event), written to
+        // events_filename when the first one is received
+        std::ofstream eventsFile;
+        std::string events_filename;
+        // capture commands sent in the current capture (see CaptureCommand), and the marked
+        // events the Zynq has not sent back yet: the receive thread sends them again every
+        // EVENT_RESEND_S (see check_pending_events)
+        struct PendingEvent {
+            CaptureCommand command;
+            std::chrono::time_point<std::chrono::high_resolution_clock> sent;
+        };
+        std::mutex capture_cmd_mutex;
+        uint32_t capture_cmd_sequence = 0;
+        std::vector<PendingEvent> pending_events;
+        std::atomic<int> pending_event_count{0};
+
+        // layout of the samples, from the metadata
+        SampleFormat sample_format;
+
+        // columns of the samples, compiled from their schema: one op per column, the first
+        // one being the timestamp
+        std::vector<ColumnOp> columns;
+        std::vector<std::string> column_names;
+        double tick_period = 0.0;
+
         bool stop_data_collection_flag;
 
         bool collect_data_ret;
 
         bool isDataCollectionRunning;
 
+        // set by attach() to join a capture already running on the Zynq
+        bool attach_to_capture = false;
+
         int data_capture_count = 1;
 
         int udp_data_packets_recvd_count = 0;
 
         int packet_misses_counter = 0;
+        // when the last datagram of the current capture was received
+        std::chrono::time_point<std::chrono::high_resolution_clock> last_packet_time;
+
+        // start command of the current capture sent, and nothing received from the Zynq
+        // since (see handle_packet_timeout), when it was last sent and how many times
+        bool start_pending = false;
+        std::chrono::time_point<std::chrono::high_resolution_clock> start_sent;
+        int start_sends = 0;
+
+        // bytes of data packets and samples received in the current capture
+        long long data_bytes_recvd_count = 0;
+        long long samples_recvd_count = 0;
+
+        // intervals between the timestamps of consecutive samples of the current
+        // capture (sample timing jitter on the Zynq, plus gaps of lost packets)
+        double last_sample_timestamp = 0.0;
+        double interval_sum = 0.0;
+        double interval_sum_sq = 0.0;
+        double interval_min = 0.0;
+        double interval_max = 0.0;
 
         uint16_t sample_rate = 0;
 
-        std::ofstream myFile;
+        // UDP payload size proposed to the Zynq (the agreed size is dc_meta.payload_size)
+        uint32_t payload_size = UDP_REAL_MTU;
+
+        // handshakes (or resume requests) sent to the Zynq in the last init() or resume()
+        int handshake_attempts = 0;
+
+        // CSV, telemetry, events and summary files of the captures (see set_file_output)
+        bool write_files = true;
+
+        // stages of the samples of the captures (see set_pipeline), and whether they run in
+        // the current capture
+        SamplePipeline pipeline;
+        bool pipeline_used = false;
+
+        // batches of samples for a reader in the program (see set_batch_output), off if
+        // batch_samples is 0
+        uint32_t batch_samples = 0;
+        uint32_t num_batches = 0;
+        SampleBatchQueue sample_batches;
 
         std::string filename;
 
+        // address of the Zynq, if not the default one derived from the board ID
+        std::string zynq_address;
+
         int sock_id;
 
-        uint32_t data_packet[UDP_MAX_QUADLET_PER_PACKET] = {0};
+        uint32_t data_packet[UDP_MAX_PAYLOAD_QUADLETS] = {0};
 
-        void load_meta_data(uint32_t *meta_data);
+        bool load_meta_data(void);
+        bool handshake(int start_state);
+        bool open_packet_ring(void);
         
         // DATA COLLECTION UTILITY METHODS
         int collect_data();
-        void process_sample(uint32_t *data_packet, int start_idx);
+        bool compile_schema(void);
+        double sample_timestamp(const uint32_t *sample) const;
+        bool is_data_packet(const uint32_t *packet, int length) const;
+        bool is_burst_status(const uint32_t *packet, int length) const;
+        void handle_burst_status(const uint32_t *packet);
+        uint32_t *fec_slot(size_t index);
+        void buffer_fec_packet(const uint32_t *packet, int length);
+        void flush_fec_packets(size_t count);
+        bool is_fec_parity(const uint32_t *packet, int length) const;
+        void handle_fec_parity(const uint32_t *packet);
+        uint32_t data_trailer_size(void) const;
+        int packet_samples(const uint32_t *packet, int length) const;
+        double capture_time(void) const;
+        void deliver_data_packet(const uint32_t *packet, int length);
+        bool is_retransmitted_packet(const uint32_t *packet, int length) const;
+        uint32_t *reorder_slot(uint32_t sequence);
+        void reorder_packet(const uint32_t *packet, int length, uint32_t sequence);
+        void mark_missing_packets(uint32_t end);
+        void give_up_packet(ReorderSlot &slot);
+        void write_reordered_packets(void);
+        void check_retransmits(double now);
+        void send_nack(NackRequest &request);
+        void flush_reordered_packets(void);
+        bool is_telemetry_packet(const uint32_t *packet, int length) const;
+        void handle_telemetry(const uint32_t *packet);
+        long long lost_packets(void) const;
+        long long lost_samples(void) const;
+        void print_telemetry_summary(void);
+        void write_capture_summary(void);
+        bool is_event_packet(const uint32_t *packet, int length) const;
+        void handle_event(const uint32_t *packet);
+        void check_pending_events(void);
+        bool send_capture_cmd(const char *cmd, uint32_t value);
         void handle_data_collection(void);
-        void write_csv_headers(void);
-        void process_and_write_data(void);
+        std::string axis_column(const char *name, int axis, bool motor) const;
+        void write_sample(const uint32_t *sample);
+        template <class Queue> void decode_sample(const uint32_t *sample, Queue &queue);
+        void process_and_write_data(const uint32_t *packet, int length);
         void handle_packet_timeout(void);
         void handle_udp_error(int ret_code);
         void handle_socket_closure(void);
@@ -121,9 +328,62 @@ class DataCollection {
         pthread_t collect_data_t;
     public:
         DataCollection();
+        // connect to the given address instead of 169.254.10.<boardID> (e.g., simulated Zynq program)
+        void set_zynq_address(const std::string &address);
+        // channels to include in the samples, used if ENABLE_CHANNEL_MASK_MSK is passed to init()
+        void set_channel_mask(const SampleChannelMask &mask);
+        // board reads averaged per sample, used if ENABLE_OVERSAMPLING_MSK is passed to init()
+        void set_oversampling(uint32_t reads_per_sample, bool min_max);
+        // samples recorded around a trigger and sent after it, used if ENABLE_BURST_MSK is
+        // passed to init(); a capture then ends by itself (see burst_complete)
+        void set_burst(const BurstConfig &config);
+        // data packets per FEC parity packet (0: off, at most MAX_FEC_GROUP_SIZE); a single
+        // lost data packet per group is rebuilt from the others and the parity
+        void set_fec(uint32_t group_size);
+        // data packets kept on the Zynq for retransmission (0: off, at most MAX_RETRANSMIT_HISTORY);
+        // lost data packets are requested again and written in order
+        void set_retransmit(uint32_t history);
+        // impairs the datagrams received from the Zynq (loss, duplication, reordering, delay,
+        // truncation) to test the program under network faults; before init()
+        void set_fault_injection(const UdpFaultConfig &config);
+        // receive the datagrams of the captures from a memory-mapped AF_PACKET ring instead of
+        // the UDP socket (Linux, needs CAP_NET_RAW), without copying them to the program;
+        // falls back to the UDP socket if the ring cannot be opened
+        void set_packet_ring(bool enable);
+        // also pass the samples of the captures to the program, in batches of samples_per_batch
+        // samples (0: off) with one array per column, num_batches of which can be held
+        // by the program at a time (see batches)
+        void set_batch_output(uint32_t samples_per_batch, uint32_t num_batches);
+        // write the CSV, telemetry, events and summary files (default), or only pass the samples on
+        void set_file_output(bool enable);
+        // stages of the samples of the captures, e.g. "stats,decimate=10,csv" (default "csv",
+        // the CSV file; see SamplePipeline::Configure); between captures. Returns false (with
+        // error set) if stages cannot be parsed.
+        bool set_pipeline(const std::string &stages, std::string &error);
+        // columns of the samples, known after init() or resume()
+        std::vector<SampleBatchQueue::Column> batch_columns() const;
+        // batches of the current capture, nullptr if set_batch_output is off
+        SampleBatchQueue *batches() { return (batch_samples > 0) ? &sample_batches : nullptr; }
         bool init(uint8_t boardID, uint8_t optionsMask, int sample_rate);
+        // reattach to the session of a running Zynq program (e.g., after a host crash).
+        // Returns false if the Zynq has no session, in which case init() should be used.
+        bool resume(uint8_t boardID, bool &capture_in_progress);
         bool start();
+        // continue writing a capture found in progress by resume()
+        bool attach();
+        // stop a capture found in progress by resume() without recording it
+        bool abort_capture();
         bool stop();
+        // trigger the burst of the current capture (BURST_TRIGGER_HOST, or to end the
+        // wait for another trigger)
+        bool trigger_burst();
+        // true once the burst of the current capture has been received
+        bool burst_complete() const { return burst_done; }
+        // change the sample rate of the current capture (started with a sample rate)
+        bool set_sample_rate(uint32_t sample_rate);
+        // mark an event in the current capture; the Zynq sends it back with the sample
+        // count and time it was received, which are written to the events file
+        bool mark_event(uint32_t event_id);
         bool terminate();
 };
 
@@ -0,0 +1,136 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __DATACOLLECTIONC_H__
+#define __DATACOLLECTIONC_H__
+
+#include <stdint.h>
+
+/*
+  C interface of the data collection library (libdvrkDataCollectionC), e.g. for Python
+  with ctypes (see host/python/dvrk_data_collection.py). A capture is driven as with the
+  host program, and its samples are pulled in batches with one contiguous array per CSV
+  column, in the type of the column, which can be wrapped as NumPy arrays without a
+  copy (shape num_samples, stride itemsize, type typestr):
+
+    dvrk_dc *dc = dvrk_dc_create();
+    dvrk_dc_set_file_output(dc, 0);
+    dvrk_dc_init(dc, board_id, DVRK_DC_ENABLE_PSIO, 0);
+    dvrk_dc_start(dc);
+    while (... && dvrk_dc_pull_batch(dc, &batch, 100) >= 0) {
+        ... batch.data[c] holds batch.num_samples values of column c ...
+        dvrk_dc_release_batch(dc);
+    }
+    dvrk_dc_stop(dc);
+    ... read the remaining batches until dvrk_dc_pull_batch returns -1 ...
+    dvrk_dc_terminate(dc);
+    dvrk_dc_destroy(dc);
+
+  Functions returning int return 1 on success and 0 on failure, unless noted. The
+  functions and structures only change with DVRK_DC_API_VERSION.
+*/
+
+#if defined(_WIN32)
+#define DVRK_DC_API __declspec(dllexport)
+#else
+#define DVRK_DC_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DVRK_DC_API_VERSION             1
+
+/* options of dvrk_dc_init (ENABLE_*_MSK in data_collection_shared.h) */
+#define DVRK_DC_ENABLE_PSIO             0x01
+#define DVRK_DC_ENABLE_POT              0x02
+#define DVRK_DC_ENABLE_SAMPLE_RATE      0x04
+#define DVRK_DC_ENABLE_COMPRESSION      0x08
+#define DVRK_DC_ENABLE_CHANNEL_MASK     0x10
+#define DVRK_DC_ENABLE_OVERSAMPLING     0x20
+#define DVRK_DC_ENABLE_FPGA_TIMESTAMP   0x80
+
+/* batches held by default, of DVRK_DC_DEFAULT_BATCH_SAMPLES samples */
+#define DVRK_DC_DEFAULT_BATCH_SAMPLES   4096
+#define DVRK_DC_DEFAULT_NUM_BATCHES     64
+
+typedef struct dvrk_dc dvrk_dc;
+
+typedef struct {
+    const char *name;                   /* CSV column name, e.g. "ENCODER_POS_1" */
+    const char *typestr;                /* NumPy array interface type, e.g. "<f8" */
+    uint32_t itemsize;                  /* bytes per value, the stride of the arrays */
+} dvrk_dc_column;
+
+typedef struct {
+    uint64_t sequence;                  /* batch number in the capture */
+    uint64_t first_sample;              /* sample number of the first sample, counting dropped ones */
+    uint64_t dropped_samples;           /* samples dropped since the start of the capture, because
+                                           the batches were not released in time */
+    uint32_t num_samples;
+    uint32_t num_columns;
+    const void * const *data;           /* array of each column; valid until released */
+} dvrk_dc_batch;
+
+DVRK_DC_API uint32_t dvrk_dc_api_version(void);
+
+DVRK_DC_API dvrk_dc *dvrk_dc_create(void);
+DVRK_DC_API void dvrk_dc_destroy(dvrk_dc *dc);
+
+/* before dvrk_dc_init (see DataCollection) */
+DVRK_DC_API void dvrk_dc_set_zynq_address(dvrk_dc *dc, const char *address);
+DVRK_DC_API void dvrk_dc_set_channel_mask(dvrk_dc *dc, uint32_t encoder_position, uint32_t encoder_velocity,
+                                          uint32_t motor, uint32_t pot);
+DVRK_DC_API void dvrk_dc_set_oversampling(dvrk_dc *dc, uint32_t reads_per_sample, int min_max);
+DVRK_DC_API void dvrk_dc_set_fec(dvrk_dc *dc, uint32_t group_size);
+DVRK_DC_API void dvrk_dc_set_retransmit(dvrk_dc *dc, uint32_t history);
+
+/* before dvrk_dc_start: samples per batch and batches that can be held at a time
+   (DVRK_DC_DEFAULT_*), and whether the CSV files are written too (default: yes) */
+DVRK_DC_API void dvrk_dc_set_batches(dvrk_dc *dc, uint32_t samples_per_batch, uint32_t num_batches);
+DVRK_DC_API void dvrk_dc_set_file_output(dvrk_dc *dc, int enable);
+
+/* connects to the Zynq of the board and negotiates the options; sample_rate (Hz) is
+   used with DVRK_DC_ENABLE_SAMPLE_RATE */
+DVRK_DC_API int dvrk_dc_init(dvrk_dc *dc, uint8_t board_id, uint8_t options_mask, int sample_rate);
+
+/* columns of the samples, after dvrk_dc_init (the first one is the timestamp, in s) */
+DVRK_DC_API uint32_t dvrk_dc_num_columns(dvrk_dc *dc);
+DVRK_DC_API int dvrk_dc_get_column(dvrk_dc *dc, uint32_t index, dvrk_dc_column *column);
+
+DVRK_DC_API int dvrk_dc_start(dvrk_dc *dc);
+
+/* waits up to timeout_ms (-1: no timeout) for the next batch of the capture. Returns 1
+   with a batch, 0 on timeout and -1 once the capture stopped and all its batches were
+   pulled. Batches are released in the order they were pulled, before the next start. */
+DVRK_DC_API int dvrk_dc_pull_batch(dvrk_dc *dc, dvrk_dc_batch *batch, int timeout_ms);
+DVRK_DC_API void dvrk_dc_release_batch(dvrk_dc *dc);
+
+/* during a capture */
+DVRK_DC_API int dvrk_dc_set_sample_rate(dvrk_dc *dc, uint32_t sample_rate);
+DVRK_DC_API int dvrk_dc_mark_event(dvrk_dc *dc, uint32_t event_id);
+
+DVRK_DC_API int dvrk_dc_stop(dvrk_dc *dc);
+/* ends the session with the Zynq program */
+DVRK_DC_API int dvrk_dc_terminate(dvrk_dc *dc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
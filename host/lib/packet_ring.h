@@ -0,0 +1,84 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __PACKETRING_H__
+#define __PACKETRING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Receives the datagrams of a connected UDP socket from a memory-mapped AF_PACKET ring
+// (TPACKET_V3, Linux) instead of the socket, to save the copy of each datagram to the
+// program: the kernel writes the datagrams to blocks of the ring shared with the program,
+// Receive parses their IP and UDP headers in place and returns a pointer to the payload,
+// and a block goes back to the kernel once all its datagrams have been read. A BPF
+// filter only lets the datagrams from the peer of the UDP socket to its port into the
+// ring, and the UDP socket drops them while the ring is open. Opening the ring needs
+// CAP_NET_RAW (Open fails with errno EPERM otherwise, see set_packet_ring).
+class PacketRing {
+public:
+    struct Stats {
+        uint64_t Packets = 0;       // datagrams received by the ring socket (kernel count)
+        uint64_t Drops = 0;         // datagrams dropped by the kernel, the ring being full
+        uint64_t Freezes = 0;       // times the ring was full
+        uint64_t Blocks = 0;        // blocks read
+    };
+
+    PacketRing();
+    ~PacketRing();
+
+    // opens a ring of num_blocks blocks of block_size bytes (a multiple of the page size)
+    // for the datagrams of udp_socket; false (with errno set) on error
+    bool Open(int udp_socket, uint32_t block_size, uint32_t num_blocks);
+    // the UDP socket receives the datagrams again
+    void Close(void);
+    bool IsOpen(void) const { return Socket >= 0; }
+
+    // next datagram, if any, like udp_nonblocking_receive: returns the length of its
+    // payload and sets payload to it (valid until the next call), or a UDP_RETURN_CODES
+    // value (UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT if none)
+    int Receive(const uint32_t *&payload);
+
+    // since Open (also once closed)
+    Stats GetStats(void);
+
+protected:
+    int Socket;
+    int UdpSocket;
+    uint8_t *Ring;
+    size_t RingSize;
+    uint32_t BlockSize;
+    uint32_t NumBlocks;
+    // addresses and ports of the datagrams (network byte order)
+    uint32_t PeerAddress;
+    uint16_t PeerPort;
+    uint16_t LocalPort;
+
+    // block being read (nullptr if none), its next datagram and the datagrams left in it
+    uint32_t Block;
+    uint8_t *Current;
+    const uint8_t *Frame;
+    uint32_t Remaining;
+
+    Stats Counts;
+
+    bool AttachFilter(void);
+    void ReadKernelStats(void);
+    int Parse(const uint8_t *frame, const uint32_t *&payload) const;
+};
+
+#endif
@@ -0,0 +1,113 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __SAMPLEBATCHQUEUE_H__
+#define __SAMPLEBATCHQUEUE_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Batches of decoded samples passed from the receive thread to a reader (e.g., the C API
+// in data_collection_c.h) without copying. A batch holds one contiguous array per CSV
+// column, in the column's own type (e.g., "<i4" for encoder positions), so that each one
+// can be wrapped as a NumPy array as is. The batches are allocated by Configure before
+// the capture; when the reader falls behind, the receive thread drops samples (counted)
+// rather than wait. The receive thread writes each sample with
+//   uint8_t *slot = queue.ValueSlot(c);   // for each column, nullptr if dropped
+//   ... write the value of column c to slot ...
+//   queue.CommitSample();
+// and the reader calls Pull, then Release once done with the arrays of the batch.
+class SampleBatchQueue {
+public:
+    struct Column {
+        std::string name;
+        std::string typestr;        // NumPy array interface type, e.g. "<f8"
+        uint32_t itemsize;          // bytes per value (the stride of the array)
+    };
+
+    struct Batch {
+        uint64_t sequence;          // batch number in the capture
+        uint64_t first_sample;      // sample number of the first sample, counting dropped ones
+        uint64_t dropped_samples;   // samples dropped since the start of the capture
+        uint32_t num_samples;
+        const void * const *data;   // array of each column, num_samples values
+    };
+
+    SampleBatchQueue();
+
+    // allocates num_batches batches of batch_samples samples of the columns, and empties the
+    // queue for a new capture (the reader must have released its batches)
+    void Configure(const std::vector<Column> &columns, uint32_t batch_samples, uint32_t num_batches);
+
+    bool IsConfigured(void) const { return !Slots.empty(); }
+    const std::vector<Column> &GetColumns(void) const { return Columns; }
+
+    // receive thread: slot of the value of column in the next sample (nullptr while samples
+    // are dropped), then CommitSample once all columns are written
+    uint8_t *ValueSlot(uint32_t column)
+    {
+        return (Current != nullptr) ? Current->Columns[column] + Count * Columns[column].itemsize : nullptr;
+    }
+    void CommitSample(void);
+    // publishes the last (partial) batch and ends the capture
+    void Finish(void);
+
+    // reader: waits up to timeout_ms (-1: no timeout) for the next batch. Returns 1 with a
+    // batch, 0 on timeout, -1 if the capture ended and all batches were pulled. Batches
+    // are released in the order they were pulled.
+    int Pull(Batch &batch, int timeout_ms);
+    void Release(void);
+
+protected:
+    struct Slot {
+        std::vector<uint64_t> Storage;      // 8-byte aligned columns
+        std::vector<uint8_t *> Columns;
+        std::vector<const void *> Data;
+        uint64_t Sequence;
+        uint64_t FirstSample;
+        uint64_t DroppedSamples;
+        uint32_t NumSamples;
+    };
+
+    std::vector<Column> Columns;
+    std::vector<Slot> Slots;
+    uint32_t BatchSamples;
+
+    // receive thread: batch being filled (nullptr while samples are dropped) and its samples
+    Slot *Current;
+    uint32_t Count;
+    uint64_t SampleNumber;
+    uint64_t DroppedSamples;
+
+    // batches published (Head), pulled and released (Tail), free running
+    std::atomic<uint64_t> Head;
+    uint64_t Pulled;
+    std::atomic<uint64_t> Tail;
+    bool Finished;
+
+    std::mutex Mutex;
+    std::condition_variable Published;
+
+    void StartBatch(void);
+    void Publish(void);
+};
+
+#endif
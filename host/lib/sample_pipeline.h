@@ -0,0 +1,222 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __SAMPLEPIPELINE_H__
+#define __SAMPLEPIPELINE_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "sample_batch_queue.h"
+
+// Stages the decoded samples of a capture go through, configured at run time from a list
+// such as "stats,decimate=10,csv,publish=127.0.0.1:6000" (see Configure for the stages).
+// The receive thread decodes the samples into a batch with one array per column, in the
+// column's own type (as SampleBatchQueue), and passes each batch (a data packet, or
+// BatchSamples samples) down the stages in order:
+//   filters  (decimate, trigger) run on the receive thread and remove samples from the
+//            batch in place, for all the stages that follow them
+//   sinks    (csv, npy, stats, publish) run on their own thread, from a bounded queue of
+//            batches allocated by Begin; when a sink falls behind, the batches it has no
+//            room for are dropped (counted) rather than hold up the receive thread, except
+//            for the files of the capture (csv, npy, see IsLossless), which the receive
+//            thread waits for
+// Stages are called once per batch, never per sample. The receive thread writes each
+// sample with
+//   uint8_t *slot = pipeline.ValueSlot(c);    // for each column
+//   ... write the value of column c to slot ...
+//   pipeline.CommitSample();
+// then calls Flush at the end of each data packet.
+class SamplePipeline {
+public:
+    typedef SampleBatchQueue::Column Column;
+
+    // samples of a batch: the array of each column, num_samples values
+    struct Batch {
+        uint64_t first_sample;      // sample number (in the capture, before the filters) of the
+                                    // first sample decoded into the batch
+        uint32_t num_samples;
+        std::vector<uint8_t *> columns;
+        std::vector<uint64_t> storage;      // 8-byte aligned columns
+
+        void Allocate(const std::vector<Column> &columns, uint32_t capacity);
+        void CopyFrom(const Batch &batch, const std::vector<Column> &columns);
+    };
+
+    // what the stages are given at the start of a capture
+    struct Context {
+        std::vector<Column> columns;
+        std::string basename;       // of the files of the capture, e.g. capture_<date and time>
+        bool write_files;           // false: file sinks do nothing (see set_file_output)
+    };
+
+    class Stage {
+    public:
+        virtual ~Stage() {}
+        // false if the stage cannot run in this capture, with error set (e.g. a column it
+        // needs is missing) or empty (nothing to do, e.g. a file sink with the files off);
+        // it is then bypassed
+        virtual bool Begin(const Context &context, std::string &error) = 0;
+        // filters remove samples from the batch (moving the others down); sinks only read it
+        virtual void Process(Batch &batch) = 0;
+        // end of the capture, after the last batch
+        virtual void End(void) {}
+        // what the stage did in the capture, e.g. the file it wrote ("" for nothing)
+        virtual std::string Summary(void) const { return ""; }
+        virtual bool IsSink(void) const = 0;
+        // sinks that get every batch: the receive thread waits for room in their queue
+        virtual bool IsLossless(void) const { return false; }
+    };
+
+    // figures of a stage in the current (or last) capture
+    struct StageStats {
+        std::string name;
+        bool sink;
+        bool bypassed;
+        uint64_t batches;           // processed
+        uint64_t samples;           // into the stage
+        uint64_t dropped_batches;   // sinks: no room in the queue
+        uint64_t dropped_samples;
+        uint64_t waits;             // lossless sinks: times the receive thread waited for room
+        uint32_t queue_size;        // sinks: batches the queue holds
+        uint32_t max_depth;         // batches waiting in the queue, when a batch was queued
+        double mean_depth;
+    };
+
+    // defaults of Begin
+    static const uint32_t DEFAULT_BATCH_SAMPLES = 512;
+    static const size_t DEFAULT_QUEUE_BYTES = 8 * 1024 * 1024;
+
+    SamplePipeline();
+    ~SamplePipeline();
+
+    // replaces the stages by <stage>[,<stage>...], each one of
+    //   csv                             CSV file of the samples (capture_<date>.csv)
+    //   npy                             NumPy file of the samples, one record per sample
+    //   stats                           count, mean, std dev, min and max of each column,
+    //                                   to <base>_stats.csv
+    //   publish=<address>:<port>        UDP datagrams of the samples (see PublishHeader)
+    //   decimate=<n>                    keeps one sample in n
+    //   trigger=<column><op><value>[:<n>]
+    //                                   keeps the samples from when the value of the column
+    //                                   crosses value (op > or <), n samples per crossing
+    //                                   (0 or none: all of them from the first crossing)
+    // Returns false (with error set) if the list cannot be parsed, the stages being unchanged.
+    bool Configure(const std::string &spec, std::string &error);
+    const std::string &GetSpec(void) const { return Spec; }
+    bool IsEmpty(void) const { return Stages.empty(); }
+    // true if the list has the stage (e.g. "csv")
+    bool HasStage(const std::string &name) const;
+
+    // starts the stages for a capture: allocates the batches (of batch_samples samples, and
+    // queue_bytes per sink queue) and starts the threads of the sinks. Stages that cannot
+    // run are bypassed (with an error printed); the pipeline does not run without a sink.
+    void Begin(const Context &context, uint32_t batch_samples = DEFAULT_BATCH_SAMPLES,
+               size_t queue_bytes = DEFAULT_QUEUE_BYTES);
+    bool IsRunning(void) const { return Running; }
+
+    // receive thread: slot of the value of column in the next sample, then CommitSample
+    // once all columns are written
+    uint8_t *ValueSlot(uint32_t column) { return Current.columns[column] + Current.num_samples * Columns[column].itemsize; }
+    void CommitSample(void)
+    {
+        if (++Current.num_samples == BatchSamples) {
+            Flush();
+        }
+    }
+    // passes the samples committed so far down the stages
+    void Flush(void);
+    // flushes, waits for the sinks to empty their queues and ends the stages
+    void End(void);
+
+    std::vector<StageStats> GetStats(void) const;
+    // samples the sinks dropped in the current (or last) capture, over all of them
+    uint64_t GetDroppedSamples(void) const;
+    // one line per stage: what it did, and its queue (see StageStats)
+    void PrintSummary(void) const;
+
+    // datagrams of publish, in the byte order of the host: a header, then the names of the
+    // columns separated by commas (PUBLISH_COLUMNS, at the start of the capture and every
+    // second), or num_samples samples of num_columns float64 values, sample after sample
+    // (PUBLISH_SAMPLES)
+    enum PublishKind {
+        PUBLISH_COLUMNS = 0,
+        PUBLISH_SAMPLES = 1
+    };
+    struct PublishHeader {
+        uint32_t magic;             // PUBLISH_MAGIC
+        uint16_t kind;              // PublishKind
+        uint16_t num_columns;
+        uint32_t sequence;          // datagram number in the capture
+        uint32_t num_samples;
+        uint64_t first_sample;      // samples published before in the capture
+    };
+    static const uint32_t PUBLISH_MAGIC = 0x4456524B;      // "DVRK"
+
+protected:
+    // queue of the batches of a sink, filled by the receive thread and emptied by the
+    // thread of the sink
+    struct SinkQueue {
+        std::vector<Batch> Slots;
+        // batches queued (Head) and processed (Tail), free running
+        std::atomic<uint64_t> Head;
+        std::atomic<uint64_t> Tail;
+        bool Finished;
+        std::mutex Mutex;
+        std::condition_variable Queued;
+        std::condition_variable Dequeued;       // lossless sinks
+        std::thread Thread;
+
+        SinkQueue() : Head(0), Tail(0), Finished(false) {}
+    };
+
+    struct StageSlot {
+        std::string Name;
+        Stage *Instance;
+        bool Bypassed;
+        SinkQueue *Queue;           // sinks only, while running
+        uint64_t Batches;
+        uint64_t Samples;
+        uint64_t DroppedBatches;
+        uint64_t DroppedSamples;
+        uint64_t Waits;
+        uint32_t QueueSize;
+        uint64_t DepthSum;
+        uint32_t MaxDepth;
+    };
+
+    std::string Spec;
+    std::vector<StageSlot> Stages;
+    std::vector<Column> Columns;
+    uint32_t BatchSamples;
+    bool Running;
+
+    // receive thread: batch being filled, and the sample number of its first sample
+    Batch Current;
+    uint64_t SampleNumber;
+
+    void Clear(void);
+    void Enqueue(StageSlot &slot, const Batch &batch);
+    void RunSink(StageSlot *slot);
+};
+
+#endif
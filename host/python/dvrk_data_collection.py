@@ -0,0 +1,215 @@
+"""
+Python interface of the data collection library (libdvrkDataCollectionC.so, see
+host/lib/data_collection_c.h), with ctypes.
+
+The samples of a capture are pulled in batches, as a dict of NumPy arrays (one per
+CSV column) that point into the buffers of the library, without a copy:
+
+    dc = DataCollection(board_id)
+    dc.init(psio=True)
+    dc.start()
+    for batch in dc.batches(duration=10):
+        print(batch.first_sample, batch['ENCODER_POS_1'].mean())
+    dc.terminate()
+
+The arrays of a batch are only valid until the next batch is pulled (or the batch is
+released): copy them (e.g. np.concatenate) to keep the samples.
+"""
+
+import ctypes
+import ctypes.util
+import os
+import time
+
+import numpy as np
+
+API_VERSION = 1
+
+ENABLE_PSIO = 0x01
+ENABLE_POT = 0x02
+ENABLE_SAMPLE_RATE = 0x04
+ENABLE_COMPRESSION = 0x08
+ENABLE_CHANNEL_MASK = 0x10
+ENABLE_OVERSAMPLING = 0x20
+ENABLE_FPGA_TIMESTAMP = 0x80
+
+
+class _Column(ctypes.Structure):
+    _fields_ = [('name', ctypes.c_char_p),
+                ('typestr', ctypes.c_char_p),
+                ('itemsize', ctypes.c_uint32)]
+
+
+class _Batch(ctypes.Structure):
+    _fields_ = [('sequence', ctypes.c_uint64),
+                ('first_sample', ctypes.c_uint64),
+                ('dropped_samples', ctypes.c_uint64),
+                ('num_samples', ctypes.c_uint32),
+                ('num_columns', ctypes.c_uint32),
+                ('data', ctypes.POINTER(ctypes.c_void_p))]
+
+
+def _load_library(path=None):
+    if path is None:
+        path = os.environ.get('DVRK_DATA_COLLECTION_LIB') or ctypes.util.find_library('dvrkDataCollectionC')
+    if path is None:
+        raise OSError('libdvrkDataCollectionC not found, set DVRK_DATA_COLLECTION_LIB to its path')
+    lib = ctypes.CDLL(path)
+
+    p = ctypes.c_void_p
+    signatures = {
+        'dvrk_dc_api_version': (ctypes.c_uint32, []),
+        'dvrk_dc_create': (p, []),
+        'dvrk_dc_destroy': (None, [p]),
+        'dvrk_dc_set_zynq_address': (None, [p, ctypes.c_char_p]),
+        'dvrk_dc_set_channel_mask': (None, [p, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32]),
+        'dvrk_dc_set_oversampling': (None, [p, ctypes.c_uint32, ctypes.c_int]),
+        'dvrk_dc_set_fec': (None, [p, ctypes.c_uint32]),
+        'dvrk_dc_set_retransmit': (None, [p, ctypes.c_uint32]),
+        'dvrk_dc_set_batches': (None, [p, ctypes.c_uint32, ctypes.c_uint32]),
+        'dvrk_dc_set_file_output': (None, [p, ctypes.c_int]),
+        'dvrk_dc_init': (ctypes.c_int, [p, ctypes.c_uint8, ctypes.c_uint8, ctypes.c_int]),
+        'dvrk_dc_num_columns': (ctypes.c_uint32, [p]),
+        'dvrk_dc_get_column': (ctypes.c_int, [p, ctypes.c_uint32, ctypes.POINTER(_Column)]),
+        'dvrk_dc_start': (ctypes.c_int, [p]),
+        'dvrk_dc_pull_batch': (ctypes.c_int, [p, ctypes.POINTER(_Batch), ctypes.c_int]),
+        'dvrk_dc_release_batch': (None, [p]),
+        'dvrk_dc_set_sample_rate': (ctypes.c_int, [p, ctypes.c_uint32]),
+        'dvrk_dc_mark_event': (ctypes.c_int, [p, ctypes.c_uint32]),
+        'dvrk_dc_stop': (ctypes.c_int, [p]),
+        'dvrk_dc_terminate': (ctypes.c_int, [p]),
+    }
+    for name, (restype, argtypes) in signatures.items():
+        function = getattr(lib, name)
+        function.restype = restype
+        function.argtypes = argtypes
+
+    if lib.dvrk_dc_api_version() != API_VERSION:
+        raise OSError('{} has API version {}, expected {}'.format(path, lib.dvrk_dc_api_version(), API_VERSION))
+    return lib
+
+
+class _ColumnArray:
+    # exposes one column of a batch to NumPy through the array interface (no copy)
+    def __init__(self, address, length, typestr, owner):
+        self.__array_interface__ = {'shape': (length,), 'typestr': typestr,
+                                    'data': (address, True), 'version': 3}
+        self._owner = owner
+
+
+class Batch(dict):
+    """Arrays of a batch by column name, valid until the batch is released."""
+
+    def __init__(self, raw, columns):
+        dict.__init__(self)
+        self.sequence = raw.sequence
+        self.first_sample = raw.first_sample
+        self.dropped_samples = raw.dropped_samples
+        self.num_samples = raw.num_samples
+        for c, (name, typestr) in enumerate(columns):
+            self[name] = np.asarray(_ColumnArray(raw.data[c] or 0, raw.num_samples, typestr, self))
+
+
+class DataCollection:
+    def __init__(self, board_id, zynq_address=None, library=None):
+        self._lib = _load_library(library)
+        self._dc = self._lib.dvrk_dc_create()
+        if not self._dc:
+            raise MemoryError('dvrk_dc_create failed')
+        self.board_id = board_id
+        self.columns = []
+        self._held = False
+        self._running = False
+        if zynq_address is not None:
+            self._lib.dvrk_dc_set_zynq_address(self._dc, zynq_address.encode())
+
+    def __del__(self):
+        if getattr(self, '_dc', None):
+            self._lib.dvrk_dc_destroy(self._dc)
+            self._dc = None
+
+    def init(self, psio=False, pot=False, sample_rate=None, compression=False, fpga_timestamp=False,
+             channel_mask=None, oversampling=None, min_max=False, fec=0, retransmit=0,
+             batch_samples=0, num_batches=0, write_files=False):
+        """Connects to the Zynq; channel_mask is (pos, vel, cur, pot) axis bit masks."""
+        options = 0
+        if psio:
+            options |= ENABLE_PSIO
+        if pot:
+            options |= ENABLE_POT
+        if sample_rate:
+            options |= ENABLE_SAMPLE_RATE
+        if compression:
+            options |= ENABLE_COMPRESSION
+        if fpga_timestamp:
+            options |= ENABLE_FPGA_TIMESTAMP
+        if channel_mask is not None:
+            options |= ENABLE_CHANNEL_MASK
+            self._lib.dvrk_dc_set_channel_mask(self._dc, *channel_mask)
+        if oversampling:
+            options |= ENABLE_OVERSAMPLING
+            self._lib.dvrk_dc_set_oversampling(self._dc, oversampling, int(min_max))
+        self._lib.dvrk_dc_set_fec(self._dc, fec)
+        self._lib.dvrk_dc_set_retransmit(self._dc, retransmit)
+        self._lib.dvrk_dc_set_batches(self._dc, batch_samples, num_batches)
+        self._lib.dvrk_dc_set_file_output(self._dc, int(write_files))
+
+        if not self._lib.dvrk_dc_init(self._dc, self.board_id, options, sample_rate or 0):
+            raise RuntimeError('could not start a session with the Zynq of board {}'.format(self.board_id))
+
+        self.columns = []
+        column = _Column()
+        for c in range(self._lib.dvrk_dc_num_columns(self._dc)):
+            self._lib.dvrk_dc_get_column(self._dc, c, ctypes.byref(column))
+            self.columns.append((column.name.decode(), column.typestr.decode()))
+
+    def start(self):
+        if not self._lib.dvrk_dc_start(self._dc):
+            raise RuntimeError('could not start the capture')
+        self._running = True
+
+    def pull(self, timeout=None):
+        """Next batch, None on timeout (s) or once the capture stopped and was read."""
+        self.release()
+        raw = _Batch()
+        ret = self._lib.dvrk_dc_pull_batch(self._dc, ctypes.byref(raw), -1 if timeout is None else int(timeout * 1000))
+        if ret != 1:
+            return None
+        self._held = True
+        return Batch(raw, self.columns)
+
+    def release(self):
+        if self._held:
+            self._lib.dvrk_dc_release_batch(self._dc)
+            self._held = False
+
+    def batches(self, duration=None):
+        """Yields the batches of the capture, and stops it after duration (s)."""
+        end = None if duration is None else time.monotonic() + duration
+        while True:
+            if self._running and end is not None and time.monotonic() >= end:
+                self.stop()
+            batch = self.pull(timeout=0.1)
+            if batch is not None:
+                yield batch
+            elif not self._running:
+                # pull after stop only times out while the last batches are being published
+                batch = self.pull(timeout=1.0)
+                if batch is None:
+                    return
+                yield batch
+
+    def set_sample_rate(self, sample_rate):
+        return bool(self._lib.dvrk_dc_set_sample_rate(self._dc, sample_rate))
+
+    def mark_event(self, event_id=0):
+        return bool(self._lib.dvrk_dc_mark_event(self._dc, event_id))
+
+    def stop(self):
+        self._running = False
+        return bool(self._lib.dvrk_dc_stop(self._dc))
+
+    def terminate(self):
+        self.release()
+        self._running = False
+        return bool(self._lib.dvrk_dc_terminate(self._dc))
@@ -32,6 +32,7 @@ http://www.cisst.org/cisst/license.txt.
 #include <string>
 #include <ctype.h>
 #include <climits>
+#include <limits>
 
 #include "data_collection.h"
 
@@ -77,12 +78,149 @@ static bool isFloat(const char* str)
     return hasDecimalPoint && strLength > 1;
 }
 
+// parses a list of axes ("all", "none" or e.g. "1,2,5-8") into a mask (bit i = axis i+1)
+static bool parseAxes(const char *str, uint32_t &mask)
+{
+    if (strcmp(str, "all") == 0) {
+        mask = 0xFFFFFFFF;
+        return true;
+    }
+    mask = 0;
+    if (strcmp(str, "none") == 0) {
+        return true;
+    }
+
+    const char *p = str;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return false;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+        }
+        if (first < 1 || last < first || last > 32) {
+            return false;
+        }
+        for (long axis = first; axis <= last; axis++) {
+            mask |= (1u << (axis - 1));
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return false;
+        }
+        p = end;
+    }
+    return true;
+}
+
+// parses a channel selection "<field>=<axes>" (see printUsage)
+static bool parseChannels(const char *str, SampleChannelMask &mask)
+{
+    const char *value = strchr(str, '=');
+    if (value == NULL) {
+        return false;
+    }
+    string field(str, value - str);
+    value++;
+
+    if (field == "pos") {
+        return parseAxes(value, mask.encoder_position);
+    } else if (field == "vel") {
+        return parseAxes(value, mask.encoder_velocity);
+    } else if (field == "cur") {
+        return parseAxes(value, mask.motor);
+    } else if (field == "pot") {
+        return parseAxes(value, mask.pot);
+    }
+    return false;
+}
+
+// parses a burst size "<pre>:<post>" (samples before and from the trigger)
+static bool parseBurst(const char *str, BurstConfig &config)
+{
+    char *end;
+    long pre = strtol(str, &end, 10);
+    if (end == str || *end != ':' || pre < 0) {
+        return false;
+    }
+    const char *p = end + 1;
+    long post = strtol(p, &end, 10);
+    if (end == p || *end != '\0' || post < 1) {
+        return false;
+    }
+    config.pre_trigger = (uint32_t) pre;
+    config.post_trigger = (uint32_t) post;
+    return true;
+}
+
+// parses a burst trigger (see printUsage): host, dio:<board>:<mask>[:<edge>] or
+// cur:<axis>:<threshold>[:<edge>]
+static bool parseTrigger(const char *str, BurstConfig &config)
+{
+    config.edge = BURST_EDGE_RISING;
+    if (strcmp(str, "host") == 0) {
+        config.trigger = BURST_TRIGGER_HOST;
+        return true;
+    }
+
+    const char *p;
+    if (strncmp(str, "dio:", 4) == 0) {
+        config.trigger = BURST_TRIGGER_DIGITAL_IO;
+    } else if (strncmp(str, "cur:", 4) == 0) {
+        config.trigger = BURST_TRIGGER_MOTOR_CURRENT;
+    } else {
+        return false;
+    }
+    p = str + 4;
+
+    char *end;
+    long channel = strtol(p, &end, 10);
+    if (end == p || *end != ':' || channel < 1 || channel > 32) {
+        return false;
+    }
+    p = end + 1;
+    unsigned long value = strtoul(p, &end, 0);
+    if (end == p || (*end != ':' && *end != '\0') || value > 0xFFFFFFFFul) {
+        return false;
+    }
+    config.channel = (uint32_t) (channel - 1);
+    if (config.trigger == BURST_TRIGGER_DIGITAL_IO) {
+        config.mask = (uint32_t) value;
+    } else if (value <= 0xFFFF) {
+        config.threshold = (uint32_t) value;
+    } else {
+        return false;
+    }
+
+    if (*end == ':') {
+        const char *edge = end + 1;
+        if (strcmp(edge, "rise") == 0) {
+            config.edge = BURST_EDGE_RISING;
+        } else if (strcmp(edge, "fall") == 0) {
+            config.edge = BURST_EDGE_FALLING;
+        } else if (strcmp(edge, "both") == 0) {
+            config.edge = BURST_EDGE_BOTH;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void printUsage(const char *progName)
 {
     cout << endl;
     cout << "                 dVRK Data Collection Program" << endl;
     cout << "|-----------------------------------------------------------------------" << endl;
-    cout << "|Usage: " << progName << " <boardID> [-t <seconds>] [-s <Hz>] [-i] [-p]" << endl;
+    cout << "|Usage: " << progName << " <boardID> [-t <seconds>] [-s <Hz>] [-i] [-p] [-z] [-f] [-c <field>=<axes>] [-o <reads> [-m]] [-b <pre>:<post> [-T <trigger>]] [-F <packets>] [-N <packets>] [-I <faults>] [-P] [-O <stages>] [-r] [-a <address>]" << endl;
     cout << "|" << endl;
     cout << "|Arguments:" << endl;
     cout << "|  <boardID>          Required. ID of the board to connect to." << endl;
@@ -92,12 +230,94 @@ static void printUsage(const char *progName)
     cout << "|  -s <Hz>            Optional. Sample rate in Hz (integer)." << endl;
     cout << "|  -i                 Optional. Include PS IO in data packet." << endl;
     cout << "|  -p                 Optional. Include potentiometer readings in data packet." << endl;
+    cout << "|  -z                 Optional. Delta compress data packets on the Zynq." << endl;
+    cout << "|  -f                 Optional. Timestamp samples with the FPGA clock of the boards instead" << endl;
+    cout << "|                     of the Zynq clock (converted to seconds from the first sample)." << endl;
+    cout << "|  -c <field>=<axes>  Optional, repeatable. Only include the given axes of a field" << endl;
+    cout << "|                     (pos, vel, cur for motor current and status, pot), e.g. cur=1,2" << endl;
+    cout << "|                     or pos=1-4. Axes: list of numbers and ranges, all or none." << endl;
+    cout << "|                     Fields not given include all axes. With several boards, axes" << endl;
+    cout << "|                     are numbered over all boards, in board order." << endl;
+    cout << "|  -o <reads>         Optional. Oversampling: each sample is the mean of <reads> board" << endl;
+    cout << "|                     reads on the Zynq (integer, up to " << MAX_READS_PER_SAMPLE << ")." << endl;
+    cout << "|  -m                 Optional. With -o, also record the min and max of each channel." << endl;
+    cout << "|  -b <pre>:<post>    Optional. Burst capture: the Zynq records <pre> samples before the" << endl;
+    cout << "|                     trigger and <post> from it in RAM, then sends them (up to " << MAX_BURST_BYTES / (1024 * 1024) << " MB)." << endl;
+    cout << "|  -T <trigger>       Optional. With -b, trigger of the burst (default host):" << endl;
+    cout << "|                       host                          [ENTER] or the end of -t" << endl;
+    cout << "|                       dio:<board>:<mask>[:<edge>]   edge of digital I/O bits of a board" << endl;
+    cout << "|                       cur:<axis>:<count>[:<edge>]   motor current crossing a threshold" << endl;
+    cout << "|                     Boards and axes are 1-based; <edge> is rise (default), fall or both." << endl;
+    cout << "|  -F <packets>       Optional. Forward error correction: a parity packet follows every" << endl;
+    cout << "|                     <packets> data packets (up to " << MAX_FEC_GROUP_SIZE << "), from which a single lost" << endl;
+    cout << "|                     data packet of the group is rebuilt." << endl;
+    cout << "|  -N <packets>       Optional. Retransmission: the Zynq keeps the last <packets> data" << endl;
+    cout << "|                     packets (up to " << MAX_RETRANSMIT_HISTORY << ") and resends the ones the host reports lost." << endl;
+    cout << "|  -I <faults>        Optional. Impair the datagrams received from the Zynq, for testing:" << endl;
+    cout << "|                     comma separated loss, dup, reorder, truncate (probabilities)," << endl;
+    cout << "|                     delay, jitter (ms) and seed, e.g. loss=0.01,delay=2,seed=7." << endl;
+    cout << "|  -P                 Optional. Receive the data from a memory-mapped packet ring instead" << endl;
+    cout << "|                     of the UDP socket (Linux, needs CAP_NET_RAW, else not used)." << endl;
+    cout << "|  -O <stages>        Optional. Stages of the samples, in order (default csv):" << endl;
+    cout << "|                       csv, npy, stats               files of the capture" << endl;
+    cout << "|                       publish=<address>:<port>      UDP datagrams, for a live display" << endl;
+    cout << "|                       decimate=<n>                  one sample in n to the next stages" << endl;
+    cout << "|                       trigger=<column><op><value>[:<n>]" << endl;
+    cout << "|                                                     samples from when the column crosses" << endl;
+    cout << "|                                                     value (op > or <), n per crossing" << endl;
+    cout << "|                     comma separated, e.g. stats,decimate=10,csv,publish=127.0.0.1:6000." << endl;
+    cout << "|  -r                 Optional. Resume the session of a running Zynq program." << endl;
+    cout << "|  -a <address>       Optional. IP address of the Zynq (default 169.254.10.<boardID>)." << endl;
     cout << "|  -h                 Show this help message." << endl;
     cout << "|" << endl;
     cout << "|[NOTE] Ensure the server is started before running the client." << endl;
     cout << "__________________________________________________________________________" << endl;
 }
 
+// reads a line typed during a capture, if any (without the newline)
+static bool readCaptureLine(string &line)
+{
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(STDIN_FILENO, &readfds);
+
+    struct timeval timeout = {0, 0};
+    if (select(STDIN_FILENO + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+        return false;
+    }
+
+    char buf[256];
+    if (fgets(buf, sizeof(buf), stdin) == NULL) {
+        return false;
+    }
+    line = buf;
+    line.erase(line.find_last_not_of("\r\n") + 1);
+    return true;
+}
+
+// handles a command typed during a capture: "m [<id>]" marks an event (numbered from 1
+// by default) and "s <Hz>" changes the sample rate
+static void handleCaptureCommand(DataCollection *DC, const string &line, uint32_t &next_event_id)
+{
+    char *end;
+    if (line[0] == 'm') {
+        const char *arg = line.c_str() + 1;
+        unsigned long id = strtoul(arg, &end, 10);
+        uint32_t event_id = (end == arg) ? next_event_id : (uint32_t) id;
+        if (DC->mark_event(event_id)) {
+            next_event_id = event_id + 1;
+        }
+    } else if (line[0] == 's') {
+        const char *arg = line.c_str() + 1;
+        unsigned long rate = strtoul(arg, &end, 10);
+        if (end == arg || rate == 0 || !DC->set_sample_rate((uint32_t) rate)) {
+            cout << "[ERROR] cannot change the sample rate to " << arg << " (capture needs -s)" << endl;
+        }
+    } else {
+        cout << "[ERROR] unknown command " << line << ". Type m [<id>] to mark an event or s <Hz> to set the sample rate" << endl;
+    }
+}
+
 static bool isExitKeyPressed()
 {
     fd_set readfds;
@@ -115,6 +335,50 @@ static bool isExitKeyPressed()
     return false;
 }
 
+// waits for [ENTER] or the end of the timed capture, handling the commands typed
+// meanwhile (see handleCaptureCommand)
+static void waitForCaptureEnd(DataCollection *DC, bool timedCaptureFlag, float data_collection_duration_s)
+{
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    uint32_t next_event_id = 1;
+    string line;
+
+    while (!timedCaptureFlag ||
+           std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() < data_collection_duration_s) {
+        if (readCaptureLine(line)) {
+            if (!line.empty()) {
+                handleCaptureCommand(DC, line, next_event_id);
+            } else if (!timedCaptureFlag) {
+                break;
+            }
+        }
+        usleep(1000);
+    }
+}
+
+// burst mode: waits for the burst to be received. With a host trigger, [ENTER] or the
+// end of the timed capture triggers the burst; with other triggers, they abandon it.
+static void waitForBurstEnd(DataCollection *DC, bool hostTrigger, bool timedCaptureFlag, float data_collection_duration_s)
+{
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    bool triggered = false;
+
+    while (!DC->burst_complete()) {
+        float elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+        bool end = isExitKeyPressed() || (timedCaptureFlag && !triggered && elapsed >= data_collection_duration_s);
+
+        if (end && (triggered || !hostTrigger)) {
+            cout << "Burst abandoned" << endl;
+            break;
+        }
+        if (end) {
+            DC->trigger_burst();
+            triggered = true;
+            cout << "Burst triggered, waiting for the samples (press [ENTER] to abandon)" << endl;
+        }
+        usleep(1000);
+    }
+}
 
 int main(int argc, char *argv[])
 {
@@ -122,11 +386,32 @@ int main(int argc, char *argv[])
     bool timedCaptureFlag = false;
     bool use_ps_io_flag = false;
     bool use_pot_flag = false;
+    bool use_compression_flag = false;
+    bool use_fpga_timestamp_flag = false;
+    bool use_channel_mask_flag = false;
+    bool use_oversampling_flag = false;
+    bool use_min_max_flag = false;
+    long reads_per_sample = 1;
+    SampleChannelMask channel_mask = { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+    bool use_burst_flag = false;
+    bool use_trigger_flag = false;
+    BurstConfig burst_config = {0, 1, BURST_TRIGGER_HOST, 0, 0, 0, BURST_EDGE_RISING};
+    long fec_group_size = 0;
+    long retransmit_history = 0;
+    UdpFaultConfig fault_config;
+    bool use_packet_ring = false;
+    const char *pipeline_stages = nullptr;
     bool use_sample_rate = false;
+    bool resume_session = false;
+    const char *zynq_address = nullptr;
     uint8_t options_mask = 0x00;
     uint8_t boardID = 0;
     int sample_rate = 0;
 
+    // unbuffered, so that select() sees the lines not read yet (see readCaptureLine): a
+    // buffered stdin would hold lines typed during a capture until the next prompt
+    setvbuf(stdin, NULL, _IONBF, 0);
+
     if (argc == 1) {
         printUsage(argv[0]);
         return 0;
@@ -153,7 +438,7 @@ int main(int argc, char *argv[])
     opterr = 0;
     optind = 1;
     int opt = 0;
-    while ((opt = getopt(argc - 1, argv + 1, "t:s:iph")) != -1) {
+    while ((opt = getopt(argc - 1, argv + 1, "t:s:ipzfc:o:mb:T:F:N:I:PO:ra:h")) != -1) {
         switch (opt) {
             case 't':
                 if (!isFloat(optarg)) {
@@ -185,12 +470,119 @@ int main(int argc, char *argv[])
                 cout << "Potentiometer readings will be included in data packet!" << endl;
                 break;
 
+            case 'z':
+                use_compression_flag = true;
+                cout << "Data packets will be compressed!" << endl;
+                break;
+
+            case 'f':
+                use_fpga_timestamp_flag = true;
+                cout << "Samples will be timestamped with the FPGA clock!" << endl;
+                break;
+
+            case 'c':
+                if (!parseChannels(optarg, channel_mask)) {
+                    cout << "[ERROR] invalid channel selection " << optarg << ". Pass in <field>=<axes>, e.g. cur=1,2" << endl;
+                    return -1;
+                }
+                use_channel_mask_flag = true;
+                break;
+
+            case 'o':
+                reads_per_sample = isInteger(optarg) ? strtol(optarg, nullptr, 10) : 0;
+                if (reads_per_sample < 1 || reads_per_sample > (long) MAX_READS_PER_SAMPLE) {
+                    cout << "[ERROR] invalid number of reads per sample " << optarg << ". Pass in Integer in [1, "
+                         << MAX_READS_PER_SAMPLE << "]" << endl;
+                    return -1;
+                }
+                use_oversampling_flag = true;
+                cout << "Oversampling: " << reads_per_sample << " reads per sample" << endl;
+                break;
+
+            case 'm':
+                use_min_max_flag = true;
+                break;
+
+            case 'b':
+                if (!parseBurst(optarg, burst_config)) {
+                    cout << "[ERROR] invalid burst " << optarg << ". Pass in <pre>:<post>, e.g. 1000:5000" << endl;
+                    return -1;
+                }
+                use_burst_flag = true;
+                break;
+
+            case 'T':
+                if (!parseTrigger(optarg, burst_config)) {
+                    cout << "[ERROR] invalid burst trigger " << optarg << ". Pass in host, dio:<board>:<mask>[:<edge>]"
+                         << " or cur:<axis>:<count>[:<edge>]" << endl;
+                    return -1;
+                }
+                use_trigger_flag = true;
+                break;
+
+            case 'F':
+                fec_group_size = isInteger(optarg) ? strtol(optarg, nullptr, 10) : 0;
+                if (fec_group_size < 1 || fec_group_size > (long) MAX_FEC_GROUP_SIZE) {
+                    cout << "[ERROR] invalid FEC group size " << optarg << ". Pass in Integer in [1, "
+                         << MAX_FEC_GROUP_SIZE << "]" << endl;
+                    return -1;
+                }
+                cout << "FEC: parity packet every " << fec_group_size << " data packets" << endl;
+                break;
+
+            case 'N':
+                retransmit_history = isInteger(optarg) ? strtol(optarg, nullptr, 10) : 0;
+                if (retransmit_history < 1 || retransmit_history > (long) MAX_RETRANSMIT_HISTORY) {
+                    cout << "[ERROR] invalid retransmit history " << optarg << ". Pass in Integer in [1, "
+                         << MAX_RETRANSMIT_HISTORY << "]" << endl;
+                    return -1;
+                }
+                cout << "Retransmit: last " << retransmit_history << " data packets kept on the Zynq" << endl;
+                break;
+
+            case 'I':
+                if (!parse_udp_fault_config(optarg, fault_config)) {
+                    cout << "[ERROR] invalid fault injection " << optarg << ". Pass in e.g. loss=0.01,delay=2" << endl;
+                    return -1;
+                }
+                cout << "Fault injection: loss " << fault_config.loss << ", dup " << fault_config.duplicate << ", reorder "
+                     << fault_config.reorder << ", truncate " << fault_config.truncate << ", delay " << fault_config.delay_ms
+                     << " ms + " << fault_config.jitter_ms << " ms jitter, seed " << fault_config.seed << endl;
+                break;
+
+            case 'P':
+                use_packet_ring = true;
+                cout << "Packet ring: receiving the data from an AF_PACKET ring, if possible" << endl;
+                break;
+
+            case 'O': {
+                SamplePipeline pipeline;
+                string error;
+                if (!pipeline.Configure(optarg, error)) {
+                    cout << "[ERROR] invalid stages " << optarg << ": " << error << endl;
+                    return -1;
+                }
+                pipeline_stages = optarg;
+                cout << "Pipeline: " << optarg << endl;
+                break;
+            }
+
+            case 'r':
+                resume_session = true;
+                break;
+
+            case 'a':
+                zynq_address = optarg;
+                break;
+
             case 'h':
                 printUsage(argv[0]);
                 return 0;
 
             case '?':
-                if (optopt == 't' || optopt == 's') {
+                if (optopt == 't' || optopt == 's' || optopt == 'c' || optopt == 'o' || optopt == 'b' ||
+                    optopt == 'T' || optopt == 'F' || optopt == 'N' || optopt == 'I' || optopt == 'O' ||
+                    optopt == 'a') {
                     cout << "[ERROR] Option -" << static_cast<char>(optopt) << " requires a value" << endl;
                 } else {
                     cout << "[ERROR] Invalid arg: -" << static_cast<char>(optopt) << endl;
@@ -219,24 +611,105 @@ int main(int argc, char *argv[])
     if (use_sample_rate) {
         options_mask |= ENABLE_SAMPLE_RATE_MSK;
     }
+    if (use_compression_flag) {
+        options_mask |= ENABLE_COMPRESSION_MSK;
+    }
+    if (use_fpga_timestamp_flag) {
+        options_mask |= ENABLE_FPGA_TIMESTAMP_MSK;
+    }
+    if (use_channel_mask_flag) {
+        options_mask |= ENABLE_CHANNEL_MASK_MSK;
+    }
+    if (use_min_max_flag && !use_oversampling_flag) {
+        cout << "[ERROR] -m requires oversampling (-o <reads>)" << endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (use_oversampling_flag) {
+        options_mask |= ENABLE_OVERSAMPLING_MSK;
+    }
+    if (use_trigger_flag && !use_burst_flag) {
+        cout << "[ERROR] -T requires a burst (-b <pre>:<post>)" << endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (use_burst_flag) {
+        options_mask |= ENABLE_BURST_MSK;
+    }
 
     bool ret;
 
     DataCollection *DC = new DataCollection();
     bool stop_data_collection = false;
 
-    if (!DC->init(boardID, options_mask, sample_rate)) {
+    if (zynq_address != nullptr) {
+        DC->set_zynq_address(zynq_address);
+    }
+    if (fault_config.enabled()) {
+        DC->set_fault_injection(fault_config);
+    }
+    DC->set_packet_ring(use_packet_ring);
+    if (pipeline_stages != nullptr) {
+        string error;
+        DC->set_pipeline(pipeline_stages, error);
+    }
+
+    DC->set_channel_mask(channel_mask);
+    DC->set_oversampling((uint32_t) reads_per_sample, use_min_max_flag);
+    DC->set_burst(burst_config);
+    DC->set_fec((uint32_t) fec_group_size);
+    DC->set_retransmit((uint32_t) retransmit_history);
+
+    bool resumed = false;
+    bool capture_in_progress = false;
+
+    if (resume_session) {
+        resumed = DC->resume(boardID, capture_in_progress);
+        if (!resumed) {
+            cout << "Could not resume session, starting a new one" << endl << endl;
+        }
+    }
+
+    if (!resumed && !DC->init(boardID, options_mask, sample_rate)) {
         return -1;
     }
 
     int count = 1;
 
+    if (capture_in_progress) {
+        char yn = 0;
+        while (yn != 'y' && yn != 'n') {
+            cout << "Capture in progress on Zynq. Continue recording it? (y/n): ";
+            cin >> yn;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+        cout << endl;
+
+        if (yn == 'y') {
+            if (!DC->attach()) {
+                return -1;
+            }
+            cout << "...Press [ENTER] to terminate capture" << endl;
+
+            waitForCaptureEnd(DC, timedCaptureFlag, data_collection_duration_s);
+
+            if (!DC->stop()) {
+                return -1;
+            }
+            count++;
+        } else if (!DC->abort_capture()) {
+            return -1;
+        }
+    }
+
     while (!stop_data_collection) {
 
         cout << "Woud you like to start capture [" << count << "]? (y/n): ";
 
         char yn;
         cin >> yn;
+        // rest of the answer, which would otherwise be read as a command during the capture
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
 
         if (yn == 'y') {
             stop_data_collection = false;
@@ -254,17 +727,14 @@ int main(int argc, char *argv[])
         if (!DC->start()) {
             return -1;
         }
-        cout << "...Press [ENTER] to terminate capture" << endl;
 
-        if (timedCaptureFlag) {
-            int data_collection_duration_us = data_collection_duration_s * 1000000;
-            usleep(data_collection_duration_us);
+        if (use_burst_flag) {
+            bool host_trigger = (burst_config.trigger == BURST_TRIGGER_HOST);
+            cout << "...Press [ENTER] to " << (host_trigger ? "trigger the burst" : "abandon the burst") << endl;
+            waitForBurstEnd(DC, host_trigger, timedCaptureFlag, data_collection_duration_s);
         } else {
-            while(1) {
-                if (isExitKeyPressed()) {
-                    break;
-                } 
-            }
+            cout << "...Press [ENTER] to terminate capture (m [<id>]: mark an event, s <Hz>: set the sample rate)" << endl;
+            waitForCaptureEnd(DC, timedCaptureFlag, data_collection_duration_s);
         }
 
         if (!DC->stop()) {
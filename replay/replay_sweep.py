@@ -0,0 +1,261 @@
+"""
+Replays a capture at several speeds, under several network impairments and with each
+receive path of the host program, and reports how the host program copes at each: rate,
+loss, recovery and the time it takes to receive a data packet.
+
+For each combination, the Zynq program is started on this machine with the capture
+(dvrk-data-collection-zynq -r <csv> -x <speed>), the host program records one timed
+capture from it (over loopback), and the figures of the capture are read from the
+summary file the host program writes (capture_<date>_summary.csv):
+
+    python3 replay_sweep.py capture.csv --zynq <zynq build>/dvrk-data-collection-zynq \
+        --host <host build>/bin/dvrk-data-collection-host --speeds 1,2,4,0 -- -z
+
+Without a capture, one is first recorded from the simulated board of the Zynq program
+(without impairments, with the arguments passed to the host program).
+
+Speed 0 replays as fast as possible. --faults lists impairments of the datagrams both
+programs receive (their -I option), separated by ';' (or given with several --faults),
+with none for none, e.g.
+
+    --faults 'none;loss=0.01;loss=0.05;loss=0.05,reorder=0.05' -- -N 512
+
+--backends compares the UDP socket (socket) with the packet ring (ring, the -P option,
+which needs CAP_NET_RAW), e.g. at the maximum rate:
+
+    --speeds 0 --backends socket,ring
+
+The arguments after -- are passed to the host program (e.g. -z, -f, -F 4, -N 512).
+
+--events <ms> marks an event every <ms> during each capture (m <id>, numbered from 1),
+while the host program also sends its NACKs (-N) and other commands, e.g.
+
+    --events 5 --faults 'loss=0.05,dup=0.05,seed=1' -- -N 256
+
+A run fails if the host program gets no capture (e.g. the handshake did not complete),
+the final telemetry of the Zynq is not received (the loss cannot be accounted for), the
+loss is negative, the events of the capture (capture_<date>_events.csv) are not the ones
+marked, or the Zynq program does not terminate successfully (e.g. it went out of sync
+with the host). The sweep exits with status 1 if a run failed.
+"""
+
+import argparse
+import csv
+import glob
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def mark_events(args, host, host_log_name):
+    """Marks an event every args.events ms once the capture is in progress, until 0.5 s
+    before its end. Returns the IDs marked."""
+    marked = []
+    deadline = time.time() + args.duration + args.timeout
+    while time.time() < deadline and host.poll() is None:
+        with open(host_log_name) as host_log:
+            if 'in Progress' in host_log.read():
+                break
+        time.sleep(0.01)
+    # the capture is timed from its start, a little after the message
+    end = time.time() + args.duration - 0.5
+    while time.time() < end and host.poll() is None:
+        marked.append(len(marked) + 1)
+        host.stdin.write('m {}\n'.format(marked[-1]))
+        host.stdin.flush()
+        time.sleep(args.events / 1000.0)
+    return marked
+
+
+def check_events(rundir, marked):
+    """Reasons the events of the capture are not the ones marked, if any."""
+    files = glob.glob(os.path.join(rundir, '*_events.csv'))
+    received = []
+    if files:
+        with open(files[0]) as events_file:
+            received = [int(row['EVENT']) for row in csv.DictReader(events_file)]
+    failures = []
+    missing = sorted(set(marked) - set(received))
+    unknown = sorted(set(received) - set(marked))
+    duplicates = len(received) - len(set(received))
+    if missing:
+        failures.append('{} of {} events missing (e.g. {})'.format(len(missing), len(marked), missing[0]))
+    if unknown:
+        failures.append('{} events never marked (e.g. {})'.format(len(unknown), unknown[0]))
+    if duplicates:
+        failures.append('{} events duplicated'.format(duplicates))
+    return failures
+
+
+def run_capture(args, zynq_args, host_args, rundir):
+    """Runs one capture in rundir. Returns the summary of the capture (None if there is
+    none) and the reasons the run failed, if any."""
+    os.makedirs(rundir)
+    failures = []
+    marked = []
+    zynq_log = open(os.path.join(rundir, 'zynq.log'), 'w')
+    host_log = open(os.path.join(rundir, 'host.log'), 'w')
+    zynq = subprocess.Popen([args.zynq] + zynq_args, stdout=zynq_log, stderr=subprocess.STDOUT, cwd=rundir)
+    try:
+        # the Zynq program loads the capture before it waits for the host
+        time.sleep(args.startup)
+        # answers the host: start one capture, then no other once it is over (its summary
+        # is written)
+        host = subprocess.Popen([args.host, str(args.board), '-a', '127.0.0.1', '-t', str(args.duration)] + host_args,
+                                stdin=subprocess.PIPE, stdout=host_log, stderr=subprocess.STDOUT, text=True,
+                                cwd=rundir)
+        host.stdin.write('y\n')
+        host.stdin.flush()
+        if args.events > 0:
+            marked = mark_events(args, host, host_log.name)
+        deadline = time.time() + args.duration + args.timeout
+        while host.poll() is None and not glob.glob(os.path.join(rundir, '*_summary.csv')) and time.time() < deadline:
+            time.sleep(0.1)
+        try:
+            if host.poll() is None:
+                host.stdin.write('n\n')
+                host.stdin.flush()
+            host.wait(timeout=args.timeout)
+        except (subprocess.TimeoutExpired, BrokenPipeError):
+            host.kill()
+            host.wait()
+            failures.append('host program did not finish')
+    finally:
+        try:
+            if zynq.wait(timeout=5) != 0:
+                failures.append('Zynq program failed (exit status {})'.format(zynq.returncode))
+        except subprocess.TimeoutExpired:
+            zynq.kill()
+            zynq.wait()
+            failures.append('Zynq program did not terminate')
+        zynq_log.close()
+        host_log.close()
+
+    summary = read_summary(rundir)
+    if summary is None:
+        failures.insert(0, 'no capture (handshake failed?)')
+    elif summary['FINAL_TELEMETRY'] != 1:
+        failures.append('no final telemetry, loss not accounted for')
+    elif summary['LOST_PACKETS'] < 0 or summary['LOST_SAMPLES'] < 0:
+        failures.append('negative loss ({:.0f} packets, {:.0f} samples)'.format(summary['LOST_PACKETS'],
+                                                                                summary['LOST_SAMPLES']))
+    if summary is not None and args.events > 0:
+        failures += check_events(rundir, marked)
+    return summary, failures
+
+
+def read_summary(rundir):
+    """Figures of the capture (see DataCollection::write_capture_summary), empty ones
+    (no final telemetry) as None."""
+    files = glob.glob(os.path.join(rundir, '*_summary.csv'))
+    if not files:
+        return None
+    with open(files[0]) as summary_file:
+        rows = list(csv.DictReader(summary_file))
+    if not rows:
+        return None
+    return {name: (float(value) if value else None) for name, value in rows[0].items()}
+
+
+def record(args, host_args, workdir):
+    """Records a capture from the simulated board of the Zynq program, to replay."""
+    summary, failures = run_capture(args, [], host_args, os.path.join(workdir, 'record'))
+    captures = [name for name in glob.glob(os.path.join(workdir, 'record', 'capture_*.csv'))
+                if not name.endswith(('_summary.csv', '_telemetry.csv', '_events.csv', '_stats.csv'))]
+    if failures or not captures:
+        print('recording from the simulated board failed: {} (see {})'.format(
+              ', '.join(failures) or 'no capture file', os.path.join(workdir, 'record')), file=sys.stderr)
+        return None
+    return captures[0]
+
+
+def report(args, capture, speed, backend, faults, host_args, workdir, run):
+    zynq_args = ['-r', os.path.abspath(capture), '-x', str(speed)]
+    if faults != 'none':
+        zynq_args += ['-I', faults]
+        host_args = ['-I', faults] + host_args
+    if backend == 'ring':
+        host_args = ['-P'] + host_args
+    rundir = os.path.join(workdir, 'run-{}'.format(run))
+    summary, failures = run_capture(args, zynq_args, host_args, rundir)
+
+    label = 'max' if speed == 0 else '{:g}x'.format(speed)
+    if summary is None or summary['FINAL_TELEMETRY'] != 1:
+        print('{:>6} {:>7} {:>40} FAILED: {} (see {})'.format(label, backend, faults, ', '.join(failures), rundir))
+        return False
+    # the host program fell back to the UDP socket
+    if backend == 'ring' and not summary['PACKET_RING']:
+        backend = 'socket*'
+
+    elapsed = summary['ELAPSED']
+    sent = summary['SAMPLES_SENT']
+    # replay rate, and rate of the samples that reached the host (recovered or not)
+    rate = summary['SAMPLES_TAKEN'] / elapsed if elapsed > 0 else 0.0
+    received = (sent - summary['LOST_SAMPLES']) / elapsed if elapsed > 0 else 0.0
+    recovery = '-'
+    if summary['RETRANSMIT_RECOVERED'] > 0:
+        recovery = '{:.2f} / {:.2f}'.format(summary['RECOVERY_LATENCY_MEAN'] * 1e3, summary['RECOVERY_LATENCY_MAX'] * 1e3)
+    impaired = '{:.0f} / {:.0f}'.format(summary['FAULTS_IMPAIRED'], summary['ZYNQ_FAULTS_IMPAIRED'])
+    print('{:>6} {:>7} {:>40} {:>10.0f} {:>10.0f} {:>13} {:>3.0f} {:>8.0f} {:>9.3f} {:>8.0f} {:>8.0f} {:>15} {:>8.2f}{}'.format(
+        label, backend, faults, rate, received, impaired, summary['HANDSHAKE_ATTEMPTS'], summary['LOST_PACKETS'],
+        100.0 * summary['LOST_SAMPLES'] / sent if sent else 0.0, summary['FEC_RECOVERED'],
+        summary['RETRANSMIT_RECOVERED'], recovery, summary['RECEIVE_TIME'] * 1e6,
+        '  FAILED: {} (see {})'.format(', '.join(failures), rundir) if failures else ''))
+    return not failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Host loss and recovery as a function of the replay rate, impairments '
+                                                 'and receive path')
+    parser.add_argument('capture', nargs='?', help='capture CSV written by the host program (default: recorded from '
+                                                   'the simulated board of the Zynq program)')
+    parser.add_argument('--zynq', required=True, help='dvrk-data-collection-zynq built for this machine')
+    parser.add_argument('--host', required=True, help='dvrk-data-collection-host')
+    parser.add_argument('--board', type=int, default=0, help='board ID passed to the host program')
+    parser.add_argument('--speeds', default='1,2,4,8,0', help='replay speeds, 0 for as fast as possible')
+    parser.add_argument('--backends', default='socket', help='receive paths of the host: socket, ring (-P)')
+    parser.add_argument('--faults', action='append', help="impairments of both programs (-I), separated by ';', "
+                                                          "none for none (default)")
+    parser.add_argument('--duration', type=float, default=5.0, help='length of each capture (s)')
+    parser.add_argument('--events', type=float, default=0.0, help='marks an event every so many ms during the '
+                                                                  'captures (0: none)')
+    parser.add_argument('--startup', type=float, default=1.0, help='time given to the Zynq program to load the capture (s)')
+    parser.add_argument('--timeout', type=float, default=30.0, help='time given to the host program for the handshake '
+                                                                    'and to terminate, on top of the capture (s)')
+    parser.add_argument('--keep', action='store_true', help='keep the captures and logs of the replays (in a directory '
+                                                            'of the current directory, one directory per run)')
+    # the arguments after -- go to the host program (not to the optional capture)
+    argv = sys.argv[1:]
+    host_args = []
+    if '--' in argv:
+        host_args = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+    args = parser.parse_args(argv)
+    faults_list = [faults for value in (args.faults or ['none']) for faults in value.split(';')]
+
+    workdir = tempfile.mkdtemp(prefix='replay_sweep_', dir=os.getcwd() if args.keep else None)
+
+    capture = args.capture or record(args, host_args, workdir)
+    ok = capture is not None
+    if ok:
+        print('{:>6} {:>7} {:>40} {:>10} {:>10} {:>13} {:>3} {:>8} {:>9} {:>8} {:>8} {:>15} {:>8}'.format(
+            'speed', 'backend', 'faults', 'rate (Hz)', 'recv (Hz)', 'impaired h/z', 'hs', 'lost', 'loss (%)', 'fec',
+            'resent', 'recovery (ms)', 'rx (us)'))
+        run = 0
+        for speed in [float(s) for s in args.speeds.split(',')]:
+            for backend in args.backends.split(','):
+                for faults in faults_list:
+                    run += 1
+                    ok = report(args, capture, speed, backend, faults, host_args, workdir, run) and ok
+
+    # the runs that failed are kept to look into
+    if not args.keep and ok:
+        shutil.rmtree(workdir)
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
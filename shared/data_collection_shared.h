@@ -22,9 +22,19 @@ http://www.cisst.org/cisst/license.txt.
 #include <stdint.h>
 #include <string.h>
 
-const unsigned int MAX_NUM_ENCODERS = 8;
-const unsigned int MAX_NUM_MOTORS = 10;
+#include "sample_schema.h"
+
+// Boards on the port that are sampled; their axes are numbered in board order
+// (e.g., axis 5 is axis 1 of the second board of a pair of QLA1s)
+const unsigned int MAX_NUM_BOARDS = 8;
+// over all boards (one bit per axis in SampleChannelMask)
+const unsigned int MAX_NUM_ENCODERS = 32;
+const unsigned int MAX_NUM_MOTORS = 32;
 const unsigned int MAX_NUM_POTS = MAX_NUM_ENCODERS;
+// timestamp, encoder positions and velocities, currents, digital I/O of each board and MIO pins,
+// pots, and the minimum and maximum of each channel in oversampling mode
+const unsigned int MAX_CHANNELS_PER_SAMPLE = 2 * MAX_NUM_ENCODERS + MAX_NUM_MOTORS + MAX_NUM_POTS;
+const unsigned int MAX_QUADLETS_PER_SAMPLE = 2 + 3 * MAX_CHANNELS_PER_SAMPLE + MAX_NUM_BOARDS + 1;
 // const unsigned int MAX_NUM_FT_READINGS = 6;
 
 // Default MTU=1500 (does not count 18 bytes for Ethernet frame header and CRC)
@@ -39,21 +49,370 @@ const unsigned int UDP_REAL_MTU = MTU_DEFAULT - IP_UDP_HEADER;
 
 const unsigned int UDP_MAX_QUADLET_PER_PACKET = UDP_REAL_MTU/4;
 
+// Largest MTU supported (jumbo frames). The UDP payload size of data packets is
+// negotiated at session start: the host proposes one based on its interface MTU
+// and the Zynq clamps it to its own; UDP_REAL_MTU is the fallback.
+const unsigned int MTU_JUMBO = 9000;
+const unsigned int UDP_MAX_PAYLOAD = MTU_JUMBO - IP_UDP_HEADER;
+const unsigned int UDP_MAX_PAYLOAD_QUADLETS = UDP_MAX_PAYLOAD/4;
+
 // Arbitrary, used as a const for consistency. Can be changed later
 const unsigned int CMD_MAX_STRING_SIZE = 100;
 
 const unsigned int FORCE_SAMPLE_NUM_DEGREES = 3;
 
+// Channels included in the samples, one mask per field (bit i selects axis i+1).
+// Sent with HOST_CHANNEL_MASK_CMD when ENABLE_CHANNEL_MASK_MSK is set; otherwise
+// all channels of the board are included.
+struct SampleChannelMask {
+    uint32_t encoder_position;
+    uint32_t encoder_velocity;
+    uint32_t motor;             // motor current and status
+    uint32_t pot;               // only used if ENABLE_POT_MSK is set
+};
+
+inline unsigned int count_channels(uint32_t mask)
+{
+    unsigned int count = 0;
+    for (; mask; mask &= mask - 1) {
+        count++;
+    }
+    return count;
+}
+
+// mask of the first count axes
+inline uint32_t first_channels(unsigned int count)
+{
+    return (count >= 32) ? 0xFFFFFFFF : ((1u << count) - 1);
+}
+
+// Oversampling mode, sent with HOST_OVERSAMPLING_CMD when ENABLE_OVERSAMPLING_MSK is set:
+// each sample is the mean of reads_per_sample board reads, timestamped at the centre of
+// the reads, followed by the minimum and maximum of each channel if min_max is nonzero
+struct OversamplingConfig {
+    uint32_t reads_per_sample;
+    uint32_t min_max;
+};
+
+const uint32_t MAX_READS_PER_SAMPLE = 65535;
+
+// Burst mode, sent with HOST_BURST_CMD when ENABLE_BURST_MSK is set: instead of streaming,
+// the Zynq records samples into a RAM ring (as fast as the boards can be read, unless a
+// sample rate is set) until post_trigger samples from the trigger sample on, keeping the
+// pre_trigger samples before it. The samples are then sent as data packets of the usual
+// format (the last one may hold fewer samples), followed by a BurstStatus packet.
+enum BurstTriggerSource {
+    BURST_TRIGGER_HOST = 0,             // HOST_BURST_TRIGGER_CMD
+    BURST_TRIGGER_DIGITAL_IO,           // edge of the digital I/O bits in mask of board channel (0-based)
+    BURST_TRIGGER_MOTOR_CURRENT         // motor current of axis channel (0-based) crossing threshold
+};
+
+enum BurstTriggerEdge {
+    BURST_EDGE_RISING = 1,
+    BURST_EDGE_FALLING = 2,
+    BURST_EDGE_BOTH = 3
+};
+
+struct BurstConfig {
+    uint32_t pre_trigger;               // samples before the trigger sample
+    uint32_t post_trigger;              // samples from the trigger sample on (at least 1)
+    uint32_t trigger;                   // BurstTriggerSource
+    uint32_t channel;
+    uint32_t mask;                      // BURST_TRIGGER_DIGITAL_IO
+    uint32_t threshold;                 // BURST_TRIGGER_MOTOR_CURRENT, 16-bit count
+    uint32_t edge;                      // BurstTriggerEdge
+};
+
+// RAM for the samples of a burst on the Zynq
+const uint32_t MAX_BURST_BYTES = 64 * 1024 * 1024;
+
+// Last packet of a burst
+const uint32_t BURST_STATUS_TAG = 0x42525354;
+struct BurstStatus {
+    uint32_t tag;                       // BURST_STATUS_TAG
+    uint32_t num_samples;               // samples sent (fewer than pre_trigger + post_trigger if
+                                        // the trigger came early)
+    uint32_t trigger_index;             // index of the trigger sample among them
+    uint32_t reserved;
+    double trigger_timestamp;           // timestamp of the trigger sample
+    double sample_rate;                 // average rate of the recorded samples (Hz)
+};
+
+// Telemetry of a capture, sent by the Zynq every telemetry_interval_ms (metadata) and once
+// more when the capture stops (final). The counters cover the capture up to the packet;
+// in the final packet, they are exact (the transmit thread has stopped), so the host can
+// tell samples lost on the network from samples the Zynq did not send.
+const uint32_t TELEMETRY_TAG = 0x54454C4D;
+struct TelemetryPacket {
+    uint32_t tag;                       // TELEMETRY_TAG
+    uint32_t sequence;                  // from 0 in each capture
+    uint32_t final;                     // 1 for the packet sent when the capture stops
+    uint32_t emio_errors;               // failed board reads
+    uint32_t producer_stalls;           // times sampling waited for the transmit thread
+    uint32_t transmit_errors;           // failed send calls
+    uint32_t dropped_packets;           // data packets of failed send calls, or left unsent at stop
+    uint32_t fec_parity_packets;        // FecParityHeader packets sent (FEC mode)
+    uint64_t samples_taken;             // samples read from the board(s)
+    uint64_t packets_sent;              // data packets sent
+    uint64_t samples_sent;              // samples in them
+    double timestamp;                   // capture time (s)
+    double sample_rate;                 // samples taken per second since the previous packet
+    float cpu_load;                     // CPU time of the Zynq program per wall time since
+                                        // the previous packet (1.0 = one core)
+    float fec_encode_ns;                // FEC mode: mean time to encode a data packet into
+                                        // the parity of its group (ns)
+    uint32_t retransmitted_packets;     // retransmit mode: data packets resent on request
+    uint32_t retransmit_misses;         // requested data packets no longer in the history
+    uint64_t numbered_packets;          // retransmit mode: data packets numbered (sent or not)
+    uint32_t faults_received;           // fault injection (-I): datagrams received from the host
+                                        // since the program started (handshakes included)
+    uint32_t faults_impaired;           // of them, dropped, duplicated, reordered, delayed or truncated
+    uint64_t numbered_samples;          // retransmit mode: samples in the numbered data packets
+};
+
+// Command of the host during a capture (HOST_SET_SAMPLE_RATE_CMD or HOST_MARK_EVENT_CMD)
+// and its value, in a single datagram: the value cannot be lost apart from its command,
+// or separated from it by another datagram of the host (e.g. a NackRequest)
+// The host numbers them from 1 in each capture: it sends a HOST_MARK_EVENT_CMD again until
+// the EventPacket of its sequence number is received, and the Zynq handles each number once.
+struct CaptureCommand {
+    char cmd[28];                       // NUL terminated
+    uint32_t value;
+    uint32_t sequence;
+};
+
+inline bool is_capture_command(const void *data, int length, const char *cmd)
+{
+    return length == (int) sizeof(CaptureCommand) && strcmp((const char *) data, cmd) == 0;
+}
+
+// Event marked by the host during a capture (HOST_MARK_EVENT_CMD), sent back in line
+// with the data packets
+const uint32_t EVENT_TAG = 0x45564E54;
+struct EventPacket {
+    uint32_t tag;                       // EVENT_TAG
+    uint32_t event_id;                  // sent by the host
+    uint64_t sample_index;              // samples taken when the event was received
+    double timestamp;                   // capture time when the event was received (s)
+    uint32_t sequence;                  // of the CaptureCommand
+};
+
+// The first two quadlets of a sample hold its timestamp, high quadlet first: the bits of
+// a double (seconds), or a uint64_t count of FPGA clock ticks (see SampleFormat)
+inline uint64_t sample_timestamp_bits(const uint32_t *sample)
+{
+    return ((uint64_t) sample[0] << 32) | sample[1];
+}
+
+inline void set_sample_timestamp_bits(uint32_t *sample, uint64_t bits)
+{
+    sample[0] = (uint32_t) (bits >> 32);
+    sample[1] = (uint32_t) (bits & 0xFFFFFFFF);
+}
+
+inline uint64_t seconds_timestamp_bits(double seconds)
+{
+    uint64_t bits;
+    memcpy(&bits, &seconds, sizeof(bits));
+    return bits;
+}
+
+// Forward error correction (FEC mode, HOST_FEC_CMD): the data packets are sent in groups
+// of fec_group_size (metadata), each followed by a parity packet, the XOR of the data
+// packets of the group (zero-padded to the longest) after this header. The host rebuilds
+// a single lost data packet of a group from the others and the parity. Telemetry and
+// event packets are not part of the groups; a group is closed early (fewer data packets)
+// before a BurstStatus packet and when the capture stops. Data packets are smaller than
+// the payload size by sizeof(FecParityHeader), so that the parity packets fit.
+const uint32_t FEC_PARITY_TAG = 0x46454350;
+const uint32_t MAX_FEC_GROUP_SIZE = 64;
+struct FecParityHeader {
+    uint32_t tag;                       // FEC_PARITY_TAG
+    uint32_t group;                     // from 0 in each capture
+    uint64_t first_key;                 // fec_packet_key of the first and last data packets
+    uint64_t last_key;                  // of the group
+    uint16_t num_packets;               // data packets in the group
+    uint16_t length;                    // parity bytes after the header
+    uint32_t length_xor;                // XOR of the lengths (bytes) of the data packets
+};
+
+// Retransmit mode (HOST_RETRANSMIT_CMD): the last 4 bytes of every data packet hold its
+// sequence number, from 0 in each capture. The Zynq keeps the last retransmit_history
+// data packets (metadata) and resends the ones listed in a NackRequest from the host, with
+// RETRANSMITTED_PACKET_FLAG set in their sequence number. The requests fit in the
+// command buffers, so the state machine also handles them between captures (for the
+// packets lost at the end of one).
+const uint32_t MAX_RETRANSMIT_HISTORY = 1024;
+const uint32_t RETRANSMITTED_PACKET_FLAG = 0x80000000;
+const uint32_t NACK_TAG = 0x4B43414E;
+struct NackRange {
+    uint32_t first;                     // sequence number
+    uint32_t count;
+};
+const unsigned int MAX_NACK_RANGES = (CMD_MAX_STRING_SIZE - 8) / sizeof(NackRange);
+struct NackRequest {
+    uint32_t tag;                       // NACK_TAG
+    uint32_t num_ranges;
+    NackRange ranges[MAX_NACK_RANGES];
+};
+
+inline bool is_nack_request(const void *data, int length)
+{
+    if (length != (int) sizeof(NackRequest)) {
+        return false;
+    }
+    uint32_t tag;
+    memcpy(&tag, data, sizeof(tag));
+    return tag == NACK_TAG;
+}
+
+// Order of the data packets of a capture, which tells the host the packets of each FEC
+// group: the timestamp bits of the first sample (after the header quadlet of compressed
+// packets), which increase from packet to packet (timestamps are not negative)
+inline uint64_t fec_packet_key(const uint32_t *packet, bool compressed)
+{
+    return sample_timestamp_bits(compressed ? packet + 1 : packet);
+}
+
+// XORs the first length bytes of packet into parity
+inline void fec_xor(uint32_t *parity, const uint32_t *packet, unsigned int length)
+{
+    const unsigned int quadlets = length / 4;
+    for (unsigned int q = 0; q < quadlets; q++) {
+        parity[q] ^= packet[q];
+    }
+
+    // compressed packets need not end on a quadlet
+    uint8_t *dst = reinterpret_cast<uint8_t *>(parity + quadlets);
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(packet + quadlets);
+    for (unsigned int b = 0; b < length % 4; b++) {
+        dst[b] ^= src[b];
+    }
+}
+
+// Layout of the samples of a capture (see calculate_quadlets_per_sample in the Zynq program)
+struct SampleFormat {
+    unsigned int num_boards;
+    // over all boards
+    unsigned int num_encoders;
+    unsigned int num_motors;
+    bool ps_io;
+    bool pot;
+    SampleChannelMask channels;
+    // minimum and maximum of the channels follow (oversampling mode)
+    bool min_max;
+    // timestamps are ticks of the FPGA clock at this rate (ENABLE_FPGA_TIMESTAMP_MSK)
+    // instead of seconds; 0 if not
+    uint32_t timestamp_ticks_per_s;
+
+    // selects every channel of the board
+    void select_all_channels(void)
+    {
+        channels.encoder_position = first_channels(num_encoders);
+        channels.encoder_velocity = first_channels(num_encoders);
+        channels.motor = first_channels(num_motors);
+        channels.pot = first_channels(num_encoders);
+    }
+
+    bool all_channels(void) const
+    {
+        return channels.encoder_position == first_channels(num_encoders) &&
+               channels.encoder_velocity == first_channels(num_encoders) &&
+               channels.motor == first_channels(num_motors) &&
+               (!pot || channels.pot == first_channels(num_encoders));
+    }
+
+    unsigned int num_positions(void) const { return count_channels(channels.encoder_position); }
+    unsigned int num_velocities(void) const { return count_channels(channels.encoder_velocity); }
+    unsigned int num_motor_channels(void) const { return count_channels(channels.motor); }
+    unsigned int num_pots(void) const { return pot ? count_channels(channels.pot) : 0; }
+
+    // encoder positions, velocities, motor quadlets and pots
+    unsigned int num_channels(void) const
+    {
+        return num_positions() + num_velocities() + num_motor_channels() + num_pots();
+    }
+
+    // digital I/O of each board, then MIO pins
+    unsigned int ps_io_quadlets(void) const { return ps_io ? num_boards + 1 : 0; }
+
+    unsigned int quadlets(void) const
+    {
+        return 2 + num_channels() * (min_max ? 3 : 1) + ps_io_quadlets();
+    }
+
+    // timestamp of a sample in seconds (capture time, or FPGA clock time from the first
+    // sample with timestamp_ticks_per_s)
+    double timestamp_seconds(const uint32_t *sample) const
+    {
+        uint64_t bits = sample_timestamp_bits(sample);
+        if (timestamp_ticks_per_s != 0) {
+            return (double) bits / timestamp_ticks_per_s;
+        }
+        double seconds;
+        memcpy(&seconds, &bits, sizeof(seconds));
+        return seconds;
+    }
+};
+
+// Session state reported in DataCollectionMeta
+enum DataCollectionSessionState {
+    SESSION_NONE = 0,       // no host session configured on the Zynq
+    SESSION_IDLE,           // session configured, waiting for start command
+    SESSION_CAPTURING       // capture in progress
+};
+
+// Board of a capture, in DataCollectionMeta
+struct BoardSection {
+    uint32_t board_id;
+    uint32_t hwvers;
+    uint32_t num_encoders;
+    uint32_t num_motors;
+};
+
 // Data collection meta-data
 struct DataCollectionMeta {
+    // hardware version of the first board
     uint32_t hwvers;
+    // over all boards
     uint32_t num_motors;
     uint32_t num_encoders;
     uint32_t data_packet_size;
     uint32_t size_of_sample;
     uint32_t samples_per_packet;
+    // session info (lets a restarted host reattach to a running Zynq)
+    uint32_t session_id;
+    uint32_t session_state;
+    uint32_t options_mask;
+    uint32_t sample_rate;
+    // negotiated maximum UDP payload (in bytes)
+    uint32_t payload_size;
+    // channels included in the samples
+    SampleChannelMask channel_mask;
+    // reads_per_sample is 1 if oversampling is off
+    OversamplingConfig oversampling;
+    // boards sampled, in the order of their axes in the samples
+    uint32_t num_boards;
+    BoardSection boards[MAX_NUM_BOARDS];
+    // burst mode (ENABLE_BURST_MSK), with the sample counts clamped to MAX_BURST_BYTES
+    BurstConfig burst;
+    // period of the telemetry packets (0: only when the capture stops)
+    uint32_t telemetry_interval_ms;
+    // rate of the FPGA clock ticks in the sample timestamps (ENABLE_FPGA_TIMESTAMP_MSK), 0 if off
+    uint32_t timestamp_ticks_per_s;
+    // data packets per FEC group (HOST_FEC_CMD), 0 if off
+    uint32_t fec_group_size;
+    // data packets kept on the Zynq for retransmission (HOST_RETRANSMIT_CMD), 0 if off
+    uint32_t retransmit_history;
+    // fields of the samples, from which the host decodes them
+    SampleSchema schema;
 };
 
+// Smallest UDP payload the Zynq agrees to (the 1280-byte minimum MTU of IPv6), whatever
+// the host proposes: the metadata is sent in one datagram of at most the payload size
+const unsigned int MIN_UDP_PAYLOAD = 1280 - IP_UDP_HEADER;
+static_assert(sizeof(DataCollectionMeta) <= MIN_UDP_PAYLOAD, "the metadata must fit in the smallest UDP payload");
+
 // State Machine Return Codes
 enum StateMachineReturnCodes {
     SM_SUCCESS, 
@@ -75,12 +434,31 @@ enum StateMachineReturnCodes {
     #define HOST_READY_CMD                                  "HOST: READY FOR DATA COLLECTION"
     #define HOST_FLAG_CMD                                   "HOST: FLAG CMD"
     #define HOST_SAMPLE_RATE_CMD                            "HOST: SAMPLE RATE CMD"
+    #define HOST_CHANNEL_MASK_CMD                           "HOST: CHANNEL MASK CMD"
+    #define HOST_OVERSAMPLING_CMD                           "HOST: OVERSAMPLING CMD"
+    #define HOST_BURST_CMD                                  "HOST: BURST CMD"
+    #define HOST_BURST_TRIGGER_CMD                          "HOST: BURST TRIGGER"
+    // during a capture, in a CaptureCommand with the sample rate (sample rate mode only, in Hz)
+    #define HOST_SET_SAMPLE_RATE_CMD                        "HOST: SET SAMPLE RATE"
+    // during a capture, in a CaptureCommand with the event ID (see EventPacket)
+    #define HOST_MARK_EVENT_CMD                             "HOST: MARK EVENT"
+    // followed by a uint32_t FEC group size (0: off), see FecParityHeader
+    #define HOST_FEC_CMD                                    "HOST: FEC CMD"
+    // followed by a uint32_t number of data packets kept for retransmission (0: off), see NackRequest
+    #define HOST_RETRANSMIT_CMD                             "HOST: RETRANSMIT CMD"
+    #define HOST_PAYLOAD_SIZE_CMD                           "HOST: PAYLOAD SIZE CMD"
+    #define HOST_PROBE_PAYLOAD_CMD                          "HOST: PROBE PAYLOAD SIZE"
     #define HOST_RECVD_METADATA                             "HOST: RECEIVED METADATA"
+    #define HOST_RESUME_SESSION_CMD                         "HOST: RESUME SESSION"
     #define HOST_STOP_DATA_COLLECTION                       "HOST: STOP DATA COLLECTION"
     #define HOST_TERMINATE_SERVER                           "HOST: TERMINATE SERVER"
     // ZYNQ
     #define ZYNQ_READY_CMD                                  "ZYNQ: READY FOR DATA COLLECTION"
     #define ZYNQ_TERMINATATION_SUCCESSFUL                   "ZYNQ: TERMINATION SUCCESSFUL"
+    #define ZYNQ_PROBE_PAYLOAD                              "ZYNQ: PROBE PAYLOAD"
+
+static_assert(sizeof(HOST_SET_SAMPLE_RATE_CMD) <= sizeof(CaptureCommand::cmd) &&
+              sizeof(HOST_MARK_EVENT_CMD) <= sizeof(CaptureCommand::cmd), "the capture commands must fit in a CaptureCommand");
 
 
 
@@ -89,5 +467,11 @@ enum StateMachineReturnCodes {
 #define ENABLE_PSIO_MSK                                     0x01
 #define ENABLE_POT_MSK                                      0x02
 #define ENABLE_SAMPLE_RATE_MSK                              0x04
+#define ENABLE_COMPRESSION_MSK                              0x08
+#define ENABLE_CHANNEL_MASK_MSK                             0x10
+#define ENABLE_OVERSAMPLING_MSK                             0x20
+#define ENABLE_BURST_MSK                                    0x40
+// timestamps from the FPGA timestamp counter of the boards instead of the Zynq clock
+#define ENABLE_FPGA_TIMESTAMP_MSK                           0x80
 
 #endif
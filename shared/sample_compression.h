@@ -0,0 +1,366 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __SAMPLECOMPRESSION_H__
+#define __SAMPLECOMPRESSION_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include "data_collection_shared.h"
+
+// Delta compression of data packets, used when ENABLE_COMPRESSION_MSK is set.
+//
+// Samples are the uncompressed samples of the data packets (see
+// calculate_quadlets_per_sample in the Zynq program). A compressed data packet
+// holds a variable number of samples:
+//   quadlet 0:     COMPRESSED_PACKET_TAG (upper 16 bits), number of samples (lower 16 bits)
+//   first sample:  uncompressed
+//   other samples: bytes, each field coded against the same field of the previous sample
+//     timestamp            zigzag varint of the change of the time step (ns, or FPGA clock
+//                          ticks if SampleFormat::timestamp_ticks_per_s is set)
+//     encoder position     zigzag varint of the difference
+//     encoder velocity     varint of the XOR of the float bits
+//     motor quadlet        zigzag varints of the differences of both 16-bit halves
+//     digital I/O, MIO     varint of a mask with bit i set if PS IO quadlet i (digital I/O
+//                          of each board, then MIO pins) changed, followed by the changed
+//                          values as varints
+//     pot                  zigzag varint of the difference
+//     minimum, maximum     (oversampling mode) same coding as the channels above
+// Packets are decoded independently of each other, so a lost packet only loses its samples.
+
+const uint32_t COMPRESSED_PACKET_TAG = 0x445A;
+
+// timestamp of a sample as an integer, in the unit of its delta coding
+inline int64_t timestamp_steps(const SampleFormat &format, const uint32_t *sample)
+{
+    if (format.timestamp_ticks_per_s != 0) {
+        return (int64_t) sample_timestamp_bits(sample);
+    }
+    return (int64_t) (format.timestamp_seconds(sample) * 1e9 + 0.5);
+}
+
+inline void set_timestamp_steps(const SampleFormat &format, uint32_t *sample, int64_t steps)
+{
+    if (format.timestamp_ticks_per_s != 0) {
+        set_sample_timestamp_bits(sample, (uint64_t) steps);
+    } else {
+        set_sample_timestamp_bits(sample, seconds_timestamp_bits(steps * 1e-9));
+    }
+}
+
+// worst case size of a delta coded sample, in bytes
+inline unsigned int max_delta_sample_bytes(const SampleFormat &format)
+{
+    unsigned int channel_bytes = 5 * (format.num_positions() + format.num_velocities() + format.num_pots()) +
+                                 2 * 3 * format.num_motor_channels();
+    return 10 + channel_bytes * (format.min_max ? 3 : 1) + (format.ps_io ? 2 + 5 * format.ps_io_quadlets() : 0);
+}
+
+inline bool is_compressed_packet(const uint32_t *packet, int length)
+{
+    return (length >= 4) && ((packet[0] >> 16) == COMPRESSED_PACKET_TAG);
+}
+
+class SampleEncoder {
+protected:
+    SampleFormat Format;
+    // sample size and channel counts of the format
+    unsigned int Quadlets, NumPositions, NumVelocities, NumMotors, NumPSIO, NumPots;
+    unsigned int MaxSampleBytes;
+    uint8_t *Packet;
+    unsigned int Capacity;
+    unsigned int Length;
+    unsigned int Count;
+    uint32_t Previous[MAX_QUADLETS_PER_SAMPLE];
+    // timestamps, in the unit of timestamp_steps
+    int64_t PreviousTime;
+    int64_t PreviousStep;
+
+    void put_varint(uint64_t value)
+    {
+        while (value >= 0x80) {
+            Packet[Length++] = (uint8_t) (value | 0x80);
+            value >>= 7;
+        }
+        Packet[Length++] = (uint8_t) value;
+    }
+
+    void put_signed(int64_t value)
+    {
+        put_varint(((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+    }
+
+    void put_diff32(uint32_t value, uint32_t previous)
+    {
+        put_signed((int32_t) (value - previous));
+    }
+
+    void put_diff16(uint32_t value, uint32_t previous)
+    {
+        put_signed((int16_t) (uint16_t) (value - previous));
+    }
+
+    // codes one value of each channel (and the digital I/O and MIO pins if ps_io),
+    // starting at sample[idx]
+    void put_channels(const uint32_t *sample, unsigned int &idx, bool ps_io)
+    {
+        for (unsigned int i = 0; i < NumPositions; i++, idx++) {
+            put_diff32(sample[idx], Previous[idx]);
+        }
+        for (unsigned int i = 0; i < NumVelocities; i++, idx++) {
+            put_varint(sample[idx] ^ Previous[idx]);
+        }
+        for (unsigned int i = 0; i < NumMotors; i++, idx++) {
+            put_diff16(sample[idx] >> 16, Previous[idx] >> 16);
+            put_diff16(sample[idx], Previous[idx]);
+        }
+        if (ps_io) {
+            uint32_t changed = 0;
+            for (unsigned int i = 0; i < NumPSIO; i++) {
+                if (sample[idx + i] != Previous[idx + i]) {
+                    changed |= (1u << i);
+                }
+            }
+            put_varint(changed);
+            for (unsigned int i = 0; i < NumPSIO; i++, idx++) {
+                if (changed & (1u << i)) {
+                    put_varint(sample[idx]);
+                }
+            }
+        }
+        for (unsigned int i = 0; i < NumPots; i++, idx++) {
+            put_diff32(sample[idx], Previous[idx]);
+        }
+    }
+
+public:
+    explicit SampleEncoder(const SampleFormat &format) :
+        Format(format), Quadlets(format.quadlets()),
+        NumPositions(format.num_positions()), NumVelocities(format.num_velocities()),
+        NumMotors(format.num_motor_channels()), NumPSIO(format.ps_io_quadlets()), NumPots(format.num_pots()),
+        MaxSampleBytes(max_delta_sample_bytes(format)), Packet(0), Capacity(0), Length(0), Count(0) {}
+
+    // starts a packet in buffer, of capacity bytes (at least 4 + quadlets() * 4)
+    void Begin(uint32_t *buffer, unsigned int capacity)
+    {
+        Packet = reinterpret_cast<uint8_t *>(buffer);
+        Capacity = capacity;
+        Length = 4;
+        Count = 0;
+    }
+
+    // true if the packet can hold another sample
+    bool HasRoom(void) const
+    {
+        return (Count == 0) || (Length + MaxSampleBytes <= Capacity && Count < 0xFFFF);
+    }
+
+    void Add(const uint32_t *sample)
+    {
+        if (Count == 0) {
+            memcpy(Packet + Length, sample, Quadlets * 4);
+            Length += Quadlets * 4;
+            PreviousTime = timestamp_steps(Format, sample);
+            PreviousStep = 0;
+        } else {
+            unsigned int idx = 2;
+
+            int64_t time = timestamp_steps(Format, sample);
+            put_signed((time - PreviousTime) - PreviousStep);
+            PreviousStep = time - PreviousTime;
+            PreviousTime = time;
+
+            put_channels(sample, idx, Format.ps_io);
+            if (Format.min_max) {
+                put_channels(sample, idx, false);
+                put_channels(sample, idx, false);
+            }
+        }
+
+        memcpy(Previous, sample, Quadlets * 4);
+        Count++;
+    }
+
+    // writes the header and returns the packet length in bytes
+    unsigned int End(void)
+    {
+        uint32_t header = (COMPRESSED_PACKET_TAG << 16) | Count;
+        memcpy(Packet, &header, sizeof(header));
+        return Length;
+    }
+
+    unsigned int SampleCount(void) const { return Count; }
+};
+
+class SampleDecoder {
+protected:
+    SampleFormat Format;
+    // sample size and channel counts of the format
+    unsigned int Quadlets, NumPositions, NumVelocities, NumMotors, NumPSIO, NumPots;
+    const uint8_t *Packet;
+    unsigned int Length;
+    unsigned int Offset;
+    unsigned int Remaining;
+    bool First;
+    uint32_t Previous[MAX_QUADLETS_PER_SAMPLE];
+    // timestamps, in the unit of timestamp_steps
+    int64_t PreviousTime;
+    int64_t PreviousStep;
+
+    bool get_varint(uint64_t &value)
+    {
+        value = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            if (Offset >= Length) {
+                return false;
+            }
+            uint8_t byte = Packet[Offset++];
+            value |= (uint64_t) (byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool get_signed(int64_t &value)
+    {
+        uint64_t zigzag;
+        if (!get_varint(zigzag)) {
+            return false;
+        }
+        value = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+        return true;
+    }
+
+    // decodes one value of each channel (and the digital I/O and MIO pins if ps_io),
+    // starting at sample[idx]
+    bool get_channels(uint32_t *sample, unsigned int &idx, bool ps_io)
+    {
+        int64_t value;
+        uint64_t bits;
+
+        for (unsigned int i = 0; i < NumPositions; i++, idx++) {
+            if (!get_signed(value)) {
+                return false;
+            }
+            sample[idx] = Previous[idx] + (uint32_t) value;
+        }
+        for (unsigned int i = 0; i < NumVelocities; i++, idx++) {
+            if (!get_varint(bits)) {
+                return false;
+            }
+            sample[idx] = Previous[idx] ^ (uint32_t) bits;
+        }
+        for (unsigned int i = 0; i < NumMotors; i++, idx++) {
+            int64_t high, low;
+            if (!get_signed(high) || !get_signed(low)) {
+                return false;
+            }
+            sample[idx] = ((uint32_t) (uint16_t) ((Previous[idx] >> 16) + high) << 16) |
+                          (uint16_t) (Previous[idx] + low);
+        }
+        if (ps_io) {
+            uint64_t changed;
+            if (!get_varint(changed)) {
+                return false;
+            }
+            for (unsigned int i = 0; i < NumPSIO; i++, idx++) {
+                sample[idx] = Previous[idx];
+                if (changed & (1u << i)) {
+                    if (!get_varint(bits)) {
+                        return false;
+                    }
+                    sample[idx] = (uint32_t) bits;
+                }
+            }
+        }
+        for (unsigned int i = 0; i < NumPots; i++, idx++) {
+            if (!get_signed(value)) {
+                return false;
+            }
+            sample[idx] = Previous[idx] + (uint32_t) value;
+        }
+        return true;
+    }
+
+public:
+    explicit SampleDecoder(const SampleFormat &format) :
+        Format(format), Quadlets(format.quadlets()),
+        NumPositions(format.num_positions()), NumVelocities(format.num_velocities()),
+        NumMotors(format.num_motor_channels()), NumPSIO(format.ps_io_quadlets()), NumPots(format.num_pots()),
+        Packet(0), Length(0), Offset(0), Remaining(0), First(true) {}
+
+    // starts decoding a compressed packet of length bytes; returns false if it is not one
+    bool Begin(const uint32_t *packet, int length)
+    {
+        if (!is_compressed_packet(packet, length) || Quadlets > MAX_QUADLETS_PER_SAMPLE) {
+            return false;
+        }
+        Packet = reinterpret_cast<const uint8_t *>(packet);
+        Length = (unsigned int) length;
+        Offset = 4;
+        Remaining = packet[0] & 0xFFFF;
+        First = true;
+        return true;
+    }
+
+    // decodes the next sample of the packet into sample (quadlets() quadlets);
+    // returns false at the end of the packet or if the packet is malformed
+    bool Next(uint32_t *sample)
+    {
+        if (Remaining == 0) {
+            return false;
+        }
+
+        if (First) {
+            if (Offset + Quadlets * 4 > Length) {
+                return false;
+            }
+            memcpy(sample, Packet + Offset, Quadlets * 4);
+            Offset += Quadlets * 4;
+
+            PreviousTime = timestamp_steps(Format, sample);
+            PreviousStep = 0;
+            First = false;
+        } else {
+            unsigned int idx = 2;
+            int64_t value;
+
+            if (!get_signed(value)) {
+                return false;
+            }
+            PreviousStep += value;
+            PreviousTime += PreviousStep;
+            set_timestamp_steps(Format, sample, PreviousTime);
+
+            if (!get_channels(sample, idx, Format.ps_io)) {
+                return false;
+            }
+            if (Format.min_max && !(get_channels(sample, idx, false) && get_channels(sample, idx, false))) {
+                return false;
+            }
+        }
+
+        memcpy(Previous, sample, Quadlets * 4);
+        Remaining--;
+        return true;
+    }
+};
+
+#endif
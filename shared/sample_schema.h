@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __SAMPLESCHEMA_H__
+#define __SAMPLESCHEMA_H__
+
+#include <stdint.h>
+
+// Self-describing layout of the samples, sent by the Zynq in DataCollectionMeta. Each
+// field is a run of values of one type in the (uncompressed) sample; the fields are
+// listed in the order of the CSV columns, which need not be the order of the quadlets
+// (e.g., both halves of the motor quadlets are separate fields). The host decodes the
+// samples from the schema only, so the Zynq can change the layout without a new host,
+// as long as it only uses the types and indices below; a host that does not know the
+// version of the schema refuses the session.
+const uint32_t SAMPLE_SCHEMA_VERSION = 1;
+const unsigned int MAX_SCHEMA_FIELDS = 24;
+
+enum SchemaFieldType {
+    SCHEMA_INT = 0,                     // signed integer (width 4)
+    SCHEMA_UINT,                        // unsigned integer (width 2 or 4)
+    SCHEMA_FLOAT,                       // IEEE float (width 4) or double (width 8)
+    SCHEMA_TICKS                        // uint64_t FPGA clock ticks (width 8), in seconds at
+                                        // DataCollectionMeta::timestamp_ticks_per_s
+};
+
+// what the values of a field are indexed by, which names their columns
+enum SchemaFieldIndex {
+    SCHEMA_INDEX_NONE = 0,              // a single value: <name><suffix>
+    SCHEMA_INDEX_ENCODER,               // encoder axes: [BOARD<id>_]<name>_<axis><suffix>
+    SCHEMA_INDEX_MOTOR,                 // motor axes, same names
+    SCHEMA_INDEX_BOARD                  // boards: [BOARD<id>_]<name><suffix>
+};
+
+struct SchemaField {
+    char name[16];                      // NUL terminated, e.g. "ENCODER_POS"
+    char suffix[8];                     // NUL terminated, e.g. "_MIN"
+    uint8_t type;                       // SchemaFieldType
+    uint8_t width;                      // bytes per value; 8-byte values take two quadlets,
+                                        // high quadlet first
+    uint8_t shift;                      // position of values narrower than a quadlet, in bits
+    uint8_t index;                      // SchemaFieldIndex
+    uint16_t count;                     // values
+    uint16_t offset;                    // quadlet of the first value
+    uint16_t stride;                    // quadlets from one value to the next
+    uint16_t reserved;
+    uint32_t axes;                      // SCHEMA_INDEX_ENCODER, SCHEMA_INDEX_MOTOR: bit i set for
+                                        // each axis i with a value, in increasing order
+};
+
+struct SampleSchema {
+    uint32_t version;                   // SAMPLE_SCHEMA_VERSION
+    uint32_t num_fields;
+    uint32_t quadlets;                  // sample size
+    uint32_t reserved;
+    SchemaField fields[MAX_SCHEMA_FIELDS];
+};
+
+#endif
@@ -0,0 +1,262 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __UDPFAULTINJECTION_H__
+#define __UDPFAULTINJECTION_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <deque>
+#include <mutex>
+#include <random>
+#include <vector>
+
+// Impairments of the received datagrams, to reproduce the faults of a real network
+// (e.g., with -I in both programs). They are applied where the datagrams are received,
+// so that each datagram of either direction goes through them once, whichever way it
+// was sent (e.g., the sendmmsg batches of the Zynq). Each datagram is, in this order:
+//   loss       dropped, with probability loss
+//   truncate   cut to a random shorter length, with probability truncate
+//   duplicate  delivered twice, with probability duplicate
+//   reorder    held until the next datagram has arrived, with probability reorder
+//   delay      held for delay_ms plus a uniform random jitter of up to jitter_ms
+//              (datagrams delayed differently are reordered too)
+// The draws come from a generator seeded with seed, so that a run can be reproduced
+// as long as the datagrams arrive the same way.
+struct UdpFaultConfig {
+    double loss = 0.0;
+    double truncate = 0.0;
+    double duplicate = 0.0;
+    double reorder = 0.0;
+    double delay_ms = 0.0;
+    double jitter_ms = 0.0;
+    uint64_t seed = 1;
+
+    bool enabled(void) const
+    {
+        return loss > 0.0 || truncate > 0.0 || duplicate > 0.0 || reorder > 0.0 || delay_ms > 0.0 || jitter_ms > 0.0;
+    }
+};
+
+// parses <name>=<value>[,<name>=<value>...] with the names loss, truncate, dup, reorder,
+// delay, jitter (ms) and seed, e.g. "loss=0.01,delay=2,jitter=1,seed=7"
+inline bool parse_udp_fault_config(const char *spec, UdpFaultConfig &config)
+{
+    const char *item = spec;
+    while (*item != '\0') {
+        const char *equal = strchr(item, '=');
+        if (equal == nullptr) {
+            return false;
+        }
+        char *end;
+        double value = strtod(equal + 1, &end);
+        if (end == equal + 1 || (*end != ',' && *end != '\0') || value < 0.0) {
+            return false;
+        }
+
+        const size_t length = equal - item;
+        const bool probability = value <= 1.0;
+        if (length == 4 && strncmp(item, "loss", 4) == 0 && probability) {
+            config.loss = value;
+        } else if (length == 8 && strncmp(item, "truncate", 8) == 0 && probability) {
+            config.truncate = value;
+        } else if (length == 3 && strncmp(item, "dup", 3) == 0 && probability) {
+            config.duplicate = value;
+        } else if (length == 7 && strncmp(item, "reorder", 7) == 0 && probability) {
+            config.reorder = value;
+        } else if (length == 5 && strncmp(item, "delay", 5) == 0) {
+            config.delay_ms = value;
+        } else if (length == 6 && strncmp(item, "jitter", 6) == 0) {
+            config.jitter_ms = value;
+        } else if (length == 4 && strncmp(item, "seed", 4) == 0) {
+            config.seed = (uint64_t) value;
+        } else {
+            return false;
+        }
+        item = (*end == ',') ? end + 1 : end;
+    }
+    return true;
+}
+
+class UdpFaultInjector {
+public:
+    struct Stats {
+        uint64_t Received = 0;
+        uint64_t Dropped = 0;
+        uint64_t Truncated = 0;
+        uint64_t Duplicated = 0;
+        uint64_t Reordered = 0;
+        uint64_t Delayed = 0;
+    };
+
+    void Configure(const UdpFaultConfig &config)
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Config = config;
+        Enabled = config.enabled();
+        Generator.seed(config.seed);
+        Held.clear();
+        Counts = Stats();
+    }
+
+    bool IsEnabled(void) const { return Enabled; }
+
+    Stats GetStats(void)
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        return Counts;
+    }
+
+    // impairs the datagram of length bytes just received in data. Returns the length to
+    // deliver now, or 0 if it is dropped or held (see Release)
+    int Receive(const void *data, int length)
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        const double now = Now();
+        Counts.Received++;
+
+        if (Draw(Config.loss)) {
+            Counts.Dropped++;
+            return 0;
+        }
+        if (length > 1 && Draw(Config.truncate)) {
+            length = 1 + (int) (Uniform() * (length - 1));
+            Counts.Truncated++;
+        }
+        const bool duplicate = Draw(Config.duplicate);
+        Counts.Duplicated += duplicate ? 1 : 0;
+
+        double due = now;
+        uint64_t after = 0;
+        if (Draw(Config.reorder)) {
+            // released once the next datagram arrived
+            after = Counts.Received + 1;
+            Counts.Reordered++;
+        }
+        if (Config.delay_ms > 0.0 || Config.jitter_ms > 0.0) {
+            due += (Config.delay_ms + Uniform() * Config.jitter_ms) * 1e-3;
+            Counts.Delayed++;
+        }
+
+        if (after == 0 && due == now) {
+            if (duplicate) {
+                Hold(data, length, now, 0);
+            }
+            return length;
+        }
+        // the duplicate follows the datagram
+        Hold(data, length, due, after);
+        if (duplicate) {
+            Hold(data, length, due, after);
+        }
+        return 0;
+    }
+
+    // copies a held datagram that is due into data (truncated to size bytes); returns its
+    // length, or 0 if none is due
+    int Release(void *data, int size)
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if (Held.empty()) {
+            return 0;
+        }
+
+        const double now = Now();
+        size_t due = Held.size();
+        for (size_t i = 0; i < Held.size(); i++) {
+            if (Held[i].Due <= now && Held[i].After <= Counts.Received &&
+                (due == Held.size() || Held[i].Due < Held[due].Due)) {
+                due = i;
+            }
+        }
+        if (due == Held.size()) {
+            return 0;
+        }
+
+        int length = (int) Held[due].Data.size();
+        if (length > size) {
+            length = size;
+        }
+        memcpy(data, Held[due].Data.data(), length);
+        Held.erase(Held.begin() + due);
+        return length;
+    }
+
+    // ms until the next delayed datagram is due, -1 if none is waiting for a time
+    int NextDueMs(void)
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        double next = -1.0;
+        for (size_t i = 0; i < Held.size(); i++) {
+            if (Held[i].After <= Counts.Received && (next < 0.0 || Held[i].Due < next)) {
+                next = Held[i].Due;
+            }
+        }
+        if (next < 0.0) {
+            return -1;
+        }
+        const double ms = (next - Now()) * 1e3;
+        return (ms > 0.0) ? (int) ms + 1 : 0;
+    }
+
+protected:
+    // datagrams held beyond this are delivered right away
+    static const size_t MaxHeld = 4096;
+
+    struct HeldDatagram {
+        std::vector<uint8_t> Data;
+        double Due;                 // CLOCK_MONOTONIC, s
+        uint64_t After;             // released once Received reaches it (0: any time)
+    };
+
+    UdpFaultConfig Config;
+    bool Enabled = false;
+    std::mt19937_64 Generator;
+    std::deque<HeldDatagram> Held;
+    Stats Counts;
+    std::mutex Mutex;
+
+    static double Now(void)
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec * 1e-9;
+    }
+
+    // uniform in [0, 1), the same for a seed on every platform
+    double Uniform(void) { return (Generator() >> 11) * (1.0 / 9007199254740992.0); }
+
+    bool Draw(double probability) { return probability > 0.0 && Uniform() < probability; }
+
+    void Hold(const void *data, int length, double due, uint64_t after)
+    {
+        if (Held.size() >= MaxHeld) {
+            Held.front().Due = 0.0;
+            Held.front().After = 0;
+        }
+        HeldDatagram held;
+        held.Data.assign((const uint8_t *) data, (const uint8_t *) data + length);
+        held.Due = due;
+        held.After = after;
+        Held.push_back(held);
+    }
+};
+
+#endif
@@ -0,0 +1,112 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __BOARDACCESS_H__
+#define __BOARDACCESS_H__
+
+#include <stdint.h>
+
+// Board access used by the data collection state machine. Covers exactly what is
+// needed to sample the boards of the port, so that the Zynq program can also run
+// against simulated boards (e.g., on an x86 Linux host).
+//
+// Axes of all boards are numbered in board order: the encoder and motor indices
+// of the Get methods go from 0 to GetNumEncoders() - 1 (GetNumMotors() - 1) over
+// all boards.
+class BoardAccess {
+protected:
+    bool QuadletCommandedCurrent;
+
+public:
+    BoardAccess() : QuadletCommandedCurrent(false) {}
+    virtual ~BoardAccess() {}
+
+    // Reads the real-time blocks of all boards (one bus transaction); the
+    // Get methods below return values from the last read
+    virtual bool ReadAllBoards(void) = 0;
+    // true if the last read is valid for every board
+    virtual bool ValidRead(void) const = 0;
+
+    virtual unsigned int GetNumBoards(void) const = 0;
+    virtual uint8_t GetBoardId(unsigned int board) const = 0;
+    virtual uint32_t GetHardwareVersion(unsigned int board) const = 0;
+    virtual unsigned int GetBoardNumEncoders(unsigned int board) const = 0;
+    virtual unsigned int GetBoardNumMotors(unsigned int board) const = 0;
+
+    // over all boards
+    virtual unsigned int GetNumEncoders(void) const = 0;
+    virtual unsigned int GetNumMotors(void) const = 0;
+
+    virtual int32_t GetEncoderPosition(unsigned int index) const = 0;
+    virtual int32_t GetEncoderMidRange(void) const = 0;
+    virtual double GetEncoderVelocityPredicted(unsigned int index) const = 0;
+    virtual uint32_t GetMotorCurrent(unsigned int index) const = 0;
+    virtual uint32_t GetDigitalIO(unsigned int board) const = 0;
+    virtual uint32_t GetAnalogInput(unsigned int index) const = 0;
+
+    // FPGA timestamp counter of the first board: clock ticks between the last read and
+    // the one before (the counter restarts at each read of the real-time block)
+    virtual uint32_t GetTimestamp(void) const = 0;
+    // of the timestamp counter, in seconds
+    virtual double GetFPGAClockPeriod(void) const = 0;
+
+    // Gets the commanded currents of the first count motors. Taken from the
+    // last ReadAllBoards if the boards provide them there, otherwise (or if
+    // SetQuadletCommandedCurrent was called) read with one bus transaction per motor.
+    virtual bool ReadCommandedCurrents(uint32_t *values, unsigned int count) = 0;
+
+    // Forces one bus transaction per motor for the commanded currents
+    void SetQuadletCommandedCurrent(bool enable) { QuadletCommandedCurrent = enable; }
+
+    // Reads the PS MIO pins of the Zynq
+    virtual uint8_t ReadMIOPins(void) = 0;
+};
+
+// Settings of the simulated boards
+struct SimulatedBoardConfig {
+    // identical boards, with board ids 0 to num_boards - 1
+    unsigned int num_boards;
+    // of each board
+    uint32_t hwvers;
+    unsigned int num_encoders;
+    unsigned int num_motors;
+    // time taken by each bus transaction (ReadAllBoards, ReadCommandedCurrents per motor)
+    unsigned int read_latency_us;
+};
+
+// Simulated boards that generate synthetic data (see board_access_sim.cpp)
+BoardAccess *CreateSimulatedBoard(const SimulatedBoardConfig &config);
+
+// Settings of the boards that replay a capture
+struct ReplayBoardConfig {
+    // capture CSV written by the host program
+    const char *filename;
+    // of the timestamps of the file: 1 for the original timing, 0 for as fast as possible
+    double speed;
+};
+
+// Boards that replay the samples of a capture (see board_access_replay.cpp). Returns
+// nullptr if the file cannot be read.
+BoardAccess *CreateReplayBoard(const ReplayBoardConfig &config);
+
+#ifdef DC_HAS_AMP1394
+// Boards of the default Amp1394 port, with MIO pins read via /dev/mem
+// (see board_access_amp1394.cpp). Returns nullptr on failure.
+BoardAccess *CreateAmp1394Board(void);
+#endif
+
+#endif
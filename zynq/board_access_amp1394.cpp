@@ -0,0 +1,246 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+// stdlibs
+#include <iostream>
+#include <string>
+#include <vector>
+
+// mmap mio pins
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// dvrk libs
+#include "BasePort.h"
+#include "PortFactory.h"
+#include "ZynqEmioPort.h"
+#include "AmpIO.h"
+
+#include "board_access.h"
+#include "data_collection_shared.h"
+
+using namespace std;
+
+// defines and variables for MIO Memory mapping for reading MIO pins
+const uint32_t GPIO_BASE_ADDR = 0xE000A000;
+const unsigned int GPIO_BANK1_OFFSET = 0x8;
+const uint32_t SCLR_CLK_BASE_ADDR = 0xF8000000;
+
+static volatile uint32_t *mio_mmap_init()
+{
+    int mem_fd;
+
+    // Open /dev/mem for accessing physical memory
+    if ((mem_fd = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
+        cout << "Failed to open /dev/mem" << endl;
+        return NULL;
+    }
+
+    void *gpio_mmap = mmap(
+        NULL,
+        0x1000,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        mem_fd,
+        GPIO_BASE_ADDR
+    );
+
+    if (gpio_mmap == MAP_FAILED) {
+        perror("Failed to mmap");
+        close(mem_fd);  // Always close the file descriptor on failure
+        return NULL;
+    }
+
+    // Following code ensures that APER_CLK is enabled; should not be necessary
+    // since fpgav3_emio_mmap also does this.
+    void *clk_map = mmap(
+        NULL,
+        0x00000130,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        mem_fd,
+        SCLR_CLK_BASE_ADDR
+    );
+
+    volatile unsigned long *clock_map = (volatile unsigned long *)clk_map;
+
+    uint32_t bitmsk = (1 << 22);
+    uint32_t aper_clk_reg = clock_map[0x12C/4];
+
+    if ((aper_clk_reg & bitmsk) == 0) {
+        clock_map[0x12C/4] |= bitmsk;
+    }
+
+    munmap(clk_map, 0x00000130);
+    // End of APER_CLK check
+
+    close(mem_fd);
+
+    return (volatile uint32_t * ) gpio_mmap;
+}
+
+// Boards of the port, read together by Port->ReadAllBoards. Each axis maps to its
+// board and to its index on that board.
+class Amp1394Board : public BoardAccess {
+protected:
+    BasePort *Port;
+    vector<AmpIO *> Boards;
+    unsigned int NumEncoders;
+    unsigned int NumMotors;
+    uint8_t EncoderBoard[MAX_NUM_ENCODERS];
+    uint8_t EncoderIndex[MAX_NUM_ENCODERS];
+    uint8_t MotorBoard[MAX_NUM_MOTORS];
+    uint8_t MotorIndex[MAX_NUM_MOTORS];
+    volatile uint32_t *GPIO_MEM_REGION;
+
+    const AmpIO *EncoderAmpIO(unsigned int index) const { return Boards[EncoderBoard[index]]; }
+    const AmpIO *MotorAmpIO(unsigned int index) const { return Boards[MotorBoard[index]]; }
+
+public:
+    Amp1394Board(BasePort *port, const vector<AmpIO *> &boards, volatile uint32_t *gpio) :
+        Port(port), Boards(boards), NumEncoders(0), NumMotors(0), GPIO_MEM_REGION(gpio)
+    {
+        for (size_t b = 0; b < Boards.size(); b++) {
+            for (unsigned int i = 0; i < Boards[b]->GetNumEncoders(); i++, NumEncoders++) {
+                EncoderBoard[NumEncoders] = (uint8_t) b;
+                EncoderIndex[NumEncoders] = (uint8_t) i;
+            }
+            for (unsigned int i = 0; i < Boards[b]->GetNumMotors(); i++, NumMotors++) {
+                MotorBoard[NumMotors] = (uint8_t) b;
+                MotorIndex[NumMotors] = (uint8_t) i;
+            }
+        }
+    }
+
+    bool ReadAllBoards(void) { return Port->ReadAllBoards(); }
+
+    bool ValidRead(void) const
+    {
+        for (size_t b = 0; b < Boards.size(); b++) {
+            if (!Boards[b]->ValidRead()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    unsigned int GetNumBoards(void) const { return (unsigned int) Boards.size(); }
+    uint8_t GetBoardId(unsigned int board) const { return Boards[board]->GetBoardId(); }
+    uint32_t GetHardwareVersion(unsigned int board) const { return Boards[board]->GetHardwareVersion(); }
+    unsigned int GetBoardNumEncoders(unsigned int board) const { return Boards[board]->GetNumEncoders(); }
+    unsigned int GetBoardNumMotors(unsigned int board) const { return Boards[board]->GetNumMotors(); }
+
+    unsigned int GetNumEncoders(void) const { return NumEncoders; }
+    unsigned int GetNumMotors(void) const { return NumMotors; }
+
+    int32_t GetEncoderPosition(unsigned int index) const { return EncoderAmpIO(index)->GetEncoderPosition(EncoderIndex[index]); }
+    int32_t GetEncoderMidRange(void) const { return Boards[0]->GetEncoderMidRange(); }
+    double GetEncoderVelocityPredicted(unsigned int index) const { return EncoderAmpIO(index)->GetEncoderVelocityPredicted(EncoderIndex[index]); }
+    uint32_t GetMotorCurrent(unsigned int index) const { return MotorAmpIO(index)->GetMotorCurrent(MotorIndex[index]); }
+    // digital I/O from the real-time block (ReadDigitalIO would be an extra bus transaction)
+    uint32_t GetDigitalIO(unsigned int board) const { return Boards[board]->GetDigitalInput(); }
+    // one pot per encoder
+    uint32_t GetAnalogInput(unsigned int index) const { return EncoderAmpIO(index)->GetAnalogInput(EncoderIndex[index]); }
+
+    // the boards are read in the same transaction, so the first one times all of them
+    uint32_t GetTimestamp(void) const { return Boards[0]->GetTimestamp(); }
+    double GetFPGAClockPeriod(void) const { return Boards[0]->GetFPGAClockPeriod(); }
+
+    bool ReadCommandedCurrents(uint32_t *values, unsigned int count)
+    {
+        bool ok = true;
+        for (unsigned int i = 0; i < count; i++) {
+            AmpIO *board = Boards[MotorBoard[i]];
+            // Firmware Rev 8+ includes the commanded current (lower 16 bits) in the
+            // motor status quadlets of the real-time block read by ReadAllBoards
+            if (!QuadletCommandedCurrent && board->GetFirmwareVersion() >= 8) {
+                values[i] = board->GetMotorStatus(MotorIndex[i]) & 0x0000FFFF;
+            } else {
+                // otherwise, read the DAC register of the channel
+                ok &= Port->ReadQuadlet(board->GetBoardId(), ((MotorIndex[i]+1) << 4) | 1, values[i]);
+            }
+        }
+        return ok;
+    }
+
+    uint8_t ReadMIOPins(void)
+    {
+        if (GPIO_MEM_REGION == NULL) {
+            cout << "[ERROR] MIO mmap region initialized incorrectly!" << endl;
+            return 0;
+        }
+
+        const uint16_t MIO_PINS_MSK = 0x3C;
+        uint32_t gpio_bank1 = GPIO_MEM_REGION[GPIO_BANK1_OFFSET/4];
+
+        return (gpio_bank1 & MIO_PINS_MSK) >> 2;
+    }
+};
+
+BoardAccess *CreateAmp1394Board(void)
+{
+    string portDescription = BasePort::DefaultPort();
+    BasePort *Port = PortFactory(portDescription.c_str());
+
+    if (!Port->IsOK()) {
+        std::cerr << "Failed to initialize " << Port->GetPortTypeString() << std::endl;
+        return nullptr;
+    }
+
+    if (Port->GetNumOfNodes() == 0) {
+        std::cerr << "Failed to find any boards" << std::endl;
+        return nullptr;
+    }
+
+    ZynqEmioPort *EmioPort = dynamic_cast<ZynqEmioPort *>(Port);
+    if (EmioPort) {
+        cout << "Verbose: " << EmioPort->GetVerbose() << std::endl;
+        // EmioPort->SetVerbose(true);
+        EmioPort->SetTimeout_us(80);
+    }
+    else {
+      cout << "[warning] failed to dynamic cast to ZynqEmioPort" << endl;
+    }
+
+    // all boards of the port, up to the sample limits; they are read with one
+    // ReadAllBoards, like a single board
+    vector<AmpIO *> Boards;
+    unsigned int num_encoders = 0;
+    unsigned int num_motors = 0;
+    for (unsigned int i = 0; i < Port->GetNumOfNodes(); i++) {
+        AmpIO *Board = new AmpIO(Port->GetBoardId(i));
+        Port->AddBoard(Board);
+
+        if (Boards.size() == MAX_NUM_BOARDS ||
+            num_encoders + Board->GetNumEncoders() > MAX_NUM_ENCODERS ||
+            num_motors + Board->GetNumMotors() > MAX_NUM_MOTORS) {
+            cout << "[warning] too many axes, not sampling board " << (unsigned int) Board->GetBoardId() << endl;
+            continue;
+        }
+        num_encoders += Board->GetNumEncoders();
+        num_motors += Board->GetNumMotors();
+        Boards.push_back(Board);
+    }
+
+    // on failure, MIO pins cannot be read but data collection can proceed
+    volatile uint32_t *gpio = mio_mmap_init();
+
+    return new Amp1394Board(Port, Boards, gpio);
+}
@@ -0,0 +1,452 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "board_access.h"
+#include "data_collection_shared.h"
+
+using namespace std;
+
+// Boards that replay a capture CSV written by the host program. Each ReadAllBoards
+// call returns the next row, so the samples go through the packers (and compression,
+// oversampling, etc.) exactly as board reads would. The values of the columns are the
+// ones the packers produce from the board (e.g., the encoder position quadlet with its
+// midrange), so that a replayed capture gives back the same CSV. Channels without a
+// column (e.g., a capture with a channel selection) read 0; the _MIN and _MAX columns
+// of oversampled captures are ignored. The file wraps around at its end.
+//
+// ReadAllBoards waits until the time of the row, from the first read, following the
+// TIMESTAMP column divided by the speed (speed 0: no wait, as fast as the reads come).
+// If a read comes more than ResyncSeconds late (e.g., the first read of the next
+// capture), the pacing restarts from it. The FPGA timestamp counter gives the time
+// steps of the TIMESTAMP column (not scaled by the speed).
+class ReplayBoard : public BoardAccess {
+protected:
+    static const double ResyncSeconds;
+    static const double ClockPeriod;
+
+    struct Board {
+        uint8_t id;
+        unsigned int num_encoders;
+        unsigned int num_motors;
+    };
+
+    // where the value of each channel is in a row, -1 for none
+    struct Channels {
+        vector<int> encoder_position;
+        vector<int> encoder_velocity;
+        vector<int> motor_current;
+        vector<int> motor_status;
+        vector<int> pot;
+        vector<int> digital_io;
+        int mio_pins;
+    };
+
+    ReplayBoardConfig Config;
+    vector<Board> Boards;
+    unsigned int NumEncoders;
+    unsigned int NumMotors;
+    Channels Columns;
+
+    // rows of the file, RowQuadlets values each (float bits for velocities), from the
+    // ValueColumns of the file
+    vector<double> Timestamps;
+    vector<uint32_t> Values;
+    unsigned int RowQuadlets;
+    vector<int> ValueColumns;
+    vector<bool> FloatColumns;
+
+    // row of the last read, and rows read since the file was loaded
+    size_t Row;
+    uint64_t RowsRead;
+    double Span;
+    double Period;
+    timespec PacingStart;
+    double PacingOrigin;
+    // FPGA clock ticks from the first row to the row of the last read, and since the read before
+    uint64_t RowTicks;
+    uint32_t TimestampTicks;
+
+    uint32_t Value(int column) const
+    {
+        return (column >= 0) ? Values[Row * RowQuadlets + column] : 0;
+    }
+
+    // time of the row in the timestamps of the file, counting the times it wrapped around
+    double RowTime(void) const
+    {
+        return Timestamps[Row] + Span * (double) (RowsRead / Timestamps.size());
+    }
+
+    void WaitForRow(void)
+    {
+        if (Config.speed <= 0.0) {
+            return;
+        }
+
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - PacingStart.tv_sec) + (now.tv_nsec - PacingStart.tv_nsec) * 1e-9;
+        double due = (RowTime() - PacingOrigin) / Config.speed;
+
+        if (RowsRead == 0 || elapsed - due > ResyncSeconds) {
+            PacingStart = now;
+            PacingOrigin = RowTime();
+            return;
+        }
+        if (due <= elapsed) {
+            return;
+        }
+
+        double wake_s = PacingStart.tv_sec + PacingStart.tv_nsec * 1e-9 + due;
+        timespec wake;
+        wake.tv_sec = (time_t) wake_s;
+        wake.tv_nsec = (long) ((wake_s - (double) wake.tv_sec) * 1e9);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, nullptr) == EINTR) {
+        }
+    }
+
+    static vector<string> SplitLine(const string &line)
+    {
+        vector<string> fields;
+        size_t start = 0;
+        while (true) {
+            size_t end = line.find(',', start);
+            fields.push_back(line.substr(start, (end == string::npos) ? string::npos : end - start));
+            if (end == string::npos) {
+                break;
+            }
+            start = end + 1;
+        }
+        if (!fields.empty() && !fields.back().empty() && fields.back().back() == '\r') {
+            fields.back().pop_back();
+        }
+        return fields;
+    }
+
+    // splits a column name into board id, channel name and axis (1-based, 0 for none);
+    // returns false for the _MIN and _MAX columns
+    static bool ParseColumn(const string &column, int &board_id, string &name, unsigned int &axis)
+    {
+        string rest = column;
+        board_id = -1;
+        if (rest.compare(0, 5, "BOARD") == 0) {
+            size_t end = rest.find('_');
+            if (end == string::npos) {
+                return false;
+            }
+            board_id = atoi(rest.substr(5, end - 5).c_str());
+            rest = rest.substr(end + 1);
+        }
+        if (rest.size() > 4 && (rest.compare(rest.size() - 4, 4, "_MIN") == 0 || rest.compare(rest.size() - 4, 4, "_MAX") == 0)) {
+            return false;
+        }
+
+        size_t end = rest.find_last_of('_');
+        axis = 0;
+        if (end != string::npos && end + 1 < rest.size() && strspn(rest.c_str() + end + 1, "0123456789") == rest.size() - end - 1) {
+            axis = (unsigned int) atoi(rest.c_str() + end + 1);
+            rest = rest.substr(0, end);
+        }
+        name = rest;
+        return true;
+    }
+
+    Board &FindBoard(int board_id)
+    {
+        uint8_t id = (board_id >= 0) ? (uint8_t) board_id : 0;
+        for (size_t b = 0; b < Boards.size(); b++) {
+            if (Boards[b].id == id) {
+                return Boards[b];
+            }
+        }
+        Board board = {id, 0, 0};
+        Boards.push_back(board);
+        return Boards.back();
+    }
+
+    // assigns the columns of the header to the channels, numbering the axes over all boards
+    bool ParseHeader(const vector<string> &header, int &timestamp_column)
+    {
+        struct Parsed {
+            int board_id;
+            string name;
+            unsigned int axis;
+        };
+        vector<Parsed> parsed(header.size());
+        timestamp_column = -1;
+
+        for (size_t c = 0; c < header.size(); c++) {
+            Parsed &p = parsed[c];
+            if (!ParseColumn(header[c], p.board_id, p.name, p.axis)) {
+                p.name.clear();
+                continue;
+            }
+            if (p.name == "TIMESTAMP") {
+                timestamp_column = (int) c;
+            } else if (p.name == "ENCODER_POS" || p.name == "ENCODER_VEL" || p.name == "POT") {
+                Board &board = FindBoard(p.board_id);
+                board.num_encoders = max(board.num_encoders, p.axis);
+            } else if (p.name == "MOTOR_CURRENT" || p.name == "MOTOR_STATUS") {
+                Board &board = FindBoard(p.board_id);
+                board.num_motors = max(board.num_motors, p.axis);
+            } else if (p.name == "DIGITAL_IO") {
+                FindBoard(p.board_id);
+            }
+        }
+
+        if (timestamp_column < 0) {
+            cout << "[ERROR] no TIMESTAMP column in " << Config.filename << endl;
+            return false;
+        }
+        if (Boards.empty()) {
+            FindBoard(-1);
+        }
+        if (Boards.size() > MAX_NUM_BOARDS) {
+            cout << "[ERROR] more than " << MAX_NUM_BOARDS << " boards in " << Config.filename << endl;
+            return false;
+        }
+
+        // first axis of each board over all boards
+        vector<unsigned int> first_encoder(Boards.size()), first_motor(Boards.size());
+        NumEncoders = NumMotors = 0;
+        for (size_t b = 0; b < Boards.size(); b++) {
+            first_encoder[b] = NumEncoders;
+            first_motor[b] = NumMotors;
+            NumEncoders += Boards[b].num_encoders;
+            NumMotors += Boards[b].num_motors;
+        }
+        if (NumEncoders > MAX_NUM_ENCODERS || NumMotors > MAX_NUM_MOTORS) {
+            cout << "[ERROR] more than " << MAX_NUM_ENCODERS << " encoders or " << MAX_NUM_MOTORS
+                 << " motors in " << Config.filename << endl;
+            return false;
+        }
+
+        Columns.encoder_position.assign(NumEncoders, -1);
+        Columns.encoder_velocity.assign(NumEncoders, -1);
+        Columns.pot.assign(NumEncoders, -1);
+        Columns.motor_current.assign(NumMotors, -1);
+        Columns.motor_status.assign(NumMotors, -1);
+        Columns.digital_io.assign(Boards.size(), -1);
+        Columns.mio_pins = -1;
+
+        // the values of a row are kept in the order of the columns, without the timestamp
+        RowQuadlets = 0;
+        for (size_t c = 0; c < header.size(); c++) {
+            const Parsed &p = parsed[c];
+            if (p.name.empty() || (int) c == timestamp_column) {
+                continue;
+            }
+            size_t b = &FindBoard(p.board_id) - &Boards[0];
+            vector<int> *channel = nullptr;
+            unsigned int axis = 0;
+            if (p.name == "ENCODER_POS") {
+                channel = &Columns.encoder_position;
+                axis = first_encoder[b] + p.axis - 1;
+            } else if (p.name == "ENCODER_VEL") {
+                channel = &Columns.encoder_velocity;
+                axis = first_encoder[b] + p.axis - 1;
+            } else if (p.name == "POT") {
+                channel = &Columns.pot;
+                axis = first_encoder[b] + p.axis - 1;
+            } else if (p.name == "MOTOR_CURRENT") {
+                channel = &Columns.motor_current;
+                axis = first_motor[b] + p.axis - 1;
+            } else if (p.name == "MOTOR_STATUS") {
+                channel = &Columns.motor_status;
+                axis = first_motor[b] + p.axis - 1;
+            } else if (p.name == "DIGITAL_IO") {
+                channel = &Columns.digital_io;
+                axis = (unsigned int) b;
+            } else if (p.name == "MIO_PINS") {
+                Columns.mio_pins = (int) RowQuadlets;
+            } else {
+                cout << "[warning] column " << header[c] << " is not replayed" << endl;
+                continue;
+            }
+            if (channel != nullptr) {
+                if ((p.axis == 0 && channel != &Columns.digital_io) || axis >= channel->size()) {
+                    cout << "[warning] column " << header[c] << " is not replayed" << endl;
+                    continue;
+                }
+                (*channel)[axis] = (int) RowQuadlets;
+            }
+            ValueColumns.push_back((int) c);
+            FloatColumns.push_back(p.name == "ENCODER_VEL");
+            RowQuadlets++;
+        }
+        return true;
+    }
+
+public:
+    ReplayBoard(const ReplayBoardConfig &config) : Config(config), NumEncoders(0), NumMotors(0), RowQuadlets(0), Row(0),
+                                                   RowsRead(0), Span(0.0), Period(0.0), PacingOrigin(0.0), RowTicks(0),
+                                                   TimestampTicks(0)
+    {
+        PacingStart.tv_sec = 0;
+        PacingStart.tv_nsec = 0;
+    }
+
+    // reads the whole file; false if it is not a capture
+    bool Load(void)
+    {
+        ifstream file(Config.filename);
+        if (!file) {
+            cout << "[ERROR] could not open " << Config.filename << endl;
+            return false;
+        }
+
+        string line;
+        if (!getline(file, line)) {
+            cout << "[ERROR] " << Config.filename << " is empty" << endl;
+            return false;
+        }
+        int timestamp_column;
+        if (!ParseHeader(SplitLine(line), timestamp_column)) {
+            return false;
+        }
+
+        size_t line_number = 1;
+        while (getline(file, line)) {
+            line_number++;
+            if (line.empty() || line == "\r") {
+                continue;
+            }
+            vector<string> fields = SplitLine(line);
+            if ((int) fields.size() <= timestamp_column) {
+                cout << "[ERROR] line " << line_number << " of " << Config.filename << " is too short" << endl;
+                return false;
+            }
+            Timestamps.push_back(strtod(fields[timestamp_column].c_str(), nullptr));
+            for (size_t q = 0; q < ValueColumns.size(); q++) {
+                const char *field = ((size_t) ValueColumns[q] < fields.size()) ? fields[ValueColumns[q]].c_str() : "0";
+                uint32_t value;
+                if (FloatColumns[q]) {
+                    float velocity = strtof(field, nullptr);
+                    memcpy(&value, &velocity, sizeof(value));
+                } else {
+                    // signed (encoder positions, as the quadlet) or unsigned columns
+                    value = (uint32_t) strtoll(field, nullptr, 10);
+                }
+                Values.push_back(value);
+            }
+        }
+
+        if (Timestamps.empty()) {
+            cout << "[ERROR] no samples in " << Config.filename << endl;
+            return false;
+        }
+
+        // the file wraps around one mean period after its last row
+        Period = (Timestamps.size() > 1) ? (Timestamps.back() - Timestamps.front()) / (double) (Timestamps.size() - 1) : 0.001;
+        Span = Timestamps.back() - Timestamps.front() + Period;
+        Row = Timestamps.size() - 1;
+
+        cout << "Replaying " << Timestamps.size() << " samples of " << Config.filename << " (" << Boards.size() << " board(s), "
+             << NumEncoders << " encoders, " << NumMotors << " motors, "
+             << ((Period > 0.0) ? 1.0 / Period : 0.0) << " Hz) ";
+        if (Config.speed > 0.0) {
+            cout << "at " << Config.speed << "x speed" << endl;
+        } else {
+            cout << "as fast as possible" << endl;
+        }
+        return true;
+    }
+
+    bool ReadAllBoards(void)
+    {
+        Row = (Row + 1) % Timestamps.size();
+        // from the time of the row, so that the rounding does not add up
+        uint64_t ticks = (uint64_t) llround(max(RowTime() - Timestamps.front(), 0.0) / ClockPeriod);
+        TimestampTicks = (ticks > RowTicks) ? (uint32_t) (ticks - RowTicks) : 0;
+        RowTicks = max(ticks, RowTicks);
+
+        WaitForRow();
+        RowsRead++;
+        return true;
+    }
+
+    bool ValidRead(void) const { return true; }
+
+    unsigned int GetNumBoards(void) const { return (unsigned int) Boards.size(); }
+    uint8_t GetBoardId(unsigned int board) const { return Boards[board].id; }
+    uint32_t GetHardwareVersion(unsigned int board) const
+    {
+        // the layout of the known boards, QLA1 otherwise
+        if (Boards[board].num_encoders == 7 && Boards[board].num_motors == 10) {
+            return 0x64524131;
+        } else if (Boards[board].num_encoders == 8 && Boards[board].num_motors == 8) {
+            return 0x44514C41;
+        }
+        return 0x514C4131;
+    }
+    unsigned int GetBoardNumEncoders(unsigned int board) const { return Boards[board].num_encoders; }
+    unsigned int GetBoardNumMotors(unsigned int board) const { return Boards[board].num_motors; }
+
+    unsigned int GetNumEncoders(void) const { return NumEncoders; }
+    unsigned int GetNumMotors(void) const { return NumMotors; }
+
+    int32_t GetEncoderPosition(unsigned int index) const { return (int32_t) Value(Columns.encoder_position[index]) - GetEncoderMidRange(); }
+    int32_t GetEncoderMidRange(void) const { return 0x800000; }
+    double GetEncoderVelocityPredicted(unsigned int index) const
+    {
+        float velocity;
+        uint32_t bits = Value(Columns.encoder_velocity[index]);
+        memcpy(&velocity, &bits, sizeof(velocity));
+        return velocity;
+    }
+    uint32_t GetMotorCurrent(unsigned int index) const { return Value(Columns.motor_current[index]) & 0xFFFF; }
+    uint32_t GetDigitalIO(unsigned int board) const { return Value(Columns.digital_io[board]); }
+    uint32_t GetAnalogInput(unsigned int index) const { return Value(Columns.pot[index]); }
+
+    uint32_t GetTimestamp(void) const { return TimestampTicks; }
+    double GetFPGAClockPeriod(void) const { return ClockPeriod; }
+
+    bool ReadCommandedCurrents(uint32_t *values, unsigned int count)
+    {
+        for (unsigned int i = 0; i < count; i++) {
+            values[i] = Value(Columns.motor_status[i]) & 0xFFFF;
+        }
+        return true;
+    }
+
+    uint8_t ReadMIOPins(void) { return (uint8_t) Value(Columns.mio_pins); }
+};
+
+const double ReplayBoard::ResyncSeconds = 0.1;
+const double ReplayBoard::ClockPeriod = 1.0 / 49.152e6;
+
+BoardAccess *CreateReplayBoard(const ReplayBoardConfig &config)
+{
+    ReplayBoard *board = new ReplayBoard(config);
+    if (!board->Load()) {
+        delete board;
+        return nullptr;
+    }
+    return board;
+}
@@ -0,0 +1,128 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <math.h>
+#include <time.h>
+
+#include "board_access.h"
+#include "data_collection_shared.h"
+
+// Simulated boards. Each ReadAllBoards call advances a sample counter from which
+// deterministic signals are generated (encoder ramps, sinusoidal currents) for the
+// axes of all boards, and every bus transaction busy-waits for read_latency_us like
+// an EMIO transaction (ReadAllBoards reads all boards in one transaction).
+// Like firmware Rev 8+, the commanded currents come with ReadAllBoards unless
+// SetQuadletCommandedCurrent is used. As with AmpIO, the signals are computed
+// by ReadAllBoards and the Get methods only return them. The FPGA timestamp counter
+// runs at the 49.152 MHz clock of the boards, from the Zynq clock.
+class SimulatedBoard : public BoardAccess {
+protected:
+    SimulatedBoardConfig Config;
+    uint32_t ReadCount;
+    // FPGA clock ticks at the last two reads
+    uint64_t ReadTicks;
+    uint64_t PreviousReadTicks;
+    uint32_t MotorCurrent[MAX_NUM_MOTORS];
+    uint32_t CommandedCurrent[MAX_NUM_MOTORS];
+
+    void BusTransaction(void) const
+    {
+        if (Config.read_latency_us == 0) {
+            return;
+        }
+
+        timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        long latency_ns = (long) Config.read_latency_us * 1000L;
+        do {
+            clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        } while ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) < latency_ns);
+    }
+
+    // 16-bit current signal (midrange 0x8000) of a motor
+    uint32_t Current(unsigned int index, double phase) const
+    {
+        return (uint32_t) (0x8000 + 1000.0 * sin(ReadCount * 0.001 * (index + 1) + phase)) & 0xFFFF;
+    }
+
+    static uint64_t ClockTicks(void)
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        uint64_t ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+        // 6144 ticks per 125 us, without overflowing
+        return ns / 125000 * 6144 + (ns % 125000) * 6144 / 125000;
+    }
+
+public:
+    SimulatedBoard(const SimulatedBoardConfig &config) : Config(config), ReadCount(0)
+    {
+        ReadTicks = PreviousReadTicks = ClockTicks();
+    }
+
+    bool ReadAllBoards(void)
+    {
+        BusTransaction();
+        ReadCount++;
+        PreviousReadTicks = ReadTicks;
+        ReadTicks = ClockTicks();
+        for (unsigned int i = 0; i < GetNumMotors(); i++) {
+            MotorCurrent[i] = Current(i, 0.0);
+            CommandedCurrent[i] = Current(i, 0.1);
+        }
+        return true;
+    }
+
+    bool ValidRead(void) const { return true; }
+
+    unsigned int GetNumBoards(void) const { return Config.num_boards; }
+    uint8_t GetBoardId(unsigned int board) const { return (uint8_t) board; }
+    uint32_t GetHardwareVersion(unsigned int) const { return Config.hwvers; }
+    unsigned int GetBoardNumEncoders(unsigned int) const { return Config.num_encoders; }
+    unsigned int GetBoardNumMotors(unsigned int) const { return Config.num_motors; }
+
+    unsigned int GetNumEncoders(void) const { return Config.num_boards * Config.num_encoders; }
+    unsigned int GetNumMotors(void) const { return Config.num_boards * Config.num_motors; }
+
+    int32_t GetEncoderPosition(unsigned int index) const { return (int32_t) (ReadCount * (index + 1)) - 0x400000; }
+    int32_t GetEncoderMidRange(void) const { return 0x800000; }
+    double GetEncoderVelocityPredicted(unsigned int index) const { return (double) (index + 1); }
+    uint32_t GetMotorCurrent(unsigned int index) const { return MotorCurrent[index]; }
+    uint32_t GetDigitalIO(unsigned int board) const { return ((ReadCount >> 8) + (board << 16)) & 0x000FFFFF; }
+    uint32_t GetAnalogInput(unsigned int index) const { return 0x8000 + 100 * index; }
+
+    uint32_t GetTimestamp(void) const { return (uint32_t) (ReadTicks - PreviousReadTicks); }
+    double GetFPGAClockPeriod(void) const { return 1.0 / 49.152e6; }
+
+    bool ReadCommandedCurrents(uint32_t *values, unsigned int count)
+    {
+        for (unsigned int i = 0; i < count; i++) {
+            if (QuadletCommandedCurrent) {
+                BusTransaction();
+            }
+            values[i] = CommandedCurrent[i];
+        }
+        return true;
+    }
+
+    uint8_t ReadMIOPins(void) { return (ReadCount >> 10) & 0x0F; }
+};
+
+BoardAccess *CreateSimulatedBoard(const SimulatedBoardConfig &config)
+{
+    return new SimulatedBoard(config);
+}
@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <string.h>
+
+#include "burst_recorder.h"
+
+BurstRecorder::BurstRecorder() : Quadlets(2), Capacity(1), Ring(2, 0)
+{
+    memset(&Config, 0, sizeof(Config));
+    Config.post_trigger = 1;
+    Arm();
+}
+
+void BurstRecorder::Configure(BurstConfig &config, unsigned int quadlets)
+{
+    const uint32_t max_samples = MAX_BURST_BYTES / (quadlets * 4);
+
+    if (config.post_trigger < 1) {
+        config.post_trigger = 1;
+    } else if (config.post_trigger > max_samples) {
+        config.post_trigger = max_samples;
+    }
+    if (config.pre_trigger > max_samples - config.post_trigger) {
+        config.pre_trigger = max_samples - config.post_trigger;
+    }
+
+    Config = config;
+    Quadlets = quadlets;
+    Capacity = (uint64_t) config.pre_trigger + config.post_trigger;
+
+    // writes every page of the ring, so that recording does not page fault
+    Ring.assign(Capacity * Quadlets, 0);
+
+    Arm();
+}
+
+void BurstRecorder::Arm(void)
+{
+    Head = 0;
+    First = 0;
+    TriggerSample = 0;
+    IsTriggered = false;
+    HasPrevious = false;
+    Previous = 0;
+}
+
+bool BurstRecorder::CheckTrigger(BoardAccess *board)
+{
+    uint32_t value;
+
+    switch (Config.trigger) {
+        case BURST_TRIGGER_DIGITAL_IO:
+            if (Config.channel >= board->GetNumBoards()) {
+                return false;
+            }
+            value = board->GetDigitalIO(Config.channel) & Config.mask;
+            break;
+        case BURST_TRIGGER_MOTOR_CURRENT:
+            if (Config.channel >= board->GetNumMotors()) {
+                return false;
+            }
+            value = ((board->GetMotorCurrent(Config.channel) & 0x0000FFFF) >= Config.threshold) ? 1 : 0;
+            break;
+        default:
+            return false;
+    }
+
+    // edges of any bit of value (a single bit for the current threshold)
+    uint32_t rising = value & ~Previous;
+    uint32_t falling = Previous & ~value;
+    bool fired = HasPrevious && (((Config.edge & BURST_EDGE_RISING) && rising) ||
+                                 ((Config.edge & BURST_EDGE_FALLING) && falling));
+
+    Previous = value;
+    HasPrevious = true;
+    return fired;
+}
+
+void BurstRecorder::Commit(bool trigger)
+{
+    if (!IsTriggered && trigger) {
+        IsTriggered = true;
+        TriggerSample = Head;
+    }
+
+    Head++;
+
+    // before the trigger, only the last pre_trigger samples are kept (the next one may
+    // be the trigger sample)
+    if (!IsTriggered && Head - First > Config.pre_trigger) {
+        First = Head - Config.pre_trigger;
+    }
+}
@@ -0,0 +1,83 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __BURSTRECORDER_H__
+#define __BURSTRECORDER_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "board_access.h"
+#include "data_collection_shared.h"
+
+// Records the samples of a burst (see BurstConfig) into a ring allocated (and faulted
+// in) by Configure, so that recording does not allocate. Samples are written in place:
+//   uint32_t *sample = recorder.Slot();
+//   ... pack the sample into it ...
+//   recorder.Commit(recorder.CheckTrigger(board) || host_trigger);
+// until Complete(), and are then read back in chronological order with Sample(i).
+class BurstRecorder {
+public:
+    BurstRecorder();
+
+    // allocates the ring for the samples of config, of quadlets each. The sample
+    // counts are clamped to MAX_BURST_BYTES (config is updated).
+    void Configure(BurstConfig &config, unsigned int quadlets);
+
+    // starts a new burst
+    void Arm(void);
+
+    // slot of the next sample
+    uint32_t *Slot(void) { return &Ring[(Head % Capacity) * Quadlets]; }
+
+    // true if the trigger condition (digital I/O or motor current) holds for the
+    // last read of the board; the first read after Arm only sets the reference
+    bool CheckTrigger(BoardAccess *board);
+
+    // stores the sample written to Slot; trigger is ignored once triggered
+    void Commit(bool trigger);
+
+    bool Triggered(void) const { return IsTriggered; }
+    bool Complete(void) const { return IsTriggered && (Head - TriggerSample >= Config.post_trigger); }
+
+    // recorded samples, in chronological order (after Complete)
+    unsigned int NumSamples(void) const { return (unsigned int) (Head - First); }
+    unsigned int TriggerIndex(void) const { return (unsigned int) (TriggerSample - First); }
+    const uint32_t *Sample(unsigned int index) const { return &Ring[((First + index) % Capacity) * Quadlets]; }
+
+    // samples committed since Arm (including overwritten ones)
+    uint64_t Recorded(void) const { return Head; }
+
+protected:
+    BurstConfig Config;
+    unsigned int Quadlets;
+    // in samples
+    uint64_t Capacity;
+    std::vector<uint32_t> Ring;
+
+    // sample numbers since Arm: next sample, oldest sample kept, trigger sample
+    uint64_t Head;
+    uint64_t First;
+    uint64_t TriggerSample;
+    bool IsTriggered;
+
+    // last value of the trigger input
+    bool HasPrevious;
+    uint32_t Previous;
+};
+
+#endif
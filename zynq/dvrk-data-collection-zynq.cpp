@@ -25,64 +25,194 @@ http://www.cisst.org/cisst/license.txt.
 #include <chrono>
 #include <pthread.h>
 #include <atomic>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <getopt.h>
+#include <algorithm>
+#include <vector>
 
-// mmap mio pins
 #include <stdio.h>
 #include <stdint.h>
-#include <fcntl.h>
-#include <sys/mman.h>
+#include <string.h>
 
-// dvrk libs
-#include "BasePort.h"
-#include "PortFactory.h"
-#include "ZynqEmioPort.h"
-#include "AmpIO.h"
+// board access (Amp1394 or simulated)
+#include "board_access.h"
+#include "sample_packer.h"
+#include "sample_compression.h"
+#include "sample_averager.h"
+#include "burst_recorder.h"
+#include "udp_fault_injection.h"
 
 // shared header
 #include "data_collection_shared.h"
 
 using namespace std;
 
-// UDP_MAX_PACKET_SIZE (in bytes) is calculated from GetMaxWriteDataSize (based
-// on the MTU) in EthUdpPort.cpp
-// PK: This is now defined in data_collection_shared.h
-const int UDP_MAX_PACKET_SIZE = UDP_REAL_MTU;
-
-// defines and variables for MIO Memory mapping for reading MIO pins
-const uint32_t GPIO_BASE_ADDR = 0xE000A000;
-const unsigned int GPIO_BANK1_OFFSET = 0x8;
-const uint32_t SCLR_CLK_BASE_ADDR = 0xF8000000;
-volatile uint32_t *GPIO_MEM_REGION;
+// UDP_MAX_PACKET_SIZE (in bytes) is the size of the packet buffers. The payload
+// size actually used (udp_payload_size) is negotiated with the host and may
+// be larger than UDP_REAL_MTU if both sides support jumbo frames.
+const int UDP_MAX_PACKET_SIZE = UDP_MAX_PAYLOAD;
+uint32_t udp_payload_size = UDP_REAL_MTU;
 
 // FLAG for including Processor IO in data packets
 bool use_ps_io_flag = false;
 bool use_pot_flag = true;
+bool use_compression_flag = false;
+
+// channels requested by the host (HOST_CHANNEL_MASK_CMD); all channels if not set
+bool use_channel_mask_flag = false;
+SampleChannelMask channel_mask;
+
+// oversampling mode requested by the host (HOST_OVERSAMPLING_CMD)
+bool use_oversampling_flag = false;
+OversamplingConfig oversampling = {1, 0};
+
+// burst mode requested by the host (HOST_BURST_CMD)
+bool use_burst_flag = false;
+BurstConfig burst_config;
+
+// timestamps from the FPGA timestamp counter instead of the Zynq clock (ENABLE_FPGA_TIMESTAMP_MSK)
+bool use_fpga_timestamp_flag = false;
+
+// data packets per FEC group requested by the host (HOST_FEC_CMD), 0 if off
+uint32_t fec_group_size = 0;
+
+// data packets kept for retransmission, requested by the host (HOST_RETRANSMIT_CMD), 0 if off
+uint32_t retransmit_history_size = 0;
+
+// impairments of the datagrams received from the host (-I), and their counts when the
+// current capture started
+UdpFaultInjector udp_faults;
+UdpFaultInjector::Stats fault_stats_start;
 
 ///////////////////////////////////
 ///// STATE MACHINE VARIABLES /////
 //////////////////////////////////
 
-// Double Buffer Struct handling double buffer between collecting and transmitting data between 
-// threads
-struct Double_Buffer_Info {
-    uint32_t double_buffer[2][UDP_MAX_PACKET_SIZE/4]; //note: changed from 1500 which makes sense
-    uint16_t buffer_size; 
-    uint8_t prod_buf;
-    uint8_t cons_buf;
-    atomic_uint8_t cons_busy; 
+// Number of packet slots between collecting and transmitting threads (must be a power of 2).
+// Absorbs short stalls in sendto() without holding up sampling.
+const uint32_t PACKET_RING_SLOTS = 16;
+static_assert((PACKET_RING_SLOTS & (PACKET_RING_SLOTS - 1)) == 0, "PACKET_RING_SLOTS must be a power of 2");
+
+// Single-producer/single-consumer ring of data packets. The producer (state machine) fills
+// the slot at head and the consumer thread transmits the slot at tail. Indices are free
+// running and only masked when indexing the ring.
+struct Packet_Ring_Info {
+    uint32_t ring[PACKET_RING_SLOTS][UDP_MAX_PACKET_SIZE/4];
+    uint16_t length[PACKET_RING_SLOTS];  // bytes of each packet
+    uint16_t samples[PACKET_RING_SLOTS]; // samples of each packet (0: not a data packet)
+    atomic_uint32_t head;               // written by producer only
+    atomic_uint32_t tail;               // written by consumer only
+    atomic_bool cons_waiting;           // consumer is (about to be) blocked on event_fd
+    int event_fd;                       // wakes up consumer
+    uint32_t full_count;                // times the producer found the ring full
+};
+
+// Commands received from the host during a capture. The control thread blocks on the
+// socket and posts them to the producer through a single-producer/single-consumer
+// mailbox, so that the sampling loop only checks the mailbox indices between packets
+// (see check_for_stop_data_collection).
+enum ControlCommandType {
+    CONTROL_STOP,
+    CONTROL_BURST_TRIGGER,
+    CONTROL_SET_SAMPLE_RATE,            // value: sample rate (Hz)
+    CONTROL_MARK_EVENT,                 // value: event ID
+    CONTROL_SESSION,                    // session command (see is_session_cmd) in cmd
+    CONTROL_UDP_ERROR
+};
+
+struct Control_Command {
+    ControlCommandType type;
+    uint32_t value;
+    uint32_t sequence;                  // of a CaptureCommand
+    double timestamp;                   // capture time when received
+    char cmd[CMD_MAX_STRING_SIZE];
+    struct sockaddr_in addr;            // sender
+};
+
+const uint32_t CONTROL_MAILBOX_SLOTS = 8;
+static_assert((CONTROL_MAILBOX_SLOTS & (CONTROL_MAILBOX_SLOTS - 1)) == 0, "CONTROL_MAILBOX_SLOTS must be a power of 2");
+
+struct Control_Mailbox {
+    Control_Command slots[CONTROL_MAILBOX_SLOTS];
+    atomic_uint32_t head;               // written by control thread only
+    atomic_uint32_t tail;               // written by producer only
+    int event_fd;                       // wakes up the control thread when the capture stops
+    pthread_t thread;
+};
+
+// Lateness histogram bins of the sample pacer: bin i counts samples that started
+// less than PACER_HIST_EDGES_US[i] late, the last bin counts the rest
+const long PACER_HIST_EDGES_US[] = {1, 2, 5, 10, 20, 50, 100, 1000};
+const int PACER_HIST_BINS = sizeof(PACER_HIST_EDGES_US) / sizeof(PACER_HIST_EDGES_US[0]) + 1;
+
+// policy when a sample starts more than a period late
+enum PacerPolicy {
+    PACER_CATCH_UP,         // keep the schedule: late samples are taken back to back
+    PACER_SKIP              // drop the missed periods and realign to the next deadline
+};
+
+// Paces samples at the requested sample rate. The producer sleeps with
+// clock_nanosleep(TIMER_ABSTIME) until spin_margin_ns before the deadline and
+// spins for the remainder. The margin is calibrated from the wake-up latency of
+// clock_nanosleep when the capture starts, grows when a sleep overshoots the
+// deadline and slowly shrinks back to the calibrated value otherwise. At rates
+// whose period is below the margin, the pacer only spins.
+struct Sample_Pacer_Info {
+    timespec deadline;                  // CLOCK_MONOTONIC (clock_nanosleep does not support RAW)
+    long period_ns;
+    long spin_margin_ns;
+    long calibrated_margin_ns;
+    PacerPolicy policy;
+
+    uint32_t missed_count;              // deadlines already passed when the previous sample ended
+    uint32_t skipped_periods;           // periods dropped by PACER_SKIP
+    uint32_t lateness_hist[PACER_HIST_BINS];
+    long max_lateness_ns;
+    long long spin_ns;                  // total time spent spinning
 };
 
 // have methods return new state
 // slim down sm struct to non local 
 
 DataCollectionMeta data_collection_meta;
-Double_Buffer_Info db;
+Packet_Ring_Info packet_ring;
+Control_Mailbox control_mailbox;
+Sample_Pacer_Info sample_pacer;
+
+// sample packer and packet size, selected when a capture starts (see select_sample_packer)
+SampleFormat sample_format;
+SamplePacker sample_packer = PackSampleGeneric;
+SampleAverager sample_averager;
+uint16_t samples_per_packet = 0;
+
+// Burst of the current capture (burst mode): recorded, then sent to the host
+enum BurstPhase {
+    BURST_RECORDING,
+    BURST_SENDING,
+    BURST_DONE
+};
+
+// samples recorded between checks for host commands, when sampling as fast as possible
+const unsigned int BURST_POLL_SAMPLES = 64;
+// rate at which a burst is sent, in bytes of (uncompressed) samples: the whole burst
+// is ready at once, faster than the host writes it out, and it cannot be recorded again
+const double BURST_SEND_BYTES_PER_S = 20e6;
+
+BurstRecorder burst_recorder;
+BurstPhase burst_phase = BURST_RECORDING;
+bool burst_host_trigger = false;
+unsigned int burst_sent_samples = 0;
+// CLOCK_MONOTONIC, of the next packet of the burst
+timespec burst_send_deadline;
 char recvd_cmd[CMD_MAX_STRING_SIZE] = {0};
 
 
 struct Dvrk_Controller {
-    BasePort *Port;
-    AmpIO *Board;   
+    BoardAccess *Board;
 } dvrk_controller;
 
 struct SM{
@@ -97,8 +227,99 @@ struct SM{
 
 
 // DEBUGGING VARIABLES 
-int data_packet_count = 0;
+// data packets and samples sent, updated by the consumer (also read by the producer
+// for the telemetry packets)
+atomic_int data_packet_count(0);
+atomic_llong sent_sample_count(0);
 int sample_count = 0;
+// board reads (more than samples in oversampling mode)
+long long board_read_count = 0;
+
+// transmit statistics (sendmmsg calls and failed calls, and the data packets of
+// failed calls or left in the packet ring when the capture stops, and their samples)
+int tx_syscall_count = 0;
+atomic_int tx_error_count(0);
+atomic_int dropped_packet_count(0);
+atomic_llong dropped_sample_count(0);
+
+// Telemetry packets (see TelemetryPacket) sent every telemetry_interval_s during a
+// capture, set with the -T command line option (0: only when the capture stops)
+double telemetry_interval_s = 1.0;
+struct Telemetry_Info {
+    uint32_t sequence;
+    double next_time;                   // capture time of the next packet
+    // at the previous packet, for the sample rate and CPU load
+    double last_time;
+    int last_sample_count;
+    double last_cpu_s;
+};
+Telemetry_Info telemetry;
+
+// bytes of data packets sent (to report the compression ratio)
+long long wire_byte_count = 0;
+
+// FEC mode: parity of the current group, built by the consumer as it sends the data
+// packets (see FecParityHeader)
+const unsigned int FEC_HEADER_QUADLETS = sizeof(FecParityHeader) / 4;
+struct Fec_Info {
+    uint32_t group;
+    uint32_t encoded;                   // ring index of the next packet to encode
+    bool complete;                      // group closed, parity not sent yet
+    uint16_t num_packets;
+    uint16_t max_length;                // bytes of parity
+    uint32_t length_xor;
+    uint64_t first_key;
+    uint64_t last_key;
+    uint32_t parity[UDP_MAX_PAYLOAD_QUADLETS];  // header, then XOR of the data packets
+};
+Fec_Info fec;
+
+// parity packets sent, and time spent encoding data packets into them
+atomic_int fec_parity_count(0);
+atomic_llong fec_encode_ns(0);
+atomic_int fec_encoded_count(0);
+
+// Retransmit mode: copies of the last data packets, by sequence number (see NackRequest),
+// written by the consumer once sent (or dropped) and read by the thread that receives
+// the requests of the host (the control thread during a capture, the state machine
+// after it). Each slot holds the sequence number of its packet + 1, 0 while it is
+// written; the reader checks it again after copying the packet out.
+struct Retransmit_History {
+    std::vector<uint32_t> packets;      // slots of UDP_MAX_PAYLOAD_QUADLETS
+    std::vector<uint16_t> length;
+    std::vector<atomic_uint32_t> sequence;
+};
+Retransmit_History retransmit_history;
+
+// sequence number of the next data packet, written by the producer
+uint32_t data_packet_sequence = 0;
+// packets resent, and requested ones no longer in the history
+atomic_int retransmit_count(0);
+atomic_int retransmit_miss_count(0);
+
+// Batched transmit: the consumer sends up to tx_batch_max ready packets per
+// sendmmsg() call. If fewer are ready, it waits up to tx_batch_latency_us for
+// more before sending a partial batch (0: send whatever is ready immediately).
+// Set with the -b and -l command line options.
+uint32_t tx_batch_max = 8;
+long tx_batch_latency_us = 0;
+
+// Real-time settings of the producer (state machine) and consumer (transmit) threads,
+// set with the -A, -R and -K command line options. On the dual-core Zynq, the producer
+// is best pinned to the core that is not running Linux housekeeping (e.g., CPU 1 with
+// isolcpus=1 on the kernel command line) and the consumer to the other one.
+struct Realtime_Config {
+    int producer_cpu;                   // -1: not pinned
+    int consumer_cpu;
+    int priority;                       // SCHED_FIFO priority of both threads during captures, 0: default scheduling
+    bool lock_memory;                   // mlockall and prefault stacks and buffers
+};
+Realtime_Config realtime = {-1, -1, 0, false};
+
+// stack of the consumer thread when memory is locked (locked stacks are faulted in
+// entirely, so the 8MB default would be wasted), and stack prefaulted by each thread
+const size_t CONSUMER_STACK_SIZE = 256 * 1024;
+const size_t PREFAULT_STACK_SIZE = 64 * 1024;
 
 // Motor Current/Status arrays to store data 
 // for emio timeout error
@@ -112,18 +333,24 @@ double last_timestamp = 0;
 
 timespec t_data_collection_start;
 
-// keeps track of deadline to control sample rate
-timespec deadline;
-
-// expected period of sample capture
-long period_ns;
+// FPGA clock ticks since the first board read of the capture: the timestamp counter
+// of the boards (ticks since the previous read) extended to 64 bits
+uint64_t fpga_timestamp_ticks = 0;
 
 // global sample rate variable to change sample rate
 int SAMPLE_RATE = 0;
 bool useSampleRate = false;
 
 // FLAG set when the host terminates data collection
-bool stop_data_collection_flag = false;
+atomic_bool stop_data_collection_flag(false);
+
+// FLAG set while a capture is running (consumer thread active)
+bool capture_in_progress = false;
+
+// ID of the current host session, assigned when the metadata is first sent
+// (0 if no host has configured a session).
+// Lets a restarted host reattach to this program (see handle_session_cmd)
+uint32_t session_id = 0;
 
 // State Machine states
 enum DataCollectionStateMachine {
@@ -134,6 +361,18 @@ enum DataCollectionStateMachine {
     SM_WAIT_FOR_HOST_FLAG_VALUE,
     SM_WAIT_FOR_HOST_SAMPLE_RATE_CMD,
     SM_WAIT_FOR_HOST_SAMPLE_RATE_VALUE,
+    SM_WAIT_FOR_HOST_CHANNEL_MASK_CMD,
+    SM_WAIT_FOR_HOST_CHANNEL_MASK_VALUE,
+    SM_WAIT_FOR_HOST_OVERSAMPLING_CMD,
+    SM_WAIT_FOR_HOST_OVERSAMPLING_VALUE,
+    SM_WAIT_FOR_HOST_BURST_CMD,
+    SM_WAIT_FOR_HOST_BURST_VALUE,
+    SM_WAIT_FOR_HOST_FEC_CMD,
+    SM_WAIT_FOR_HOST_FEC_VALUE,
+    SM_WAIT_FOR_HOST_RETRANSMIT_CMD,
+    SM_WAIT_FOR_HOST_RETRANSMIT_VALUE,
+    SM_WAIT_FOR_HOST_PAYLOAD_SIZE_CMD,
+    SM_WAIT_FOR_HOST_PAYLOAD_SIZE_VALUE,
     SM_WAIT_FOR_HOST_START_CMD,
     SM_START_DATA_COLLECTION,
     SM_CHECK_FOR_STOP_DATA_COLLECTION_CMD,
@@ -164,73 +403,27 @@ struct UDP_Info {
     socklen_t AddrLen;
 } udp_host; // this is global bc there will only be one
 
+// Address and port of the host that the datagrams are sent to, packed into one word so
+// that the threads of a capture (producer, consumer and control) read it at once. Only
+// the state machine thread changes it: to the sender of each command it receives, and
+// during a capture on a session command (see check_for_stop_data_collection).
+// udp_host.Addr is only where recvfrom writes the sender.
+static atomic_uint64_t host_destination(0);
 
-static int mio_mmap_init()
+static void set_host_address(const struct sockaddr_in &addr)
 {
-    int mem_fd;
-
-    // Open /dev/mem for accessing physical memory
-    if ((mem_fd = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
-        cout << "Failed to open /dev/mem" << endl;
-        return -1;
-    }
-
-    void *gpio_mmap = mmap(
-        NULL,
-        0x1000,
-        PROT_READ | PROT_WRITE,
-        MAP_SHARED,
-        mem_fd,
-        GPIO_BASE_ADDR
-    );
-
-    if (gpio_mmap == MAP_FAILED) {
-        perror("Failed to mmap");
-        close(mem_fd);  // Always close the file descriptor on failure
-        return -1;
-    }
-
-    GPIO_MEM_REGION = (volatile uint32_t * ) gpio_mmap;
-
-    // Following code ensures that APER_CLK is enabled; should not be necessary
-    // since fpgav3_emio_mmap also does this.
-    void *clk_map = mmap(
-        NULL,
-        0x00000130,
-        PROT_READ | PROT_WRITE,
-        MAP_SHARED,
-        mem_fd,
-        SCLR_CLK_BASE_ADDR
-    );
-
-    volatile unsigned long *clock_map = (volatile unsigned long *)clk_map;
-
-    uint32_t bitmsk = (1 << 22);
-    uint32_t aper_clk_reg = clock_map[0x12C/4];
-
-    if ((aper_clk_reg & bitmsk) == 0) {
-        clock_map[0x12C/4] |= bitmsk;
-    }
-
-    munmap(clk_map, 0x00000130);
-    // End of APER_CLK check
-
-    close(mem_fd);
-
-    return 0;
+    host_destination.store(((uint64_t) addr.sin_addr.s_addr << 16) | addr.sin_port, memory_order_release);
 }
 
-uint8_t returnMIOPins(){
-
-    if (GPIO_MEM_REGION == NULL) {
-        cout << "[ERROR] MIO mmap region initialized incorrectly!" << endl;
-        return 0;
-    }
-
-    const uint16_t MIO_PINS_MSK = 0x3C;
-    uint32_t gpio_bank1 = GPIO_MEM_REGION[GPIO_BANK1_OFFSET/4];
-
-    return (gpio_bank1 & MIO_PINS_MSK) >> 2;
+static struct sockaddr_in host_address(void)
+{
+    const uint64_t packed = host_destination.load(memory_order_acquire);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = (uint32_t) (packed >> 16);
+    addr.sin_port = (uint16_t) (packed & 0xFFFF);
+    return addr;
 }
 
 // checks if data is available from udp buffer (for noblocking udp recv)
@@ -242,6 +435,13 @@ int udp_nonblocking_receive(UDP_Info *udp_host, void *data, int size)
 
     int ret_code;
 
+    if (udp_faults.IsEnabled()) {
+        ret_code = udp_faults.Release(data, size);
+        if (ret_code > 0) {
+            return ret_code;
+        }
+    }
+
     struct timeval timeout;
 
     // Timeout values
@@ -258,11 +458,17 @@ int udp_nonblocking_receive(UDP_Info *udp_host, void *data, int size)
     } else {
         if (FD_ISSET(udp_host->socket, &readfds)) {
             ret_code = recvfrom(udp_host->socket, data, size, 0, (struct sockaddr *)&udp_host->Addr, &udp_host->AddrLen);
+            if (ret_code > 0) {
+                // replies go to the sender
+                set_host_address(udp_host->Addr);
+            }
 
             if (ret_code == 0) {
                 return UDP_CONNECTION_CLOSED_ERROR;
             } else if (ret_code < 0) {
                 return UDP_SOCKET_ERROR;
+            } else if (udp_faults.IsEnabled() && (ret_code = udp_faults.Receive(data, ret_code)) == 0) {
+                return UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT;
             } else {
                 return ret_code; // Return the number of bytes received
             }
@@ -277,14 +483,37 @@ int udp_nonblocking_receive(UDP_Info *udp_host, void *data, int size)
 static int udp_transmit(UDP_Info *udp_host, void * data, int size)
 {
 
-    if (size > UDP_MAX_PACKET_SIZE) {
+    if (size > (int) udp_payload_size) {
         return -1;
     }
 
-    return sendto(udp_host->socket, data, size, 0, (struct sockaddr *)&udp_host->Addr, udp_host->AddrLen);
+    struct sockaddr_in addr = host_address();
+    return sendto(udp_host->socket, data, size, 0, (struct sockaddr *)&addr, sizeof(addr));
 }
 
 
+// returns the largest UDP payload that can be sent to the host without
+// fragmentation, based on the MTU of the Zynq interface used to reach it
+static uint32_t max_payload_to_host()
+{
+    int mtu = MTU_DEFAULT;
+    socklen_t len = sizeof(mtu);
+
+    // a connected socket reports the MTU of its route
+    int probe_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = host_address();
+    if (probe_socket >= 0) {
+        if (connect(probe_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            getsockopt(probe_socket, IPPROTO_IP, IP_MTU, &mtu, &len) != 0) {
+            mtu = MTU_DEFAULT;
+        }
+        close(probe_socket);
+    }
+
+    uint32_t payload = (uint32_t) mtu - IP_UDP_HEADER;
+    return (payload < UDP_MAX_PAYLOAD) ? payload : UDP_MAX_PAYLOAD;
+}
+
 static bool initiate_socket_connection(int &host_socket)
 {
     cout << endl << "Initiating Socket Connection with host..." << endl;
@@ -315,45 +544,160 @@ static bool initiate_socket_connection(int &host_socket)
     return true;
 }
 
+// format of the samples for the options and channels requested by the host
+static SampleFormat capture_sample_format(BoardAccess *board)
+{
+    SampleFormat format;
+    format.num_boards = board->GetNumBoards();
+    format.num_encoders = board->GetNumEncoders();
+    format.num_motors = board->GetNumMotors();
+    format.ps_io = use_ps_io_flag;
+    format.pot = use_pot_flag;
+    format.min_max = use_oversampling_flag && oversampling.min_max;
+    format.timestamp_ticks_per_s = use_fpga_timestamp_flag ? (uint32_t) (1.0 / board->GetFPGAClockPeriod() + 0.5) : 0;
+    format.select_all_channels();
+
+    if (use_channel_mask_flag) {
+        // ignore channels the boards do not have
+        format.channels.encoder_position &= channel_mask.encoder_position;
+        format.channels.encoder_velocity &= channel_mask.encoder_velocity;
+        format.channels.motor &= channel_mask.motor;
+        format.channels.pot &= channel_mask.pot;
+    }
+
+    return format;
+}
+
 // calculate the size of a sample in quadlets
-static uint16_t calculate_quadlets_per_sample(uint8_t num_encoders, uint8_t num_motors)
+static uint16_t calculate_quadlets_per_sample(BoardAccess *board)
 {
     // SAMPLE STRUCTURE
 
     // 1 quadlet = 4 bytes
 
     // Timestamp (Double -> 64 bits stored as two seperate quadlets)                                                           [1 quadlet]
+    //     (or uint64_t FPGA clock ticks if the host requested FPGA timestamps)
     // Encoder Position (32 * num of encoders)                                      [1 quadlet * num of encoders]
     // Encoder Velocity Predicted (64 * num of encoders -> truncated to 32bits)     [1 quadlet * num of encoders]
     // Motur Current and Motor Status (32 * num of Motors -> each are 16 bits)      [1 quadlet * num of motors]
-    // Digtial IO Values  (optional, used if PS IO is enabled ) 32 bits             [1 quadlet * digital IO]
+    // Digtial IO Values  (optional, used if PS IO is enabled ) 32 bits             [1 quadlet * num of boards]
     // MIO Pins (optional, used if PS IO is enabled ) 4 bits -> pad 32 bits         [1 quadlet * MIO PINS]  
     // POT pins (optional, used if Pot is enabled) num_encoders * 16 bits    
-    
-    int default_quadlets_per_sample = (2 + (2*(num_encoders)) + (num_motors));
-    int quadlets_per_sample = default_quadlets_per_sample;
 
-    if (use_ps_io_flag){
-        quadlets_per_sample += 2;
+    // Encoders, motors and pots are those of all boards of the port, in board order
+    // (see BoardAccess), and the digital I/O values are in board order too
+
+    // Encoder positions, velocities, motor quadlets and pots are only included for the
+    // channels selected by the host (in increasing axis order)
+
+    // In oversampling mode with min/max, the minimum and maximum of the channels follow
+    // (see SampleAverager)
+
+    // The host decodes the samples from their schema (see fill_sample_schema)
+
+    return capture_sample_format(board).quadlets();
+}
+
+// adds a field of count values, one per quadlet from offset, to the schema (if count > 0)
+static void add_schema_field(SampleSchema &schema, const char *name, const char *suffix,
+                             uint8_t type, uint8_t width, uint8_t shift, uint8_t index,
+                             uint32_t axes, unsigned int count, unsigned int offset)
+{
+    if (count == 0 || schema.num_fields == MAX_SCHEMA_FIELDS) {
+        return;
+    }
+
+    SchemaField &field = schema.fields[schema.num_fields++];
+    memset(&field, 0, sizeof(field));
+    strncpy(field.name, name, sizeof(field.name) - 1);
+    strncpy(field.suffix, suffix, sizeof(field.suffix) - 1);
+    field.type = type;
+    field.width = width;
+    field.shift = shift;
+    field.index = index;
+    field.count = (uint16_t) count;
+    field.offset = (uint16_t) offset;
+    field.stride = 1;
+    field.axes = axes;
+}
+
+// adds the fields of a value of each selected channel (and of the digital I/O and MIO
+// pins if ps_io) from offset; returns the quadlet after them
+static unsigned int add_channel_fields(SampleSchema &schema, const SampleFormat &format,
+                                       const char *suffix, unsigned int offset, bool ps_io)
+{
+    const SampleChannelMask &channels = format.channels;
+
+    add_schema_field(schema, "ENCODER_POS", suffix, SCHEMA_INT, 4, 0, SCHEMA_INDEX_ENCODER,
+                     channels.encoder_position, format.num_positions(), offset);
+    offset += format.num_positions();
+    add_schema_field(schema, "ENCODER_VEL", suffix, SCHEMA_FLOAT, 4, 0, SCHEMA_INDEX_ENCODER,
+                     channels.encoder_velocity, format.num_velocities(), offset);
+    offset += format.num_velocities();
+    // motor current in the lower half of the motor quadlets, commanded current (status) in the upper one
+    add_schema_field(schema, "MOTOR_CURRENT", suffix, SCHEMA_UINT, 2, 0, SCHEMA_INDEX_MOTOR,
+                     channels.motor, format.num_motor_channels(), offset);
+    add_schema_field(schema, "MOTOR_STATUS", suffix, SCHEMA_UINT, 2, 16, SCHEMA_INDEX_MOTOR,
+                     channels.motor, format.num_motor_channels(), offset);
+    offset += format.num_motor_channels();
+    if (ps_io) {
+        add_schema_field(schema, "DIGITAL_IO", suffix, SCHEMA_UINT, 4, 0, SCHEMA_INDEX_BOARD,
+                         0, format.num_boards, offset);
+        offset += format.num_boards;
+        add_schema_field(schema, "MIO_PINS", suffix, SCHEMA_UINT, 4, 0, SCHEMA_INDEX_NONE, 0, 1, offset);
+        offset++;
+    }
+    add_schema_field(schema, "POT", suffix, SCHEMA_UINT, 4, 0, SCHEMA_INDEX_ENCODER,
+                     channels.pot, format.num_pots(), offset);
+    offset += format.num_pots();
+
+    return offset;
+}
+
+// describes the samples of format (see calculate_quadlets_per_sample) for the host
+static void fill_sample_schema(const SampleFormat &format, SampleSchema &schema)
+{
+    memset(&schema, 0, sizeof(schema));
+    schema.version = SAMPLE_SCHEMA_VERSION;
+    schema.quadlets = format.quadlets();
+
+    if (format.timestamp_ticks_per_s != 0) {
+        add_schema_field(schema, "TIMESTAMP", "", SCHEMA_TICKS, 8, 0, SCHEMA_INDEX_NONE, 0, 1, 0);
+    } else {
+        add_schema_field(schema, "TIMESTAMP", "", SCHEMA_FLOAT, 8, 0, SCHEMA_INDEX_NONE, 0, 1, 0);
     }
 
-    if (use_pot_flag) {
-        quadlets_per_sample += (1 * num_encoders);
+    unsigned int offset = add_channel_fields(schema, format, "", 2, format.ps_io);
+    if (format.min_max) {
+        offset = add_channel_fields(schema, format, "_MIN", offset, false);
+        add_channel_fields(schema, format, "_MAX", offset, false);
     }
+}
+
+// bytes after the samples of a data packet: its sequence number in retransmit mode
+static uint32_t data_trailer_size()
+{
+    return (retransmit_history_size > 0) ? sizeof(uint32_t) : 0;
+}
 
-    return quadlets_per_sample;
+// bytes of samples of the largest data packet: in FEC mode, the parity packets (header
+// and XOR of the data packets) must fit in the payload
+static uint32_t data_payload_size()
+{
+    uint32_t size = udp_payload_size - data_trailer_size();
+    return (fec_group_size > 0) ? size - sizeof(FecParityHeader) : size;
 }
 
-// calculates the # of samples per packet in quadlets
-static uint16_t calculate_samples_per_packet(uint8_t num_encoders, uint8_t num_motors)
+// calculates the # of samples per packet in quadlets (0 if a sample does not fit in a packet)
+static uint16_t calculate_samples_per_packet(BoardAccess *board)
 {
-    return ((UDP_MAX_PACKET_SIZE/4)/ calculate_quadlets_per_sample(num_encoders, num_motors) );
+    return ((data_payload_size()/4)/ calculate_quadlets_per_sample(board) );
 }
 
 // calculate # of quadlets per packet
-static uint16_t calculate_quadlets_per_packet(uint8_t num_encoders, uint8_t num_motors)
+static uint16_t calculate_quadlets_per_packet(BoardAccess *board)
 {
-    return (calculate_samples_per_packet(num_encoders, num_motors) * calculate_quadlets_per_sample(num_encoders, num_motors));
+    return (calculate_samples_per_packet(board) * calculate_quadlets_per_sample(board));
 }
 
 // Compute elapsed seconds between two timespecs
@@ -363,10 +707,228 @@ static double ts_diff_s(const timespec &start, const timespec &end) {
     return double(dsec) + double(dnsec) * 1e-9;
 }
 
-// loads data buffer for data collection
-    // size of the data buffer is dependent on encoder count and motor count
-    // see calculate_quadlets_per_sample method for data formatting
-static bool load_data_packet(Dvrk_Controller dvrk_controller, uint32_t *data_packet, uint8_t num_encoders, uint8_t num_motors)
+// Compute nanoseconds from start to end
+static long long ts_diff_ns(const timespec &start, const timespec &end) {
+    return (long long) (end.tv_sec - start.tv_sec) * 1'000'000'000LL + (end.tv_nsec - start.tv_nsec);
+}
+
+static void ts_add_ns(timespec &ts, long long ns) {
+    ns += ts.tv_nsec;
+    ts.tv_sec += ns / 1'000'000'000LL;
+    ts.tv_nsec = ns % 1'000'000'000LL;
+}
+
+// 90th percentile of the wake-up latency of clock_nanosleep over a few short
+// sleeps, plus some slack (outliers, e.g. preemptions, are left to the runtime
+// adjustment in pace_next_sample)
+static long calibrate_spin_margin()
+{
+    const int CALIBRATION_SLEEPS = 20;
+    const long CALIBRATION_SLEEP_NS = 100'000;
+    long wakeup_ns[CALIBRATION_SLEEPS];
+
+    for (int i = 0; i < CALIBRATION_SLEEPS; i++) {
+        timespec target, now;
+        clock_gettime(CLOCK_MONOTONIC, &target);
+        ts_add_ns(target, CALIBRATION_SLEEP_NS);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, nullptr);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wakeup_ns[i] = (long) ts_diff_ns(target, now);
+    }
+
+    sort(wakeup_ns, wakeup_ns + CALIBRATION_SLEEPS);
+    long p90_ns = wakeup_ns[(CALIBRATION_SLEEPS * 9) / 10];
+    return p90_ns + p90_ns / 2 + 10'000;
+}
+
+void reset_sample_pacer(Sample_Pacer_Info *sp, int sample_rate)
+{
+    sp->period_ns = 1'000'000'000L / sample_rate;
+    sp->calibrated_margin_ns = calibrate_spin_margin();
+    sp->spin_margin_ns = sp->calibrated_margin_ns;
+    sp->missed_count = 0;
+    sp->skipped_periods = 0;
+    memset(sp->lateness_hist, 0, sizeof(sp->lateness_hist));
+    sp->max_lateness_ns = 0;
+    sp->spin_ns = 0;
+
+    // first sample is due now
+    clock_gettime(CLOCK_MONOTONIC, &sp->deadline);
+}
+
+// waits for the deadline of the next sample and records how late it starts
+static void pace_next_sample(Sample_Pacer_Info *sp)
+{
+    ts_add_ns(sp->deadline, sp->period_ns);
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long remaining_ns = ts_diff_ns(now, sp->deadline);
+
+    if (remaining_ns > sp->spin_margin_ns) {
+        timespec wake = sp->deadline;
+        ts_add_ns(wake, -sp->spin_margin_ns);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, nullptr);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // overslept past the deadline: widen the margin by a quarter of the
+        // overshoot. Overshoots beyond the calibrated margin are preemptions
+        // rather than wake-up latency and would only turn the pacer into a
+        // busy spin for the rest of the capture.
+        long long overshoot_ns = ts_diff_ns(sp->deadline, now);
+        if (overshoot_ns > 0) {
+            overshoot_ns = min(overshoot_ns, (long long) sp->calibrated_margin_ns);
+            sp->spin_margin_ns = min(sp->spin_margin_ns + (long) (overshoot_ns / 4), sp->period_ns);
+        } else if (sp->spin_margin_ns > sp->calibrated_margin_ns) {
+            sp->spin_margin_ns -= (sp->spin_margin_ns - sp->calibrated_margin_ns) / 64 + 1;
+        }
+    }
+
+    timespec spin_start = now;
+    while (ts_diff_ns(now, sp->deadline) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    sp->spin_ns += ts_diff_ns(spin_start, now);
+
+    long long lateness_ns = ts_diff_ns(sp->deadline, now);
+    if (lateness_ns > 0 && remaining_ns < 0) {
+        sp->missed_count++;
+    }
+
+    int bin = 0;
+    while (bin < PACER_HIST_BINS - 1 && lateness_ns >= PACER_HIST_EDGES_US[bin] * 1000L) {
+        bin++;
+    }
+    sp->lateness_hist[bin]++;
+    sp->max_lateness_ns = max(sp->max_lateness_ns, (long) lateness_ns);
+
+    if (sp->policy == PACER_SKIP && lateness_ns >= sp->period_ns) {
+        // realign: the next deadline is the first one still ahead
+        long long missed_periods = lateness_ns / sp->period_ns;
+        ts_add_ns(sp->deadline, missed_periods * sp->period_ns);
+        sp->skipped_periods += (uint32_t) missed_periods;
+    }
+}
+
+static void print_sample_pacer(const Sample_Pacer_Info *sp, double capture_time_s)
+{
+    cout << "MISSED DEADLINES: " << sp->missed_count << " (max lateness " << sp->max_lateness_ns / 1000.0 << "us)" << endl;
+    if (sp->policy == PACER_SKIP) {
+        cout << "SKIPPED SAMPLE PERIODS: " << sp->skipped_periods << endl;
+    }
+    cout << "SPIN MARGIN: " << sp->spin_margin_ns / 1000.0 << "us, SPINNING: "
+         << ((capture_time_s > 0) ? (float) (100.0 * sp->spin_ns * 1e-9 / capture_time_s) : 0.0f) << "% of capture" << endl;
+    cout << "LATENESS HISTOGRAM:";
+    for (int i = 0; i < PACER_HIST_BINS; i++) {
+        if (i < PACER_HIST_BINS - 1) {
+            cout << " <" << PACER_HIST_EDGES_US[i] << "us:";
+        } else {
+            cout << " >=" << PACER_HIST_EDGES_US[i - 1] << "us:";
+        }
+        cout << sp->lateness_hist[i];
+    }
+    cout << endl;
+}
+
+// selects the packer for the format of the capture, a specialized one if available
+static void select_sample_packer(BoardAccess *board)
+{
+    sample_format = capture_sample_format(board);
+
+    sample_packer = FindSamplePacker(sample_format);
+    if (sample_packer == nullptr) {
+        if (sample_format.num_boards > 1) {
+            cout << sample_format.num_boards << " boards: " << sample_format.quadlets() << " quadlets per sample, using generic packer" << endl;
+        } else if (sample_format.all_channels()) {
+            cout << "[warning] no specialized sample packer for " << sample_format.num_encoders << " encoders and "
+                 << sample_format.num_motors << " motors, using generic packer" << endl;
+        } else {
+            cout << "Channel selection: " << sample_format.quadlets() << " quadlets per sample, using generic packer" << endl;
+        }
+        sample_packer = PackSampleGeneric;
+    }
+
+    sample_averager.SetFormat(sample_format);
+
+    samples_per_packet = calculate_samples_per_packet(board);
+}
+
+// reads the board and packs the values into dst (without minimum and maximum).
+// Returns the number of quadlets written, or 0 on failure.
+static unsigned int read_board(Dvrk_Controller &dvrk_controller, uint32_t *dst)
+{
+    timespec t0;
+    if (!use_fpga_timestamp_flag) {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+    }
+
+    if (!dvrk_controller.Board->ReadAllBoards()) {
+        emio_read_error_counter++;
+        return 0;
+    }
+
+    if (!dvrk_controller.Board->ValidRead()) {
+        cout << "[ERROR in load_data_packet] invalid read for ReadAllBoards" << endl;
+        return 0;
+    }
+
+    uint64_t timestamp;
+    if (use_fpga_timestamp_flag) {
+        // the first read of the capture is the origin
+        if (board_read_count > 0) {
+            fpga_timestamp_ticks += dvrk_controller.Board->GetTimestamp();
+        }
+        timestamp = fpga_timestamp_ticks;
+        last_timestamp = (double) fpga_timestamp_ticks / sample_format.timestamp_ticks_per_s;
+    } else {
+        double time_elapsed = ts_diff_s(t_data_collection_start, t0);
+        timestamp = seconds_timestamp_bits(time_elapsed);
+        last_timestamp = time_elapsed;
+    }
+    board_read_count++;
+
+    return sample_packer(sample_format, dvrk_controller.Board, dst, timestamp);
+}
+
+// reads a sample into dst (see calculate_quadlets_per_sample method for data
+// formatting), waiting for the next sample time if a sample rate is set. In
+// oversampling mode, the sample combines reads_per_sample back to back reads.
+// Returns the number of quadlets written, or 0 on failure.
+static unsigned int read_sample(Dvrk_Controller &dvrk_controller, uint32_t *dst)
+{
+    unsigned int quadlets;
+
+    if (use_oversampling_flag) {
+        uint32_t values[MAX_QUADLETS_PER_SAMPLE];
+
+        for (uint32_t i = 0; i < oversampling.reads_per_sample; i++) {
+            if (read_board(dvrk_controller, values) == 0) {
+                sample_averager.Reset();
+                return 0;
+            }
+            sample_averager.Add(values);
+        }
+        quadlets = sample_averager.End(dst);
+    } else {
+        quadlets = read_board(dvrk_controller, dst);
+        if (quadlets == 0) {
+            return 0;
+        }
+    }
+
+    if (useSampleRate){
+        pace_next_sample(&sample_pacer);
+    }
+
+    sample_count++;
+    return quadlets;
+}
+
+// loads data buffer for data collection and sets length to its size in bytes and
+// samples to the number of samples in it
+    // with compression, samples are added until the packet is full (see sample_compression.h)
+    // otherwise, the packet holds samples_per_packet samples
+static bool load_data_packet(Dvrk_Controller &dvrk_controller, uint32_t *data_packet, uint16_t &length, uint16_t &samples)
 {   
 
     if (data_packet == NULL) {
@@ -374,162 +936,1351 @@ static bool load_data_packet(Dvrk_Controller dvrk_controller, uint32_t *data_pac
         return false;
     }
 
-    if (sizeof(data_packet) == 0) {
-        cout << "[ERROR - load_data_packet] len of databuffer == 0" << endl;
-        return false;
+    if (use_compression_flag) {
+        SampleEncoder encoder(sample_format);
+        uint32_t sample[MAX_QUADLETS_PER_SAMPLE];
+
+        encoder.Begin(data_packet, data_payload_size());
+        while (encoder.HasRoom()) {
+            if (read_sample(dvrk_controller, sample) == 0) {
+                return false;
+            }
+            encoder.Add(sample);
+        }
+        length = (uint16_t) encoder.End();
+        samples = (uint16_t) encoder.SampleCount();
+        return true;
     }
 
-    uint16_t samples_per_packet = calculate_samples_per_packet(num_encoders, num_motors);
     uint16_t count = 0;
 
     // CAPTURE DATA 
     for (int j = 0; j < samples_per_packet; j++) {
-
-        timespec t0;
-        clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
-
-        if (!dvrk_controller.Port->ReadAllBoards()) {
-            emio_read_error_counter++;
+        unsigned int quadlets = read_sample(dvrk_controller, &data_packet[count]);
+        if (quadlets == 0) {
             return false;
         }
+        count += quadlets;
+    }
 
-        if (!dvrk_controller.Board->ValidRead()) {
-            cout << "[ERROR in load_data_packet] invalid read for ReadAllBoards" << endl;
-            return false;
-        }
+    length = count * 4;
+    samples = (uint16_t) samples_per_packet;
+    return true;    
+}
 
-        double time_elapsed = ts_diff_s(t_data_collection_start, t0);
+// generates a new (nonzero) session id
+static uint32_t new_session_id()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
 
-        last_timestamp = time_elapsed;
+    uint32_t id = (uint32_t)(now.tv_nsec ^ (now.tv_sec << 20) ^ getpid());
+    return (id == 0) ? 1 : id;
+}
 
-        uint64_t timestamp_uint64 = *reinterpret_cast<uint64_t *>(&time_elapsed);
+void package_meta_data(DataCollectionMeta *dc_meta, BoardAccess *board)
+{
+    dc_meta->hwvers = board->GetHardwareVersion(0);
+    dc_meta->num_encoders = (uint32_t) board->GetNumEncoders();
+    dc_meta->num_motors = (uint32_t) board->GetNumMotors();
+
+    dc_meta->num_boards = board->GetNumBoards();
+    memset(dc_meta->boards, 0, sizeof(dc_meta->boards));
+    for (unsigned int b = 0; b < dc_meta->num_boards; b++) {
+        dc_meta->boards[b].board_id = board->GetBoardId(b);
+        dc_meta->boards[b].hwvers = board->GetHardwareVersion(b);
+        dc_meta->boards[b].num_encoders = board->GetBoardNumEncoders(b);
+        dc_meta->boards[b].num_motors = board->GetBoardNumMotors(b);
+    }
 
-        uint32_t timestamp_high = (timestamp_uint64  >> 32);
-        uint32_t timestamp_low =  (uint32_t) (timestamp_uint64 & 0xFFFFFFFF);
+    dc_meta->size_of_sample = (uint32_t) calculate_quadlets_per_sample(board);
+    if (use_compression_flag) {
+        // variable number of samples, up to the payload size
+        dc_meta->data_packet_size = data_payload_size() + data_trailer_size();
+        dc_meta->samples_per_packet = 0;
+    } else {
+        dc_meta->data_packet_size = (uint32_t)calculate_quadlets_per_packet(board) * 4 + data_trailer_size();
+        dc_meta->samples_per_packet = (uint32_t) calculate_samples_per_packet(board);
+    }
 
-        // float time_elapsed_float = static_cast<float>(time_elapsed);
-        data_packet[count++] = timestamp_high;
-        data_packet[count++] = timestamp_low;
+    dc_meta->session_id = session_id;
+    if (session_id == 0) {
+        dc_meta->session_state = SESSION_NONE;
+    } else {
+        dc_meta->session_state = capture_in_progress ? SESSION_CAPTURING : SESSION_IDLE;
+    }
 
-        // DATA 2: encoder position
-        for (int i = 0; i < num_encoders; i++) {
-            int32_t encoder_pos = dvrk_controller.Board->GetEncoderPosition(i);
-            data_packet[count++] = static_cast<uint32_t>(encoder_pos + dvrk_controller.Board->GetEncoderMidRange());
-        }
+    // report the flags actually in use (e.g., PS IO is forced on in sample rate mode)
+    dc_meta->options_mask = (use_ps_io_flag ? ENABLE_PSIO_MSK : 0) |
+                            (use_pot_flag ? ENABLE_POT_MSK : 0) |
+                            (useSampleRate ? ENABLE_SAMPLE_RATE_MSK : 0) |
+                            (use_compression_flag ? ENABLE_COMPRESSION_MSK : 0) |
+                            (use_channel_mask_flag ? ENABLE_CHANNEL_MASK_MSK : 0) |
+                            (use_oversampling_flag ? ENABLE_OVERSAMPLING_MSK : 0) |
+                            (use_burst_flag ? ENABLE_BURST_MSK : 0) |
+                            (use_fpga_timestamp_flag ? ENABLE_FPGA_TIMESTAMP_MSK : 0);
+    dc_meta->sample_rate = useSampleRate ? SAMPLE_RATE : 0;
+    dc_meta->payload_size = udp_payload_size;
+    dc_meta->channel_mask = capture_sample_format(board).channels;
+    if (use_oversampling_flag) {
+        dc_meta->oversampling = oversampling;
+    } else {
+        dc_meta->oversampling.reads_per_sample = 1;
+        dc_meta->oversampling.min_max = 0;
+    }
+    if (use_burst_flag) {
+        dc_meta->burst = burst_config;
+    } else {
+        memset(&dc_meta->burst, 0, sizeof(dc_meta->burst));
+    }
+    dc_meta->telemetry_interval_ms = (uint32_t) (telemetry_interval_s * 1000.0 + 0.5);
+    dc_meta->timestamp_ticks_per_s = capture_sample_format(board).timestamp_ticks_per_s;
+    dc_meta->fec_group_size = fec_group_size;
+    dc_meta->retransmit_history = retransmit_history_size;
+    fill_sample_schema(capture_sample_format(board), dc_meta->schema);
+}
 
-        // DATA 3: encoder velocity
-        for (int i = 0; i < num_encoders; i++) {
-            float encoder_velocity_float= static_cast<float>(dvrk_controller.Board->GetEncoderVelocityPredicted(i));
-            data_packet[count++] = *reinterpret_cast<uint32_t *>(&encoder_velocity_float);
-        }
+void reset_packet_ring(Packet_Ring_Info *pr)
+{
+    pr->head = 0;
+    pr->tail = 0;
+    pr->cons_waiting = false;
+    pr->full_count = 0;
 
-        // DATA 4 & 5: motor current and motor status (for num_motors)
-        for (int i = 0; i < num_motors; i++) {
-            uint32_t motor_curr = dvrk_controller.Board->GetMotorCurrent(i); 
-            // uint32_t motor_status = dvrk_controller.Board->GetMotorStatus(i);
+    memset(pr->ring, 0, sizeof(pr->ring));
+}
 
-            uint32_t raw_cmd_current;
-            dvrk_controller.Port->ReadQuadlet(dvrk_controller.Port->GetBoardId(0), ((i+1) << 4) | 1, raw_cmd_current);
-            // int16_t raw_cmd_current_16_bit = static_cast<int16_t>(raw_cmd_current);
-            // uint16_t cmd_current_casted = *reinterpret_cast<uint16_t *>(&raw_cmd_current_16_bit);
-  
-            data_packet[count++] = (uint32_t)(((raw_cmd_current & 0x0000FFFF) << 16) | (motor_curr & 0x0000FFFF));
+// wakes up the consumer if it is blocked (or about to block) waiting for a packet
+static void wake_consumer(Packet_Ring_Info *pr)
+{
+    if (pr->cons_waiting.load()) {
+        uint64_t one = 1;
+        if (write(pr->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            cout << "[ERROR] failed to signal consumer thread" << endl;
         }
+    }
+}
 
-        if (use_ps_io_flag){
-            data_packet[count++] = dvrk_controller.Board->ReadDigitalIO();
-            data_packet[count++] = (uint32_t) returnMIOPins();
-        }
+// returns the next free slot, or nullptr if the ring is full
+static uint32_t *packet_ring_slot(Packet_Ring_Info *pr)
+{
+    uint32_t head = pr->head.load(memory_order_relaxed);
+
+    if (head - pr->tail.load(memory_order_acquire) == PACKET_RING_SLOTS) {
+        return nullptr;
+    }
+
+    return pr->ring[head & (PACKET_RING_SLOTS - 1)];
+}
+
+// makes the slot returned by packet_ring_slot, holding a packet of length bytes with
+// samples samples (0 if it is not a data packet), available to the consumer. In
+// retransmit mode, the sequence number is appended to data packets.
+static void packet_ring_publish(Packet_Ring_Info *pr, uint16_t length, uint16_t samples)
+{
+    uint32_t slot = pr->head.load(memory_order_relaxed) & (PACKET_RING_SLOTS - 1);
+    if (samples > 0 && retransmit_history_size > 0) {
+        memcpy(reinterpret_cast<uint8_t *>(pr->ring[slot]) + length, &data_packet_sequence, sizeof(uint32_t));
+        data_packet_sequence++;
+        length += sizeof(uint32_t);
+    }
+    pr->length[slot] = length;
+    pr->samples[slot] = samples;
+    pr->head.fetch_add(1);  // seq_cst: ordered before the cons_waiting check
+    wake_consumer(pr);
+}
 
-        if (use_pot_flag){
-            for (int i = 0; i < num_encoders; i++) {
-                data_packet[count++] = dvrk_controller.Board->GetAnalogInput(i);
+// blocks the consumer until head moves past seen_head, the capture is stopped,
+// or timeout_us expires (timeout_us < 0: no timeout)
+static void wait_for_packets(Packet_Ring_Info *pr, uint32_t seen_head, long timeout_us)
+{
+    // announce the wait, then check again so a packet published in
+    // between is not missed (the producer writes event_fd in that case)
+    pr->cons_waiting = true;
+
+    if (seen_head == pr->head.load() && !stop_data_collection_flag) {
+        struct pollfd pfd = { pr->event_fd, POLLIN, 0 };
+        timespec timeout = { timeout_us / 1000000, (timeout_us % 1000000) * 1000 };
+
+        if (ppoll(&pfd, 1, (timeout_us < 0) ? NULL : &timeout, NULL) > 0) {
+            uint64_t count;
+            if (read(pr->event_fd, &count, sizeof(count)) < 0) {
+                cout << "[ERROR] consumer thread failed to wait for data" << endl;
             }
         }
+    }
 
-        
-        if (useSampleRate){
-            
-            deadline.tv_nsec += period_ns;
-            if (deadline.tv_nsec >= 1'000'000'000) {
-                deadline.tv_sec++;
-                deadline.tv_nsec -= 1'000'000'000;
-            }
+    pr->cons_waiting = false;
+}
 
-            // 4) busy spin until deadline, subtracting work_ns if you like
-            timespec now;
-            do {
-                clock_gettime(CLOCK_MONOTONIC_RAW, &now);
-            } while ((  now.tv_sec  < deadline.tv_sec) ||
-                        (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec));
+// sends count packets of the ring, starting at index first, followed by the extra packet
+// of extra_length bytes if not 0 (FEC parity), with one sendmmsg() call.
+// Returns the number of packets sent, or -1 on error.
+static int udp_transmit_batch(UDP_Info *udp_host, Packet_Ring_Info *pr, uint32_t first, uint32_t count,
+                              uint32_t *extra, uint16_t extra_length)
+{
+    struct mmsghdr msgs[PACKET_RING_SLOTS + 1];
+    struct iovec iovecs[PACKET_RING_SLOTS + 1];
+    const uint32_t total = count + ((extra_length > 0) ? 1 : 0);
+    // once per batch, the host may change during the capture
+    struct sockaddr_in addr = host_address();
+
+    memset(msgs, 0, total * sizeof(struct mmsghdr));
+
+    for (uint32_t i = 0; i < total; i++) {
+        if (i < count) {
+            iovecs[i].iov_base = pr->ring[(first + i) & (PACKET_RING_SLOTS - 1)];
+            iovecs[i].iov_len = pr->length[(first + i) & (PACKET_RING_SLOTS - 1)];
+        } else {
+            iovecs[i].iov_base = extra;
+            iovecs[i].iov_len = extra_length;
         }
 
-        sample_count++;
+        msgs[i].msg_hdr.msg_name = &addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
-    return true;    
+    return sendmmsg(udp_host->socket, msgs, total, 0);
+}
+
+// starts the next FEC group
+static void fec_next_group()
+{
+    memset(&fec.parity[FEC_HEADER_QUADLETS], 0, fec.max_length);
+    fec.group++;
+    fec.complete = false;
+    fec.num_packets = 0;
+    fec.max_length = 0;
+    fec.length_xor = 0;
+}
+
+// starts the first FEC group of a capture (the ring indices restart at 0)
+static void reset_fec()
+{
+    fec_next_group();
+    fec.group = 0;
+    fec.encoded = 0;
+    fec_parity_count = 0;
+    fec_encode_ns = 0;
+    fec_encoded_count = 0;
 }
 
-void package_meta_data(DataCollectionMeta *dc_meta, AmpIO *board)
+// encodes the data packets of the batch of count packets at first (the ones not encoded
+// yet) into the parity of the group. The group is closed at its last data packet, or
+// before a burst status packet; returns the packets of the batch up to the end of the group.
+static uint32_t fec_encode(Packet_Ring_Info *pr, uint32_t first, uint32_t count)
 {
-    uint8_t num_encoders = (uint8_t) board->GetNumEncoders();
-    uint8_t num_motors = (uint8_t) board->GetNumMotors();
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+
+    int packets = 0;
+    uint32_t i = fec.encoded;
+    for (; i != first + count && !fec.complete; i++) {
+        const uint32_t slot = i & (PACKET_RING_SLOTS - 1);
+        const uint16_t length = pr->length[slot];
+
+        if (pr->samples[slot] == 0) {
+            if (fec.num_packets > 0 && length == sizeof(BurstStatus) && pr->ring[slot][0] == BURST_STATUS_TAG) {
+                fec.complete = true;
+                break;
+            }
+            continue;
+        }
+
+        fec.last_key = fec_packet_key(pr->ring[slot], use_compression_flag);
+        if (fec.num_packets == 0) {
+            fec.first_key = fec.last_key;
+        }
+        fec_xor(&fec.parity[FEC_HEADER_QUADLETS], pr->ring[slot], length);
+        fec.length_xor ^= length;
+        if (length > fec.max_length) {
+            fec.max_length = length;
+        }
+        fec.num_packets++;
+        packets++;
+        fec.complete = (fec.num_packets == fec_group_size);
+    }
+    fec.encoded = i;
 
-    dc_meta->hwvers = board->GetHardwareVersion();
-    dc_meta->num_encoders = (uint32_t) num_encoders;
-    dc_meta->num_motors = (uint32_t) num_motors;
+    if (packets > 0) {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        fec_encode_ns += ts_diff_ns(start, end);
+        fec_encoded_count += packets;
+    }
 
-    dc_meta->data_packet_size = (uint32_t)calculate_quadlets_per_packet(num_encoders, num_motors) * 4;
-    dc_meta->size_of_sample = (uint32_t) calculate_quadlets_per_sample(num_encoders, num_motors);
-    dc_meta->samples_per_packet = (uint32_t) calculate_samples_per_packet(num_encoders, num_motors);
+    return fec.complete ? fec.encoded - first : count;
 }
 
-void reset_double_buffer_info(Double_Buffer_Info *db, AmpIO *board)
+// fills the header of the parity packet of the group; returns its length in bytes
+static uint16_t fec_parity_packet()
 {
-    db->cons_buf = 0;
-    db->prod_buf = 0;
-    db->cons_busy = 0;
-    db->buffer_size = calculate_quadlets_per_packet(board->GetNumEncoders(), board->GetNumMotors()) * 4;
+    FecParityHeader *header = reinterpret_cast<FecParityHeader *>(fec.parity);
+    header->tag = FEC_PARITY_TAG;
+    header->group = fec.group;
+    header->first_key = fec.first_key;
+    header->last_key = fec.last_key;
+    header->num_packets = fec.num_packets;
+    header->length = fec.max_length;
+    header->length_xor = fec.length_xor;
+    return (uint16_t) (sizeof(FecParityHeader) + fec.max_length);
+}
 
-    memset(db->double_buffer, 0, sizeof(db->double_buffer));
+// allocates (and faults in) the history for retransmit mode, 0 packets if off
+static void allocate_retransmit_history(uint32_t size)
+{
+    retransmit_history.packets.assign((size_t) size * UDP_MAX_PAYLOAD_QUADLETS, 0);
+    retransmit_history.length.assign(size, 0);
+    retransmit_history.sequence = std::vector<atomic_uint32_t>(size);
+    for (uint32_t i = 0; i < size; i++) {
+        retransmit_history.sequence[i] = 0;
+    }
 }
 
-void *consume_data(void *arg)
+// empties the history for a new capture (the sequence numbers restart at 0)
+static void reset_retransmit_history()
 {
-    Double_Buffer_Info* db = (Double_Buffer_Info*)arg;
+    for (uint32_t i = 0; i < retransmit_history_size; i++) {
+        retransmit_history.sequence[i] = 0;
+    }
+    data_packet_sequence = 0;
+    retransmit_count = 0;
+    retransmit_miss_count = 0;
+}
 
-    while (!stop_data_collection_flag) {
+// events of the current capture, by the sequence number of their command: an event marked
+// again by the host (its command or the event packet was lost) is sent again as it was
+const uint32_t EVENT_HISTORY = 64;
+static EventPacket event_history[EVENT_HISTORY];
+// sequence number of the last sample rate command (older ones arriving late are ignored)
+static uint32_t sample_rate_sequence = 0;
 
-        if (db->prod_buf != db->cons_buf) {
-            
-            db->cons_busy = 1; 
-            udp_transmit(&udp_host, db->double_buffer[db->cons_buf], db->buffer_size);
-            data_packet_count++;
-            db->cons_busy = 0; 
+// forgets the capture commands (the host numbers them from 1 in each capture, and again
+// when it reattaches)
+static void reset_capture_commands()
+{
+    memset(event_history, 0, sizeof(event_history));
+    sample_rate_sequence = 0;
+}
 
-            db->cons_buf = (db->cons_buf + 1) % 2;
-        }   
+// copies the packet of the ring slot to the history if it is a data packet
+static void retransmit_history_store(Packet_Ring_Info *pr, uint32_t slot)
+{
+    if (retransmit_history_size == 0 || pr->samples[slot] == 0) {
+        return;
     }
 
-    return nullptr;
+    const uint16_t length = pr->length[slot];
+    uint32_t sequence;
+    memcpy(&sequence, reinterpret_cast<uint8_t *>(pr->ring[slot]) + length - sizeof(uint32_t), sizeof(sequence));
+
+    const uint32_t h = sequence % retransmit_history_size;
+    retransmit_history.sequence[h].store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&retransmit_history.packets[(size_t) h * UDP_MAX_PAYLOAD_QUADLETS], pr->ring[slot], length);
+    retransmit_history.length[h] = length;
+    retransmit_history.sequence[h].store(sequence + 1, memory_order_release);
 }
 
-SM wait_for_host_handshake( SM sm ){
-    memset(recvd_cmd, 0, CMD_MAX_STRING_SIZE);
-    sm.udp_ret = udp_nonblocking_receive(&udp_host, recvd_cmd, CMD_MAX_STRING_SIZE);
+// copies the data packet of the sequence number out of the history; returns its length,
+// or 0 if it is no longer (or not yet) there
+static uint16_t retransmit_history_load(uint32_t sequence, uint32_t *packet)
+{
+    const uint32_t h = sequence % retransmit_history_size;
+    if (retransmit_history.sequence[h].load(memory_order_acquire) != sequence + 1) {
+        return 0;
+    }
+
+    uint16_t length = retransmit_history.length[h];
+    memcpy(packet, &retransmit_history.packets[(size_t) h * UDP_MAX_PAYLOAD_QUADLETS], length);
+    atomic_thread_fence(memory_order_acquire);
+
+    // overwritten while copying
+    if (retransmit_history.sequence[h].load(memory_order_relaxed) != sequence + 1) {
+        return 0;
+    }
+    return length;
+}
+
+// resends the data packets of a request of the host from the history, marked as
+// retransmitted. Called from a single thread at a time (see Retransmit_History).
+static void handle_nack_request(const void *data)
+{
+    static uint32_t packet[UDP_MAX_PAYLOAD_QUADLETS];
+    NackRequest request;
+    memcpy(&request, data, sizeof(request));
+
+    if (retransmit_history_size == 0) {
+        return;
+    }
+
+    const uint32_t num_ranges = (request.num_ranges < MAX_NACK_RANGES) ? request.num_ranges : MAX_NACK_RANGES;
+    for (uint32_t r = 0; r < num_ranges; r++) {
+        // older packets are gone anyway
+        const uint32_t count = (request.ranges[r].count < retransmit_history_size) ? request.ranges[r].count : retransmit_history_size;
+        for (uint32_t i = 0; i < count; i++) {
+            uint16_t length = retransmit_history_load(request.ranges[r].first + i, packet);
+            if (length == 0) {
+                retransmit_miss_count++;
+                continue;
+            }
+
+            uint8_t *trailer = reinterpret_cast<uint8_t *>(packet) + length - sizeof(uint32_t);
+            uint32_t sequence;
+            memcpy(&sequence, trailer, sizeof(sequence));
+            sequence |= RETRANSMITTED_PACKET_FLAG;
+            memcpy(trailer, &sequence, sizeof(sequence));
+
+            if (udp_transmit(&udp_host, packet, length) > 0) {
+                retransmit_count++;
+            }
+        }
+    }
+}
+
+// touches size bytes of the stack of the calling thread, so that it does not page fault
+// later (the pages stay resident with mlockall)
+static void __attribute__((noinline)) prefault_stack(size_t size)
+{
+    volatile uint8_t stack[PREFAULT_STACK_SIZE];
+    for (size_t i = 0; i < size && i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+// Failures of the real-time settings (e.g., missing CAP_SYS_NICE) are reported but not fatal
+
+// pins the calling thread to cpu (unless -1) and prefaults its stack if memory is locked
+static void pin_thread(const char *name, int cpu)
+{
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            cout << "[warning] failed to pin " << name << " to CPU " << cpu << ": " << strerror(err) << endl;
+        }
+    }
+
+    if (realtime.lock_memory) {
+        prefault_stack(PREFAULT_STACK_SIZE);
+    }
+}
+
+// switches the calling thread to SCHED_FIFO with the -R priority during a capture, and
+// back to default scheduling after it (the state machine busy-polls the socket between
+// captures, which must not starve the rest of the system)
+static void set_thread_realtime(const char *name, bool capturing)
+{
+    if (realtime.priority == 0) {
+        return;
+    }
+
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = capturing ? realtime.priority : 0;
+    int err = pthread_setschedparam(pthread_self(), capturing ? SCHED_FIFO : SCHED_OTHER, &param);
+    if (err != 0) {
+        cout << "[warning] failed to set scheduling policy of " << name << ": " << strerror(err) << endl;
+    }
+}
+
+// locks the pages of the program (current and future) in memory; the static buffers
+// (packet ring, averager) are faulted in by mlockall itself
+static void lock_memory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        perror("[warning] mlockall failed");
+        return;
+    }
+    cout << "Memory locked" << endl;
+}
+
+void *consume_data(void *arg)
+{
+    Packet_Ring_Info* pr = (Packet_Ring_Info*)arg;
+
+    pin_thread("consumer", realtime.consumer_cpu);
+    set_thread_realtime("consumer", true);
+
+    // time when the consumer first saw the packets of a partial batch
+    timespec batch_start;
+    bool batch_pending = false;
+
+    while (!stop_data_collection_flag) {
+
+        uint32_t tail = pr->tail.load(memory_order_relaxed);
+        uint32_t head = pr->head.load(memory_order_acquire);
+        uint32_t ready = head - tail;
+        // the parity of a closed group is sent even if no packet is ready
+        bool parity_pending = fec.complete;
+
+        if (ready == 0 && !parity_pending) {
+            wait_for_packets(pr, head, -1);
+            continue;
+        }
+
+        if (ready < tx_batch_max && tx_batch_latency_us > 0 && !parity_pending) {
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+            if (!batch_pending) {
+                batch_start = now;
+                batch_pending = true;
+            }
+
+            long waited_us = (now.tv_sec - batch_start.tv_sec) * 1000000L + (now.tv_nsec - batch_start.tv_nsec) / 1000;
+            if (waited_us < tx_batch_latency_us) {
+                wait_for_packets(pr, head, tx_batch_latency_us - waited_us);
+                continue;
+            }
+        }
+
+        batch_pending = false;
+
+        uint32_t count = (ready < tx_batch_max) ? ready : tx_batch_max;
+        uint16_t parity_length = 0;
+        if (fec_group_size > 0) {
+            // the batch ends with the parity of the group if it closes in it
+            count = fec_encode(pr, tail, count);
+            if (fec.complete) {
+                parity_length = fec_parity_packet();
+            }
+        }
+
+        int sent = udp_transmit_batch(&udp_host, pr, tail, count, fec.parity, parity_length);
+        tx_syscall_count++;
+
+        if (sent < 0) {
+            // drop the batch rather than stall sampling (the host may request it again)
+            tx_error_count++;
+            for (uint32_t i = 0; i < count; i++) {
+                if (pr->samples[(tail + i) & (PACKET_RING_SLOTS - 1)] > 0) {
+                    dropped_packet_count++;
+                    dropped_sample_count += pr->samples[(tail + i) & (PACKET_RING_SLOTS - 1)];
+                }
+                retransmit_history_store(pr, (tail + i) & (PACKET_RING_SLOTS - 1));
+            }
+            sent = count;
+            if (parity_length > 0) {
+                fec_next_group();
+            }
+        } else {
+            // a partial send never includes the parity, which is retried with the rest
+            if (sent > (int) count) {
+                fec_parity_count++;
+                fec_next_group();
+                sent = count;
+            }
+
+            int packets = 0;
+            long long samples = 0;
+            for (int i = 0; i < sent; i++) {
+                uint32_t slot = (tail + i) & (PACKET_RING_SLOTS - 1);
+                wire_byte_count += pr->length[slot];
+                if (pr->samples[slot] > 0) {
+                    packets++;
+                    samples += pr->samples[slot];
+                }
+                retransmit_history_store(pr, slot);
+            }
+            data_packet_count += packets;
+            sent_sample_count += samples;
+        }
+
+        pr->tail.store(tail + sent, memory_order_release);
+    }
+
+    return nullptr;
+}
+
+// CPU time of the program (all threads), in seconds
+static double process_cpu_s()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+// time since the start of the capture, in seconds
+static double capture_time()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return ts_diff_s(t_data_collection_start, now);
+}
+
+static void reset_telemetry()
+{
+    telemetry.sequence = 0;
+    telemetry.next_time = telemetry_interval_s;
+    telemetry.last_time = 0.0;
+    telemetry.last_sample_count = 0;
+    telemetry.last_cpu_s = process_cpu_s();
+}
+
+// fills a telemetry packet with the counters of the capture so far
+static void fill_telemetry(TelemetryPacket *tp, bool final)
+{
+    double now = capture_time();
+    double cpu_s = process_cpu_s();
+    double interval = now - telemetry.last_time;
+
+    memset(tp, 0, sizeof(*tp));
+    tp->tag = TELEMETRY_TAG;
+    tp->sequence = telemetry.sequence++;
+    tp->final = final ? 1 : 0;
+    tp->emio_errors = (uint32_t) emio_read_error_counter;
+    tp->producer_stalls = packet_ring.full_count;
+    tp->transmit_errors = (uint32_t) tx_error_count;
+    tp->dropped_packets = (uint32_t) dropped_packet_count;
+    tp->fec_parity_packets = (uint32_t) fec_parity_count;
+    tp->samples_taken = (uint64_t) sample_count;
+    tp->packets_sent = (uint64_t) data_packet_count;
+    tp->samples_sent = (uint64_t) sent_sample_count;
+    tp->timestamp = now;
+    if (interval > 0.0) {
+        tp->sample_rate = (sample_count - telemetry.last_sample_count) / interval;
+        tp->cpu_load = (float) ((cpu_s - telemetry.last_cpu_s) / interval);
+    }
+    if (fec_encoded_count > 0) {
+        tp->fec_encode_ns = (float) fec_encode_ns / fec_encoded_count;
+    }
+    tp->retransmitted_packets = (uint32_t) retransmit_count;
+    tp->retransmit_misses = (uint32_t) retransmit_miss_count;
+    tp->numbered_packets = data_packet_sequence;
+    tp->numbered_samples = (uint64_t) (sent_sample_count + dropped_sample_count);
+    if (udp_faults.IsEnabled()) {
+        UdpFaultInjector::Stats faults = udp_faults.GetStats();
+        tp->faults_received = (uint32_t) faults.Received;
+        tp->faults_impaired = (uint32_t) (faults.Dropped + faults.Duplicated + faults.Reordered + faults.Delayed + faults.Truncated);
+    }
+
+    telemetry.last_time = now;
+    telemetry.last_sample_count = sample_count;
+    telemetry.last_cpu_s = cpu_s;
+}
+
+// final telemetry packet of the last capture, sent again when the host repeats the stop
+// command (tag 0: none)
+static TelemetryPacket last_final_telemetry;
+
+// stops the consumer thread and prints the capture summary. If report_to_host, the
+// final telemetry packet is sent to the host.
+static void stop_capture(pthread_t consumer_t, bool report_to_host)
+{
+    stop_data_collection_flag = true;
+    packet_ring.cons_waiting = true;
+    wake_consumer(&packet_ring);
+
+    uint64_t one = 1, count;
+    if (write(control_mailbox.event_fd, &one, sizeof(one)) != sizeof(one)) {
+        cout << "[ERROR] failed to signal control thread" << endl;
+    }
+
+    pthread_join(consumer_t, nullptr);
+    pthread_join(control_mailbox.thread, nullptr);
+
+    // the control thread may have exited before the signal (e.g., after the stop command)
+    while (read(control_mailbox.event_fd, &count, sizeof(count)) > 0) {}
+
+    // packets still in the ring are not sent (the host may request them)
+    for (uint32_t i = packet_ring.tail; i != packet_ring.head; i++) {
+        if (packet_ring.samples[i & (PACKET_RING_SLOTS - 1)] > 0) {
+            dropped_packet_count++;
+            dropped_sample_count += packet_ring.samples[i & (PACKET_RING_SLOTS - 1)];
+        }
+        retransmit_history_store(&packet_ring, i & (PACKET_RING_SLOTS - 1));
+    }
+
+    capture_in_progress = false;
+    set_thread_realtime("producer", false);
+
+    if (report_to_host) {
+        // parity of the last group (closed early)
+        if (fec_group_size > 0 && fec.num_packets > 0) {
+            if (udp_transmit(&udp_host, fec.parity, fec_parity_packet()) < 1) {
+                cout << "[ERROR] failed to send last FEC parity packet to host" << endl;
+            } else {
+                fec_parity_count++;
+            }
+        }
+
+        fill_telemetry(&last_final_telemetry, true);
+        if (udp_transmit(&udp_host, &last_final_telemetry, sizeof(last_final_telemetry)) < 1) {
+            cout << "[ERROR] failed to send final telemetry to host" << endl;
+        }
+    } else {
+        last_final_telemetry.tag = 0;
+    }
+
+    cout << "------------------------------------------------" << endl;
+    cout << "UDP DATA PACKETS SENT TO HOST: " << data_packet_count << endl;
+    cout << "SAMPLES SENT TO HOST: " << sent_sample_count << " (" << sample_count << " taken)" << endl;
+    cout << "EMIO ERROR COUNT: " << emio_read_error_counter << endl;
+    cout << "PRODUCER STALLS (PACKET RING FULL): " << packet_ring.full_count << endl;
+    cout << "TRANSMIT SYSCALLS: " << tx_syscall_count << " (" << (float) (tx_syscall_count / last_timestamp) << "/s)" << endl;
+    cout << "AVERAGE BATCH SIZE: " << ((tx_syscall_count > 0) ? (float) data_packet_count / tx_syscall_count : 0.0f) << " packets" << endl;
+    cout << "TRANSMIT ERRORS: " << tx_error_count << " (" << dropped_packet_count << " data packets not sent)" << endl;
+    cout << "TIME ELAPSED: " << last_timestamp << endl;
+    cout << "AVERAGE SAMPLE RATE: " << (float) (sample_count / last_timestamp) << "Hz" << endl;
+    if (use_oversampling_flag) {
+        cout << "BOARD READS: " << board_read_count << " (" << (float) (board_read_count / last_timestamp) << "/s, "
+             << oversampling.reads_per_sample << " per sample)" << endl;
+    }
+    if (useSampleRate) {
+        print_sample_pacer(&sample_pacer, last_timestamp);
+    }
+    if (use_burst_flag) {
+        if (burst_recorder.Complete()) {
+            cout << "BURST: " << burst_recorder.NumSamples() << " samples (trigger at sample " << burst_recorder.TriggerIndex()
+                 << "), " << burst_sent_samples << " sent" << endl;
+        } else {
+            cout << "BURST: not triggered (" << burst_recorder.Recorded() << " samples recorded)" << endl;
+        }
+    }
+    if (use_compression_flag && wire_byte_count > 0) {
+        long long sample_bytes = sent_sample_count * sample_format.quadlets() * 4;
+        cout << "COMPRESSION RATIO: " << (float) sample_bytes / wire_byte_count << " (" << sample_bytes
+             << " bytes of samples in " << wire_byte_count << " bytes)" << endl;
+    }
+    if (fec_group_size > 0) {
+        cout << "FEC PARITY PACKETS: " << fec_parity_count << " (groups of " << fec_group_size << "), encoding "
+             << ((fec_encoded_count > 0) ? (float) fec_encode_ns / fec_encoded_count : 0.0f) << " ns per data packet" << endl;
+    }
+    if (retransmit_history_size > 0) {
+        cout << "RETRANSMITTED PACKETS: " << retransmit_count << " (" << retransmit_miss_count
+             << " requested packets no longer in the history of " << retransmit_history_size << ")" << endl;
+    }
+    if (udp_faults.IsEnabled()) {
+        UdpFaultInjector::Stats faults = udp_faults.GetStats();
+        cout << "FAULT INJECTION: " << faults.Received - fault_stats_start.Received << " datagrams received, "
+             << faults.Dropped - fault_stats_start.Dropped << " dropped, "
+             << faults.Duplicated - fault_stats_start.Duplicated << " duplicated, "
+             << faults.Reordered - fault_stats_start.Reordered << " reordered, "
+             << faults.Delayed - fault_stats_start.Delayed << " delayed, "
+             << faults.Truncated - fault_stats_start.Truncated << " truncated" << endl;
+    }
+    cout << "------------------------------------------------" << endl << endl;
+
+    emio_read_error_counter = 0; 
+    data_packet_count = 0;
+    sent_sample_count = 0;
+    sample_count = 0;
+    board_read_count = 0;
+    tx_syscall_count = 0;
+    tx_error_count = 0;
+    dropped_packet_count = 0;
+    dropped_sample_count = 0;
+    wire_byte_count = 0;
+}
+
+// Session commands may arrive in any state, e.g. when the host program was
+// restarted after a crash or network outage, and are not out of sync
+static bool is_session_cmd(const char *cmd)
+{
+    return (strcmp(cmd, HOST_READY_CMD) == 0) || (strcmp(cmd, HOST_RESUME_SESSION_CMD) == 0);
+}
+
+// receives a datagram of at most size bytes from the host, waiting up to timeout_ms
+// (-1: until it arrives or the capture stops). Returns its length, 0 if the capture
+// stopped or the wait timed out, or a UDP_RETURN_CODES error.
+static int control_receive(void *data, int size, struct sockaddr_in *addr, int timeout_ms)
+{
+    if (udp_faults.IsEnabled()) {
+        // held datagrams come from the host of the session
+        int ret = udp_faults.Release(data, size);
+        if (ret > 0) {
+            *addr = host_address();
+            return ret;
+        }
+        int due_ms = udp_faults.NextDueMs();
+        if (due_ms >= 0 && (timeout_ms < 0 || due_ms < timeout_ms)) {
+            timeout_ms = due_ms;
+        }
+    }
+
+    struct pollfd fds[2] = {
+        { udp_host.socket, POLLIN, 0 },
+        { control_mailbox.event_fd, POLLIN, 0 }
+    };
+
+    int ret = poll(fds, 2, timeout_ms);
+    if (ret < 0) {
+        return (errno == EINTR) ? 0 : UDP_SELECT_ERROR;
+    }
+    if (ret == 0 || stop_data_collection_flag || (fds[1].revents & POLLIN)) {
+        return 0;
+    }
+
+    socklen_t addr_len = sizeof(*addr);
+    ret = recvfrom(udp_host.socket, data, size, 0, (struct sockaddr *) addr, &addr_len);
+    if (ret == 0) {
+        return UDP_CONNECTION_CLOSED_ERROR;
+    }
+    if (ret > 0 && udp_faults.IsEnabled()) {
+        return udp_faults.Receive(data, ret);
+    }
+    return (ret < 0) ? UDP_SOCKET_ERROR : ret;
+}
+
+// waits for a free slot of the mailbox (the producer handles the commands between packets)
+static Control_Command *control_mailbox_slot()
+{
+    uint32_t head = control_mailbox.head.load(memory_order_relaxed);
+
+    while (head - control_mailbox.tail.load(memory_order_acquire) == CONTROL_MAILBOX_SLOTS) {
+        if (stop_data_collection_flag) {
+            return nullptr;
+        }
+        usleep(100);
+    }
+
+    return &control_mailbox.slots[head & (CONTROL_MAILBOX_SLOTS - 1)];
+}
+
+// receives the commands of the host during a capture; stops after a command that
+// ends the capture
+void *control_data(void *)
+{
+    pin_thread("control", realtime.consumer_cpu);
+
+    bool running = true;
+    while (running && !stop_data_collection_flag) {
+        Control_Command *command = control_mailbox_slot();
+        if (command == nullptr) {
+            break;
+        }
+
+        memset(command->cmd, 0, sizeof(command->cmd));
+        int ret = control_receive(command->cmd, sizeof(command->cmd) - 1, &command->addr, -1);
+        if (ret == 0) {
+            continue;
+        }
+
+        command->timestamp = capture_time();
+        command->value = 0;
+        command->sequence = 0;
+
+        if (ret > 0 && is_nack_request(command->cmd, ret)) {
+            // resent right away, without going through the producer
+            handle_nack_request(command->cmd);
+            continue;
+        }
+
+        if (ret > 0 && strcmp(command->cmd, HOST_START_DATA_COLLECTION) == 0) {
+            // start command sent again by the host (see DataCollection::handle_packet_timeout)
+            continue;
+        }
+
+        if (ret < 0) {
+            command->type = CONTROL_UDP_ERROR;
+        } else if (strcmp(command->cmd, HOST_STOP_DATA_COLLECTION) == 0) {
+            command->type = CONTROL_STOP;
+        } else if (strcmp(command->cmd, HOST_BURST_TRIGGER_CMD) == 0) {
+            command->type = CONTROL_BURST_TRIGGER;
+        } else if (is_capture_command(command->cmd, ret, HOST_SET_SAMPLE_RATE_CMD) ||
+                   is_capture_command(command->cmd, ret, HOST_MARK_EVENT_CMD)) {
+            command->type = (strcmp(command->cmd, HOST_MARK_EVENT_CMD) == 0) ? CONTROL_MARK_EVENT : CONTROL_SET_SAMPLE_RATE;
+            CaptureCommand capture;
+            memcpy(&capture, command->cmd, sizeof(capture));
+            command->value = capture.value;
+            command->sequence = capture.sequence;
+        } else if (is_session_cmd(command->cmd)) {
+            command->type = CONTROL_SESSION;
+        } else {
+            // stray, late or truncated datagram (e.g. a NACK cut short): the host sends
+            // again what it needs
+            cout << "[WARNING] Ignoring unexpected datagram from host during the capture (" << ret << " bytes)" << endl;
+            continue;
+        }
+
+        // the state machine receives the commands that follow the end of the capture
+        running = !(command->type == CONTROL_STOP || command->type == CONTROL_UDP_ERROR ||
+                    (command->type == CONTROL_SESSION && strcmp(command->cmd, HOST_READY_CMD) == 0));
+
+        control_mailbox.head.fetch_add(1, memory_order_release);
+    }
+
+    return nullptr;
+}
+
+// handles a session command received in recvd_cmd. The caller sets sm.state
+// to the state to remain in; consumer_t is only used if a capture is running.
+// Note that the host address has already been set to the sender (see set_host_address).
+SM handle_session_cmd(SM sm, pthread_t *consumer_t)
+{
+    if (strcmp(recvd_cmd, HOST_READY_CMD) == 0) {
+        // fresh handshake from a host: drop the old session
+        cout << "Received Message - " << HOST_READY_CMD << " (new session)" << endl;
+
+        if (capture_in_progress) {
+            stop_capture(*consumer_t, false);
+        }
+
+        session_id = 0;
+        sm.state = SM_WAIT_FOR_HOST_FLAG_CMD;
+        return sm;
+    }
+
+    cout << "Received Message - " << HOST_RESUME_SESSION_CMD << endl;
+
+    if (session_id != 0 && !capture_in_progress) {
+        // idle session: resend metadata and complete the handshake as usual
+        sm.state = SM_SEND_DATA_COLLECTION_METADATA;
+        return sm;
+    }
+
+    // no session (host falls back to a full handshake) or capture in progress
+    // (host reattaches to the data stream, which now goes to its address)
+    if (capture_in_progress) {
+        reset_capture_commands();
+    }
+    package_meta_data(&data_collection_meta, dvrk_controller.Board);
+
+    if (udp_transmit(&udp_host, &data_collection_meta, sizeof(struct DataCollectionMeta)) < 1) {
+        sm.ret = SM_UDP_INVALID_HOST_ADDR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+// last datagram of the handshake, to skip its copies
+static char handshake_last[CMD_MAX_STRING_SIZE];
+static int handshake_last_size = 0;
+
+// receives the next command or value of the handshake, as udp_nonblocking_receive,
+// skipping the copies of the previous datagram that the network may deliver (the host
+// never sends the same datagram twice in a row). The datagram is left in recvd_cmd, and
+// copied to data if it has size bytes.
+static int handshake_receive(void *data, int size)
+{
+    char datagram[CMD_MAX_STRING_SIZE];
+    memset(datagram, 0, sizeof(datagram));
+
+    int ret = udp_nonblocking_receive(&udp_host, datagram, sizeof(datagram));
+    if (ret <= 0) {
+        return ret;
+    }
+    if (ret == handshake_last_size && memcmp(datagram, handshake_last, ret) == 0) {
+        return UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT;
+    }
+    memcpy(handshake_last, datagram, ret);
+    handshake_last_size = ret;
+
+    memcpy(recvd_cmd, datagram, CMD_MAX_STRING_SIZE);
+    if (ret == size) {
+        memcpy(data, datagram, size);
+    }
+    return ret;
+}
+
+// datagram in recvd_cmd other than the command or value expected in the handshake: a
+// session command, or a command or value lost, duplicated or reordered on the way. The
+// host starts the handshake again when no metadata comes back (see
+// DataCollection::handshake), so the rest of this one is ignored until then.
+static SM unexpected_handshake_message(SM sm)
+{
+    if (is_session_cmd(recvd_cmd)) {
+        return handle_session_cmd(sm, nullptr);
+    }
+
+    cout << "[WARNING] Unexpected message in the handshake, waiting for the host to start it again" << endl;
+    handshake_last_size = 0;
+    sm.state = SM_WAIT_FOR_HOST_HANDSHAKE;
+    return sm;
+}
+
+SM wait_for_host_handshake( SM sm ){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
+
+    if (sm.udp_ret > 0) {
+        if (strcmp(recvd_cmd,  HOST_READY_CMD) == 0) {
+            cout << "Received Message - " <<  HOST_READY_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_FLAG_CMD;
+        } else if (is_session_cmd(recvd_cmd)) {
+            sm = handle_session_cmd(sm, nullptr);
+        } else {
+            // rest of a handshake given up (see unexpected_handshake_message)
+            sm.state = SM_WAIT_FOR_HOST_HANDSHAKE;
+        }
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_HANDSHAKE;
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_flag_cmd(SM sm){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
+
+    if (sm.udp_ret > 0) {
+        if (strcmp(recvd_cmd, HOST_FLAG_CMD) == 0) {
+            cout << "Received Message - " << HOST_FLAG_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_FLAG_VALUE;
+        } else {
+            sm = unexpected_handshake_message(sm);
+        }
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_FLAG_CMD;
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+// state after the flag value or an option value, waiting for the next option
+// enabled in the flags (sample rate, channel mask, oversampling), in that order
+static int next_option_state(int state)
+{
+    // options with a value, in the order the host sends them
+    struct OptionStates {
+        int cmd_state;
+        int value_state;
+        bool enabled;
+    };
+    const OptionStates options[] = {
+        { SM_WAIT_FOR_HOST_SAMPLE_RATE_CMD, SM_WAIT_FOR_HOST_SAMPLE_RATE_VALUE, useSampleRate },
+        { SM_WAIT_FOR_HOST_CHANNEL_MASK_CMD, SM_WAIT_FOR_HOST_CHANNEL_MASK_VALUE, use_channel_mask_flag },
+        { SM_WAIT_FOR_HOST_OVERSAMPLING_CMD, SM_WAIT_FOR_HOST_OVERSAMPLING_VALUE, use_oversampling_flag },
+        { SM_WAIT_FOR_HOST_BURST_CMD, SM_WAIT_FOR_HOST_BURST_VALUE, use_burst_flag }
+    };
+    const int num_options = sizeof(options) / sizeof(options[0]);
+
+    // first option after the one whose value was received
+    int i = 0;
+    if (state != SM_WAIT_FOR_HOST_FLAG_VALUE) {
+        while (i < num_options && options[i].value_state != state) {
+            i++;
+        }
+        i++;
+    }
+
+    for (; i < num_options; i++) {
+        if (options[i].enabled) {
+            return options[i].cmd_state;
+        }
+    }
+    // always sent after the options (no room left in the flag byte)
+    return SM_WAIT_FOR_HOST_FEC_CMD;
+}
+
+SM wait_for_host_flag_value(SM sm){
+    uint8_t flag_cmd = 0x00;
+    sm.udp_ret = handshake_receive(&flag_cmd, sizeof(flag_cmd));
+
+    if (sm.udp_ret == sizeof(flag_cmd)) {
+        use_ps_io_flag = (flag_cmd & ENABLE_PSIO_MSK);
+        use_pot_flag = (flag_cmd & ENABLE_POT_MSK);
+        useSampleRate = (flag_cmd & ENABLE_SAMPLE_RATE_MSK);
+        use_compression_flag = (flag_cmd & ENABLE_COMPRESSION_MSK);
+        use_channel_mask_flag = (flag_cmd & ENABLE_CHANNEL_MASK_MSK);
+        use_oversampling_flag = (flag_cmd & ENABLE_OVERSAMPLING_MSK);
+        use_burst_flag = (flag_cmd & ENABLE_BURST_MSK);
+        use_fpga_timestamp_flag = (flag_cmd & ENABLE_FPGA_TIMESTAMP_MSK);
+
+        cout << "Received Flag Byte: 0x" << std::hex << static_cast<int>(flag_cmd) << std::dec << endl;
+
+        if (!useSampleRate && (use_ps_io_flag || use_pot_flag)){
+            reset_packet_ring(&packet_ring);
+        }
+        sm.state = next_option_state(SM_WAIT_FOR_HOST_FLAG_VALUE);
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_FLAG_VALUE;
+    }
+    else if (sm.udp_ret > 0) {
+        sm = unexpected_handshake_message(sm);
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_sample_rate_cmd(SM sm){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
+
+    if (sm.udp_ret > 0) {
+        if (strcmp(recvd_cmd, HOST_SAMPLE_RATE_CMD) == 0){
+            cout << "Received Message - " << HOST_SAMPLE_RATE_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_SAMPLE_RATE_VALUE;
+        } else {
+            sm = unexpected_handshake_message(sm);
+        }
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_SAMPLE_RATE_CMD;
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_sample_rate_value(SM sm){
+    int host_sample_rate = 0;
+    sm.udp_ret = handshake_receive(&host_sample_rate, sizeof(host_sample_rate));
+
+    if (sm.udp_ret == sizeof(host_sample_rate)){
+        SAMPLE_RATE = host_sample_rate;
+        printf("NEW SAMPLE RATE: %d\n", SAMPLE_RATE);
+
+        // Keep existing behavior when sample-rate mode is enabled.
+        use_ps_io_flag = true;
+
+        if (use_ps_io_flag){
+            reset_packet_ring(&packet_ring);
+        }
+
+        sm.state = next_option_state(SM_WAIT_FOR_HOST_SAMPLE_RATE_VALUE);
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_SAMPLE_RATE_VALUE;
+    }
+    else if (sm.udp_ret > 0) {
+        sm = unexpected_handshake_message(sm);
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_channel_mask_cmd(SM sm){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
+
+    if (sm.udp_ret > 0) {
+        if (strcmp(recvd_cmd, HOST_CHANNEL_MASK_CMD) == 0){
+            cout << "Received Message - " << HOST_CHANNEL_MASK_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_CHANNEL_MASK_VALUE;
+        } else {
+            sm = unexpected_handshake_message(sm);
+        }
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_CHANNEL_MASK_CMD;
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_channel_mask_value(SM sm){
+    SampleChannelMask host_channel_mask;
+    memset(&host_channel_mask, 0, sizeof(host_channel_mask));
+    sm.udp_ret = handshake_receive(&host_channel_mask, sizeof(host_channel_mask));
+
+    if (sm.udp_ret == sizeof(host_channel_mask)){
+        channel_mask = host_channel_mask;
+        printf("CHANNEL MASK: position 0x%x, velocity 0x%x, motor 0x%x, pot 0x%x\n",
+               channel_mask.encoder_position, channel_mask.encoder_velocity, channel_mask.motor, channel_mask.pot);
+
+        sm.state = next_option_state(SM_WAIT_FOR_HOST_CHANNEL_MASK_VALUE);
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_CHANNEL_MASK_VALUE;
+    }
+    else if (sm.udp_ret > 0) {
+        sm = unexpected_handshake_message(sm);
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_oversampling_cmd(SM sm){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
+
+    if (sm.udp_ret > 0) {
+        if (strcmp(recvd_cmd, HOST_OVERSAMPLING_CMD) == 0){
+            cout << "Received Message - " << HOST_OVERSAMPLING_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_OVERSAMPLING_VALUE;
+        } else {
+            sm = unexpected_handshake_message(sm);
+        }
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_OVERSAMPLING_CMD;
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_oversampling_value(SM sm){
+    OversamplingConfig host_oversampling;
+    memset(&host_oversampling, 0, sizeof(host_oversampling));
+    sm.udp_ret = handshake_receive(&host_oversampling, sizeof(host_oversampling));
+
+    if (sm.udp_ret == sizeof(host_oversampling)){
+        oversampling = host_oversampling;
+        if (oversampling.reads_per_sample < 1) {
+            oversampling.reads_per_sample = 1;
+        } else if (oversampling.reads_per_sample > MAX_READS_PER_SAMPLE) {
+            oversampling.reads_per_sample = MAX_READS_PER_SAMPLE;
+        }
+        oversampling.min_max = oversampling.min_max ? 1 : 0;
+        printf("OVERSAMPLING: %u reads per sample%s\n", oversampling.reads_per_sample,
+               oversampling.min_max ? ", with min/max" : "");
+
+        sm.state = next_option_state(SM_WAIT_FOR_HOST_OVERSAMPLING_VALUE);
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_OVERSAMPLING_VALUE;
+    }
+    else if (sm.udp_ret > 0) {
+        sm = unexpected_handshake_message(sm);
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_burst_cmd(SM sm){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
+
+    if (sm.udp_ret > 0) {
+        if (strcmp(recvd_cmd, HOST_BURST_CMD) == 0){
+            cout << "Received Message - " << HOST_BURST_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_BURST_VALUE;
+        } else {
+            sm = unexpected_handshake_message(sm);
+        }
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_BURST_CMD;
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_burst_value(SM sm){
+    BurstConfig host_burst;
+    memset(&host_burst, 0, sizeof(host_burst));
+    sm.udp_ret = handshake_receive(&host_burst, sizeof(host_burst));
+
+    if (sm.udp_ret == sizeof(host_burst)){
+        burst_config = host_burst;
+        if (burst_config.edge == 0 || burst_config.edge > BURST_EDGE_BOTH) {
+            burst_config.edge = BURST_EDGE_RISING;
+        }
+
+        // the sample format is known (the burst follows the other options), so the ring
+        // is allocated now rather than when the capture starts
+        unsigned int quadlets = calculate_quadlets_per_sample(dvrk_controller.Board);
+        burst_recorder.Configure(burst_config, quadlets);
+        printf("BURST: %u samples before and %u from the trigger (%.1f MB), trigger %u (channel %u)\n",
+               burst_config.pre_trigger, burst_config.post_trigger,
+               ((double) burst_config.pre_trigger + burst_config.post_trigger) * quadlets * 4 / 1e6,
+               burst_config.trigger, burst_config.channel);
+        if ((burst_config.trigger == BURST_TRIGGER_DIGITAL_IO && burst_config.channel >= dvrk_controller.Board->GetNumBoards()) ||
+            (burst_config.trigger == BURST_TRIGGER_MOTOR_CURRENT && burst_config.channel >= dvrk_controller.Board->GetNumMotors())) {
+            cout << "[WARNING] No channel " << burst_config.channel << " to trigger the burst, only the host can" << endl;
+        }
+
+        sm.state = next_option_state(SM_WAIT_FOR_HOST_BURST_VALUE);
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_BURST_VALUE;
+    }
+    else if (sm.udp_ret > 0) {
+        sm = unexpected_handshake_message(sm);
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
+
+SM wait_for_host_fec_cmd(SM sm){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
+
+    if (sm.udp_ret > 0) {
+        if (strcmp(recvd_cmd, HOST_FEC_CMD) == 0){
+            cout << "Received Message - " << HOST_FEC_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_FEC_VALUE;
+        } else {
+            sm = unexpected_handshake_message(sm);
+        }
+    }
+    else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
+        sm.state = SM_WAIT_FOR_HOST_FEC_CMD;
+    }
+    else {
+        sm.ret = SM_UDP_ERROR;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
+    }
+
+    return sm;
+}
 
-    if (sm.udp_ret > 0) {
-        if (strcmp(recvd_cmd,  HOST_READY_CMD) == 0) {
-            cout << "Received Message - " <<  HOST_READY_CMD << endl;
-            sm.state = SM_WAIT_FOR_HOST_FLAG_CMD;
-        } else {
-            sm.ret = SM_OUT_OF_SYNC;
-            sm.last_state = sm.state;
-            sm.state = SM_TERMINATE;
+SM wait_for_host_fec_value(SM sm){
+    uint32_t host_fec_group_size = 0;
+    sm.udp_ret = handshake_receive(&host_fec_group_size, sizeof(host_fec_group_size));
+
+    if (sm.udp_ret == sizeof(host_fec_group_size)){
+        fec_group_size = (host_fec_group_size < MAX_FEC_GROUP_SIZE) ? host_fec_group_size : MAX_FEC_GROUP_SIZE;
+        if (fec_group_size > 0) {
+            printf("FEC: parity packet every %u data packets\n", fec_group_size);
         }
+
+        sm.state = SM_WAIT_FOR_HOST_RETRANSMIT_CMD;
     }
     else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
-        sm.state = SM_WAIT_FOR_HOST_HANDSHAKE;
+        sm.state = SM_WAIT_FOR_HOST_FEC_VALUE;
+    }
+    else if (sm.udp_ret > 0) {
+        sm = unexpected_handshake_message(sm);
     }
     else {
         sm.ret = SM_UDP_ERROR;
@@ -540,22 +2291,19 @@ SM wait_for_host_handshake( SM sm ){
     return sm;
 }
 
-SM wait_for_host_flag_cmd(SM sm){
-    memset(recvd_cmd, 0, CMD_MAX_STRING_SIZE);
-    sm.udp_ret = udp_nonblocking_receive(&udp_host, recvd_cmd, CMD_MAX_STRING_SIZE);
+SM wait_for_host_retransmit_cmd(SM sm){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
 
     if (sm.udp_ret > 0) {
-        if (strcmp(recvd_cmd, HOST_FLAG_CMD) == 0) {
-            cout << "Received Message - " << HOST_FLAG_CMD << endl;
-            sm.state = SM_WAIT_FOR_HOST_FLAG_VALUE;
+        if (strcmp(recvd_cmd, HOST_RETRANSMIT_CMD) == 0){
+            cout << "Received Message - " << HOST_RETRANSMIT_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_RETRANSMIT_VALUE;
         } else {
-            sm.ret = SM_OUT_OF_SYNC;
-            sm.last_state = sm.state;
-            sm.state = SM_TERMINATE;
+            sm = unexpected_handshake_message(sm);
         }
     }
     else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
-        sm.state = SM_WAIT_FOR_HOST_FLAG_CMD;
+        sm.state = SM_WAIT_FOR_HOST_RETRANSMIT_CMD;
     }
     else {
         sm.ret = SM_UDP_ERROR;
@@ -566,28 +2314,24 @@ SM wait_for_host_flag_cmd(SM sm){
     return sm;
 }
 
-SM wait_for_host_flag_value(SM sm){
-    uint8_t flag_cmd = 0x00;
-    sm.udp_ret = udp_nonblocking_receive(&udp_host, &flag_cmd, sizeof(flag_cmd));
-
-    if (sm.udp_ret > 0) {
-        use_ps_io_flag = (flag_cmd & ENABLE_PSIO_MSK);
-        use_pot_flag = (flag_cmd & ENABLE_POT_MSK);
-        useSampleRate = (flag_cmd & ENABLE_SAMPLE_RATE_MSK);
-
-        cout << "Received Flag Byte: 0x" << std::hex << static_cast<int>(flag_cmd) << std::dec << endl;
+SM wait_for_host_retransmit_value(SM sm){
+    uint32_t host_history_size = 0;
+    sm.udp_ret = handshake_receive(&host_history_size, sizeof(host_history_size));
 
-        if (useSampleRate){
-            sm.state = SM_WAIT_FOR_HOST_SAMPLE_RATE_CMD;
-        } else {
-            if (use_ps_io_flag || use_pot_flag){
-                reset_double_buffer_info(&db, dvrk_controller.Board);
-            }
-            sm.state = SM_SEND_DATA_COLLECTION_METADATA;
+    if (sm.udp_ret == sizeof(host_history_size)){
+        retransmit_history_size = (host_history_size < MAX_RETRANSMIT_HISTORY) ? host_history_size : MAX_RETRANSMIT_HISTORY;
+        allocate_retransmit_history(retransmit_history_size);
+        if (retransmit_history_size > 0) {
+            printf("RETRANSMIT: last %u data packets kept\n", retransmit_history_size);
         }
+
+        sm.state = SM_WAIT_FOR_HOST_PAYLOAD_SIZE_CMD;
     }
     else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
-        sm.state = SM_WAIT_FOR_HOST_FLAG_VALUE;
+        sm.state = SM_WAIT_FOR_HOST_RETRANSMIT_VALUE;
+    }
+    else if (sm.udp_ret > 0) {
+        sm = unexpected_handshake_message(sm);
     }
     else {
         sm.ret = SM_UDP_ERROR;
@@ -598,22 +2342,19 @@ SM wait_for_host_flag_value(SM sm){
     return sm;
 }
 
-SM wait_for_host_sample_rate_cmd(SM sm){
-    memset(recvd_cmd, 0, CMD_MAX_STRING_SIZE);
-    sm.udp_ret = udp_nonblocking_receive(&udp_host, recvd_cmd, CMD_MAX_STRING_SIZE);
+SM wait_for_host_payload_size_cmd(SM sm){
+    sm.udp_ret = handshake_receive(recvd_cmd, CMD_MAX_STRING_SIZE);
 
     if (sm.udp_ret > 0) {
-        if (strcmp(recvd_cmd, HOST_SAMPLE_RATE_CMD) == 0){
-            cout << "Received Message - " << HOST_SAMPLE_RATE_CMD << endl;
-            sm.state = SM_WAIT_FOR_HOST_SAMPLE_RATE_VALUE;
+        if (strcmp(recvd_cmd, HOST_PAYLOAD_SIZE_CMD) == 0){
+            cout << "Received Message - " << HOST_PAYLOAD_SIZE_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_PAYLOAD_SIZE_VALUE;
         } else {
-            sm.ret = SM_OUT_OF_SYNC;
-            sm.last_state = sm.state;
-            sm.state = SM_TERMINATE;
+            sm = unexpected_handshake_message(sm);
         }
     }
     else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
-        sm.state = SM_WAIT_FOR_HOST_SAMPLE_RATE_CMD;
+        sm.state = SM_WAIT_FOR_HOST_PAYLOAD_SIZE_CMD;
     }
     else {
         sm.ret = SM_UDP_ERROR;
@@ -624,25 +2365,35 @@ SM wait_for_host_sample_rate_cmd(SM sm){
     return sm;
 }
 
-SM wait_for_host_sample_rate_value(SM sm){
-    int host_sample_rate = 0;
-    sm.udp_ret = udp_nonblocking_receive(&udp_host, &host_sample_rate, sizeof(host_sample_rate));
-
-    if (sm.udp_ret > 0){
-        SAMPLE_RATE = host_sample_rate;
-        printf("NEW SAMPLE RATE: %d\n", SAMPLE_RATE);
-
-        // Keep existing behavior when sample-rate mode is enabled.
-        use_ps_io_flag = true;
+SM wait_for_host_payload_size_value(SM sm){
+    uint32_t host_payload_size = 0;
+    sm.udp_ret = handshake_receive(&host_payload_size, sizeof(host_payload_size));
+
+    if (sm.udp_ret == sizeof(host_payload_size)){
+        // clamp the host proposal to what the Zynq interface supports
+        uint32_t max_payload = max_payload_to_host();
+        udp_payload_size = (host_payload_size < max_payload) ? host_payload_size : max_payload;
+        // room for the metadata (see MIN_UDP_PAYLOAD)
+        if (udp_payload_size < MIN_UDP_PAYLOAD) {
+            udp_payload_size = MIN_UDP_PAYLOAD;
+        }
+        printf("UDP PAYLOAD SIZE: %u (host proposed %u, Zynq max %u)\n", udp_payload_size, host_payload_size, max_payload);
 
-        if (use_ps_io_flag){
-            reset_double_buffer_info(&db, dvrk_controller.Board);
+        // the host rejects the metadata of such a capture
+        unsigned int sample_bytes = calculate_quadlets_per_sample(dvrk_controller.Board) * 4;
+        if (sample_bytes > data_payload_size()) {
+            printf("[ERROR] samples of %u bytes do not fit in the UDP payload\n", sample_bytes);
         }
 
+        reset_packet_ring(&packet_ring);
+
         sm.state = SM_SEND_DATA_COLLECTION_METADATA;
     }
     else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
-        sm.state = SM_WAIT_FOR_HOST_SAMPLE_RATE_VALUE;
+        sm.state = SM_WAIT_FOR_HOST_PAYLOAD_SIZE_VALUE;
+    }
+    else if (sm.udp_ret > 0) {
+        sm = unexpected_handshake_message(sm);
     }
     else {
         sm.ret = SM_UDP_ERROR;
@@ -653,12 +2404,32 @@ SM wait_for_host_sample_rate_value(SM sm){
     return sm;
 }
 
+// sends a packet of the negotiated payload size so the host can check that
+// large frames get through
+static int send_payload_probe()
+{
+    static uint32_t probe_packet[UDP_MAX_PAYLOAD_QUADLETS];
+
+    memset(probe_packet, 0, sizeof(probe_packet));
+    memcpy(probe_packet, ZYNQ_PROBE_PAYLOAD, sizeof(ZYNQ_PROBE_PAYLOAD));
+
+    return udp_transmit(&udp_host, probe_packet, udp_payload_size);
+}
+
 SM send_data_collection_meta_data( SM sm ){
+    // a payload size renegotiated after the probe is not a copy
+    handshake_last_size = 0;
+
+    if (session_id == 0) {
+        session_id = new_session_id();
+    }
+
     package_meta_data(&data_collection_meta, dvrk_controller.Board);
 
     if (udp_transmit(&udp_host,  &data_collection_meta, sizeof(struct DataCollectionMeta )) < 1 ) {
         sm.ret = SM_UDP_INVALID_HOST_ADDR;
-        sm.last_state = SM_TERMINATE;
+        sm.last_state = sm.state;
+        sm.state = SM_TERMINATE;
     }
     else {
         sm.state = SM_WAIT_FOR_HOST_RECV_METADATA;
@@ -677,10 +2448,19 @@ SM wait_for_host_to_recv_metadata( SM sm ){
             cout << "Handshake Complete!" << endl;
 
             sm.state = SM_SEND_READY_STATE_TO_HOST;
+        } else if (strcmp(recvd_cmd, HOST_PROBE_PAYLOAD_CMD) == 0) {
+            cout << "Received Message: " << HOST_PROBE_PAYLOAD_CMD << endl;
+            send_payload_probe();
+            sm.state = SM_WAIT_FOR_HOST_RECV_METADATA;
+        } else if (strcmp(recvd_cmd, HOST_PAYLOAD_SIZE_CMD) == 0) {
+            // host did not receive the probe and proposes a smaller payload
+            cout << "Received Message: " << HOST_PAYLOAD_SIZE_CMD << endl;
+            sm.state = SM_WAIT_FOR_HOST_PAYLOAD_SIZE_VALUE;
+        } else if (is_session_cmd(recvd_cmd)) {
+            sm = handle_session_cmd(sm, nullptr);
         } else {
-            sm.ret = SM_OUT_OF_SYNC;
-            sm.last_state = sm.state;
-            sm.state = SM_TERMINATE;
+            // late copy of a datagram of the handshake
+            sm.state = SM_WAIT_FOR_HOST_RECV_METADATA;
         }
     }
     else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
@@ -722,10 +2502,26 @@ SM wait_for_host_start_cmd( SM sm ){
             sm.ret = SM_SUCCESS;
             sm.state = SM_TERMINATE;
         }
+        else if (strcmp(recvd_cmd, HOST_STOP_DATA_COLLECTION) == 0) {
+            // capture already stopped (e.g., stop sent again by a resumed host, or by a
+            // host that did not receive the final telemetry)
+            if (last_final_telemetry.tag == TELEMETRY_TAG) {
+                udp_transmit(&udp_host, &last_final_telemetry, sizeof(last_final_telemetry));
+            }
+            sm.state = SM_WAIT_FOR_HOST_START_CMD;
+        }
+        else if (is_nack_request(recvd_cmd, sm.udp_ret)) {
+            // packets lost at the end of the capture
+            handle_nack_request(recvd_cmd);
+            sm.state = SM_WAIT_FOR_HOST_START_CMD;
+        }
+        else if (is_session_cmd(recvd_cmd)) {
+            sm = handle_session_cmd(sm, nullptr);
+        }
         else {
-            sm.ret = SM_OUT_OF_SYNC;
-            sm.last_state = sm.state;
-            sm.state = SM_TERMINATE;
+            // late copy of a datagram of the handshake, or the rest of a handshake whose
+            // HOST READY was lost (the host starts it again)
+            sm.state = SM_WAIT_FOR_HOST_START_CMD;
         }
     }
     else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE) {
@@ -742,76 +2538,295 @@ SM wait_for_host_start_cmd( SM sm ){
 
 SM start_consumer_thread( SM sm , pthread_t *consumer_t){
     // Starting Consumer Thread: sends packets to host
-    if (pthread_create(consumer_t, nullptr, consume_data, &db) != 0) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (realtime.lock_memory) {
+        pthread_attr_setstacksize(&attr, CONSUMER_STACK_SIZE);
+    }
+
+    int err = pthread_create(consumer_t, &attr, consume_data, &packet_ring);
+
+    if (err != 0) {
+        pthread_attr_destroy(&attr);
         std::cerr << "Error creating consumer thread" << std::endl;
         sm.state = SM_EXIT;
         sm.ret = SM_FAILED_TO_CREATE_THREAD;
+        return sm;
     }
 
-    pthread_detach(*consumer_t);
+    // Starting Control Thread: receives the commands of the host during the capture
+    control_mailbox.head = 0;
+    control_mailbox.tail = 0;
+    err = pthread_create(&control_mailbox.thread, &attr, control_data, nullptr);
+    pthread_attr_destroy(&attr);
+
+    if (err != 0) {
+        std::cerr << "Error creating control thread" << std::endl;
+        sm.state = SM_EXIT;
+        sm.ret = SM_FAILED_TO_CREATE_THREAD;
+        return sm;
+    }
 
     sm.state = SM_PRODUCE_DATA;
 
     return sm;
 }
 
+// free slot of the packet ring, waiting for the consumer if needed
+static uint32_t *wait_for_packet_slot()
+{
+    uint32_t *data_packet = packet_ring_slot(&packet_ring);
+
+    if (data_packet == nullptr) {
+        // consumer fell PACKET_RING_SLOTS packets behind; wait for a free slot
+        packet_ring.full_count++;
+        do {
+            sched_yield();
+        } while ((data_packet = packet_ring_slot(&packet_ring)) == nullptr);
+    }
+
+    return data_packet;
+}
+
+// true if the control thread posted a command
+static inline bool control_pending()
+{
+    return control_mailbox.head.load(memory_order_acquire) != control_mailbox.tail.load(memory_order_relaxed);
+}
+
+// queues an event packet behind the data packets
+static void queue_event(const Control_Command &command)
+{
+    EventPacket &event = event_history[command.sequence & (EVENT_HISTORY - 1)];
+    if (event.tag != EVENT_TAG || event.sequence != command.sequence) {
+        memset(&event, 0, sizeof(event));
+        event.tag = EVENT_TAG;
+        event.event_id = command.value;
+        event.sample_index = (uint64_t) sample_count;
+        event.timestamp = command.timestamp;
+        event.sequence = command.sequence;
+    }
+
+    uint32_t *packet = wait_for_packet_slot();
+    memcpy(packet, &event, sizeof(event));
+    packet_ring_publish(&packet_ring, sizeof(EventPacket), 0);
+}
+
+// queues a telemetry packet behind the data packets if one is due
+static void queue_telemetry()
+{
+    if (telemetry_interval_s <= 0.0) {
+        return;
+    }
+
+    double now = capture_time();
+    if (now < telemetry.next_time) {
+        return;
+    }
+
+    uint32_t *packet = wait_for_packet_slot();
+    fill_telemetry(reinterpret_cast<TelemetryPacket *>(packet), false);
+    packet_ring_publish(&packet_ring, sizeof(TelemetryPacket), 0);
+
+    telemetry.next_time += telemetry_interval_s;
+    if (telemetry.next_time <= now) {
+        telemetry.next_time = now + telemetry_interval_s;
+    }
+}
+
+static void fill_burst_status(BurstStatus *status)
+{
+    const unsigned int num_samples = burst_recorder.NumSamples();
+
+    memset(status, 0, sizeof(*status));
+    status->tag = BURST_STATUS_TAG;
+    status->num_samples = num_samples;
+    status->trigger_index = burst_recorder.TriggerIndex();
+    status->trigger_timestamp = sample_format.timestamp_seconds(burst_recorder.Sample(burst_recorder.TriggerIndex()));
+    if (num_samples > 1) {
+        double duration = sample_format.timestamp_seconds(burst_recorder.Sample(num_samples - 1)) -
+                          sample_format.timestamp_seconds(burst_recorder.Sample(0));
+        status->sample_rate = (duration > 0.0) ? (num_samples - 1) / duration : 0.0;
+    }
+}
+
+// loads the next recorded samples of the burst into a data packet (like load_data_packet)
+// and sets length to its size in bytes
+static void load_burst_packet(uint32_t *data_packet, uint16_t &length)
+{
+    const unsigned int num_samples = burst_recorder.NumSamples();
+
+    if (use_compression_flag) {
+        SampleEncoder encoder(sample_format);
+
+        encoder.Begin(data_packet, data_payload_size());
+        while (encoder.HasRoom() && burst_sent_samples < num_samples) {
+            encoder.Add(burst_recorder.Sample(burst_sent_samples++));
+        }
+        length = (uint16_t) encoder.End();
+        return;
+    }
+
+    const unsigned int quadlets = sample_format.quadlets();
+    unsigned int count = 0;
+    for (int j = 0; j < samples_per_packet && burst_sent_samples < num_samples; j++) {
+        memcpy(&data_packet[count], burst_recorder.Sample(burst_sent_samples++), quadlets * 4);
+        count += quadlets;
+    }
+    length = (uint16_t) (count * 4);
+}
+
+// Burst mode: records samples until the burst is complete, then sends one packet of
+// the burst per call and finally the BurstStatus packet
+static SM produce_burst_data( SM sm ){
+    if (burst_phase == BURST_RECORDING) {
+        // check for host commands (e.g., the trigger) between samples when pacing them
+        unsigned int batch = useSampleRate ? 1 : BURST_POLL_SAMPLES;
+
+        for (unsigned int i = 0; i < batch && !burst_recorder.Complete(); i++) {
+            if (read_sample(dvrk_controller, burst_recorder.Slot()) == 0) {
+                cout << "[ERROR]load data buffer fail" << endl;
+                sm.state = SM_EXIT;
+                sm.ret = SM_BOARD_ERROR;
+                return sm;
+            }
+            bool trigger = burst_recorder.CheckTrigger(dvrk_controller.Board) || burst_host_trigger;
+            burst_recorder.Commit(trigger);
+        }
+
+        if (burst_recorder.Complete()) {
+            cout << "BURST TRIGGERED: sending " << burst_recorder.NumSamples() << " samples" << endl;
+            burst_phase = BURST_SENDING;
+            burst_sent_samples = 0;
+            clock_gettime(CLOCK_MONOTONIC, &burst_send_deadline);
+        }
+    } else if (burst_phase == BURST_SENDING) {
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &burst_send_deadline, nullptr);
+
+        uint32_t *data_packet = wait_for_packet_slot();
+        uint16_t length = 0;
+        unsigned int first_sample = burst_sent_samples;
+
+        if (burst_sent_samples < burst_recorder.NumSamples()) {
+            load_burst_packet(data_packet, length);
+        } else {
+            fill_burst_status(reinterpret_cast<BurstStatus *>(data_packet));
+            length = sizeof(BurstStatus);
+            burst_phase = BURST_DONE;
+        }
+
+        packet_ring_publish(&packet_ring, length, (uint16_t) (burst_sent_samples - first_sample));
+        unsigned int sample_bytes = (burst_sent_samples - first_sample) * sample_format.quadlets() * 4;
+        ts_add_ns(burst_send_deadline, (long long) (sample_bytes * 1e9 / BURST_SEND_BYTES_PER_S));
+    } else {
+        // burst sent, wait for the stop command
+        usleep(1000);
+    }
+
+    queue_telemetry();
+
+    sm.state = control_pending() ? SM_CHECK_FOR_STOP_DATA_COLLECTION_CMD : SM_PRODUCE_DATA;
+    return sm;
+}
+
 SM produce_data( SM sm ){
 
-    if ( !load_data_packet(dvrk_controller, db.double_buffer[db.prod_buf], data_collection_meta.num_encoders, data_collection_meta.num_motors)) {
+    if (use_burst_flag) {
+        return produce_burst_data(sm);
+    }
+
+    uint32_t *data_packet = wait_for_packet_slot();
+
+    uint16_t length = 0;
+    uint16_t samples = 0;
+
+    if ( !load_data_packet(dvrk_controller, data_packet, length, samples)) {
         cout << "[ERROR]load data buffer fail" << endl;
         sm.state = SM_EXIT;
         sm.ret = SM_BOARD_ERROR;
         return sm;
     }
 
-    while (db.cons_busy) {}
+    packet_ring_publish(&packet_ring, length, samples);
+    queue_telemetry();
 
-    // Switch to the next buffer
-    db.prod_buf = (db.prod_buf + 1) % 2;
-
-    sm.state = SM_CHECK_FOR_STOP_DATA_COLLECTION_CMD;
+    sm.state = control_pending() ? SM_CHECK_FOR_STOP_DATA_COLLECTION_CMD : SM_PRODUCE_DATA;
 
     return sm;
 }
 
+// handles the commands posted by the control thread
 SM check_for_stop_data_collection(SM sm, pthread_t consumer_t){
 
-    sm.udp_ret = udp_nonblocking_receive(&udp_host, recvd_cmd, CMD_MAX_STRING_SIZE);
-
-    if (sm.udp_ret > 0) {
-        if (strcmp(recvd_cmd, HOST_STOP_DATA_COLLECTION) == 0) {
-            cout << "Message from Host: STOP DATA COLLECTION" << endl;
+    if (!control_pending()) {
+        sm.state = SM_PRODUCE_DATA;
+        return sm;
+    }
 
-            stop_data_collection_flag = true;
+    uint32_t tail = control_mailbox.tail.load(memory_order_relaxed);
+    const Control_Command &command = control_mailbox.slots[tail & (CONTROL_MAILBOX_SLOTS - 1)];
 
-            pthread_join(consumer_t, nullptr);
+    memcpy(recvd_cmd, command.cmd, CMD_MAX_STRING_SIZE);
+    sm.state = SM_PRODUCE_DATA;
 
-            cout << "------------------------------------------------" << endl;
-            cout << "UDP DATA PACKETS SENT TO HOST: " << data_packet_count << endl;
-            cout << "SAMPLES SENT TO HOST: " << sample_count << endl;
-            cout << "EMIO ERROR COUNT: " << emio_read_error_counter << endl;
-            cout << "TIME ELAPSED: " << last_timestamp << endl;
-            cout << "AVERAGE SAMPLE RATE: " << (float) (sample_count / last_timestamp) << "Hz" << endl;
-            cout << "------------------------------------------------" << endl << endl;
+    switch (command.type) {
+        case CONTROL_STOP:
+            cout << "Message from Host: STOP DATA COLLECTION" << endl;
 
-            emio_read_error_counter = 0; 
-            data_packet_count = 0;
-            sample_count = 0;
+            stop_capture(consumer_t, true);
 
             sm.state = SM_WAIT_FOR_HOST_START_CMD;
             cout << "Waiting for command from host..." << endl;
-            
-        } else {
-            sm.ret = SM_OUT_OF_SYNC;
-            sm.last_state = sm.state;
+            break;
+
+        case CONTROL_BURST_TRIGGER:
+            if (use_burst_flag) {
+                cout << "Message from Host: BURST TRIGGER" << endl;
+                burst_host_trigger = true;
+            } else {
+                cout << "[WARNING] Ignoring BURST TRIGGER (capture not started in burst mode)" << endl;
+            }
+            break;
+
+        case CONTROL_SET_SAMPLE_RATE:
+            if (command.sequence <= sample_rate_sequence) {
+                break;
+            }
+            sample_rate_sequence = command.sequence;
+            if (!useSampleRate || command.value == 0) {
+                cout << "[WARNING] Ignoring sample rate " << command.value << " (capture not started with a sample rate)" << endl;
+            } else {
+                SAMPLE_RATE = (int) command.value;
+                sample_pacer.period_ns = 1'000'000'000L / SAMPLE_RATE;
+                printf("NEW SAMPLE RATE: %d\n", SAMPLE_RATE);
+            }
+            break;
+
+        case CONTROL_MARK_EVENT:
+            queue_event(command);
+            break;
+
+        case CONTROL_SESSION:
+            // a resuming host gets the replies and the data from now on (the consumer and
+            // control threads copy the address per batch or datagram)
+            set_host_address(command.addr);
+            sm = handle_session_cmd(sm, &consumer_t);
+            break;
+
+        default:
+            sm.ret = SM_UDP_ERROR;
+            sm.last_state = SM_CHECK_FOR_STOP_DATA_COLLECTION_CMD;
             sm.state = SM_TERMINATE;
-        }
-    } else if (sm.udp_ret == UDP_DATA_IS_NOT_AVAILABLE_WITHIN_TIMEOUT || sm.udp_ret == UDP_NON_UDP_DATA_IS_AVAILABLE){
-        sm.state = SM_PRODUCE_DATA;
-    } else {
-        sm.ret = SM_UDP_ERROR;
-        sm.last_state = sm.state;
-        sm.state = SM_TERMINATE;
+            break;
+    }
+
+    control_mailbox.tail.store(tail + 1, memory_order_release);
+
+    // the commands posted meanwhile are handled before the next packet, so that a burst of
+    // commands does not fill the mailbox and hold up the control thread (and the NACKs and
+    // the stop command behind them) at one command per packet
+    if (sm.state == SM_PRODUCE_DATA && control_pending()) {
+        sm.state = SM_CHECK_FOR_STOP_DATA_COLLECTION_CMD;
     }
 
     return sm;
@@ -819,20 +2834,43 @@ SM check_for_stop_data_collection(SM sm, pthread_t consumer_t){
 
 SM start_data_collection(SM sm){
 
+    reset_packet_ring(&packet_ring);
+    select_sample_packer(dvrk_controller.Board);
+
+    if (use_burst_flag) {
+        burst_recorder.Arm();
+        burst_phase = BURST_RECORDING;
+        burst_host_trigger = false;
+        burst_sent_samples = 0;
+        cout << "Burst armed, waiting for trigger" << endl;
+    }
+
     stop_data_collection_flag = false;
+    capture_in_progress = true;
+    set_thread_realtime("producer", true);
     clock_gettime(CLOCK_MONOTONIC_RAW, &t_data_collection_start);
+    fpga_timestamp_ticks = 0;
+    reset_telemetry();
+    reset_fec();
+    reset_retransmit_history();
+    reset_capture_commands();
+    fault_stats_start = udp_faults.GetStats();
 
     if (useSampleRate){
-        clock_gettime(CLOCK_MONOTONIC_RAW, &deadline);
-        // compute the nanoseconds between samples
-        period_ns = 1'000'000'000L / SAMPLE_RATE;
+        reset_sample_pacer(&sample_pacer, SAMPLE_RATE);
     }
    
     sm.state = SM_START_CONSUMER_THREAD;
     return sm;
 }
 
-SM terminate_data_collection(SM sm){
+// consumer_t is only used if a capture is running
+SM terminate_data_collection(SM sm, pthread_t consumer_t){
+
+    // the threads of the capture use the socket
+    if (capture_in_progress) {
+        stop_capture(consumer_t, false);
+    }
 
     if (sm.ret != SM_SUCCESS) {
 
@@ -853,8 +2891,13 @@ SM terminate_data_collection(SM sm){
                 break;
             case SM_FAILED_TO_CREATE_THREAD:
                 cout << "Failed to Create Thread" << endl;
+                break;
             case SM_BOARD_ERROR:
                 cout << "Board Error" << endl;
+                break;
+            default:
+                cout << "Return code " << sm.ret << endl;
+                break;
         }
 
     } else {
@@ -880,11 +2923,15 @@ static int dataCollectionStateMachine()
     cout << "Starting Handshake Routine..." << endl << endl;
     cout << "Start Data Collection Client on HOST to complete handshake..." << endl;
 
-    reset_double_buffer_info(&db, dvrk_controller.Board);
+    reset_packet_ring(&packet_ring);
 
-    if (mio_mmap_init() != 0) {
+    packet_ring.event_fd = eventfd(0, 0);
+    control_mailbox.event_fd = eventfd(0, EFD_NONBLOCK);
+    if (packet_ring.event_fd < 0 || control_mailbox.event_fd < 0) {
+        perror("Failed to create eventfd");
         sm.state = SM_TERMINATE;
-        sm.ret = SM_PS_IO_FAIL;
+        sm.ret = SM_FAILED_TO_CREATE_THREAD;
+        return sm.ret;
     }
 
     sm.state = SM_WAIT_FOR_HOST_HANDSHAKE;
@@ -912,6 +2959,54 @@ static int dataCollectionStateMachine()
                 sm = wait_for_host_sample_rate_value(sm);
                 break;
 
+            case SM_WAIT_FOR_HOST_CHANNEL_MASK_CMD:
+                sm = wait_for_host_channel_mask_cmd(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_CHANNEL_MASK_VALUE:
+                sm = wait_for_host_channel_mask_value(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_OVERSAMPLING_CMD:
+                sm = wait_for_host_oversampling_cmd(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_OVERSAMPLING_VALUE:
+                sm = wait_for_host_oversampling_value(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_BURST_CMD:
+                sm = wait_for_host_burst_cmd(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_BURST_VALUE:
+                sm = wait_for_host_burst_value(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_FEC_CMD:
+                sm = wait_for_host_fec_cmd(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_FEC_VALUE:
+                sm = wait_for_host_fec_value(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_RETRANSMIT_CMD:
+                sm = wait_for_host_retransmit_cmd(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_RETRANSMIT_VALUE:
+                sm = wait_for_host_retransmit_value(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_PAYLOAD_SIZE_CMD:
+                sm = wait_for_host_payload_size_cmd(sm);
+                break;
+
+            case SM_WAIT_FOR_HOST_PAYLOAD_SIZE_VALUE:
+                sm = wait_for_host_payload_size_value(sm);
+                break;
+
             case SM_SEND_DATA_COLLECTION_METADATA:
                 sm = send_data_collection_meta_data(sm);
                 break;
@@ -945,7 +3040,7 @@ static int dataCollectionStateMachine()
                 break;
 
             case SM_TERMINATE:
-                sm = terminate_data_collection(sm);
+                sm = terminate_data_collection(sm, consumer_t);
                 break;
         }
     }
@@ -954,34 +3049,264 @@ static int dataCollectionStateMachine()
 
 
 
-int main()
+static void printUsage(const char *progName)
 {
-    string portDescription = BasePort::DefaultPort();
-    dvrk_controller.Port = PortFactory(portDescription.c_str());
+    cout << "Usage: " << progName << " [-b <packets>] [-l <us>] [-P <policy>] [-A <cpus>] [-R <priority>] [-K] [-Q] [-T <s>] [-B <samples>] [-S <hw>] [-N <n>] [-E <n>] [-M <n>] [-L <us>] [-r <csv> [-x <speed>]] [-I <faults>]" << endl;
+    cout << "  -b <packets>   Maximum packets per transmit syscall (1-" << PACKET_RING_SLOTS << ", default " << tx_batch_max << ")" << endl;
+    cout << "  -l <us>        Maximum time to wait for a full transmit batch (default " << tx_batch_latency_us << ")" << endl;
+    cout << "  -P <policy>    Pacing of late samples with a sample rate: catchup (default) or skip" << endl;
+    cout << "  -Q             Read commanded currents with one bus transaction per motor" << endl;
+    cout << "                 (default: from the real-time block, firmware Rev 8+)" << endl;
+    cout << "  -A <p>[,<c>]   Pin the producer (sampling) thread to CPU p and the consumer" << endl;
+    cout << "                 (transmit) thread to CPU c (e.g., -A 1,0)" << endl;
+    cout << "  -R <priority>  Run both threads with SCHED_FIFO at the given priority (1-99)" << endl;
+    cout << "                 during captures" << endl;
+    cout << "  -K             Lock memory (mlockall) and prefault stacks and buffers" << endl;
+    cout << "  -T <s>         Period of the telemetry packets sent to the host during captures" << endl;
+    cout << "                 (default " << telemetry_interval_s << ", 0: only when a capture stops)" << endl;
+    cout << "  -B <samples>   Benchmark the sample packers on the board and exit" << endl;
+    cout << "  -S <hw>        Use a simulated board of hardware version QLA1, dRA1 or DQLA" << endl;
+#ifndef DC_HAS_AMP1394
+    cout << "                 (always used, built without Amp1394; default QLA1)" << endl;
+#endif
+    cout << "  -N <n>         Number of simulated boards, all of the same layout (default 1)" << endl;
+    cout << "  -E <n>         Number of encoders of each simulated board" << endl;
+    cout << "  -M <n>         Number of motors of each simulated board" << endl;
+    cout << "  -L <us>        Latency of each bus transaction of the simulated boards (default 0)" << endl;
+    cout << "  -r <csv>       Replay the samples of a capture file instead of reading the boards" << endl;
+    cout << "  -x <speed>     Replay speed: 1 for the original timestamps (default), 2 for twice" << endl;
+    cout << "                 as fast, etc., 0 for as fast as possible" << endl;
+    cout << "  -I <faults>    Impair the datagrams received from the host, for testing: comma separated" << endl;
+    cout << "                 loss, dup, reorder, truncate (probabilities), delay, jitter (ms) and" << endl;
+    cout << "                 seed, e.g. loss=0.01,delay=2,seed=7" << endl;
+    cout << "  -h             Show this help message" << endl;
+}
 
-    if (!dvrk_controller.Port->IsOK()) {
-        std::cerr << "Failed to initialize " << dvrk_controller.Port->GetPortTypeString() << std::endl;
-        return -1;
+// sets hardware version and default encoder/motor counts of a simulated board
+static bool set_sim_hardware(SimulatedBoardConfig &config, const char *hw)
+{
+    if (strcmp(hw, "QLA1") == 0) {
+        config.hwvers = 0x514C4131;
+        config.num_encoders = 4;
+        config.num_motors = 4;
+    } else if (strcmp(hw, "dRA1") == 0) {
+        config.hwvers = 0x64524131;
+        config.num_encoders = 7;
+        config.num_motors = 10;
+    } else if (strcmp(hw, "DQLA") == 0) {
+        config.hwvers = 0x44514C41;
+        config.num_encoders = 8;
+        config.num_motors = 8;
+    } else {
+        return false;
     }
+    return true;
+}
 
-    if (dvrk_controller.Port->GetNumOfNodes() == 0) {
-        std::cerr << "Failed to find any boards" << std::endl;
-        return -1;
+int main(int argc, char *argv[])
+{
+    SimulatedBoardConfig sim_config;
+    sim_config.num_boards = 1;
+    set_sim_hardware(sim_config, "QLA1");
+    sim_config.read_latency_us = 0;
+#ifdef DC_HAS_AMP1394
+    bool use_sim_board = false;
+#else
+    bool use_sim_board = true;
+#endif
+    bool quadlet_cmd_current = false;
+    unsigned int benchmark_samples = 0;
+    ReplayBoardConfig replay_config;
+    replay_config.filename = nullptr;
+    replay_config.speed = 1.0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:l:P:A:R:KQT:B:S:N:E:M:L:r:x:I:h")) != -1) {
+        switch (opt) {
+            case 'S':
+                if (!set_sim_hardware(sim_config, optarg)) {
+                    cout << "[ERROR] invalid simulated hardware version " << optarg << endl;
+                    return -1;
+                }
+                use_sim_board = true;
+                break;
+
+            case 'N':
+                sim_config.num_boards = (unsigned int) atoi(optarg);
+                if (sim_config.num_boards < 1 || sim_config.num_boards > MAX_NUM_BOARDS) {
+                    cout << "[ERROR] invalid number of boards " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'E':
+                sim_config.num_encoders = (unsigned int) atoi(optarg);
+                if (sim_config.num_encoders > MAX_NUM_ENCODERS) {
+                    cout << "[ERROR] invalid number of encoders " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'M':
+                sim_config.num_motors = (unsigned int) atoi(optarg);
+                if (sim_config.num_motors > MAX_NUM_MOTORS) {
+                    cout << "[ERROR] invalid number of motors " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'L':
+                sim_config.read_latency_us = (unsigned int) atoi(optarg);
+                break;
+
+            case 'r':
+                replay_config.filename = optarg;
+                break;
+
+            case 'x':
+                replay_config.speed = atof(optarg);
+                if (replay_config.speed < 0.0) {
+                    cout << "[ERROR] invalid replay speed " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'I': {
+                UdpFaultConfig fault_config;
+                if (!parse_udp_fault_config(optarg, fault_config)) {
+                    cout << "[ERROR] invalid fault injection " << optarg << ". Pass in e.g. loss=0.01,delay=2" << endl;
+                    return -1;
+                }
+                udp_faults.Configure(fault_config);
+                cout << "Fault injection: loss " << fault_config.loss << ", dup " << fault_config.duplicate << ", reorder "
+                     << fault_config.reorder << ", truncate " << fault_config.truncate << ", delay " << fault_config.delay_ms
+                     << " ms + " << fault_config.jitter_ms << " ms jitter, seed " << fault_config.seed << endl;
+                break;
+            }
+
+            case 'T':
+                telemetry_interval_s = atof(optarg);
+                if (telemetry_interval_s < 0.0) {
+                    cout << "[ERROR] invalid telemetry period " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'b':
+                tx_batch_max = (uint32_t) atoi(optarg);
+                if (tx_batch_max < 1 || tx_batch_max > PACKET_RING_SLOTS) {
+                    cout << "[ERROR] invalid transmit batch size " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'l':
+                tx_batch_latency_us = atol(optarg);
+                if (tx_batch_latency_us < 0) {
+                    cout << "[ERROR] invalid transmit batch latency " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'P':
+                if (strcmp(optarg, "catchup") == 0) {
+                    sample_pacer.policy = PACER_CATCH_UP;
+                } else if (strcmp(optarg, "skip") == 0) {
+                    sample_pacer.policy = PACER_SKIP;
+                } else {
+                    cout << "[ERROR] invalid pacing policy " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'A': {
+                char *end;
+                realtime.producer_cpu = (int) strtol(optarg, &end, 10);
+                if (*end == ',') {
+                    realtime.consumer_cpu = (int) strtol(end + 1, &end, 10);
+                }
+                if (*end != '\0' || end == optarg || realtime.producer_cpu < 0 || realtime.consumer_cpu < -1) {
+                    cout << "[ERROR] invalid CPUs " << optarg << ". Pass in <producer>[,<consumer>], e.g. 1,0" << endl;
+                    return -1;
+                }
+                break;
+            }
+
+            case 'R':
+                realtime.priority = atoi(optarg);
+                if (realtime.priority < sched_get_priority_min(SCHED_FIFO) || realtime.priority > sched_get_priority_max(SCHED_FIFO)) {
+                    cout << "[ERROR] invalid SCHED_FIFO priority " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'K':
+                realtime.lock_memory = true;
+                break;
+
+            case 'Q':
+                quadlet_cmd_current = true;
+                break;
+
+            case 'B':
+                benchmark_samples = (unsigned int) atoi(optarg);
+                if (benchmark_samples == 0) {
+                    cout << "[ERROR] invalid number of benchmark samples " << optarg << endl;
+                    return -1;
+                }
+                break;
+
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+
+            default:
+                printUsage(argv[0]);
+                return -1;
+        }
     }
 
-    ZynqEmioPort *EmioPort = dynamic_cast<ZynqEmioPort *>(dvrk_controller.Port);
-    if (EmioPort) {
-        cout << "Verbose: " << EmioPort->GetVerbose() << std::endl;
-        // EmioPort->SetVerbose(true);
-        EmioPort->SetTimeout_us(80);
+    cout << "Transmit batch: up to " << tx_batch_max << " packets, latency bound " << tx_batch_latency_us << "us" << endl;
+
+    if (replay_config.filename != nullptr) {
+        dvrk_controller.Board = CreateReplayBoard(replay_config);
+    } else if (use_sim_board) {
+        if (sim_config.num_boards * sim_config.num_encoders > MAX_NUM_ENCODERS ||
+            sim_config.num_boards * sim_config.num_motors > MAX_NUM_MOTORS) {
+            cout << "[ERROR] more than " << MAX_NUM_ENCODERS << " encoders or " << MAX_NUM_MOTORS
+                 << " motors over all simulated boards" << endl;
+            return -1;
+        }
+        cout << "Simulated boards: " << sim_config.num_boards << " x (" << sim_config.num_encoders << " encoders, "
+             << sim_config.num_motors << " motors), " << sim_config.read_latency_us << "us bus latency" << endl;
+        dvrk_controller.Board = CreateSimulatedBoard(sim_config);
     }
+#ifdef DC_HAS_AMP1394
     else {
-      cout << "[warning] failed to dynamic cast to ZynqEmioPort" << endl;
+        dvrk_controller.Board = CreateAmp1394Board();
+    }
+#endif
+
+    if (dvrk_controller.Board == nullptr) {
+        return -1;
     }
 
-    dvrk_controller.Board = new AmpIO(dvrk_controller.Port->GetBoardId(0));
+    dvrk_controller.Board->SetQuadletCommandedCurrent(quadlet_cmd_current);
+
+    if (benchmark_samples > 0) {
+        BenchmarkSamplePackers(dvrk_controller.Board, benchmark_samples);
+        return 0;
+    }
 
-    dvrk_controller.Port->AddBoard(dvrk_controller.Board);
+    if (realtime.producer_cpu >= 0 && realtime.producer_cpu == realtime.consumer_cpu && realtime.priority > 0) {
+        cout << "[warning] producer and consumer share CPU " << realtime.producer_cpu
+             << "; without a sample rate the producer leaves little time to the consumer" << endl;
+    }
+    if (realtime.lock_memory) {
+        lock_memory();
+    }
+    // the state machine runs in the main thread, which is the producer
+    pin_thread("producer", realtime.producer_cpu);
 
     bool isOK = initiate_socket_connection(udp_host.socket);
 
@@ -990,7 +3315,6 @@ int main()
         return -1;
     }
 
-    dataCollectionStateMachine();
-
-    return 0;
+    // non-zero if the state machine failed (e.g. out of sync with the host)
+    return (dataCollectionStateMachine() == SM_SUCCESS) ? 0 : 1;
 }
\ No newline at end of file
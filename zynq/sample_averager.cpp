@@ -0,0 +1,164 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "sample_averager.h"
+
+static inline float bits_float(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+SampleAverager::SampleAverager() : RawQuadlets(2), NumSamples(0), FirstTimestamp(0), LastTimestamp(0)
+{
+    memset(&Format, 0, sizeof(Format));
+    Reset();
+}
+
+void SampleAverager::SetFormat(const SampleFormat &format)
+{
+    Format = format;
+
+    unsigned int quadlet = 2;
+    for (unsigned int i = 0; i < format.num_positions(); i++) {
+        Kind[quadlet++] = CHANNEL_SIGNED;
+    }
+    for (unsigned int i = 0; i < format.num_velocities(); i++) {
+        Kind[quadlet++] = CHANNEL_FLOAT;
+    }
+    for (unsigned int i = 0; i < format.num_motor_channels(); i++) {
+        Kind[quadlet++] = CHANNEL_HALVES;
+    }
+    for (unsigned int i = 0; i < format.ps_io_quadlets(); i++) {
+        Kind[quadlet++] = CHANNEL_LAST;
+    }
+    for (unsigned int i = 0; i < format.num_pots(); i++) {
+        Kind[quadlet++] = CHANNEL_UNSIGNED;
+    }
+    RawQuadlets = quadlet;
+
+    Reset();
+}
+
+void SampleAverager::Reset(void)
+{
+    NumSamples = 0;
+    memset(Sum, 0, 2 * RawQuadlets * sizeof(Sum[0]));
+}
+
+void SampleAverager::Add(const uint32_t *sample)
+{
+    uint64_t timestamp = sample_timestamp_bits(sample);
+    if (NumSamples == 0) {
+        FirstTimestamp = timestamp;
+    }
+    LastTimestamp = timestamp;
+
+    for (unsigned int q = 2; q < RawQuadlets; q++) {
+        uint32_t value = sample[q];
+        switch (Kind[q]) {
+            case CHANNEL_SIGNED:
+                Accumulate(2 * q, (int32_t) value);
+                break;
+            case CHANNEL_UNSIGNED:
+                Accumulate(2 * q, value);
+                break;
+            case CHANNEL_FLOAT:
+                Accumulate(2 * q, bits_float(value));
+                break;
+            case CHANNEL_HALVES:
+                Accumulate(2 * q, value >> 16);
+                Accumulate(2 * q + 1, value & 0x0000FFFF);
+                break;
+            default:
+                Last[q] = value;
+                break;
+        }
+    }
+
+    NumSamples++;
+}
+
+uint32_t SampleAverager::Quadlet(unsigned int quadlet, const double *values) const
+{
+    const double value = values[2 * quadlet];
+
+    switch (Kind[quadlet]) {
+        case CHANNEL_SIGNED:
+            return (uint32_t) (int32_t) llround(value);
+        case CHANNEL_UNSIGNED:
+            return (uint32_t) llround(value);
+        case CHANNEL_FLOAT:
+            return float_bits((float) value);
+        case CHANNEL_HALVES:
+            return ((uint32_t) llround(value) << 16) | ((uint32_t) llround(values[2 * quadlet + 1]) & 0x0000FFFF);
+        default:
+            return Last[quadlet];
+    }
+}
+
+unsigned int SampleAverager::End(uint32_t *dst)
+{
+    if (NumSamples == 0) {
+        return 0;
+    }
+
+    if (Format.timestamp_ticks_per_s != 0) {
+        set_sample_timestamp_bits(dst, FirstTimestamp + (LastTimestamp - FirstTimestamp) / 2);
+    } else {
+        double first, last;
+        memcpy(&first, &FirstTimestamp, sizeof(first));
+        memcpy(&last, &LastTimestamp, sizeof(last));
+        set_sample_timestamp_bits(dst, seconds_timestamp_bits((first + last) / 2.0));
+    }
+
+    for (unsigned int lane = 4; lane < 2 * RawQuadlets; lane++) {
+        Sum[lane] /= NumSamples;
+    }
+
+    unsigned int count = 2;
+    for (unsigned int q = 2; q < RawQuadlets; q++) {
+        dst[count++] = Quadlet(q, Sum);
+    }
+
+    if (Format.min_max) {
+        for (unsigned int q = 2; q < RawQuadlets; q++) {
+            if (Kind[q] != CHANNEL_LAST) {
+                dst[count++] = Quadlet(q, Min);
+            }
+        }
+        for (unsigned int q = 2; q < RawQuadlets; q++) {
+            if (Kind[q] != CHANNEL_LAST) {
+                dst[count++] = Quadlet(q, Max);
+            }
+        }
+    }
+
+    Reset();
+    return count;
+}
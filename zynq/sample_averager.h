@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __SAMPLEAVERAGER_H__
+#define __SAMPLEAVERAGER_H__
+
+#include <stdint.h>
+
+#include "data_collection_shared.h"
+
+// Combines consecutive samples, as written by the sample packers, into one sample of
+// the format (oversampling mode, see OversamplingConfig):
+//   timestamp                  centre of the first and last timestamps
+//   channels                   mean, rounded to the nearest count (except encoder velocities);
+//                              both halves of the motor quadlets are averaged separately
+//   digital I/O, MIO pins      last value
+//   minimum, maximum           if format.min_max, of each channel (same order as the means)
+class SampleAverager {
+public:
+    SampleAverager();
+
+    void SetFormat(const SampleFormat &format);
+
+    // adds a sample (without minimum and maximum)
+    void Add(const uint32_t *sample);
+
+    // writes the combined sample to dst and returns its size in quadlets (0 if no
+    // sample was added), then starts a new one
+    unsigned int End(uint32_t *dst);
+
+    // discards the samples added since the last End
+    void Reset(void);
+
+    unsigned int Count(void) const { return NumSamples; }
+
+protected:
+    enum ChannelKind {
+        CHANNEL_SIGNED,         // encoder position
+        CHANNEL_UNSIGNED,       // pot
+        CHANNEL_FLOAT,          // encoder velocity
+        CHANNEL_HALVES,         // motor quadlet (commanded current, motor current)
+        CHANNEL_LAST            // digital I/O, MIO pins
+    };
+
+    SampleFormat Format;
+    // size of the added samples, in quadlets
+    unsigned int RawQuadlets;
+    uint8_t Kind[MAX_QUADLETS_PER_SAMPLE];
+
+    unsigned int NumSamples;
+    // timestamp fields of the first and last samples added
+    uint64_t FirstTimestamp;
+    uint64_t LastTimestamp;
+
+    // indexed by 2 * quadlet (+ 1 for the lower half of CHANNEL_HALVES)
+    double Sum[2 * MAX_QUADLETS_PER_SAMPLE];
+    double Min[2 * MAX_QUADLETS_PER_SAMPLE];
+    double Max[2 * MAX_QUADLETS_PER_SAMPLE];
+    uint32_t Last[MAX_QUADLETS_PER_SAMPLE];
+
+    void Accumulate(unsigned int lane, double value)
+    {
+        Sum[lane] += value;
+        if (NumSamples == 0 || value < Min[lane]) {
+            Min[lane] = value;
+        }
+        if (NumSamples == 0 || value > Max[lane]) {
+            Max[lane] = value;
+        }
+    }
+
+    // quadlet of the values of a channel (sums divided by the sample count, minima or maxima)
+    uint32_t Quadlet(unsigned int quadlet, const double *values) const;
+};
+
+#endif
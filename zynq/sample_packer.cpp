@@ -0,0 +1,338 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "sample_packer.h"
+#include "sample_compression.h"
+
+using namespace std;
+
+static inline uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+unsigned int PackSampleGeneric(const SampleFormat &format, BoardAccess *board,
+                               uint32_t *dst, uint64_t timestamp)
+{
+    unsigned int count = 0;
+
+    // DATA 1: timestamp (double or FPGA clock ticks, high quadlet first)
+    set_sample_timestamp_bits(dst, timestamp);
+    count += 2;
+
+    // only the selected channels (format.channels) are read and packed
+
+    // DATA 2: encoder position
+    for (unsigned int i = 0; i < format.num_encoders; i++) {
+        if (format.channels.encoder_position & (1u << i)) {
+            dst[count++] = static_cast<uint32_t>(board->GetEncoderPosition(i) + board->GetEncoderMidRange());
+        }
+    }
+
+    // DATA 3: encoder velocity
+    for (unsigned int i = 0; i < format.num_encoders; i++) {
+        if (format.channels.encoder_velocity & (1u << i)) {
+            dst[count++] = float_bits(static_cast<float>(board->GetEncoderVelocityPredicted(i)));
+        }
+    }
+
+    // DATA 4 & 5: commanded current and motor current, up to the last selected motor
+    if (format.channels.motor) {
+        uint32_t cmd_currents[MAX_NUM_MOTORS];
+        unsigned int last = 0;
+        for (unsigned int i = 0; i < format.num_motors; i++) {
+            if (format.channels.motor & (1u << i)) {
+                last = i;
+            }
+        }
+        board->ReadCommandedCurrents(cmd_currents, last + 1);
+        for (unsigned int i = 0; i <= last; i++) {
+            if (format.channels.motor & (1u << i)) {
+                dst[count++] = ((cmd_currents[i] & 0x0000FFFF) << 16) | (board->GetMotorCurrent(i) & 0x0000FFFF);
+            }
+        }
+    }
+
+    // optional fields are only read when enabled
+    if (format.ps_io) {
+        for (unsigned int b = 0; b < format.num_boards; b++) {
+            dst[count++] = board->GetDigitalIO(b);
+        }
+        dst[count++] = (uint32_t) board->ReadMIOPins();
+    }
+
+    if (format.pot) {
+        for (unsigned int i = 0; i < format.num_encoders; i++) {
+            if (format.channels.pot & (1u << i)) {
+                dst[count++] = board->GetAnalogInput(i);
+            }
+        }
+    }
+
+    return count;
+}
+
+// Same format as PackSampleGeneric, for all channels of one board, with constant loop
+// bounds and offsets
+template <unsigned int NUM_ENCODERS, unsigned int NUM_MOTORS, bool PS_IO, bool POT>
+static unsigned int PackSample(const SampleFormat &, BoardAccess *board,
+                               uint32_t *dst, uint64_t timestamp)
+{
+    const unsigned int POS_OFFSET = 2;
+    const unsigned int VEL_OFFSET = POS_OFFSET + NUM_ENCODERS;
+    const unsigned int CUR_OFFSET = VEL_OFFSET + NUM_ENCODERS;
+    const unsigned int IO_OFFSET = CUR_OFFSET + NUM_MOTORS;
+    const unsigned int POT_OFFSET = IO_OFFSET + (PS_IO ? 2 : 0);
+    const unsigned int SIZE = POT_OFFSET + (POT ? NUM_ENCODERS : 0);
+
+    set_sample_timestamp_bits(dst, timestamp);
+
+    const int32_t midrange = board->GetEncoderMidRange();
+    for (unsigned int i = 0; i < NUM_ENCODERS; i++) {
+        dst[POS_OFFSET + i] = static_cast<uint32_t>(board->GetEncoderPosition(i) + midrange);
+        dst[VEL_OFFSET + i] = float_bits(static_cast<float>(board->GetEncoderVelocityPredicted(i)));
+    }
+
+    uint32_t cmd_currents[NUM_MOTORS];
+    board->ReadCommandedCurrents(cmd_currents, NUM_MOTORS);
+    for (unsigned int i = 0; i < NUM_MOTORS; i++) {
+        dst[CUR_OFFSET + i] = ((cmd_currents[i] & 0x0000FFFF) << 16) | (board->GetMotorCurrent(i) & 0x0000FFFF);
+    }
+
+    if (PS_IO) {
+        dst[IO_OFFSET] = board->GetDigitalIO(0);
+        dst[IO_OFFSET + 1] = (uint32_t) board->ReadMIOPins();
+    }
+
+    if (POT) {
+        for (unsigned int i = 0; i < NUM_ENCODERS; i++) {
+            dst[POT_OFFSET + i] = board->GetAnalogInput(i);
+        }
+    }
+
+    return SIZE;
+}
+
+// Specialized packers of the supported boards, indexed by (ps_io << 1) | pot.
+// The format only depends on the encoder and motor counts (of a single board).
+struct SamplePackerEntry {
+    const char *name;
+    unsigned int num_encoders;
+    unsigned int num_motors;
+    SamplePacker packers[4];
+};
+
+#define SAMPLE_PACKERS(NAME, ENC, MOT)                  \
+    { NAME, ENC, MOT, { PackSample<ENC, MOT, false, false>, \
+                        PackSample<ENC, MOT, false, true>,  \
+                        PackSample<ENC, MOT, true, false>,  \
+                        PackSample<ENC, MOT, true, true> } }
+
+static const SamplePackerEntry SamplePackerTable[] = {
+    SAMPLE_PACKERS("QLA1", 4, 4),
+    SAMPLE_PACKERS("dRA1", 7, 10),
+    SAMPLE_PACKERS("DQLA", 8, 8)
+};
+
+SamplePacker FindSamplePacker(const SampleFormat &format)
+{
+    if (format.num_boards != 1 || !format.all_channels()) {
+        return nullptr;
+    }
+    for (const SamplePackerEntry &entry : SamplePackerTable) {
+        if (entry.num_encoders == format.num_encoders && entry.num_motors == format.num_motors) {
+            return entry.packers[(format.ps_io ? 2 : 0) | (format.pot ? 1 : 0)];
+        }
+    }
+    return nullptr;
+}
+
+// CPU cycle counter of the calling thread, or -1 if perf events are not available
+static int open_cycle_counter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct PackerCost {
+    double ns_per_sample;
+    double cycles_per_sample;       // negative if not measured
+};
+
+static void start_measure(int cycle_fd, timespec &start)
+{
+    if (cycle_fd >= 0) {
+        ioctl(cycle_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cycle_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+}
+
+static PackerCost end_measure(int cycle_fd, const timespec &start, unsigned int samples)
+{
+    timespec end;
+    long long cycles = -1;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    if (cycle_fd >= 0) {
+        ioctl(cycle_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(cycle_fd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+            cycles = -1;
+        }
+    }
+
+    PackerCost cost;
+    cost.ns_per_sample = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / samples;
+    cost.cycles_per_sample = (cycles >= 0) ? (double) cycles / samples : -1.0;
+    return cost;
+}
+
+static PackerCost measure_packer(SamplePacker packer, const SampleFormat &format, BoardAccess *board,
+                                 unsigned int samples, int cycle_fd)
+{
+    uint32_t sample[MAX_QUADLETS_PER_SAMPLE];
+    timespec start;
+
+    // warm up caches and branch predictors
+    for (unsigned int i = 0; i < samples / 10 + 1; i++) {
+        packer(format, board, sample, 0);
+    }
+
+    start_measure(cycle_fd, start);
+
+    for (unsigned int i = 0; i < samples; i++) {
+        packer(format, board, sample, (uint64_t) i);
+    }
+
+    return end_measure(cycle_fd, start, samples);
+}
+
+// cost of delta compression per sample, for samples read from the board every 50us,
+// in packets of UDP_MAX_PAYLOAD bytes; sets ratio to the compression ratio
+static PackerCost measure_encoder(const SampleFormat &format, BoardAccess *board,
+                                  unsigned int samples, int cycle_fd, double &ratio)
+{
+    const unsigned int RECORDED_SAMPLES = 4096;
+    const unsigned int quadlets = format.quadlets();
+    static uint32_t packet[UDP_MAX_PAYLOAD_QUADLETS];
+    vector<uint32_t> recorded(RECORDED_SAMPLES * quadlets);
+
+    for (unsigned int i = 0; i < RECORDED_SAMPLES; i++) {
+        board->ReadAllBoards();
+        PackSampleGeneric(format, board, &recorded[i * quadlets], seconds_timestamp_bits(i * 50e-6));
+    }
+
+    SampleEncoder encoder(format);
+    long long packet_bytes = 0;
+    timespec start;
+
+    start_measure(cycle_fd, start);
+
+    encoder.Begin(packet, UDP_MAX_PAYLOAD);
+    for (unsigned int i = 0; i < samples; i++) {
+        if (!encoder.HasRoom()) {
+            packet_bytes += encoder.End();
+            encoder.Begin(packet, UDP_MAX_PAYLOAD);
+        }
+        encoder.Add(&recorded[(i % RECORDED_SAMPLES) * quadlets]);
+    }
+    packet_bytes += encoder.End();
+
+    PackerCost cost = end_measure(cycle_fd, start, samples);
+    ratio = (double) samples * quadlets * 4 / packet_bytes;
+    return cost;
+}
+
+static void print_cost(const PackerCost &cost)
+{
+    cout << setw(10) << cost.ns_per_sample << " ns";
+    if (cost.cycles_per_sample >= 0) {
+        cout << setw(10) << cost.cycles_per_sample << " cycles";
+    } else {
+        cout << setw(17) << "n/a cycles";
+    }
+}
+
+void BenchmarkSamplePackers(BoardAccess *board, unsigned int samples)
+{
+    SampleFormat format;
+    memset(&format, 0, sizeof(format));
+    format.num_boards = board->GetNumBoards();
+    format.num_encoders = board->GetNumEncoders();
+    format.num_motors = board->GetNumMotors();
+    format.select_all_channels();
+
+    int cycle_fd = open_cycle_counter();
+    if (cycle_fd < 0) {
+        cout << "[warning] perf events not available, only measuring time" << endl;
+    }
+
+    // packers only use data from the last read
+    board->ReadAllBoards();
+
+    cout << "Sample packer benchmark: " << format.num_boards << " board(s), " << format.num_encoders << " encoders, " << format.num_motors
+         << " motors, " << samples << " samples per variant (cost per sample, excluding ReadAllBoards)" << endl;
+    cout << fixed << setprecision(1);
+
+    for (int options = 0; options < 4; options++) {
+        format.ps_io = (options & 2);
+        format.pot = (options & 1);
+
+        cout << "  ps_io=" << format.ps_io << " pot=" << format.pot << "  generic:";
+        PackerCost generic = measure_packer(PackSampleGeneric, format, board, samples, cycle_fd);
+        print_cost(generic);
+
+        SamplePacker specialized = FindSamplePacker(format);
+        if (specialized) {
+            cout << "  specialized:";
+            PackerCost cost = measure_packer(specialized, format, board, samples, cycle_fd);
+            print_cost(cost);
+            cout << "  (x" << setprecision(2) << generic.ns_per_sample / cost.ns_per_sample << setprecision(1) << ")";
+        } else {
+            cout << "  (no specialized packer for this format)";
+        }
+        cout << endl;
+
+        double ratio;
+        cout << "                 compression:";
+        print_cost(measure_encoder(format, board, samples, cycle_fd, ratio));
+        cout << "  (ratio " << setprecision(2) << ratio << setprecision(1) << ")" << endl;
+    }
+
+    if (cycle_fd >= 0) {
+        close(cycle_fd);
+    }
+}
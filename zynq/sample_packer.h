@@ -0,0 +1,47 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-    */
+/* ex: set filetype=cpp softtabstop=4 shiftwidth=4 tabstop=4 cindent expandtab: */
+
+/*
+  Author(s):  Noah Drakes
+
+  (C) Copyright 2024 Johns Hopkins University (JHU), All Rights Reserved.
+
+--- begin cisst license - do not edit ---
+
+This software is provided "as is" under an open source license, with
+no warranty.  The complete license can be found in license.txt and
+http://www.cisst.org/cisst/license.txt.
+
+--- end cisst license ---
+*/
+
+#ifndef __SAMPLEPACKER_H__
+#define __SAMPLEPACKER_H__
+
+#include <stdint.h>
+
+#include "board_access.h"
+#include "data_collection_shared.h"
+
+// Packs the last sample read from the board (see calculate_quadlets_per_sample in
+// dvrk-data-collection-zynq.cpp for the format) into dst and returns the number
+// of quadlets written. The timestamp is the value of the timestamp field (see
+// sample_timestamp_bits). Specialized packers ignore the format argument.
+typedef unsigned int (*SamplePacker)(const SampleFormat &format, BoardAccess *board,
+                                     uint32_t *dst, uint64_t timestamp);
+
+// Packer for any format, with loop bounds and options evaluated at run time
+unsigned int PackSampleGeneric(const SampleFormat &format, BoardAccess *board,
+                               uint32_t *dst, uint64_t timestamp);
+
+// Packer specialized at compile time for the format (fully unrolled, no option
+// branches), or nullptr if there is none (see SamplePackerTable) or if only some
+// channels are selected
+SamplePacker FindSamplePacker(const SampleFormat &format);
+
+// Measures time (and CPU cycles, when perf events are available) per sample of the
+// generic and specialized packers and of the delta compression (sample_compression.h)
+// for the board layout, for each option combination
+void BenchmarkSamplePackers(BoardAccess *board, unsigned int samples);
+
+#endif